@@ -1,8 +1,15 @@
+#include <algorithm>
 #include <esp_event.h>
 #include "bootstrap_fsm.hpp"
 #include "mqtt_client.h"
 #include "fw_asset_manager.hpp"
 #include "http_downloader.hpp"
+#include "fw_overlay.hpp"
+#include "fw_image_cache.hpp"
+#include "asset_slot.hpp"
+#include "flash_dumper.hpp"
+#include "gdb_server.hpp"
+#include "offline_flasher.hpp"
 
 esp_err_t bootstrap_fsm::init_load_config()
 {
@@ -34,6 +41,39 @@ esp_err_t bootstrap_fsm::init_mq_client()
     return mq_client.init(&mqtt_cfg);
 }
 
+esp_err_t bootstrap_fsm::init_gdb_server()
+{
+    uint16_t port = 0;
+    if (cfg_reader->get_gdb_port(&port) != ESP_OK) {
+        return ESP_OK; // Not configured
+    }
+
+    return gdb_server::instance()->init(&gdb_swd, port);
+}
+
+esp_err_t bootstrap_fsm::init_connect_opts()
+{
+    uint32_t targetsel[multidrop_def::max_targets] = {};
+    size_t drop_cnt = 0;
+    auto ret = cfg_reader->get_drop_targets(targetsel, multidrop_def::max_targets, &drop_cnt);
+    if (ret == ESP_OK) {
+        ret = swd_prog::instance()->set_drop_targets(targetsel, drop_cnt);
+        ESP_LOGI(TAG, "%u multi-drop target(s): 0x%x", drop_cnt, ret);
+    } else if (ret != ESP_ERR_NOT_FOUND) {
+        ESP_LOGE(TAG, "Bad multi-drop target list, staying single-drop: 0x%x", ret);
+    }
+
+    bool under_reset = false, fast_reconnect = false;
+    if (cfg_reader->get_connect_opts(&under_reset, &fast_reconnect) != ESP_OK) {
+        return ESP_OK; // Normal connect, full init every time
+    }
+
+    uint32_t flags = (under_reset ? swd_def::CONNECT_UNDER_RESET : 0) | (fast_reconnect ? swd_def::CONNECT_FAST_RECONNECT : 0);
+    swd_prog::instance()->set_default_connect_flags(flags);
+    ESP_LOGI(TAG, "Target connect flags 0x%lx", flags);
+    return ESP_OK;
+}
+
 esp_err_t bootstrap_fsm::init()
 {
     ESP_LOGI(TAG, "Loading config");
@@ -43,6 +83,10 @@ esp_err_t bootstrap_fsm::init()
         // TODO handle load config failure here - stuck here forever??
     }
 
+    init_connect_opts();
+    asset_slot::instance()->init();
+    asset_store::instance()->init();
+
     ESP_LOGI(TAG, "Connecting WiFi");
     ret = init_connect_wifi();
     if (ret != ESP_OK) {
@@ -54,6 +98,13 @@ esp_err_t bootstrap_fsm::init()
     if (ret != ESP_OK) {
         ESP_LOGE(TAG, "Failed to connect: 0x%x %s", ret, esp_err_to_name(ret));
         // TODO handle wifi failure here - go to offline dumb mode?
+    } else {
+        offline_flasher::instance()->set_reporter(&mq_client);
+    }
+
+    ret = init_gdb_server();
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to start GDB server: 0x%x %s", ret, esp_err_to_name(ret));
     }
 
     auto task_ret = xTaskCreatePinnedToCoreWithCaps(fsm_task_handler, "main_fsm", 65536, this, tskIDLE_PRIORITY + 5, &fsm_task, 1, MALLOC_CAP_SPIRAM);
@@ -114,7 +165,15 @@ esp_err_t bootstrap_fsm::handle_mqtt_cmd()
         }
 
         case mqtt_client::MQ_CMD_READ_MEM: {
-            return decode_mqtt_cmd_bin_algo(json_doc);
+            return decode_mqtt_cmd_read_mem(json_doc);
+        }
+
+        case mqtt_client::MQ_CMD_SET_OVERLAY: {
+            return decode_mqtt_cmd_set_overlay(json_doc);
+        }
+
+        case mqtt_client::MQ_CMD_META_TEST: {
+            return decode_mqtt_cmd_meta_test(json_doc);
         }
     }
 
@@ -137,6 +196,15 @@ esp_err_t bootstrap_fsm::decode_mqtt_cmd_meta_fw(ArduinoJson::JsonDocument &doc)
         memcpy(hash_buf, hash_bin.data(), sizeof(hash_buf));
     }
 
+    auto *slots = asset_slot::instance();
+    if (slots->available()) {
+        return download_fw_slot(doc, hash_buf);
+    }
+
+    if (asset_store::instance()->available()) {
+        return fetch_to_store(doc, hash_buf, asset_store_def::KIND_FW);
+    }
+
     if (doc.containsKey("url") && !fw_asset_manager::check_fw_bin_hash(hash_buf, sizeof(hash_buf))) {
         http_downloader downloader = {};
         auto ret = downloader.init(doc["url"], fw_asset_manager::FIRMWARE_PATH);
@@ -146,6 +214,9 @@ esp_err_t bootstrap_fsm::decode_mqtt_cmd_meta_fw(ArduinoJson::JsonDocument &doc)
             ESP_LOGE(TAG, "Can't download firmware! 0x%x %s", ret, esp_err_to_name(ret));
             return ret;
         }
+
+        fw_image_cache::instance()->invalidate();
+        offline_flasher::instance()->on_assets_changed();
     } else {
         mq_client.report_host_state("Same firmware", ESP_OK);
     }
@@ -153,6 +224,84 @@ esp_err_t bootstrap_fsm::decode_mqtt_cmd_meta_fw(ArduinoJson::JsonDocument &doc)
     return ESP_OK;
 }
 
+esp_err_t bootstrap_fsm::download_fw_slot(ArduinoJson::JsonDocument &doc, const uint8_t *hash_buf)
+{
+    auto *slots = asset_slot::instance();
+    if (!doc.containsKey("url") || slots->is_active(hash_buf)) {
+        mq_client.report_host_state("Same firmware", ESP_OK);
+        return ESP_OK;
+    }
+
+    // Straight into the spare slot; the active one keeps working until the new one is committed.
+    // commit() checks the format from the payload itself, HEX/ELF/UF2 are turned away there
+    auto format = (asset_slot_def::asset_format)(doc["format"] | (uint8_t)asset_slot_def::FORMAT_RAW);
+    http_downloader downloader = {};
+    auto ret = slots->begin(format);
+    ret = ret ?: downloader.init_slot(doc["url"]);
+    ret = ret ?: downloader.request();
+    ret = ret ?: slots->commit(hash_buf);
+    if (ret != ESP_OK) {
+        slots->abort();
+        mq_client.report_host_state(ret == ESP_ERR_NOT_SUPPORTED ? "Firmware must be BIN, LZ4I or a segment map" : "Can't download firmware!", ret);
+        ESP_LOGE(TAG, "Can't download firmware to slot! 0x%x %s", ret, esp_err_to_name(ret));
+        return ret;
+    }
+
+    offline_flasher::instance()->on_assets_changed();
+    return ESP_OK;
+}
+
+esp_err_t bootstrap_fsm::fetch_to_store(ArduinoJson::JsonDocument &doc, const uint8_t *hash_buf, asset_store_def::asset_kind kind)
+{
+    static const char *kind_names[asset_store_def::KIND_MAX] = { "algo", "firmware", "test image" };
+    static const size_t kind_max_len[asset_store_def::KIND_MAX] = { CFG_MGR_FLASH_ALGO_MAX_SIZE, CFG_MGR_FW_MAX_SIZE, CFG_MGR_TEST_IMAGE_MAX_SIZE };
+    auto *store = asset_store::instance();
+    char msg[48] = {};
+    if (store->is_active(kind, hash_buf)) {
+        snprintf(msg, sizeof(msg), "Same %s", kind_names[kind]);
+        mq_client.report_host_state(msg, ESP_OK);
+        return ESP_OK;
+    }
+
+    // Downloaded for an earlier product and still around: switching back is only an index update
+    esp_err_t ret = ESP_OK;
+    if (store->contains(hash_buf)) {
+        ret = store->activate(kind, hash_buf);
+        snprintf(msg, sizeof(msg), "Switched to stored %s", kind_names[kind]);
+        mq_client.report_host_state(msg, ret);
+    } else if (!doc.containsKey("url")) {
+        ret = ESP_ERR_NOT_FOUND;
+        snprintf(msg, sizeof(msg), "Unknown %s and no URL!", kind_names[kind]);
+        mq_client.report_host_state(msg, ret);
+    } else {
+        size_t max_len = kind_max_len[kind];
+        size_t len = doc["size"] | max_len;
+        http_downloader downloader = {};
+        ret = store->reserve(std::min(len, max_len));
+        ret = ret ?: downloader.init(doc["url"], store->get_incoming_path(), max_len);
+        ret = ret ?: downloader.request();
+        ret = ret ?: store->commit(hash_buf, kind);
+        ret = ret ?: store->activate(kind, hash_buf);
+        if (ret != ESP_OK) {
+            store->discard_incoming();
+            snprintf(msg, sizeof(msg), "Can't download %s!", kind_names[kind]);
+            mq_client.report_host_state(msg, ret);
+        }
+    }
+
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Can't switch %s: 0x%x %s", kind_names[kind], ret, esp_err_to_name(ret));
+        return ret;
+    }
+
+    if (kind == asset_store_def::KIND_FW) {
+        fw_image_cache::instance()->invalidate();
+    }
+
+    offline_flasher::instance()->on_assets_changed();
+    return ESP_OK;
+}
+
 esp_err_t bootstrap_fsm::decode_mqtt_cmd_meta_algo(ArduinoJson::JsonDocument &doc)
 {
     uint8_t hash_buf[32] = {};
@@ -164,6 +313,10 @@ esp_err_t bootstrap_fsm::decode_mqtt_cmd_meta_algo(ArduinoJson::JsonDocument &do
         memcpy(hash_buf, hash_bin.data(), sizeof(hash_buf));
     }
 
+    if (asset_store::instance()->available()) {
+        return fetch_to_store(doc, hash_buf, asset_store_def::KIND_ALGO);
+    }
+
     if (doc.containsKey("url") && !fw_asset_manager::check_algo_bin_hash(hash_buf, sizeof(hash_buf))) {
         http_downloader downloader = {};
         auto ret = downloader.init(doc["url"], fw_asset_manager::ALGO_ELF_PATH);
@@ -173,6 +326,8 @@ esp_err_t bootstrap_fsm::decode_mqtt_cmd_meta_algo(ArduinoJson::JsonDocument &do
             ESP_LOGE(TAG, "Can't download flash algo! 0x%x %s", ret, esp_err_to_name(ret));
             return ret;
         }
+
+        offline_flasher::instance()->on_assets_changed();
     } else {
         mq_client.report_host_state("Same algo", ESP_OK);
     }
@@ -180,6 +335,26 @@ esp_err_t bootstrap_fsm::decode_mqtt_cmd_meta_algo(ArduinoJson::JsonDocument &do
     return ESP_OK;
 }
 
+esp_err_t bootstrap_fsm::decode_mqtt_cmd_meta_test(ArduinoJson::JsonDocument &doc)
+{
+    uint8_t hash_buf[32] = {};
+    ArduinoJson::MsgPackBinary hash_bin = doc["hash"];
+    if (hash_bin.data() == nullptr || hash_bin.size() < 32) {
+        ESP_LOGE(TAG, "Invalid metadata hash");
+        return ESP_ERR_INVALID_ARG;
+    } else {
+        memcpy(hash_buf, hash_bin.data(), sizeof(hash_buf));
+    }
+
+    // Test images only live in the store; without it the fixed TEST_IMAGE_PATH is uploaded over CDC
+    if (!asset_store::instance()->available()) {
+        mq_client.report_host_state("No asset store for test image!", ESP_ERR_NOT_SUPPORTED);
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+
+    return fetch_to_store(doc, hash_buf, asset_store_def::KIND_TEST);
+}
+
 esp_err_t bootstrap_fsm::decode_mqtt_cmd_bin_fw(ArduinoJson::JsonDocument &doc)
 {
     return ESP_ERR_NOT_SUPPORTED;
@@ -197,7 +372,73 @@ esp_err_t bootstrap_fsm::decode_mqtt_cmd_set_state(ArduinoJson::JsonDocument &do
 
 esp_err_t bootstrap_fsm::decode_mqtt_cmd_read_mem(ArduinoJson::JsonDocument &doc)
 {
-    return 0;
+    const char *path = doc["path"] | DEFAULT_DUMP_PATH;
+    uint32_t addr = doc["addr"] | (uint32_t)UINT32_MAX;
+    uint32_t len = doc["len"] | (uint32_t)0;
+    bool with_ram = doc["ram"] | false;
+
+    auto ret = flash_dumper::instance()->dump(path, addr, len, with_ram);
+    if (ret != ESP_OK) {
+        mq_client.report_host_state("Memory dump failed", ret);
+        return ret;
+    }
+
+    mq_client.report_host_state("Memory dump done", ESP_OK);
+    return ESP_OK;
+}
+
+esp_err_t bootstrap_fsm::decode_mqtt_cmd_set_overlay(ArduinoJson::JsonDocument &doc)
+{
+    auto *overlay = fw_overlay::instance();
+    overlay->begin_edit(); // The next unit gets either the old list or all of this message
+    if (doc["clear"].as<bool>()) {
+        overlay->clear();
+    }
+
+    ArduinoJson::JsonArray patches = doc["patches"];
+    for (ArduinoJson::JsonObject patch : patches) {
+        if (!patch["addr"].is<uint32_t>()) {
+            ESP_LOGE(TAG, "Overlay patch without address");
+            overlay->end_edit();
+            return ESP_ERR_INVALID_ARG;
+        }
+
+        uint32_t addr = patch["addr"];
+        uint8_t type = patch["type"] | (uint8_t)overlay_def::GEN_FIXED;
+        esp_err_t ret = ESP_OK;
+        switch (type) {
+            case overlay_def::GEN_FIXED: {
+                ArduinoJson::MsgPackBinary data = patch["data"];
+                ret = overlay->add_fixed(addr, (const uint8_t *)data.data(), data.size());
+                break;
+            }
+
+            case overlay_def::GEN_COUNTER: {
+                ret = overlay->add_counter(addr, patch["len"] | 4, patch["base"] | 0, patch["step"] | 1);
+                break;
+            }
+
+            case overlay_def::GEN_TEMPLATE: {
+                ret = overlay->add_template(addr, patch["fmt"], patch["len"] | 0);
+                break;
+            }
+
+            default: {
+                ret = ESP_ERR_NOT_SUPPORTED;
+                break;
+            }
+        }
+
+        if (ret != ESP_OK) {
+            overlay->end_edit();
+            mq_client.report_host_state("Invalid overlay patch", ret);
+            return ret;
+        }
+    }
+
+    overlay->end_edit();
+    ESP_LOGI(TAG, "Overlay now has %u patches", overlay->size());
+    return ESP_OK;
 }
 
 void bootstrap_fsm::fsm_task_handler(void *_ctx)
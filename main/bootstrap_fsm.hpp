@@ -5,6 +5,8 @@
 #include "wifi_manager.hpp"
 #include "mqtt_client.hpp"
 #include "cohere_flasher.hpp"
+#include "swd_gdb_target.hpp"
+#include "asset_store.hpp"
 
 class bootstrap_fsm
 {
@@ -27,16 +29,22 @@ public:
 
 private:
     esp_err_t decode_mqtt_cmd_meta_fw(ArduinoJson::JsonDocument &doc);
+    esp_err_t download_fw_slot(ArduinoJson::JsonDocument &doc, const uint8_t *hash_buf);
+    esp_err_t fetch_to_store(ArduinoJson::JsonDocument &doc, const uint8_t *hash_buf, asset_store_def::asset_kind kind);
     esp_err_t decode_mqtt_cmd_meta_algo(ArduinoJson::JsonDocument &doc);
+    esp_err_t decode_mqtt_cmd_meta_test(ArduinoJson::JsonDocument &doc);
     esp_err_t decode_mqtt_cmd_bin_fw(ArduinoJson::JsonDocument &doc);
     esp_err_t decode_mqtt_cmd_bin_algo(ArduinoJson::JsonDocument &doc);
     esp_err_t decode_mqtt_cmd_set_state(ArduinoJson::JsonDocument &doc);
     esp_err_t decode_mqtt_cmd_read_mem(ArduinoJson::JsonDocument &doc);
+    esp_err_t decode_mqtt_cmd_set_overlay(ArduinoJson::JsonDocument &doc);
 
 private:
     esp_err_t init_load_config();
     esp_err_t init_mq_client();
     esp_err_t init_connect_wifi();
+    esp_err_t init_gdb_server();
+    esp_err_t init_connect_opts();
     void run_fsm_task();
     static void fsm_task_handler(void *_ctx);
 
@@ -46,8 +54,10 @@ private:
     wifi_manager wifi = {};
     mqtt_client mq_client = {};
     cohere_flasher online_flasher = cohere_flasher();
+    swd_gdb_target gdb_swd {};
 
 private:
     static const constexpr char TAG[] = "bootstrap_fsm";
+    static const constexpr char DEFAULT_DUMP_PATH[] = "/data/dump.bin";
 };
 
@@ -9,6 +9,15 @@
 
 #include "comm_fsm.hpp"
 #include "file_utils.hpp"
+#include "fw_overlay.hpp"
+#include "flash_dumper.hpp"
+#include "asset_slot.hpp"
+#include "rtt_client.hpp"
+#include "swd_prog.hpp"
+#include "swd_wire_stats.hpp"
+#include "asset_store.hpp"
+#include "fw_image_cache.hpp"
+#include "offline_flasher.hpp"
 #include "esp_littlefs.h"
 
 esp_err_t comm_fsm::init(comm_interface *_interface)
@@ -18,11 +27,19 @@ esp_err_t comm_fsm::init(comm_interface *_interface)
     }
 
     comm_if = _interface;
+    tx_lock = xSemaphoreCreateMutex();
+    if (tx_lock == nullptr) {
+        return ESP_ERR_NO_MEM;
+    }
 
     if (xTaskCreatePinnedToCore(rx_handler_task, "cdc_rx", 16384, this, tskIDLE_PRIORITY + 1, nullptr, 0) != pdPASS) {
         return ESP_ERR_NOT_FINISHED;
     }
 
+    if (xTaskCreatePinnedToCore(rtt_stream_task, "cdc_rtt", 4096, this, tskIDLE_PRIORITY + 1, nullptr, 0) != pdPASS) {
+        return ESP_ERR_NOT_FINISHED;
+    }
+
     return ESP_OK;
 }
 
@@ -96,10 +113,18 @@ esp_err_t comm_fsm::send_buf_with_header(const uint8_t *header_buf, size_t heade
         return ESP_ERR_INVALID_ARG;
     }
 
+    if (tx_lock != nullptr && xSemaphoreTake(tx_lock, timeout_tick) != pdTRUE) {
+        return ESP_ERR_TIMEOUT;
+    }
+
     auto ret = comm_if->begin_send(header_len + len, timeout_tick);
     ret = ret ?: comm_if->send_buf(buf, len, timeout_tick);
     ret = ret ?: comm_if->finish_send(timeout_tick);
 
+    if (tx_lock != nullptr) {
+        xSemaphoreGive(tx_lock);
+    }
+
     return ret;
 }
 
@@ -144,6 +169,22 @@ void comm_fsm::rx_handler_task(void *_ctx)
 }
 
 
+void comm_fsm::rtt_stream_task(void *_ctx)
+{
+    auto *ctx = (comm_fsm *)_ctx;
+    auto *rtt = rtt_client::instance();
+    uint8_t buf[comm_def::max_pkt_len - sizeof(comm_def::header)] = {};
+    while (true) {
+        size_t len = rtt->read(buf, sizeof(buf), portMAX_DELAY);
+        if (len < 1) {
+            vTaskDelay(pdMS_TO_TICKS(100)); // RTT ring not set up yet
+            continue;
+        }
+
+        ctx->send_pkt(comm_def::PKT_RTT_DATA, buf, len, pdMS_TO_TICKS(100));
+    }
+}
+
 void comm_fsm::parse_pkt()
 {
     if (comm_if == nullptr) {
@@ -220,6 +261,31 @@ void comm_fsm::parse_pkt()
             break;
         }
 
+        case comm_def::PKT_SET_OVERLAY: {
+            handle_set_overlay();
+            break;
+        }
+
+        case comm_def::PKT_DUMP_MEMORY: {
+            handle_dump_memory();
+            break;
+        }
+
+        case comm_def::PKT_SET_SEMIHOST_INPUT: {
+            handle_set_semihost_input();
+            break;
+        }
+
+        case comm_def::PKT_SET_PROG_CHUNK: {
+            handle_set_prog_chunk();
+            break;
+        }
+
+        case comm_def::PKT_SET_CONNECT_FLAGS: {
+            handle_set_connect_flags();
+            break;
+        }
+
         default: {
             ESP_LOGW(TAG, "Unknown packet type 0x%x received", header->type);
             send_nack();
@@ -303,8 +369,17 @@ void comm_fsm::handle_file_chunk()
 
     // When file write finishes, check CRC, and clean up
     if (file_curr_offset == file_expect_len) {
+        fclose(file_handle); // Flushed before the CRC reads it back
+        file_handle = nullptr;
         if (file_utils::validate_file_crc32(file_name, file_crc) == ESP_OK) {
             ESP_LOGI(TAG, "Chunk recv successful, got %u bytes", file_expect_len);
+            auto asset_ret = on_asset_uploaded(file_name);
+            if (asset_ret != ESP_OK) {
+                ESP_LOGE(TAG, "Can't take %s into the asset store: 0x%x", file_name, asset_ret);
+                expect_file_chunk = false;
+                send_chunk_ack(comm_def::CHUNK_ERR_INTERNAL, asset_ret);
+                return;
+            }
 
             file_expect_len = 0;
             file_curr_offset = 0;
@@ -322,6 +397,36 @@ void comm_fsm::handle_file_chunk()
     }
 }
 
+esp_err_t comm_fsm::on_asset_uploaded(const char *path)
+{
+    // The store's active blob wins over the fixed path, so an upload there has to go into the store to be used
+    asset_store_def::asset_kind kind = asset_store_def::KIND_MAX;
+    if (strcmp(path, fw_asset_manager::FIRMWARE_PATH) == 0) {
+        kind = asset_store_def::KIND_FW;
+    } else if (strcmp(path, fw_asset_manager::ALGO_ELF_PATH) == 0) {
+        kind = asset_store_def::KIND_ALGO;
+    } else if (strcmp(path, fw_asset_manager::TEST_IMAGE_PATH) == 0) {
+        kind = asset_store_def::KIND_TEST;
+    } else {
+        return ESP_OK;
+    }
+
+    auto *store = asset_store::instance();
+    auto ret = store->available() ? store->import(path, kind) : ESP_OK;
+    if (kind == asset_store_def::KIND_FW) {
+        // Slots win over the filesystem, so the newest firmware only counts once they're out of the way
+        auto *slots = asset_slot::instance();
+        if (ret == ESP_OK && slots->available()) {
+            ret = slots->retire();
+        }
+
+        fw_image_cache::instance()->invalidate();
+    }
+
+    offline_flasher::instance()->on_assets_changed();
+    return ret;
+}
+
 void comm_fsm::handle_get_file_info()
 {
     uint8_t *buf = (rx_buf_ptr + sizeof(comm_def::header));
@@ -379,3 +484,125 @@ void comm_fsm::handle_format_partition()
     }
 }
 
+void comm_fsm::handle_set_overlay()
+{
+    if (rx_buf_len < sizeof(comm_def::header) + sizeof(comm_def::overlay_req)) {
+        ESP_LOGW(TAG, "Overlay request too short: %u", rx_buf_len);
+        send_nack();
+        return;
+    }
+
+    uint8_t *buf = (rx_buf_ptr + sizeof(comm_def::header));
+    auto *req = (comm_def::overlay_req *)(buf);
+    auto *overlay = fw_overlay::instance();
+    overlay->begin_edit();
+    if ((req->flags & (comm_def::OVERLAY_FLAG_CLEAR | comm_def::OVERLAY_FLAG_CLEAR_ONLY)) != 0) {
+        overlay->clear();
+    }
+
+    if ((req->flags & comm_def::OVERLAY_FLAG_CLEAR_ONLY) != 0) {
+        overlay->end_edit();
+        send_ack();
+        return;
+    }
+
+    esp_err_t ret = ESP_OK;
+    switch (req->type) {
+        case overlay_def::GEN_FIXED: {
+            ret = overlay->add_fixed(req->addr, req->buf, std::min((size_t)req->len, sizeof(req->buf)));
+            break;
+        }
+
+        case overlay_def::GEN_COUNTER: {
+            ret = overlay->add_counter(req->addr, req->len, req->base, req->step);
+            break;
+        }
+
+        case overlay_def::GEN_TEMPLATE: {
+            req->buf[sizeof(req->buf) - 1] = '\0';
+            ret = overlay->add_template(req->addr, (const char *)req->buf, req->len);
+            break;
+        }
+
+        default: {
+            ret = ESP_ERR_NOT_SUPPORTED;
+            break;
+        }
+    }
+
+    overlay->end_edit();
+    if (ret != ESP_OK) {
+        send_error(ret);
+    } else {
+        send_ack();
+    }
+}
+
+void comm_fsm::handle_dump_memory()
+{
+    if (rx_buf_len < sizeof(comm_def::header) + sizeof(comm_def::dump_req)) {
+        ESP_LOGW(TAG, "Dump request too short: %u", rx_buf_len);
+        send_nack();
+        return;
+    }
+
+    uint8_t *buf = (rx_buf_ptr + sizeof(comm_def::header));
+    auto *req = (comm_def::dump_req *)(buf);
+    req->path[sizeof(comm_def::dump_req::path) - 1] = '\0';
+
+    auto ret = flash_dumper::instance()->dump(req->path, req->addr, req->len, (req->flags & comm_def::DUMP_FLAG_WITH_RAM) != 0);
+    if (ret != ESP_OK) {
+        send_error(ret);
+    } else {
+        send_ack();
+    }
+}
+
+void comm_fsm::handle_set_semihost_input()
+{
+    uint8_t *buf = (rx_buf_ptr + sizeof(comm_def::header));
+    size_t len = rx_buf_len - sizeof(comm_def::header);
+
+    auto ret = swd_prog::instance()->get_semihost().set_input(buf, len);
+    if (ret != ESP_OK) {
+        send_error(ret);
+    } else {
+        send_ack();
+    }
+}
+
+void comm_fsm::handle_set_prog_chunk()
+{
+    if (rx_buf_len < sizeof(comm_def::header) + sizeof(uint32_t)) {
+        send_nack();
+        return;
+    }
+
+    uint32_t size = 0;
+    memcpy(&size, rx_buf_ptr + sizeof(comm_def::header), sizeof(size));
+
+    auto ret = swd_prog::instance()->set_prog_chunk_size(size);
+    if (ret != ESP_OK) {
+        send_error(ret);
+    } else {
+        send_ack();
+    }
+}
+
+void comm_fsm::handle_set_connect_flags()
+{
+    if (rx_buf_len < sizeof(comm_def::header) + sizeof(uint32_t)) {
+        send_nack();
+        return;
+    }
+
+    uint32_t flags = 0;
+    memcpy(&flags, rx_buf_ptr + sizeof(comm_def::header), sizeof(flags));
+
+    auto ret = swd_prog::instance()->set_connect_flags(flags);
+    if (ret != ESP_OK) {
+        send_error(ret);
+    } else {
+        send_ack();
+    }
+}
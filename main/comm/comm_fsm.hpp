@@ -2,6 +2,7 @@
 
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
+#include <freertos/semphr.h>
 #include <esp_err.h>
 #include "comm_interface.hpp"
 
@@ -37,6 +38,12 @@ namespace comm_def
         PKT_CHUNK_ACK = 0x14,
         PKT_GET_FILE_INFO = 0x15,
         PKT_FORMAT_PARTITION = 0x16,
+        PKT_SET_OVERLAY = 0x17,
+        PKT_DUMP_MEMORY = 0x18,
+        PKT_RTT_DATA = 0x19, // Unsolicited, device to host only
+        PKT_SET_SEMIHOST_INPUT = 0x1a, // Raw bytes handed to the target's SYS_READ calls
+        PKT_SET_PROG_CHUNK = 0x1b, // uint32_t max bytes per ProgramPage call for the current algo, 0 for one page
+        PKT_SET_CONNECT_FLAGS = 0x1d, // uint32_t swd_def::connect_flag bits for the current algo
         PKT_ERROR = 0xfe,
         PKT_NACK = 0xff,
     };
@@ -95,6 +102,34 @@ namespace comm_def
         char partition_label[max_path_len + 1];
     };
 
+    enum overlay_flag : uint8_t {
+        OVERLAY_FLAG_NONE = 0,
+        OVERLAY_FLAG_CLEAR = BIT(0), // Drop all existing patches first
+        OVERLAY_FLAG_CLEAR_ONLY = BIT(1), // Drop all existing patches and don't add the new one
+    };
+
+    struct __attribute__((packed)) overlay_req {
+        uint32_t addr;
+        uint8_t type; // overlay_def::gen_type
+        uint8_t len;
+        uint8_t flags; // overlay_flag
+        uint32_t base; // Counter only
+        uint32_t step; // Counter only
+        uint8_t buf[64]; // Fixed bytes, or NUL-terminated template string
+    };
+
+    enum dump_flag : uint8_t {
+        DUMP_FLAG_NONE = 0,
+        DUMP_FLAG_WITH_RAM = BIT(0), // Append the RAM window described by the flash algorithm
+    };
+
+    struct __attribute__((packed)) dump_req {
+        uint32_t addr; // UINT32_MAX for flash start
+        uint32_t len; // 0 for whole flash
+        uint8_t flags; // dump_flag
+        char path[max_path_len + 1];
+    };
+
     struct __attribute__((packed)) chunk_pkt {
         uint16_t len;
         uint8_t buf[max_path_len + 1];
@@ -126,6 +161,7 @@ private:
     esp_err_t send_buf_with_header(const uint8_t *header_buf, size_t header_len, const uint8_t *buf, size_t len, uint32_t timeout_tick = portMAX_DELAY);
     static inline uint16_t get_crc16(const uint8_t *buf, size_t len, uint16_t init = 0x0000);
     static void rx_handler_task(void *ctx);
+    static void rtt_stream_task(void *ctx);
 
 private:
     esp_err_t send_ack(uint16_t crc = 0, uint32_t timeout_ms = portMAX_DELAY);
@@ -138,9 +174,15 @@ private:
     void handle_fetch_file_req();
     void handle_store_file_req();
     void handle_file_chunk();
+    esp_err_t on_asset_uploaded(const char *path);
     void handle_get_file_info();
     void handle_delete_file();
     void handle_format_partition();
+    void handle_set_overlay();
+    void handle_dump_memory();
+    void handle_set_semihost_input();
+    void handle_set_prog_chunk();
+    void handle_set_connect_flags();
 
 private:
     static const constexpr char TAG[] = "comm_fsm";
@@ -150,6 +192,7 @@ private:
     uint8_t *rx_buf_ptr = nullptr;
     size_t rx_buf_len = 0;
     comm_interface *comm_if = nullptr;
+    SemaphoreHandle_t tx_lock = nullptr; // Replies from cdc_rx and the RTT stream share the same Tx path
     size_t file_expect_len = 0;
     size_t file_curr_offset = 0;
     uint32_t file_crc = 0;
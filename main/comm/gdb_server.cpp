@@ -0,0 +1,679 @@
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <cctype>
+#include <algorithm>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <esp_log.h>
+
+#include "gdb_server.hpp"
+
+namespace
+{
+    // m-profile core registers only, numbered 0-16 so that 'p'/'P' indices match the 'g' layout
+    const char target_xml[] =
+            "<?xml version=\"1.0\"?>"
+            "<!DOCTYPE target SYSTEM \"gdb-target.dtd\">"
+            "<target version=\"1.0\">"
+            "<architecture>arm</architecture>"
+            "<feature name=\"org.gnu.gdb.arm.m-profile\">"
+            "<reg name=\"r0\" bitsize=\"32\"/><reg name=\"r1\" bitsize=\"32\"/><reg name=\"r2\" bitsize=\"32\"/>"
+            "<reg name=\"r3\" bitsize=\"32\"/><reg name=\"r4\" bitsize=\"32\"/><reg name=\"r5\" bitsize=\"32\"/>"
+            "<reg name=\"r6\" bitsize=\"32\"/><reg name=\"r7\" bitsize=\"32\"/><reg name=\"r8\" bitsize=\"32\"/>"
+            "<reg name=\"r9\" bitsize=\"32\"/><reg name=\"r10\" bitsize=\"32\"/><reg name=\"r11\" bitsize=\"32\"/>"
+            "<reg name=\"r12\" bitsize=\"32\"/>"
+            "<reg name=\"sp\" bitsize=\"32\" type=\"data_ptr\"/>"
+            "<reg name=\"lr\" bitsize=\"32\"/>"
+            "<reg name=\"pc\" bitsize=\"32\" type=\"code_ptr\"/>"
+            "<reg name=\"xpsr\" bitsize=\"32\"/>"
+            "</feature>"
+            "</target>";
+
+    const char monitor_help[] =
+            "halt            Halt the target\n"
+            "reset [run]     Reset the target, halted unless 'run' is given\n"
+            "erase           Erase the whole flash\n"
+            "program [path]  Erase and program a firmware file, default is the stored firmware\n";
+}
+
+esp_err_t gdb_server::init(gdb_target *_target, uint16_t _port)
+{
+    if (_target == nullptr) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    target = _target;
+    port = _port;
+
+    if (xTaskCreatePinnedToCore(server_task, "gdb_srv", 8192, this, tskIDLE_PRIORITY + 2, nullptr, 0) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to start GDB server task");
+        return ESP_ERR_NO_MEM;
+    }
+
+    return ESP_OK;
+}
+
+void gdb_server::server_task(void *ctx)
+{
+    auto *ctx_ptr = static_cast<gdb_server *>(ctx);
+
+    ctx_ptr->listen_sock = socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
+    if (ctx_ptr->listen_sock < 0) {
+        ESP_LOGE(TAG, "Failed to create socket");
+        vTaskDelete(nullptr);
+        return;
+    }
+
+    int opt = 1;
+    setsockopt(ctx_ptr->listen_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(ctx_ptr->port);
+    if (bind(ctx_ptr->listen_sock, (sockaddr *)&addr, sizeof(addr)) != 0 || listen(ctx_ptr->listen_sock, 1) != 0) {
+        ESP_LOGE(TAG, "Failed to listen on port %u", ctx_ptr->port);
+        close(ctx_ptr->listen_sock);
+        ctx_ptr->listen_sock = -1;
+        vTaskDelete(nullptr);
+        return;
+    }
+
+    ESP_LOGI(TAG, "Listening on port %u", ctx_ptr->port);
+    while (true) {
+        int sock = accept(ctx_ptr->listen_sock, nullptr, nullptr);
+        if (sock < 0) {
+            vTaskDelay(pdMS_TO_TICKS(100));
+            continue;
+        }
+
+        // RSP is strictly request/reply with tiny packets, Nagle would add a delay to every one of them
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+
+        ctx_ptr->client_sock = sock;
+        ctx_ptr->serve_client();
+        close(sock);
+        ctx_ptr->client_sock = -1;
+    }
+}
+
+void gdb_server::serve_client()
+{
+    no_ack = false;
+    rx_stash_pos = 0;
+    rx_stash_len = 0;
+
+    ESP_LOGI(TAG, "Client connected");
+    if (target->attach() != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to attach to target");
+        target->release();
+        return;
+    }
+
+    build_memory_map();
+
+    size_t len = 0;
+    while (recv_packet(&len) == ESP_OK) {
+        if (!handle_packet(len)) {
+            break;
+        }
+    }
+
+    target->release();
+    ESP_LOGI(TAG, "Client disconnected");
+}
+
+int gdb_server::read_byte(uint32_t timeout_ms)
+{
+    if (rx_stash_pos < rx_stash_len) {
+        return rx_stash[rx_stash_pos++];
+    }
+
+    fd_set read_fds;
+    FD_ZERO(&read_fds);
+    FD_SET(client_sock, &read_fds);
+    timeval tv = {};
+    tv.tv_sec = (long)(timeout_ms / 1000);
+    tv.tv_usec = (long)((timeout_ms % 1000) * 1000);
+
+    int ret = select(client_sock + 1, &read_fds, nullptr, nullptr, timeout_ms == UINT32_MAX ? nullptr : &tv);
+    if (ret == 0) {
+        return -2; // Timed out
+    } else if (ret < 0) {
+        return -1;
+    }
+
+    ssize_t recv_len = recv(client_sock, rx_stash, sizeof(rx_stash), 0);
+    if (recv_len <= 0) {
+        return -1;
+    }
+
+    rx_stash_len = recv_len;
+    rx_stash_pos = 1;
+    return rx_stash[0];
+}
+
+esp_err_t gdb_server::recv_packet(size_t *len_out)
+{
+    while (true) {
+        int ch = read_byte(UINT32_MAX);
+        if (ch < 0) {
+            return ESP_FAIL;
+        }
+
+        // Acks, and Ctrl-C while already halted, mean nothing here
+        if (ch != '$') {
+            continue;
+        }
+
+        size_t len = 0;
+        uint8_t sum = 0;
+        bool overflow = false;
+        while (true) {
+            ch = read_byte(UINT32_MAX);
+            if (ch < 0) {
+                return ESP_FAIL;
+            } else if (ch == '#') {
+                break;
+            }
+
+            sum += (uint8_t)ch;
+            if (len < gdb_def::max_pkt_len) {
+                rx_pkt[len++] = (char)ch;
+            } else {
+                overflow = true;
+            }
+        }
+
+        int sum_hi = read_byte(UINT32_MAX);
+        int sum_lo = read_byte(UINT32_MAX);
+        if (sum_hi < 0 || sum_lo < 0) {
+            return ESP_FAIL;
+        }
+
+        if (!no_ack) {
+            uint8_t expected = (hex_val((char)sum_hi) << 4) | hex_val((char)sum_lo);
+            bool good = expected == sum && !overflow;
+            send(client_sock, good ? "+" : "-", 1, 0);
+            if (!good) {
+                ESP_LOGW(TAG, "Bad packet, checksum 0x%02x vs 0x%02x, len %u", expected, sum, len);
+                continue;
+            }
+        }
+
+        rx_pkt[len] = '\0';
+        *len_out = len;
+        return ESP_OK;
+    }
+}
+
+esp_err_t gdb_server::send_packet(const char *payload, size_t len)
+{
+    size_t pos = 0;
+    uint8_t sum = 0;
+    tx_frame[pos++] = '$';
+    for (size_t idx = 0; idx < len; idx += 1) {
+        char ch = payload[idx];
+        if (ch == '$' || ch == '#' || ch == '}' || ch == '*') {
+            tx_frame[pos++] = '}';
+            sum += '}';
+            ch ^= 0x20;
+        }
+
+        tx_frame[pos++] = ch;
+        sum += (uint8_t)ch;
+    }
+
+    pos += snprintf(tx_frame + pos, sizeof(tx_frame) - pos, "#%02x", sum);
+
+    for (uint32_t retry = 0; retry < 3; retry += 1) {
+        size_t sent = 0;
+        while (sent < pos) {
+            ssize_t ret = send(client_sock, tx_frame + sent, pos - sent, 0);
+            if (ret <= 0) {
+                return ESP_FAIL;
+            }
+
+            sent += ret;
+        }
+
+        if (no_ack) {
+            return ESP_OK;
+        }
+
+        int ch = read_byte(1000);
+        if (ch == '+') {
+            return ESP_OK;
+        } else if (ch == -1) {
+            return ESP_FAIL;
+        } else if (ch != '-') {
+            // Not an ack at all (e.g. a packet start), leave it for recv_packet()
+            if (ch >= 0) {
+                rx_stash_pos -= 1;
+            }
+
+            return ESP_OK;
+        }
+    }
+
+    return ESP_ERR_TIMEOUT;
+}
+
+esp_err_t gdb_server::send_packet(const char *payload)
+{
+    return send_packet(payload, strlen(payload));
+}
+
+esp_err_t gdb_server::send_error(uint8_t code)
+{
+    char buf[4] = {};
+    snprintf(buf, sizeof(buf), "E%02x", code);
+    return send_packet(buf);
+}
+
+esp_err_t gdb_server::send_console(const char *text)
+{
+    size_t len = std::min(strlen(text), (gdb_def::max_pkt_len - 1) / 2);
+    tx_pkt[0] = 'O';
+    to_hex((const uint8_t *)text, len, tx_pkt + 1);
+    return send_packet(tx_pkt, 1 + len * 2);
+}
+
+bool gdb_server::handle_packet(size_t len)
+{
+    if (len < 1) {
+        send_packet("");
+        return true;
+    }
+
+    switch (rx_pkt[0]) {
+        case '?': {
+            send_packet("S05");
+            break;
+        }
+
+        case 'g': {
+            handle_read_regs();
+            break;
+        }
+
+        case 'G': {
+            handle_write_regs(rx_pkt + 1);
+            break;
+        }
+
+        case 'p': {
+            handle_read_reg(rx_pkt + 1);
+            break;
+        }
+
+        case 'P': {
+            handle_write_reg(rx_pkt + 1);
+            break;
+        }
+
+        case 'm': {
+            handle_read_mem(rx_pkt + 1);
+            break;
+        }
+
+        case 'M': {
+            handle_write_mem(rx_pkt + 1);
+            break;
+        }
+
+        case 'c': {
+            if (target->resume() != ESP_OK) {
+                send_error();
+                break;
+            }
+
+            return run_until_stop();
+        }
+
+        case 's': {
+            if (target->step() != ESP_OK) {
+                send_error();
+                break;
+            }
+
+            return run_until_stop();
+        }
+
+        case 'Z':
+        case 'z': {
+            handle_breakpoint(rx_pkt + 1, rx_pkt[0] == 'Z');
+            break;
+        }
+
+        case 'q':
+        case 'Q': {
+            handle_query(rx_pkt);
+            break;
+        }
+
+        case 'H': {
+            send_packet("OK"); // Single thread, whatever GDB selects is fine
+            break;
+        }
+
+        case 'D': {
+            target->detach();
+            send_packet("OK");
+            return false;
+        }
+
+        case 'k': {
+            target->detach();
+            return false;
+        }
+
+        case 'v': {
+            if (strncmp(rx_pkt, "vKill", 5) == 0) {
+                target->detach();
+                send_packet("OK");
+                return false;
+            }
+
+            send_packet(""); // No vCont, vFlash etc.; GDB falls back to c/s and the monitor commands
+            break;
+        }
+
+        default: {
+            send_packet("");
+            break;
+        }
+    }
+
+    return true;
+}
+
+void gdb_server::handle_query(const char *pkt)
+{
+    if (strncmp(pkt, "qSupported", 10) == 0) {
+        char buf[128] = {};
+        snprintf(buf, sizeof(buf), "PacketSize=%x;qXfer:memory-map:read+;qXfer:features:read+;QStartNoAckMode+", gdb_def::max_pkt_len);
+        send_packet(buf);
+    } else if (strcmp(pkt, "QStartNoAckMode") == 0) {
+        send_packet("OK"); // Still acked, the mode starts after this reply
+        no_ack = true;
+    } else if (strcmp(pkt, "qAttached") == 0) {
+        send_packet("1");
+    } else if (strncmp(pkt, "qXfer:features:read:target.xml:", 31) == 0) {
+        handle_xfer(pkt + 31, std::string(target_xml));
+    } else if (strncmp(pkt, "qXfer:memory-map:read::", 23) == 0) {
+        handle_xfer(pkt + 23, memory_map);
+    } else if (strncmp(pkt, "qRcmd,", 6) == 0) {
+        handle_monitor(pkt + 6);
+    } else if (strncmp(pkt, "qSymbol", 7) == 0) {
+        send_packet("OK");
+    } else {
+        send_packet("");
+    }
+}
+
+void gdb_server::handle_xfer(const char *annex, const std::string &doc)
+{
+    char *end = nullptr;
+    size_t offset = strtoul(annex, &end, 16);
+    size_t len = (end != nullptr && *end == ',') ? strtoul(end + 1, nullptr, 16) : 0;
+    if (offset >= doc.size()) {
+        send_packet("l");
+        return;
+    }
+
+    size_t chunk_len = std::min({ len, doc.size() - offset, gdb_def::max_pkt_len - 1 });
+    tx_pkt[0] = offset + chunk_len < doc.size() ? 'm' : 'l';
+    memcpy(tx_pkt + 1, doc.data() + offset, chunk_len);
+    send_packet(tx_pkt, chunk_len + 1);
+}
+
+void gdb_server::handle_monitor(const char *hex)
+{
+    char cmd[128] = {};
+    size_t len = from_hex(hex, (uint8_t *)cmd, sizeof(cmd) - 1);
+    cmd[len] = '\0';
+    ESP_LOGI(TAG, "monitor %s", cmd);
+
+    esp_err_t ret = ESP_OK;
+    if (strcmp(cmd, "help") == 0) {
+        send_console(monitor_help);
+    } else if (strcmp(cmd, "halt") == 0) {
+        ret = target->halt();
+    } else if (strcmp(cmd, "reset") == 0 || strcmp(cmd, "reset halt") == 0) {
+        ret = target->reset(true);
+    } else if (strcmp(cmd, "reset run") == 0) {
+        ret = target->reset(false);
+    } else if (strcmp(cmd, "erase") == 0) {
+        send_console("Erasing...\n");
+        ret = target->erase_chip();
+    } else if (strncmp(cmd, "program", 7) == 0 && (cmd[7] == '\0' || cmd[7] == ' ')) {
+        const char *path = cmd[7] == ' ' ? cmd + 8 : nullptr;
+        send_console("Programming...\n");
+        ret = target->program_file(path);
+    } else {
+        send_console("Unknown command, try 'monitor help'\n");
+        send_packet("OK");
+        return;
+    }
+
+    if (ret != ESP_OK) {
+        char buf[64] = {};
+        snprintf(buf, sizeof(buf), "Failed: 0x%x\n", ret);
+        send_console(buf);
+        send_error();
+    } else {
+        send_packet("OK");
+    }
+}
+
+void gdb_server::handle_read_regs()
+{
+    uint32_t regs[gdb_def::core_reg_cnt] = {};
+    if (target->read_core_regs(regs, gdb_def::core_reg_cnt) != ESP_OK) {
+        send_error();
+        return;
+    }
+
+    to_hex((const uint8_t *)regs, sizeof(regs), tx_pkt);
+    send_packet(tx_pkt, sizeof(regs) * 2);
+}
+
+void gdb_server::handle_write_regs(const char *hex)
+{
+    uint32_t regs[gdb_def::core_reg_cnt] = {};
+    if (from_hex(hex, (uint8_t *)regs, sizeof(regs)) != sizeof(regs)) {
+        send_error();
+        return;
+    }
+
+    for (uint32_t idx = 0; idx < gdb_def::core_reg_cnt; idx += 1) {
+        if (target->write_core_reg(idx, regs[idx]) != ESP_OK) {
+            send_error();
+            return;
+        }
+    }
+
+    send_packet("OK");
+}
+
+void gdb_server::handle_read_reg(const char *pkt)
+{
+    uint32_t idx = strtoul(pkt, nullptr, 16);
+    uint32_t regs[gdb_def::core_reg_cnt] = {};
+    if (idx >= gdb_def::core_reg_cnt || target->read_core_regs(regs, gdb_def::core_reg_cnt) != ESP_OK) {
+        send_error();
+        return;
+    }
+
+    to_hex((const uint8_t *)&regs[idx], sizeof(uint32_t), tx_pkt);
+    send_packet(tx_pkt, sizeof(uint32_t) * 2);
+}
+
+void gdb_server::handle_write_reg(const char *pkt)
+{
+    char *end = nullptr;
+    uint32_t idx = strtoul(pkt, &end, 16);
+    uint32_t val = 0;
+    if (end == nullptr || *end != '=' || idx >= gdb_def::core_reg_cnt
+        || from_hex(end + 1, (uint8_t *)&val, sizeof(val)) != sizeof(val)
+        || target->write_core_reg(idx, val) != ESP_OK) {
+        send_error();
+        return;
+    }
+
+    send_packet("OK");
+}
+
+void gdb_server::handle_read_mem(const char *pkt)
+{
+    char *end = nullptr;
+    uint32_t addr = strtoul(pkt, &end, 16);
+    if (end == nullptr || *end != ',') {
+        send_error();
+        return;
+    }
+
+    // A short reply is fine, GDB asks again for the rest
+    size_t len = std::min((size_t)strtoul(end + 1, nullptr, 16), gdb_def::max_mem_xfer);
+    if (len > 0 && target->read_memory(addr, mem_buf, len) != ESP_OK) {
+        send_error();
+        return;
+    }
+
+    to_hex(mem_buf, len, tx_pkt);
+    send_packet(tx_pkt, len * 2);
+}
+
+void gdb_server::handle_write_mem(const char *pkt)
+{
+    char *end = nullptr;
+    uint32_t addr = strtoul(pkt, &end, 16);
+    if (end == nullptr || *end != ',') {
+        send_error();
+        return;
+    }
+
+    size_t len = strtoul(end + 1, &end, 16);
+    if (end == nullptr || *end != ':' || len > sizeof(mem_buf)) {
+        send_error();
+        return;
+    }
+
+    if (from_hex(end + 1, mem_buf, len) != len || (len > 0 && target->write_memory(addr, mem_buf, len) != ESP_OK)) {
+        send_error();
+        return;
+    }
+
+    send_packet("OK");
+}
+
+void gdb_server::handle_breakpoint(const char *pkt, bool insert)
+{
+    // Z0 (software) is served by hardware breakpoints too: most of the code lives in flash, which can't take a BKPT patch
+    if (pkt[0] != '0' && pkt[0] != '1') {
+        send_packet(""); // No watchpoints
+        return;
+    }
+
+    uint32_t addr = strtoul(pkt + 2, nullptr, 16);
+    auto ret = insert ? target->add_breakpoint(addr) : target->remove_breakpoint(addr);
+    if (ret != ESP_OK) {
+        send_error(ret == ESP_ERR_NO_MEM ? 0x0e : 1);
+        return;
+    }
+
+    send_packet("OK");
+}
+
+bool gdb_server::run_until_stop()
+{
+    bool interrupted = false;
+    gdb_def::stop_reason reason = gdb_def::STOP_RUNNING;
+    while (true) {
+        if (target->poll_stop(&reason) != ESP_OK) {
+            ESP_LOGE(TAG, "Lost the target while running");
+            target->halt();
+            break;
+        }
+
+        if (reason != gdb_def::STOP_RUNNING) {
+            break;
+        }
+
+        int ch = read_byte(gdb_def::run_poll_ms);
+        if (ch == -1) {
+            return false; // Client gone, target keeps running
+        } else if (ch == gdb_def::INTERRUPT) {
+            interrupted = true;
+            target->halt();
+        }
+    }
+
+    send_packet(interrupted ? "S02" : "S05"); // SIGINT for Ctrl-C, SIGTRAP for breakpoints and steps
+    return true;
+}
+
+void gdb_server::build_memory_map()
+{
+    std::vector<gdb_def::mem_region> regions = {};
+    memory_map = "<?xml version=\"1.0\"?>"
+                 "<!DOCTYPE memory-map PUBLIC \"+//IDN gnu.org//DTD GDB Memory Map V1.0//EN\" \"http://sourceware.org/gdb/gdb-memory-map.dtd\">"
+                 "<memory-map>";
+
+    if (target->get_memory_map(regions) != ESP_OK) {
+        ESP_LOGW(TAG, "No memory map from target");
+    }
+
+    static const char *type_names[] = { "ram", "rom", "flash" };
+    for (const auto &region : regions) {
+        char buf[160] = {};
+        if (region.type == gdb_def::MEM_FLASH) {
+            snprintf(buf, sizeof(buf), "<memory type=\"flash\" start=\"0x%lx\" length=\"0x%lx\"><property name=\"blocksize\">0x%lx</property></memory>",
+                     region.addr, region.len, region.block_size);
+        } else {
+            snprintf(buf, sizeof(buf), "<memory type=\"%s\" start=\"0x%lx\" length=\"0x%lx\"/>", type_names[region.type], region.addr, region.len);
+        }
+
+        memory_map += buf;
+    }
+
+    memory_map += "</memory-map>";
+}
+
+uint8_t gdb_server::hex_val(char ch)
+{
+    if (ch >= '0' && ch <= '9') {
+        return ch - '0';
+    } else if (ch >= 'a' && ch <= 'f') {
+        return ch - 'a' + 10;
+    } else if (ch >= 'A' && ch <= 'F') {
+        return ch - 'A' + 10;
+    }
+
+    return 0;
+}
+
+void gdb_server::to_hex(const uint8_t *buf, size_t len, char *out)
+{
+    static const char digits[] = "0123456789abcdef";
+    for (size_t idx = 0; idx < len; idx += 1) {
+        out[idx * 2] = digits[buf[idx] >> 4];
+        out[idx * 2 + 1] = digits[buf[idx] & 0x0f];
+    }
+}
+
+size_t gdb_server::from_hex(const char *hex, uint8_t *out, size_t max_len)
+{
+    size_t len = 0;
+    while (len < max_len && isxdigit((unsigned char)hex[0]) && isxdigit((unsigned char)hex[1])) {
+        out[len++] = (hex_val(hex[0]) << 4) | hex_val(hex[1]);
+        hex += 2;
+    }
+
+    return len;
+}
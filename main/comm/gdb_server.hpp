@@ -0,0 +1,86 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <esp_err.h>
+#include "gdb_target.hpp"
+
+namespace gdb_def
+{
+    static const constexpr uint16_t default_port = 3333;
+    static const constexpr size_t max_pkt_len = 4096; // Payload, as advertised in PacketSize
+    static const constexpr size_t max_mem_xfer = (max_pkt_len - 8) / 2; // Hex doubles it
+    static const constexpr uint32_t run_poll_ms = 10;
+    static const constexpr char INTERRUPT = 0x03;
+}
+
+/**
+ * GDB remote serial protocol server over TCP, one client at a time.
+ * Registers are read in one sweep per stop and memory goes through the target's cache,
+ * so GDB's burst of small reads after every stop doesn't turn into one SWD round trip each.
+ */
+class gdb_server
+{
+public:
+    static gdb_server *instance()
+    {
+        static gdb_server _instance;
+        return &_instance;
+    }
+
+    gdb_server(gdb_server const &) = delete;
+    void operator=(gdb_server const &) = delete;
+
+public:
+    esp_err_t init(gdb_target *_target, uint16_t _port = gdb_def::default_port);
+
+private:
+    gdb_server() = default;
+    static void server_task(void *ctx);
+    void serve_client();
+
+    int read_byte(uint32_t timeout_ms);
+    esp_err_t recv_packet(size_t *len_out);
+    esp_err_t send_packet(const char *payload, size_t len);
+    esp_err_t send_packet(const char *payload);
+    esp_err_t send_error(uint8_t code = 1);
+    esp_err_t send_console(const char *text);
+
+    bool handle_packet(size_t len);
+    void handle_query(const char *pkt);
+    void handle_xfer(const char *annex, const std::string &doc);
+    void handle_monitor(const char *hex);
+    void handle_read_regs();
+    void handle_write_regs(const char *hex);
+    void handle_read_reg(const char *pkt);
+    void handle_write_reg(const char *pkt);
+    void handle_read_mem(const char *pkt);
+    void handle_write_mem(const char *pkt);
+    void handle_breakpoint(const char *pkt, bool insert);
+    bool run_until_stop();
+    void build_memory_map();
+
+    static uint8_t hex_val(char ch);
+    static void to_hex(const uint8_t *buf, size_t len, char *out);
+    static size_t from_hex(const char *hex, uint8_t *out, size_t max_len);
+
+private:
+    gdb_target *target = nullptr;
+    uint16_t port = gdb_def::default_port;
+    int listen_sock = -1;
+    int client_sock = -1;
+    bool no_ack = false;
+    uint8_t rx_stash[512] = {};
+    size_t rx_stash_pos = 0;
+    size_t rx_stash_len = 0;
+    char rx_pkt[gdb_def::max_pkt_len + 1] = {};
+    char tx_pkt[gdb_def::max_pkt_len + 1] = {};
+    char tx_frame[gdb_def::max_pkt_len * 2 + 4] = {}; // Worst case every byte escaped
+    uint8_t mem_buf[gdb_def::max_mem_xfer] = {};
+    std::string memory_map = {};
+
+    static const constexpr char TAG[] = "gdb_srv";
+};
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <esp_err.h>
+
+namespace gdb_def
+{
+    static const constexpr size_t core_reg_cnt = 17; // r0-r12, sp, lr, pc, xpsr; same order as DCRSR REGSEL
+
+    enum mem_type : uint8_t
+    {
+        MEM_RAM = 0,
+        MEM_ROM = 1,
+        MEM_FLASH = 2,
+    };
+
+    struct mem_region
+    {
+        mem_type type;
+        uint32_t addr;
+        uint32_t len;
+        uint32_t block_size; // Flash only, erase granularity
+    };
+
+    enum stop_reason : uint8_t
+    {
+        STOP_RUNNING = 0,
+        STOP_HALTED = 1, // Halt request, e.g. Ctrl-C
+        STOP_BREAKPOINT = 2,
+        STOP_STEP = 3,
+    };
+}
+
+/**
+ * What gdb_server needs from a target; swd_gdb_target is the only implementation.
+ * There is no simulated target yet, the server has only been run against real hardware.
+ */
+class gdb_target
+{
+public:
+    /**
+     * Start of a client session; the target stays owned by this session until release()
+     */
+    virtual esp_err_t attach() = 0;
+    virtual esp_err_t detach() = 0;
+
+    /**
+     * Client gone, with or without detach(); also called after a failed attach()
+     */
+    virtual void release() = 0;
+    virtual esp_err_t halt() = 0;
+    virtual esp_err_t resume() = 0;
+    virtual esp_err_t step() = 0;
+    virtual esp_err_t reset(bool halt_after) = 0;
+    virtual esp_err_t poll_stop(gdb_def::stop_reason *reason) = 0;
+
+    virtual esp_err_t read_core_regs(uint32_t *regs, size_t cnt) = 0;
+    virtual esp_err_t write_core_reg(uint32_t idx, uint32_t val) = 0;
+    virtual esp_err_t read_memory(uint32_t addr, uint8_t *buf, size_t len) = 0;
+    virtual esp_err_t write_memory(uint32_t addr, const uint8_t *buf, size_t len) = 0;
+
+    virtual esp_err_t add_breakpoint(uint32_t addr) = 0;
+    virtual esp_err_t remove_breakpoint(uint32_t addr) = 0;
+
+    virtual esp_err_t get_memory_map(std::vector<gdb_def::mem_region> &regions) = 0;
+    virtual esp_err_t erase_chip() = 0;
+    virtual esp_err_t program_file(const char *path) = 0;
+};
@@ -8,6 +8,33 @@ esp_err_t http_downloader::init(const char *_url, const char *_save_path, size_t
         return ESP_ERR_INVALID_ARG;
     }
 
+    auto ret = init_client(_url, _max_len);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    fp = fopen(_save_path, "w+");
+    if (fp == nullptr) {
+        ESP_LOGE(TAG, "Failed to save file");
+        return ESP_ERR_NO_MEM;
+    }
+
+
+    return ESP_OK;
+}
+
+esp_err_t http_downloader::init_slot(const char *_url, size_t _max_len)
+{
+    if (_url == nullptr || _max_len < 1) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    slot = asset_slot::instance();
+    return init_client(_url, _max_len);
+}
+
+esp_err_t http_downloader::init_client(const char *_url, size_t _max_len)
+{
     esp_http_client_config_t config = {};
     config.url = _url;
     config.disable_auto_redirect = false;
@@ -32,13 +59,6 @@ esp_err_t http_downloader::init(const char *_url, const char *_save_path, size_t
     }
 
     max_len = _max_len;
-    fp = fopen(_save_path, "w+");
-    if (fp == nullptr) {
-        ESP_LOGE(TAG, "Failed to save file");
-        return ESP_ERR_NO_MEM;
-    }
-
-
     return ESP_OK;
 }
 
@@ -104,6 +124,21 @@ esp_err_t http_downloader::http_evt_handler(esp_http_client_event_t *evt)
                 return ESP_ERR_NO_MEM;
             }
 
+            if (ctx->slot != nullptr) {
+                auto slot_ret = ctx->slot->write((const uint8_t *)evt->data, evt->data_len);
+                if (slot_ret != ESP_OK) {
+                    ESP_LOGE(TAG, "Slot write failed, ret=0x%x", slot_ret);
+                    xEventGroupClearBits(ctx->evt_group, (http_downloader::REQ_DATA_AVAIL | http_downloader::REQ_DONE));
+                    xEventGroupSetBits(ctx->evt_group, http_downloader::REQ_ERROR);
+                    return slot_ret;
+                }
+
+                ctx->curr_pos += evt->data_len;
+                xEventGroupClearBits(ctx->evt_group, http_downloader::REQ_ERROR);
+                xEventGroupSetBits(ctx->evt_group, http_downloader::REQ_DATA_AVAIL);
+                break;
+            }
+
             if (ctx->fp == nullptr) {
                 ESP_LOGE(TAG, "Invalid file pointer");
                 xEventGroupClearBits(ctx->evt_group, (http_downloader::REQ_DATA_AVAIL | http_downloader::REQ_DONE));
@@ -129,6 +164,12 @@ esp_err_t http_downloader::http_evt_handler(esp_http_client_event_t *evt)
 
         case HTTP_EVENT_ON_FINISH: {
             ESP_LOGI(TAG, "Request finished, flushing fp");
+            if (ctx->slot != nullptr) {
+                xEventGroupClearBits(ctx->evt_group, http_downloader::REQ_ERROR);
+                xEventGroupSetBits(ctx->evt_group, http_downloader::REQ_DONE);
+                break; // Caller commits the slot
+            }
+
             if (ctx->fp == nullptr) {
                 return ESP_OK; // Make it no-op
             }
@@ -3,6 +3,7 @@
 #include <cstdio>
 #include <esp_err.h>
 #include <esp_http_client.h>
+#include "asset_slot.hpp"
 
 class http_downloader
 {
@@ -16,6 +17,11 @@ public:
 public:
     http_downloader() = default;
     esp_err_t init(const char *_url, const char *_save_path, size_t _max_len = 1048576);
+
+    /**
+     * Stream the body into the asset slot opened with asset_slot::begin(), instead of a file
+     */
+    esp_err_t init_slot(const char *_url, size_t _max_len = 1048576);
     esp_err_t set_url(const char *url);
     esp_err_t set_method(esp_http_client_method_t method);
     esp_err_t set_header(const char *key, const char *val);
@@ -29,6 +35,8 @@ private:
     size_t curr_pos = 0;
     size_t max_len = 0;
     FILE *fp = nullptr;
+    asset_slot *slot = nullptr;
+    esp_err_t init_client(const char *_url, size_t _max_len);
     static esp_err_t http_evt_handler(esp_http_client_event_t *evt);
 
     static const constexpr char TAG[] = "http_dl";
@@ -18,10 +18,12 @@ namespace mq
     static_char TOPIC_CMD_BASE[] = "/soulinjector/v1/cmd";
     static_char TOPIC_CMD_METADATA_FIRMWARE[] = "meta/fw";
     static_char TOPIC_CMD_METADATA_FLASH_ALGO[] = "meta/algo";
+    static_char TOPIC_CMD_METADATA_TEST[] = "meta/test";
     static_char TOPIC_CMD_BIN_FIRMWARE[] = "bin/fw";
     static_char TOPIC_CMD_BIN_FLASH_ALGO[] = "bin/algo";
     static_char TOPIC_CMD_SET_STATE[] = "state";
     static_char TOPIC_CMD_READ_MEM[] = "read_mem";
+    static_char TOPIC_CMD_OVERLAY[] = "overlay";
 
     enum state : uint32_t {
         MQ_STATE_PING = 0,
@@ -87,7 +87,7 @@ esp_err_t mqtt_client::report_stuff(rpc::report::base_event *event, const char *
         msgpack_buf = msgpack_buf_stack;
     }
 
-    size_t serialised_len = event->serialize(msgpack_buf, sizeof(msgpack_buf));
+    size_t serialised_len = event->serialize(msgpack_buf, heap_allocated ? expected_size : sizeof(msgpack_buf_stack));
     int ret = esp_mqtt_client_enqueue(mqtt_handle, topic_full, (const char *)msgpack_buf, (int)serialised_len, 1, 1, true);
 
     if (heap_allocated) {
@@ -216,7 +216,7 @@ void mqtt_client::mq_event_handler(void *handler_args, esp_event_base_t base, in
 esp_err_t mqtt_client::subscribe_on_connect()
 {
     char topic_str[sizeof(mq::TOPIC_CMD_BASE) + (sizeof(host_sn) * 2) + 16] = {};
-    esp_mqtt_topic_t topics[4] = {};
+    esp_mqtt_topic_t topics[6] = {};
 
     snprintf(topic_str, sizeof(topic_str), "%s/" MACSTR "/%s", mq::TOPIC_CMD_BASE, MAC2STR(host_sn), mq::TOPIC_CMD_READ_MEM);
     topic_str[sizeof(topic_str) - 1] = '\0';
@@ -242,11 +242,23 @@ esp_err_t mqtt_client::subscribe_on_connect()
     topics[3].qos = 2;
     memset(topic_str, 0, sizeof(topic_str));
 
+    snprintf(topic_str, sizeof(topic_str), "%s/" MACSTR "/%s", mq::TOPIC_CMD_BASE, MAC2STR(host_sn), mq::TOPIC_CMD_OVERLAY);
+    topic_str[sizeof(topic_str) - 1] = '\0';
+    topics[4].filter = strdup((const char *)topic_str);
+    topics[4].qos = 2;
+    memset(topic_str, 0, sizeof(topic_str));
+
+    snprintf(topic_str, sizeof(topic_str), "%s/" MACSTR "/%s", mq::TOPIC_CMD_BASE, MAC2STR(host_sn), mq::TOPIC_CMD_METADATA_TEST);
+    topic_str[sizeof(topic_str) - 1] = '\0';
+    topics[5].filter = strdup((const char *)topic_str);
+    topics[5].qos = 2;
+    memset(topic_str, 0, sizeof(topic_str));
+
 
-    auto ret = esp_mqtt_client_subscribe_multiple(mqtt_handle, topics, 4);
+    auto ret = esp_mqtt_client_subscribe_multiple(mqtt_handle, topics, sizeof(topics) / sizeof(esp_mqtt_topic_t));
     ESP_LOGI(TAG, "Subscribing to %s, ret=%d", topic_str, ret);
 
-    for (size_t idx = 0; idx < 4; idx += 1) {
+    for (size_t idx = 0; idx < sizeof(topics) / sizeof(esp_mqtt_topic_t); idx += 1) {
         if (topics[idx].filter != nullptr) {
             free((void *) topics[idx].filter);
             topics[idx].filter = nullptr;
@@ -288,6 +300,8 @@ esp_err_t mqtt_client::decode_cmd_msg(const char *topic, size_t topic_len, uint8
         ret = make_mq_cmd_packet(&cmd, MQ_CMD_META_FW, buf, buf_len);
     } else if (strnstr(topic, mq::TOPIC_CMD_METADATA_FLASH_ALGO, std::min(sizeof(mq::TOPIC_CMD_METADATA_FLASH_ALGO), topic_len)) != nullptr) {
         ret = make_mq_cmd_packet(&cmd, MQ_CMD_META_ALGO, buf, buf_len);
+    } else if (strnstr(topic, mq::TOPIC_CMD_METADATA_TEST, std::min(sizeof(mq::TOPIC_CMD_METADATA_TEST), topic_len)) != nullptr) {
+        ret = make_mq_cmd_packet(&cmd, MQ_CMD_META_TEST, buf, buf_len);
     } else if (strnstr(topic, mq::TOPIC_CMD_BIN_FIRMWARE, std::min(sizeof(mq::TOPIC_CMD_BIN_FIRMWARE), topic_len)) != nullptr) {
         xEventGroupSetBits(mqtt_state, MQ_STATE_BIN_REQ_READY);
         ret = make_mq_cmd_packet(&cmd, MQ_CMD_BIN_FW, buf, buf_len);
@@ -298,6 +312,8 @@ esp_err_t mqtt_client::decode_cmd_msg(const char *topic, size_t topic_len, uint8
         ret = make_mq_cmd_packet(&cmd, MQ_CMD_READ_MEM, buf, buf_len);
     } else if (strnstr(topic, mq::TOPIC_CMD_SET_STATE, std::min(sizeof(mq::TOPIC_CMD_SET_STATE), topic_len)) != nullptr) {
         ret = make_mq_cmd_packet(&cmd, MQ_CMD_SET_STATE, buf, buf_len);
+    } else if (strnstr(topic, mq::TOPIC_CMD_OVERLAY, std::min(sizeof(mq::TOPIC_CMD_OVERLAY), topic_len)) != nullptr) {
+        ret = make_mq_cmd_packet(&cmd, MQ_CMD_SET_OVERLAY, buf, buf_len);
     } else {
         ret = ESP_ERR_NOT_SUPPORTED;
     }
@@ -31,6 +31,8 @@ public:
         MQ_CMD_BIN_ALGO,
         MQ_CMD_SET_STATE,
         MQ_CMD_READ_MEM,
+        MQ_CMD_SET_OVERLAY,
+        MQ_CMD_META_TEST,
     };
 
     struct __attribute__((packed)) mq_cmd_pkt {
@@ -3,6 +3,7 @@
 #include <cstdint>
 #include <ArduinoJson.hpp>
 #include <psram_json_allocator.hpp>
+#include <fw_overlay.hpp>
 
 namespace rpc::report
 {
@@ -104,6 +105,8 @@ namespace rpc::report
      * @remark "sn" - Serial number detected from target product
      * @remark "addr" - Beginning address that programmed
      * @remark "len" - Length of the data programmed
+     * @remark "seq" - Per-unit overlay sequence number (only when overlay is in use)
+     * @remark "overlay" - Per-unit overlay patches applied, array of {"addr", "data"}
      */
     struct prog_event : public base_event
     {
@@ -116,6 +119,7 @@ namespace rpc::report
             document["addr"] = addr;
             document["len"] = len;
             document["sn"] = ArduinoJson::MsgPackBinary(target_sn, target_sn_len);
+            fill_overlay();
 
             return ArduinoJson::measureMsgPack(document);
         };
@@ -128,16 +132,36 @@ namespace rpc::report
             document["addr"] = addr;
             document["len"] = len;
             document["sn"] = ArduinoJson::MsgPackBinary(target_sn, std::min(target_sn_len, sizeof(target_sn)));
+            fill_overlay();
 
             return ArduinoJson::serializeMsgPack(document, (void *)buf_out, buf_size);
         }
 
+    private:
+        void fill_overlay()
+        {
+            if (overlay == nullptr || overlay->empty()) {
+                return;
+            }
+
+            document["seq"] = overlay_seq;
+            auto patch_arr = document["overlay"].to<ArduinoJson::JsonArray>();
+            for (auto &patch : *overlay) {
+                auto item = patch_arr.add<ArduinoJson::JsonObject>();
+                item["addr"] = patch.addr;
+                item["data"] = ArduinoJson::MsgPackBinary(patch.value, patch.len);
+            }
+        }
+
+    public:
         uint32_t addr = 0;
         uint32_t len = 0;
         size_t target_sn_len = 0;
         uint8_t target_sn[32]{};
         uint8_t flash_algo_hash[32]{};
         uint8_t firmware_hash[32]{};
+        uint32_t overlay_seq = 0;
+        const std::vector<overlay_def::patch_item> *overlay = nullptr;
     };
 
     struct self_test_event : public base_event
@@ -149,10 +173,14 @@ namespace rpc::report
             document["ret"] = return_num;
             document["algo"] = ArduinoJson::MsgPackBinary(flash_algo_hash, sizeof(flash_algo_hash));
             document["sn"] = ArduinoJson::MsgPackBinary(target_sn, std::min(target_sn_len, sizeof(target_sn)));
-            if (ret_buf != nullptr && ret_len == 0) {
+            if (ret_buf != nullptr && ret_len > 0) {
                 document["retPld"] = ArduinoJson::MsgPackBinary(ret_buf, ret_len);
             }
 
+            if (rtt_buf != nullptr && rtt_len > 0) {
+                document["rtt"] = ArduinoJson::MsgPackBinary(rtt_buf, rtt_len);
+            }
+
             return ArduinoJson::measureMsgPack(document);
         }
 
@@ -163,10 +191,14 @@ namespace rpc::report
             document["ret"] = return_num;
             document["algo"] = ArduinoJson::MsgPackBinary(flash_algo_hash, sizeof(flash_algo_hash));
             document["sn"] = ArduinoJson::MsgPackBinary(target_sn, target_sn_len);
-            if (ret_buf != nullptr && ret_len == 0) {
+            if (ret_buf != nullptr && ret_len > 0) {
                 document["retPld"] = ArduinoJson::MsgPackBinary(ret_buf, ret_len);
             }
 
+            if (rtt_buf != nullptr && rtt_len > 0) {
+                document["rtt"] = ArduinoJson::MsgPackBinary(rtt_buf, rtt_len);
+            }
+
             return ArduinoJson::serializeMsgPack(document, (void *)buf_out, buf_size);
         }
 
@@ -177,6 +209,8 @@ namespace rpc::report
         size_t target_sn_len = 0;
         uint8_t *ret_buf = nullptr;
         size_t ret_len = 0;
+        const uint8_t *rtt_buf = nullptr; // RTT output captured while the test was running
+        size_t rtt_len = 0;
     };
 
     struct erase_event : public base_event
@@ -113,6 +113,101 @@ esp_err_t config_reader::get_mode(config_reader::work_mode *mode)
     return ESP_OK;
 }
 
+esp_err_t config_reader::get_gdb_port(uint16_t *port)
+{
+    if (port == nullptr) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    // GDB server is opt-in, no field means no server
+    if (!has_valid_config || !json_doc["net"]["gdb_port"].is<uint16_t>()) {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    *port = json_doc["net"]["gdb_port"];
+    return ESP_OK;
+}
+
+esp_err_t config_reader::get_connect_opts(bool *under_reset, bool *fast_reconnect)
+{
+    if (under_reset == nullptr || fast_reconnect == nullptr) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (!has_valid_config || !json_doc["target"].is<ArduinoJson::JsonObject>()) {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    *under_reset = json_doc["target"]["connect_under_reset"] | false;
+    *fast_reconnect = json_doc["target"]["fast_reconnect"] | false;
+    return ESP_OK;
+}
+
+esp_err_t config_reader::get_drop_targets(uint32_t *targetsel_out, size_t max_cnt, size_t *cnt_out)
+{
+    if (targetsel_out == nullptr || cnt_out == nullptr) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    *cnt_out = 0;
+    if (!has_valid_config || !json_doc["target"]["multidrop"].is<ArduinoJson::JsonArray>()) {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    for (ArduinoJson::JsonVariant item : json_doc["target"]["multidrop"].as<ArduinoJson::JsonArray>()) {
+        if (*cnt_out >= max_cnt) {
+            ESP_LOGE(TAG, "Too many multi-drop targets, max %u", max_cnt);
+            return ESP_ERR_INVALID_SIZE;
+        }
+
+        if (!parse_u32(item, &targetsel_out[*cnt_out])) {
+            ESP_LOGE(TAG, "Bad TARGETSEL for multi-drop target %u", *cnt_out);
+            return ESP_ERR_INVALID_ARG;
+        }
+
+        *cnt_out += 1;
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t config_reader::get_uid_opts(uint32_t *addr_out, uint32_t *len_out)
+{
+    if (addr_out == nullptr || len_out == nullptr) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (!has_valid_config || json_doc["target"]["uid_addr"].isNull()) {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    if (!parse_u32(json_doc["target"]["uid_addr"], addr_out)) {
+        ESP_LOGE(TAG, "Bad uid_addr");
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    *len_out = json_doc["target"]["uid_len"] | 12; // 96-bit UID, as on most STM32 and GD32 parts
+    return ESP_OK;
+}
+
+bool config_reader::parse_u32(ArduinoJson::JsonVariantConst item, uint32_t *out)
+{
+    // Numbers, or strings for hex since JSON has no hex literals
+    if (item.is<uint32_t>()) {
+        *out = item.as<uint32_t>();
+        return true;
+    }
+
+    if (!item.is<const char *>()) {
+        return false;
+    }
+
+    char *end = nullptr;
+    const char *str = item.as<const char *>();
+    *out = strtoul(str, &end, 0);
+    return end != str && *end == '\0';
+}
+
 uint64_t config_reader::get_flash_sn() const
 {
     return flash_sn;
@@ -47,6 +47,14 @@ public:
     esp_err_t get_wifi_cred(wifi_config_t *cred);
     esp_err_t get_mqtt_cred(config::mqtt_cred &mq_cred);
     esp_err_t get_mac_addr(uint8_t *mac_addr);
+    esp_err_t get_gdb_port(uint16_t *port);
+    esp_err_t get_connect_opts(bool *under_reset, bool *fast_reconnect);
+    esp_err_t get_drop_targets(uint32_t *targetsel_out, size_t max_cnt, size_t *cnt_out);
+
+    /**
+     * Where the target keeps its unique ID, from target.uid_addr / target.uid_len; len defaults to 12 bytes
+     */
+    esp_err_t get_uid_opts(uint32_t *addr_out, uint32_t *len_out);
     void get_full_sn_str(char *sn_out, size_t buf_len);
     void get_full_sn_byte(uint8_t *buf, size_t buf_len);
     esp_err_t reload_config();
@@ -54,6 +62,7 @@ public:
 
 private:
     config_reader() = default;
+    static bool parse_u32(ArduinoJson::JsonVariantConst item, uint32_t *out);
     bool has_valid_config = false;
     uint8_t mac_addr[6] = {};
     uint64_t flash_sn = 0;
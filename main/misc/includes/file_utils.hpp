@@ -1,5 +1,7 @@
 #pragma once
 
+#include <cstdio>
+#include <sys/stat.h>
 #include <esp_err.h>
 #include <algorithm>
 
@@ -145,6 +147,44 @@ public:
         return ESP_OK;
     }
 
+    /**
+     * Move tmp_path over path. FatFS won't rename onto an existing file, so path goes first; a power cut in
+     * between leaves just tmp_path, which recover_replace() puts in place on the next boot.
+     * @param tmp_path Complete and fsync'd
+     */
+    static esp_err_t replace_file(const char *tmp_path, const char *path)
+    {
+        struct stat st = {};
+        if (stat(path, &st) == 0 && remove(path) != 0) {
+            ESP_LOGE(TAG, "Failed to remove %s", path);
+            return ESP_FAIL;
+        }
+
+        if (rename(tmp_path, path) != 0) {
+            ESP_LOGE(TAG, "Failed to rename %s to %s", tmp_path, path);
+            return ESP_FAIL;
+        }
+
+        return ESP_OK;
+    }
+
+    /**
+     * Finish an interrupted replace_file(): a lone tmp_path was already complete, one next to path may be half written
+     */
+    static void recover_replace(const char *tmp_path, const char *path)
+    {
+        struct stat st = {};
+        if (stat(tmp_path, &st) != 0) {
+            return;
+        }
+
+        if (stat(path, &st) == 0) {
+            remove(tmp_path);
+        } else if (rename(tmp_path, path) == 0) {
+            ESP_LOGW(TAG, "Recovered %s from an interrupted replace", path);
+        }
+    }
+
     static esp_err_t write_to_file(const char *path, const uint8_t *buf, size_t len)
     {
         if (path == nullptr) {
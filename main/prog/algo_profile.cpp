@@ -0,0 +1,106 @@
+#include <cstdio>
+#include <esp_log.h>
+#include <nvs_flash.h>
+
+#include "algo_profile.hpp"
+
+esp_err_t algo_profile::init()
+{
+    if (nvs_handle != nullptr) {
+        return ESP_OK;
+    }
+
+    esp_err_t ret = ESP_OK;
+    nvs_handle = nvs::open_nvs_handle(NVS_NS, NVS_READWRITE, &ret);
+    if (ret != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to open NVS: 0x%x", ret);
+        nvs_handle = nullptr;
+    }
+
+    return ret;
+}
+
+esp_err_t algo_profile::load(const uint8_t *algo_hash, algo_profile_def::record *out)
+{
+    if (algo_hash == nullptr || out == nullptr) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (nvs_handle == nullptr) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    char key[16] = {};
+    get_nvs_key(algo_hash, key, sizeof(key));
+
+    size_t len = 0;
+    auto ret = nvs_handle->get_item_size(nvs::ItemType::BLOB, key, len);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    // Fields are only ever appended, so an older (shorter) record reads fine with the new fields zeroed
+    if (len > sizeof(algo_profile_def::record) || len < sizeof(uint32_t)) {
+        ESP_LOGW(TAG, "Stale record %s, len %u", key, len);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    algo_profile_def::record record = {};
+    ret = nvs_handle->get_blob(key, &record, len);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    if (record.version < 1 || record.version > algo_profile_def::version) {
+        ESP_LOGW(TAG, "Stale record %s, version %lu", key, record.version);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    *out = record;
+    return ESP_OK;
+}
+
+esp_err_t algo_profile::store(const uint8_t *algo_hash, const algo_profile_def::record &record)
+{
+    if (algo_hash == nullptr) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (nvs_handle == nullptr) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    char key[16] = {};
+    get_nvs_key(algo_hash, key, sizeof(key));
+
+    auto ret = nvs_handle->set_blob(key, &record, sizeof(record));
+    ret = ret ?: nvs_handle->commit();
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to store %s: 0x%x", key, ret);
+    }
+
+    return ret;
+}
+
+esp_err_t algo_profile::erase(const uint8_t *algo_hash)
+{
+    if (algo_hash == nullptr) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (nvs_handle == nullptr) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    char key[16] = {};
+    get_nvs_key(algo_hash, key, sizeof(key));
+
+    auto ret = nvs_handle->erase_item(key);
+    ret = ret ?: nvs_handle->commit();
+    return ret;
+}
+
+void algo_profile::get_nvs_key(const uint8_t *algo_hash, char *key_out, size_t key_len)
+{
+    snprintf(key_out, key_len, "p%02x%02x%02x%02x%02x%02x", algo_hash[0], algo_hash[1], algo_hash[2], algo_hash[3], algo_hash[4], algo_hash[5]);
+}
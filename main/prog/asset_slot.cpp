@@ -0,0 +1,325 @@
+#include <cstring>
+#include <algorithm>
+#include <esp_log.h>
+#include <esp_crc.h>
+#include <esp_timer.h>
+
+#include "asset_slot.hpp"
+#include "fw_segmap.hpp"
+#include "lz4_image.hpp"
+
+esp_err_t asset_slot::init()
+{
+    if (inited) {
+        return ESP_OK;
+    }
+
+    for (size_t idx = 0; idx < asset_slot_def::slot_cnt; idx += 1) {
+        parts[idx] = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, asset_slot_def::PARTITION_SUBTYPE, SLOT_LABELS[idx]);
+        if (parts[idx] == nullptr) {
+            ESP_LOGI(TAG, "No %s partition, firmware stays on the filesystem", SLOT_LABELS[idx]);
+            return ESP_ERR_NOT_FOUND;
+        }
+    }
+
+    for (size_t idx = 0; idx < asset_slot_def::slot_cnt; idx += 1) {
+        auto ret = load_header(idx);
+        if (ret != ESP_OK && ret != ESP_ERR_NOT_FOUND) {
+            ESP_LOGW(TAG, "%s unusable: 0x%x", SLOT_LABELS[idx], ret);
+        }
+
+        if (valid[idx] && (active == SIZE_MAX || headers[idx].seq > headers[active].seq)) {
+            active = idx;
+        }
+    }
+
+    inited = true;
+    if (active != SIZE_MAX) {
+        ESP_LOGI(TAG, "Active: %s, seq %lu, %lu bytes, format %u", SLOT_LABELS[active], headers[active].seq, headers[active].len, headers[active].format);
+    } else {
+        ESP_LOGI(TAG, "Both slots empty");
+    }
+
+    return ESP_OK;
+}
+
+bool asset_slot::available() const
+{
+    return inited;
+}
+
+esp_err_t asset_slot::acquire(const uint8_t **data_out, size_t *len_out, asset_slot_def::header *header_out)
+{
+    if (data_out == nullptr || len_out == nullptr) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    xSemaphoreTake(reader_lock, portMAX_DELAY);
+    auto ret = active == SIZE_MAX ? ESP_ERR_NOT_FOUND : map_slot(active);
+    if (ret != ESP_OK) {
+        xSemaphoreGive(reader_lock);
+        return ret;
+    }
+
+    *data_out = mapped[active];
+    *len_out = headers[active].len;
+    if (header_out != nullptr) {
+        *header_out = headers[active];
+    }
+
+    return ESP_OK;
+}
+
+void asset_slot::release()
+{
+    xSemaphoreGive(reader_lock);
+}
+
+bool asset_slot::is_active(const uint8_t *sha256) const
+{
+    return sha256 != nullptr && active != SIZE_MAX && memcmp(headers[active].sha256, sha256, asset_slot_def::sha_len) == 0;
+}
+
+esp_err_t asset_slot::begin(asset_slot_def::asset_format format)
+{
+    if (!inited) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    if (format > asset_slot_def::FORMAT_SEGMAP) {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+
+    abort();
+
+    // The slot about to be erased may be the one a unit is still being programmed from
+    xSemaphoreTake(reader_lock, portMAX_DELAY);
+    write_idx = active == SIZE_MAX ? 0 : (active + 1) % asset_slot_def::slot_cnt;
+    unmap_slot(write_idx);
+    valid[write_idx] = false;
+
+    // First block holds the header, erasing it invalidates the slot before any payload goes in
+    uint32_t erase_len = std::min(asset_slot_def::erase_step, (uint32_t)parts[write_idx]->size);
+    auto ret = esp_partition_erase_range(parts[write_idx], 0, erase_len);
+    xSemaphoreGive(reader_lock);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to erase %s: 0x%x", SLOT_LABELS[write_idx], ret);
+        return ret;
+    }
+
+    erased_end = erase_len;
+    write_pos = 0;
+    write_format = format;
+    mbedtls_sha256_init(&sha_ctx);
+    mbedtls_sha256_starts(&sha_ctx, 0);
+    writing = true;
+    return ESP_OK;
+}
+
+esp_err_t asset_slot::write(const uint8_t *buf, size_t len)
+{
+    if (!writing) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    if (buf == nullptr || asset_slot_def::data_offset + write_pos + len > parts[write_idx]->size) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    uint32_t end = asset_slot_def::data_offset + write_pos + len;
+    while (erased_end < end) {
+        uint32_t erase_len = std::min(asset_slot_def::erase_step, (uint32_t)parts[write_idx]->size - erased_end);
+        auto ret = esp_partition_erase_range(parts[write_idx], erased_end, erase_len);
+        if (ret != ESP_OK) {
+            ESP_LOGE(TAG, "Erase at 0x%lx failed: 0x%x", erased_end, ret);
+            return ret;
+        }
+
+        erased_end += erase_len;
+    }
+
+    auto ret = esp_partition_write(parts[write_idx], asset_slot_def::data_offset + write_pos, buf, len);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Write at 0x%lx failed: 0x%x", write_pos, ret);
+        return ret;
+    }
+
+    mbedtls_sha256_update(&sha_ctx, buf, len);
+    write_pos += len;
+    return ESP_OK;
+}
+
+esp_err_t asset_slot::commit(const uint8_t *expected_sha256)
+{
+    if (!writing) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    asset_slot_def::header header = {};
+    mbedtls_sha256_finish(&sha_ctx, header.sha256);
+    mbedtls_sha256_free(&sha_ctx);
+    writing = false;
+
+    if (write_pos == 0) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    if (expected_sha256 != nullptr && memcmp(header.sha256, expected_sha256, sizeof(header.sha256)) != 0) {
+        ESP_LOGE(TAG, "SHA256 mismatch on %s, not activating", SLOT_LABELS[write_idx]);
+        return ESP_ERR_INVALID_CRC;
+    }
+
+    auto ret = detect_format(&header.format);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    header.magic = asset_slot_def::HEADER_MAGIC;
+    header.version = asset_slot_def::HEADER_VERSION;
+    header.seq = (active != SIZE_MAX ? headers[active].seq : 0) + 1;
+    header.len = write_pos;
+    header.crc = header_crc(header);
+
+    ret = esp_partition_write(parts[write_idx], 0, &header, sizeof(header));
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Header write failed: 0x%x", ret);
+        return ret;
+    }
+
+    xSemaphoreTake(reader_lock, portMAX_DELAY);
+    headers[write_idx] = header;
+    valid[write_idx] = true;
+    active = write_idx;
+    xSemaphoreGive(reader_lock);
+    ESP_LOGI(TAG, "%s active, seq %lu, %lu bytes", SLOT_LABELS[active], header.seq, header.len);
+    return ESP_OK;
+}
+
+void asset_slot::abort()
+{
+    if (writing) {
+        mbedtls_sha256_free(&sha_ctx);
+        writing = false;
+    }
+}
+
+esp_err_t asset_slot::retire()
+{
+    if (!inited) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    xSemaphoreTake(reader_lock, portMAX_DELAY);
+    esp_err_t ret = ESP_OK;
+    for (size_t idx = 0; idx < asset_slot_def::slot_cnt; idx += 1) {
+        if (!valid[idx]) {
+            continue;
+        }
+
+        unmap_slot(idx);
+        valid[idx] = false;
+        auto erase_ret = esp_partition_erase_range(parts[idx], 0, asset_slot_def::data_offset);
+        ret = ret ?: erase_ret;
+    }
+
+    active = SIZE_MAX;
+    xSemaphoreGive(reader_lock);
+    ESP_LOGI(TAG, "Slots retired, firmware comes from the filesystem");
+    return ret;
+}
+
+esp_err_t asset_slot::load_header(size_t idx)
+{
+    valid[idx] = false;
+    auto &header = headers[idx];
+    auto ret = esp_partition_read(parts[idx], 0, &header, sizeof(header));
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    if (header.magic != asset_slot_def::HEADER_MAGIC) {
+        return ESP_ERR_NOT_FOUND; // Never written, or a write that didn't get to commit()
+    }
+
+    if (header.version != asset_slot_def::HEADER_VERSION || header.crc != header_crc(header)
+        || header.len == 0 || header.len > parts[idx]->size - asset_slot_def::data_offset) {
+        return ESP_ERR_INVALID_CRC;
+    }
+
+    ret = map_slot(idx);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    int64_t start_ts = esp_timer_get_time();
+    uint8_t sha[asset_slot_def::sha_len] = {};
+    if (mbedtls_sha256(mapped[idx], header.len, sha, 0) != 0 || memcmp(sha, header.sha256, sizeof(sha)) != 0) {
+        unmap_slot(idx);
+        return ESP_ERR_INVALID_CRC;
+    }
+
+    ESP_LOGI(TAG, "%s: seq %lu, %lu bytes, SHA256 checked in %lld us", SLOT_LABELS[idx], header.seq, header.len, esp_timer_get_time() - start_ts);
+    valid[idx] = true;
+    return ESP_OK;
+}
+
+esp_err_t asset_slot::detect_format(asset_slot_def::asset_format *format_out)
+{
+    uint8_t head[std::max({sizeof(fw_segmap_def::elf32_ehdr), sizeof(fw_segmap_def::header), sizeof(lz4_image_def::header)})] = {};
+    size_t head_len = std::min((size_t)write_pos, sizeof(head));
+    auto ret = esp_partition_read(parts[write_idx], asset_slot_def::data_offset, head, head_len);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    // A HEX or ELF taken as raw would be programmed byte for byte, so those never get a header
+    if (fw_segmap::is_segmap(head, head_len)) {
+        *format_out = asset_slot_def::FORMAT_SEGMAP;
+    } else if (lz4_image::is_lz4(head, head_len)) {
+        *format_out = asset_slot_def::FORMAT_LZ4;
+    } else if (fw_segmap::detect(head, head_len) != fw_segmap_def::SRC_BIN) {
+        ESP_LOGE(TAG, "HEX/ELF/UF2 in %s, it needs ingesting into a segment map first", SLOT_LABELS[write_idx]);
+        return ESP_ERR_NOT_SUPPORTED;
+    } else if (write_format != asset_slot_def::FORMAT_RAW) {
+        ESP_LOGE(TAG, "Payload in %s isn't format %u", SLOT_LABELS[write_idx], write_format);
+        return ESP_ERR_INVALID_STATE;
+    } else {
+        *format_out = asset_slot_def::FORMAT_RAW;
+    }
+
+    if (*format_out != write_format) {
+        ESP_LOGW(TAG, "Declared format %u, payload is %u", write_format, *format_out);
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t asset_slot::map_slot(size_t idx)
+{
+    if (mapped[idx] != nullptr) {
+        return ESP_OK;
+    }
+
+    const void *ptr = nullptr;
+    auto ret = esp_partition_mmap(parts[idx], asset_slot_def::data_offset, headers[idx].len, ESP_PARTITION_MMAP_DATA, &ptr, &map_handles[idx]);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to map %s: 0x%x", SLOT_LABELS[idx], ret);
+        return ret;
+    }
+
+    mapped[idx] = static_cast<const uint8_t *>(ptr);
+    return ESP_OK;
+}
+
+void asset_slot::unmap_slot(size_t idx)
+{
+    if (mapped[idx] != nullptr) {
+        esp_partition_munmap(map_handles[idx]);
+        mapped[idx] = nullptr;
+    }
+}
+
+uint32_t asset_slot::header_crc(const asset_slot_def::header &header)
+{
+    return esp_crc32_le(0, (const uint8_t *)&header, offsetof(asset_slot_def::header, crc));
+}
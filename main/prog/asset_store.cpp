@@ -0,0 +1,450 @@
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <esp_log.h>
+#include <esp_crc.h>
+#include <esp_timer.h>
+#include <esp_vfs_fat.h>
+#include <sdkconfig.h>
+
+#include "asset_store.hpp"
+#include "fw_asset_manager.hpp"
+#include "file_utils.hpp"
+
+esp_err_t asset_store::init()
+{
+    if (inited) {
+        return ESP_OK;
+    }
+
+#ifdef CONFIG_FATFS_LFN_NONE
+    ESP_LOGW(TAG, "No long file names in this build, store disabled");
+    return ESP_ERR_NOT_SUPPORTED;
+#endif
+
+    if (mkdir(STORE_PATH, 0775) != 0 && errno != EEXIST) {
+        ESP_LOGE(TAG, "Can't create %s: %d", STORE_PATH, errno);
+        return ESP_FAIL;
+    }
+
+    int64_t start_ts = esp_timer_get_time();
+    file_utils::recover_replace(INDEX_TMP_PATH, INDEX_PATH);
+    auto ret = load_index();
+    if (ret != ESP_OK) {
+        ESP_LOGW(TAG, "Index unusable: 0x%x, rebuilding from the blobs", ret);
+        header = {};
+        entries.clear();
+    }
+
+    // Blobs are renamed in only after their hash checked out, so anything named like one is good to keep
+    if (sweep() || ret != ESP_OK) {
+        ret = save_index();
+        if (ret != ESP_OK) {
+            return ret;
+        }
+    }
+
+    for (uint8_t kind = 0; kind < asset_store_def::KIND_MAX; kind += 1) {
+        update_active_path((asset_store_def::asset_kind)kind);
+    }
+
+    inited = true;
+    ESP_LOGI(TAG, "%u blobs, active mask 0x%x, loaded in %lld us", entries.size(), header.active_mask, esp_timer_get_time() - start_ts);
+    return ESP_OK;
+}
+
+bool asset_store::available() const
+{
+    return inited;
+}
+
+bool asset_store::contains(const uint8_t *sha256) const
+{
+    return inited && find(sha256) >= 0;
+}
+
+bool asset_store::is_active(asset_store_def::asset_kind kind, const uint8_t *sha256) const
+{
+    if (!inited || sha256 == nullptr || kind >= asset_store_def::KIND_MAX || (header.active_mask & (1U << kind)) == 0) {
+        return false;
+    }
+
+    return memcmp(header.active[kind], sha256, asset_store_def::sha_len) == 0;
+}
+
+esp_err_t asset_store::reserve(size_t len)
+{
+    if (!inited) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    discard_incoming();
+    uint64_t total = 0, free_bytes = 0;
+    if (esp_vfs_fat_info(BASE_PATH, &total, &free_bytes) != ESP_OK) {
+        ESP_LOGE(TAG, "Can't get free space of %s", BASE_PATH);
+        return ESP_FAIL;
+    }
+
+    uint64_t needed = (uint64_t)len + asset_store_def::fs_headroom;
+    if (needed > total) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    while (free_bytes < needed) {
+        auto ret = evict_one();
+        if (ret != ESP_OK) {
+            ESP_LOGE(TAG, "Need %u bytes, only %u free and nothing left to evict", (size_t)needed, (size_t)free_bytes);
+            return ESP_ERR_NO_MEM;
+        }
+
+        if (esp_vfs_fat_info(BASE_PATH, &total, &free_bytes) != ESP_OK) {
+            return ESP_FAIL;
+        }
+    }
+
+    return ESP_OK;
+}
+
+const char *asset_store::get_incoming_path() const
+{
+    return INCOMING_PATH;
+}
+
+esp_err_t asset_store::commit(const uint8_t *sha256, asset_store_def::asset_kind kind)
+{
+    if (!inited) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    if (sha256 == nullptr || kind >= asset_store_def::KIND_MAX) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    uint8_t sha_actual[asset_store_def::sha_len] = {};
+    auto ret = fw_asset_manager::get_sha256_from_file(INCOMING_PATH, sha_actual);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    if (memcmp(sha_actual, sha256, sizeof(sha_actual)) != 0) {
+        ESP_LOGE(TAG, "Downloaded content doesn't match its hash");
+        discard_incoming();
+        return ESP_ERR_INVALID_CRC;
+    }
+
+    int idx = find(sha256);
+    if (idx >= 0) {
+        discard_incoming();
+        touch(idx);
+        return save_index();
+    }
+
+    if (entries.size() >= asset_store_def::max_entries && evict_one() != ESP_OK) {
+        discard_incoming();
+        return ESP_ERR_NO_MEM;
+    }
+
+    struct stat st = {};
+    char path[asset_store_def::path_len] = {};
+    make_blob_path(sha256, path);
+    if (stat(INCOMING_PATH, &st) != 0 || rename(INCOMING_PATH, path) != 0) {
+        ESP_LOGE(TAG, "Can't move download to %s", path);
+        discard_incoming();
+        return ESP_FAIL;
+    }
+
+    asset_store_def::entry entry = {};
+    memcpy(entry.sha256, sha256, sizeof(entry.sha256));
+    entry.kind = kind;
+    entry.len = st.st_size;
+    entries.emplace_back(entry);
+    touch(entries.size() - 1);
+
+    ESP_LOGI(TAG, "Stored %s, %lu bytes; %u blobs", path, entry.len, entries.size());
+    return save_index();
+}
+
+void asset_store::discard_incoming()
+{
+    remove(INCOMING_PATH);
+}
+
+esp_err_t asset_store::activate(asset_store_def::asset_kind kind, const uint8_t *sha256)
+{
+    if (!inited) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    if (sha256 == nullptr || kind >= asset_store_def::KIND_MAX) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    int idx = find(sha256);
+    if (idx < 0) {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    memcpy(header.active[kind], sha256, asset_store_def::sha_len);
+    header.active_mask |= (1U << kind);
+    touch(idx);
+    update_active_path(kind);
+    return save_index();
+}
+
+esp_err_t asset_store::import(const char *path, asset_store_def::asset_kind kind)
+{
+    if (!inited) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    if (path == nullptr || kind >= asset_store_def::KIND_MAX) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    uint8_t sha[asset_store_def::sha_len] = {};
+    auto ret = fw_asset_manager::get_sha256_from_file(path, sha);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    // Same partition, so the rename costs no space; commit() then handles it like any download
+    discard_incoming();
+    if (rename(path, INCOMING_PATH) != 0) {
+        ESP_LOGE(TAG, "Can't move %s into the store", path);
+        return ESP_FAIL;
+    }
+
+    ret = commit(sha, kind);
+    return ret ?: activate(kind, sha);
+}
+
+const char *asset_store::get_active_path(asset_store_def::asset_kind kind) const
+{
+    if (!inited || kind >= asset_store_def::KIND_MAX || active_paths[kind][0] == '\0') {
+        return nullptr;
+    }
+
+    return active_paths[kind];
+}
+
+esp_err_t asset_store::get_active_sha(asset_store_def::asset_kind kind, uint8_t *out) const
+{
+    if (out == nullptr || kind >= asset_store_def::KIND_MAX) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (!inited || (header.active_mask & (1U << kind)) == 0) {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    memcpy(out, header.active[kind], asset_store_def::sha_len);
+    return ESP_OK;
+}
+
+size_t asset_store::size() const
+{
+    return entries.size();
+}
+
+esp_err_t asset_store::load_index()
+{
+    FILE *file = fopen(INDEX_PATH, "rb");
+    if (file == nullptr) {
+        ESP_LOGI(TAG, "No index yet");
+        header = {};
+        entries.clear();
+        return ESP_OK;
+    }
+
+    asset_store_def::header hdr = {};
+    bool ok = fread(&hdr, 1, sizeof(hdr), file) == sizeof(hdr);
+    ok = ok && hdr.magic == asset_store_def::INDEX_MAGIC && hdr.version == asset_store_def::INDEX_VERSION;
+    ok = ok && hdr.entry_cnt <= asset_store_def::max_entries;
+
+    std::vector<asset_store_def::entry> loaded(ok ? hdr.entry_cnt : 0);
+    ok = ok && fread(loaded.data(), sizeof(asset_store_def::entry), loaded.size(), file) == loaded.size();
+    fclose(file);
+
+    if (!ok) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    if (hdr.crc != index_crc(hdr, loaded)) {
+        return ESP_ERR_INVALID_CRC;
+    }
+
+    header = hdr;
+    entries = std::move(loaded);
+    return ESP_OK;
+}
+
+esp_err_t asset_store::save_index()
+{
+    header.magic = asset_store_def::INDEX_MAGIC;
+    header.version = asset_store_def::INDEX_VERSION;
+    header.entry_cnt = entries.size();
+    header.crc = index_crc(header, entries);
+
+    // Same as unit_db's compaction: new file first, then file_utils::replace_file()
+    FILE *file = fopen(INDEX_TMP_PATH, "wb");
+    if (file == nullptr) {
+        ESP_LOGE(TAG, "Can't write index");
+        return ESP_FAIL;
+    }
+
+    bool ok = fwrite(&header, 1, sizeof(header), file) == sizeof(header);
+    ok = ok && fwrite(entries.data(), sizeof(asset_store_def::entry), entries.size(), file) == entries.size();
+    ok = ok && fflush(file) == 0 && fsync(fileno(file)) == 0;
+    fclose(file);
+
+    if (!ok) {
+        ESP_LOGE(TAG, "Index update failed");
+        remove(INDEX_TMP_PATH);
+        return ESP_FAIL;
+    }
+
+    if (file_utils::replace_file(INDEX_TMP_PATH, INDEX_PATH) != ESP_OK) {
+        ESP_LOGE(TAG, "Index update failed");
+        file_utils::recover_replace(INDEX_TMP_PATH, INDEX_PATH);
+        return ESP_FAIL;
+    }
+
+    return ESP_OK;
+}
+
+bool asset_store::sweep()
+{
+    // Entries whose blob went missing
+    size_t entry_cnt = entries.size();
+    uint8_t active_mask = header.active_mask;
+    struct stat st = {};
+    char path[asset_store_def::path_len] = {};
+    entries.erase(std::remove_if(entries.begin(), entries.end(), [&](const asset_store_def::entry &entry) {
+        make_blob_path(entry.sha256, path);
+        return stat(path, &st) != 0;
+    }), entries.end());
+
+    for (uint8_t kind = 0; kind < asset_store_def::KIND_MAX; kind += 1) {
+        if ((header.active_mask & (1U << kind)) != 0 && find(header.active[kind]) < 0) {
+            ESP_LOGW(TAG, "Active blob of kind %u is gone", kind);
+            header.active_mask &= ~(1U << kind);
+        }
+    }
+
+    DIR *dir = opendir(STORE_PATH);
+    if (dir == nullptr) {
+        return entries.size() != entry_cnt || header.active_mask != active_mask;
+    }
+
+    // Blobs the index lost track of are adopted, anything else (half downloads, stale temp files) is deleted
+    struct dirent *dent = nullptr;
+    while ((dent = readdir(dir)) != nullptr) {
+        if (strcasecmp(dent->d_name, "index.bin") == 0 || strcmp(dent->d_name, ".") == 0 || strcmp(dent->d_name, "..") == 0) {
+            continue;
+        }
+
+        snprintf(path, sizeof(path), "%s/%s", STORE_PATH, dent->d_name);
+        uint8_t sha[asset_store_def::sha_len] = {};
+        bool is_blob = strlen(dent->d_name) == asset_store_def::sha_len * 2 && strspn(dent->d_name, "0123456789abcdef") == asset_store_def::sha_len * 2;
+        for (size_t idx = 0; is_blob && idx < sizeof(sha); idx += 1) {
+            unsigned int val = 0;
+            sscanf(dent->d_name + idx * 2, "%2x", &val);
+            sha[idx] = val;
+        }
+
+        if (is_blob && find(sha) >= 0) {
+            continue;
+        }
+
+        if (is_blob && entries.size() < asset_store_def::max_entries && stat(path, &st) == 0) {
+            asset_store_def::entry entry = {};
+            memcpy(entry.sha256, sha, sizeof(sha));
+            entry.kind = asset_store_def::KIND_MAX; // Unknown, it's only informational
+            entry.len = st.st_size;
+            entry.last_used = 0; // First to go
+            entries.emplace_back(entry);
+            ESP_LOGW(TAG, "Adopted %s", path);
+        } else {
+            ESP_LOGW(TAG, "Removing %s", path);
+            remove(path);
+        }
+    }
+
+    closedir(dir);
+    return entries.size() != entry_cnt || header.active_mask != active_mask;
+}
+
+esp_err_t asset_store::evict_one()
+{
+    int victim = -1;
+    for (size_t idx = 0; idx < entries.size(); idx += 1) {
+        bool active = false;
+        for (uint8_t kind = 0; kind < asset_store_def::KIND_MAX && !active; kind += 1) {
+            active = is_active((asset_store_def::asset_kind)kind, entries[idx].sha256);
+        }
+
+        if (!active && (victim < 0 || entries[idx].last_used < entries[victim].last_used)) {
+            victim = (int)idx;
+        }
+    }
+
+    if (victim < 0) {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    char path[asset_store_def::path_len] = {};
+    make_blob_path(entries[victim].sha256, path);
+    ESP_LOGI(TAG, "Evicting %s, %lu bytes, last used at %lu of %lu", path, entries[victim].len, entries[victim].last_used, header.clock);
+    remove(path);
+    entries.erase(entries.begin() + victim);
+    return save_index();
+}
+
+int asset_store::find(const uint8_t *sha256) const
+{
+    if (sha256 == nullptr) {
+        return -1;
+    }
+
+    for (size_t idx = 0; idx < entries.size(); idx += 1) {
+        if (memcmp(entries[idx].sha256, sha256, asset_store_def::sha_len) == 0) {
+            return (int)idx;
+        }
+    }
+
+    return -1;
+}
+
+void asset_store::touch(size_t idx)
+{
+    header.clock += 1;
+    entries[idx].last_used = header.clock;
+}
+
+void asset_store::update_active_path(asset_store_def::asset_kind kind)
+{
+    if ((header.active_mask & (1U << kind)) == 0) {
+        active_paths[kind][0] = '\0';
+        return;
+    }
+
+    make_blob_path(header.active[kind], active_paths[kind]);
+}
+
+void asset_store::make_blob_path(const uint8_t *sha256, char *out)
+{
+    size_t pos = snprintf(out, asset_store_def::path_len, "%s/", STORE_PATH);
+    for (size_t idx = 0; idx < asset_store_def::sha_len; idx += 1) {
+        pos += snprintf(out + pos, asset_store_def::path_len - pos, "%02x", sha256[idx]);
+    }
+}
+
+uint32_t asset_store::index_crc(const asset_store_def::header &hdr, const std::vector<asset_store_def::entry> &_entries)
+{
+    uint32_t crc = esp_crc32_le(0, (const uint8_t *)&hdr, offsetof(asset_store_def::header, crc));
+    return esp_crc32_le(crc, (const uint8_t *)_entries.data(), _entries.size() * sizeof(asset_store_def::entry));
+}
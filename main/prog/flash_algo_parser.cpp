@@ -137,6 +137,109 @@ esp_err_t flash_algo_parser::get_dev_description(flash_algo::dev_description *de
     return ret;
 }
 
+esp_err_t flash_algo_parser::get_reg_script(const char *section_name, std::vector<flash_algo::reg_op> &ops) const
+{
+    ops.clear();
+    if (section_name == nullptr) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    const ELFIO::section *script = find_optional_section(section_name);
+    if (script == nullptr) {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    flash_algo::reg_script_header header = {};
+    size_t len = script->get_size();
+    if (len < sizeof(header) || script->get_data() == nullptr) {
+        ESP_LOGE(TAG, "%s: too short, len=%u", section_name, len);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    memcpy(&header, script->get_data(), sizeof(header));
+    if (header.magic != flash_algo::REG_SCRIPT_MAGIC || header.version != flash_algo::REG_SCRIPT_VERSION) {
+        ESP_LOGE(TAG, "%s: bad magic 0x%08lx or version %u", section_name, header.magic, header.version);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (header.op_cnt > flash_algo::reg_script_max_ops || len < sizeof(header) + header.op_cnt * sizeof(flash_algo::reg_op)) {
+        ESP_LOGE(TAG, "%s: %u ops don't fit in %u bytes (max %u ops)", section_name, header.op_cnt, len, flash_algo::reg_script_max_ops);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    // Everything is checked here, so a bad script is refused with the asset rather than half-run on a target
+    const uint8_t *op_ptr = (const uint8_t *)script->get_data() + sizeof(header);
+    for (size_t idx = 0; idx < header.op_cnt; idx += 1) {
+        flash_algo::reg_op op = {};
+        memcpy(&op, op_ptr + idx * sizeof(op), sizeof(op));
+
+        bool valid = true;
+        switch (op.type) {
+            case flash_algo::REG_OP_WRITE:
+            case flash_algo::REG_OP_RMW:
+            case flash_algo::REG_OP_READ: valid = (op.addr % sizeof(uint32_t)) == 0; break;
+            case flash_algo::REG_OP_POLL: {
+                valid = (op.addr % sizeof(uint32_t)) == 0 && op.timeout_ms > 0 && op.timeout_ms <= flash_algo::reg_script_max_poll_ms
+                        && (op.value & ~op.mask) == 0; // Bits outside the mask could never match
+                break;
+            }
+            case flash_algo::REG_OP_DELAY: valid = op.value <= flash_algo::reg_script_max_delay_us; break;
+            default: valid = false; break;
+        }
+
+        if (!valid) {
+            ESP_LOGE(TAG, "%s: op %u invalid; type %u, addr 0x%08lx, value 0x%08lx, mask 0x%08lx, timeout %u",
+                     section_name, idx, op.type, op.addr, op.value, op.mask, op.timeout_ms);
+            ops.clear();
+            return ESP_ERR_INVALID_ARG;
+        }
+
+        ops.emplace_back(op);
+    }
+
+    ESP_LOGI(TAG, "%s: %u ops", section_name, ops.size());
+    return ESP_OK;
+}
+
+esp_err_t flash_algo_parser::get_dual_bank_description(flash_algo::dual_bank_description *descr, uint32_t dev_size) const
+{
+    if (descr == nullptr) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    const ELFIO::section *section = find_optional_section(flash_algo::DUAL_BANK_SECTION);
+    if (section == nullptr) {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    if (section->get_size() < sizeof(flash_algo::dual_bank_description) || section->get_data() == nullptr) {
+        ESP_LOGE(TAG, "DualBank: too short, len=%u", (size_t)section->get_size());
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    memcpy(descr, section->get_data(), sizeof(flash_algo::dual_bank_description));
+    if (descr->magic != flash_algo::DUAL_BANK_MAGIC) {
+        ESP_LOGE(TAG, "DualBank: bad magic 0x%08lx", descr->magic);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    uint32_t prev_end = 0;
+    for (size_t idx = 0; idx < flash_algo::bank_cnt; idx += 1) {
+        const auto &bank = descr->banks[idx];
+        if (bank.size == 0 || bank.offset < prev_end || bank.offset > dev_size || bank.size > dev_size - bank.offset
+            || (bank.status_reg != 0 && (bank.status_reg % sizeof(uint32_t) != 0 || bank.busy_mask == 0))) {
+            ESP_LOGE(TAG, "DualBank: bank %u invalid; offset 0x%08lx, size 0x%08lx, status 0x%08lx/0x%08lx",
+                     idx, bank.offset, bank.size, bank.status_reg, bank.busy_mask);
+            return ESP_ERR_INVALID_ARG;
+        }
+
+        ESP_LOGI(TAG, "DualBank: bank %u @ +0x%08lx, len 0x%08lx, status %s", idx, bank.offset, bank.size, bank.status_reg != 0 ? "register" : "EraseStatus");
+        prev_end = bank.offset + bank.size;
+    }
+
+    return ESP_OK;
+}
+
 esp_err_t flash_algo_parser::get_flash_algo(uint8_t *buf_out, size_t buf_len, size_t *actual_len) const
 {
     size_t out_len = 0, curr_pos = 0, actual_len_cnt = 0;
@@ -173,10 +276,13 @@ esp_err_t flash_algo_parser::get_flash_algo(uint8_t *buf_out, size_t buf_len, si
     actual_len_cnt += out_len;
     curr_pos += out_len;
     size_t bss_len = 0;
-    ret = ret ?: get_section_length(ALGO_BIN_BSS_SECTION_NAME, &bss_len);
+    if (get_section_length(ALGO_BIN_BSS_SECTION_NAME, &bss_len, ELFIO::SHT_NOBITS) != ESP_OK) {
+        bss_len = 0; // No zero-initialised variables at all
+    }
 
     if (curr_pos + bss_len > buf_len) {
         ESP_LOGE(TAG, "Insufficient place for BSS, need %u, got only %u", curr_pos + bss_len, buf_len);
+        return ESP_ERR_NO_MEM;
     }
 
     memset(buf_out + curr_pos, 0, bss_len); // Wipe the RAM for BSS
@@ -288,7 +394,7 @@ esp_err_t flash_algo_parser::get_section_addr(const char *section_name, uint32_t
     return ESP_ERR_NOT_FOUND;
 }
 
-esp_err_t flash_algo_parser::get_func_pc(const char *func_name, uint32_t *pc_out)
+esp_err_t flash_algo_parser::get_func_pc(const char *func_name, uint32_t *pc_out, bool optional)
 {
     if (func_name == nullptr || pc_out == nullptr) {
         return ESP_ERR_INVALID_ARG;
@@ -341,10 +447,28 @@ esp_err_t flash_algo_parser::get_func_pc(const char *func_name, uint32_t *pc_out
         }
     }
 
-    ESP_LOGE(TAG, "Function '%s' not found", func_name);
+    if (optional) {
+        ESP_LOGD(TAG, "Optional function '%s' not found", func_name);
+    } else {
+        ESP_LOGE(TAG, "Function '%s' not found", func_name);
+    }
+
     return ESP_ERR_NOT_FOUND;
 }
 
+const ELFIO::section *flash_algo_parser::find_optional_section(const char *section_name) const
+{
+    // Unlike get_section_data(), a missing section isn't an error here
+    for (size_t idx = 0; idx < elf_parser.sections.size(); idx += 1) {
+        auto curr_section = elf_parser.sections[idx];
+        if (curr_section->get_type() == ELFIO::SHT_PROGBITS && curr_section->get_name() == section_name) {
+            return curr_section;
+        }
+    }
+
+    return nullptr;
+}
+
 esp_err_t flash_algo_parser::get_data_section_offset(uint32_t *offset)
 {
     if (offset == nullptr) {
@@ -379,6 +503,25 @@ esp_err_t flash_algo_parser::get_data_section_offset(uint32_t *offset)
     return ret;
 }
 
+esp_err_t flash_algo_parser::get_algo_sizes(size_t *code_len, size_t *data_len, size_t *bss_len) const
+{
+    if (code_len == nullptr || data_len == nullptr || bss_len == nullptr) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    auto ret = get_section_length(ALGO_BIN_CODE_SECTION_NAME, code_len);
+    ret = ret ?: get_section_length(ALGO_BIN_DATA_SECTION_NAME, data_len);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    if (get_section_length(ALGO_BIN_BSS_SECTION_NAME, bss_len, ELFIO::SHT_NOBITS) != ESP_OK) {
+        *bss_len = 0;
+    }
+
+    return ESP_OK;
+}
+
 esp_err_t flash_algo_parser::run_elf_check()
 {
     // We probably need to enforce a check here (e.g. is it ARM or RISCV? is it a bare-metal ELF?)
@@ -0,0 +1,249 @@
+#include <cstring>
+#include <algorithm>
+#include <esp_log.h>
+#include <esp_crc.h>
+#include <esp_timer.h>
+#include <esp_heap_caps.h>
+
+#include "flash_dumper.hpp"
+
+esp_err_t flash_dumper::dump(const char *path, uint32_t start_addr, size_t len, bool with_ram)
+{
+    if (path == nullptr) {
+        ESP_LOGE(TAG, "Path is null!");
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (strncmp(path, dump_def::path_prefix, strlen(dump_def::path_prefix)) != 0 || strstr(path, "..") != nullptr) {
+        ESP_LOGE(TAG, "Dump path must be under %s: %s", dump_def::path_prefix, path);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    // CDC and MQTT both land here, from their own tasks
+    swd_owner_scope owner(pdMS_TO_TICKS(dump_def::owner_wait_ms));
+    if (owner.status() != ESP_OK) {
+        return ESP_ERR_TIMEOUT;
+    }
+
+    if (busy) {
+        ESP_LOGW(TAG, "Another dump is running");
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    dump_def::header header = {};
+    header.magic = dump_def::magic;
+    header.version = dump_def::version;
+    header.header_len = sizeof(dump_def::header);
+    strncpy(header.dev_name, asset->get_dev_name(), sizeof(header.dev_name) - 1);
+
+    uint32_t flash_start = 0, flash_end = 0;
+    if (start_addr == UINT32_MAX || len == 0) {
+        auto ret = asset->get_flash_start_addr(&flash_start);
+        ret = ret ?: asset->get_flash_end_addr(&flash_end);
+        if (ret != ESP_OK || flash_end <= flash_start) {
+            ESP_LOGE(TAG, "Flash range unknown, load a flash algorithm or give an explicit range");
+            return ESP_ERR_INVALID_STATE;
+        }
+    }
+
+    header.regions[0].addr = (start_addr == UINT32_MAX) ? flash_start : start_addr;
+    if (len == 0 && header.regions[0].addr >= flash_end) {
+        ESP_LOGE(TAG, "Start addr 0x%08lx is beyond flash end 0x%08lx", header.regions[0].addr, flash_end);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    header.regions[0].len = (len == 0) ? (flash_end - header.regions[0].addr) : len;
+    header.region_cnt = 1;
+
+    if (with_ram) {
+        uint32_t ram_start = 0, ram_len = 0;
+        auto ret = asset->get_ram_start_addr(&ram_start);
+        ret = ret ?: asset->get_ram_size_byte(&ram_len);
+        if (ret != ESP_OK || ram_len == 0) {
+            ESP_LOGW(TAG, "Flash algorithm has no RAM window, skipping RAM");
+        } else {
+            header.regions[1].addr = ram_start;
+            header.regions[1].len = ram_len;
+            header.region_cnt = 2;
+        }
+    }
+
+    file = fopen(path, "wb");
+    if (file == nullptr) {
+        ESP_LOGE(TAG, "Failed to open %s", path);
+        return ESP_FAIL;
+    }
+
+    busy = true;
+
+    // Placeholder first, the CRCs are only known after reading everything
+    esp_err_t ret = ESP_OK;
+    if (fwrite(&header, 1, sizeof(header), file) != sizeof(header)) {
+        ESP_LOGE(TAG, "Failed to write header");
+        ret = ESP_FAIL;
+    }
+
+    ret = ret ?: swd->connect();
+    ret = ret ?: start_writer();
+
+    int64_t start_ts = esp_timer_get_time();
+    size_t total_len = 0;
+    for (uint32_t idx = 0; idx < header.region_cnt && ret == ESP_OK; idx += 1) {
+        ret = dump_region(&header.regions[idx]);
+        total_len += header.regions[idx].len;
+    }
+
+    auto writer_ret = stop_writer();
+    ret = ret ?: writer_ret;
+    int64_t elapsed_us = esp_timer_get_time() - start_ts;
+
+    if (ret == ESP_OK) {
+        fseek(file, 0, SEEK_SET);
+        if (fwrite(&header, 1, sizeof(header), file) != sizeof(header)) {
+            ESP_LOGE(TAG, "Failed to update header");
+            ret = ESP_FAIL;
+        }
+    }
+
+    fclose(file);
+    file = nullptr;
+    busy = false;
+
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Dump failed: 0x%x %s", ret, esp_err_to_name(ret));
+        remove(path);
+        return ret;
+    }
+
+    uint32_t kbps = elapsed_us < 1 ? 0 : (uint32_t)(((uint64_t)total_len * 1000000ULL / 1024ULL) / (uint64_t)elapsed_us);
+    ESP_LOGI(TAG, "Dumped %u bytes to %s in %lld ms, %lu KB/s; waited %lld ms for filesystem",
+             total_len, path, elapsed_us / 1000, kbps, stall_us / 1000);
+    return ESP_OK;
+}
+
+esp_err_t flash_dumper::dump_region(dump_def::region_info *region)
+{
+    ESP_LOGI(TAG, "Reading 0x%08lx, len %lu", region->addr, region->len);
+
+    uint32_t crc = 0;
+    uint32_t offset = 0;
+    while (offset < region->len) {
+        dump_def::chunk item = {};
+        int64_t wait_ts = esp_timer_get_time();
+        xQueueReceive(free_queue, &item, portMAX_DELAY);
+        stall_us += esp_timer_get_time() - wait_ts;
+
+        if (write_ret != ESP_OK) {
+            xQueueSend(free_queue, &item, portMAX_DELAY);
+            return write_ret;
+        }
+
+        item.len = std::min((uint32_t)dump_def::chunk_size, region->len - offset);
+        auto ret = swd->read_memory(region->addr + offset, item.buf, item.len);
+        if (ret != ESP_OK) {
+            xQueueSend(free_queue, &item, portMAX_DELAY);
+            return ret;
+        }
+
+        // CRC is done here rather than in the writer, so the filesystem side stays as short as possible
+        crc = esp_crc32_le(crc, item.buf, item.len);
+        xQueueSend(filled_queue, &item, portMAX_DELAY);
+        offset += item.len;
+    }
+
+    region->crc = crc;
+    ESP_LOGI(TAG, "Region 0x%08lx done, CRC 0x%08lx", region->addr, crc);
+    return ESP_OK;
+}
+
+esp_err_t flash_dumper::start_writer()
+{
+    write_ret = ESP_OK;
+    stall_us = 0;
+    reader_task = xTaskGetCurrentTaskHandle();
+
+    free_queue = xQueueCreate(dump_def::chunk_cnt, sizeof(dump_def::chunk));
+    filled_queue = xQueueCreate(dump_def::chunk_cnt + 1, sizeof(dump_def::chunk)); // +1 for the end marker
+    if (free_queue == nullptr || filled_queue == nullptr) {
+        ESP_LOGE(TAG, "Failed to create queues");
+        return ESP_ERR_NO_MEM;
+    }
+
+    for (auto &buf : chunk_bufs) {
+        // Internal RAM is preferred as both SWD and CRC hammer these buffers, PSRAM is the fallback
+        buf = static_cast<uint8_t *>(heap_caps_malloc(dump_def::chunk_size, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT));
+        if (buf == nullptr) {
+            buf = static_cast<uint8_t *>(heap_caps_malloc(dump_def::chunk_size, MALLOC_CAP_SPIRAM));
+        }
+
+        if (buf == nullptr) {
+            ESP_LOGE(TAG, "Failed to allocate chunk buffer");
+            return ESP_ERR_NO_MEM;
+        }
+
+        dump_def::chunk item = { .buf = buf, .len = 0 };
+        xQueueSend(free_queue, &item, portMAX_DELAY);
+    }
+
+    // Writer goes to the other core, so that fwrite() overlaps with the SWD bit-banging
+    BaseType_t core_id = xPortGetCoreID() == 0 ? 1 : 0;
+    if (xTaskCreatePinnedToCore(writer_task, "dump_wr", 4096, this, tskIDLE_PRIORITY + 4, nullptr, core_id) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to start writer task");
+        return ESP_ERR_NO_MEM;
+    }
+
+    writer_running = true;
+    return ESP_OK;
+}
+
+esp_err_t flash_dumper::stop_writer()
+{
+    if (writer_running) {
+        dump_def::chunk end_marker = {};
+        xQueueSend(filled_queue, &end_marker, portMAX_DELAY);
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        writer_running = false;
+    }
+
+    for (auto &buf : chunk_bufs) {
+        if (buf != nullptr) {
+            heap_caps_free(buf);
+            buf = nullptr;
+        }
+    }
+
+    if (free_queue != nullptr) {
+        vQueueDelete(free_queue);
+        free_queue = nullptr;
+    }
+
+    if (filled_queue != nullptr) {
+        vQueueDelete(filled_queue);
+        filled_queue = nullptr;
+    }
+
+    return write_ret;
+}
+
+void flash_dumper::writer_task(void *_ctx)
+{
+    auto *ctx = static_cast<flash_dumper *>(_ctx);
+    while (true) {
+        dump_def::chunk item = {};
+        xQueueReceive(ctx->filled_queue, &item, portMAX_DELAY);
+        if (item.buf == nullptr) {
+            break;
+        }
+
+        // Keep draining after a failure so that the reader never blocks on a free buffer
+        if (ctx->write_ret == ESP_OK && fwrite(item.buf, 1, item.len, ctx->file) != item.len) {
+            ESP_LOGE(TAG, "Failed to write %u bytes", item.len);
+            ctx->write_ret = ESP_FAIL;
+        }
+
+        xQueueSend(ctx->free_queue, &item, portMAX_DELAY);
+    }
+
+    xTaskNotifyGive(ctx->reader_task);
+    vTaskDelete(nullptr);
+}
@@ -1,4 +1,5 @@
 #include <cstring>
+#include <algorithm>
 #include <esp_log.h>
 #include <esp_crc.h>
 #include <nvs_flash.h>
@@ -7,10 +8,12 @@
 #include "fw_asset_manager.hpp"
 #include "file_utils.hpp"
 #include "flash_algo_parser.hpp"
+#include "asset_store.hpp"
 
 esp_err_t fw_asset_manager::init()
 {
-    esp_err_t ret = algo_parser.load(ALGO_ELF_PATH);
+    asset_store::instance()->init(); // Before picking the algo path; without the store it's the fixed path
+    esp_err_t ret = algo_parser.load(get_algo_path());
     if (ret != ESP_OK) {
         return ret;
     }
@@ -27,6 +30,30 @@ esp_err_t fw_asset_manager::init()
         ESP_LOGW(TAG, "No test info found, probably generic flash algo? 0x%x", ret);
     }
 
+    // Scripts are optional, but one that's there and broken fails the whole asset
+    ret = algo_parser.get_reg_script(flash_algo::PRE_INIT_SCRIPT_SECTION, pre_init_script);
+    if (ret != ESP_OK && ret != ESP_ERR_NOT_FOUND) {
+        return ret;
+    }
+
+    ret = algo_parser.get_reg_script(flash_algo::POST_UNINIT_SCRIPT_SECTION, post_uninit_script);
+    if (ret != ESP_OK && ret != ESP_ERR_NOT_FOUND) {
+        return ret;
+    }
+
+    has_dual_bank = false;
+    ret = algo_parser.get_dual_bank_description(&dual_bank, dev_descr.dev_size);
+    if (ret == ESP_OK) {
+        uint32_t pc_async = 0, pc_status = 0;
+        has_dual_bank = algo_parser.get_func_pc(FUNC_NAME_ERASE_SECTOR_ASYNC, &pc_async, true) == ESP_OK
+                        && algo_parser.get_func_pc(FUNC_NAME_ERASE_STATUS, &pc_status, true) == ESP_OK;
+        if (!has_dual_bank) {
+            ESP_LOGW(TAG, "DualBank info without EraseSectorAsync/EraseStatus, erasing the usual way");
+        }
+    } else if (ret != ESP_ERR_NOT_FOUND) {
+        return ret;
+    }
+
     return ESP_OK;
 }
 
@@ -87,11 +114,39 @@ esp_err_t fw_asset_manager::get_pc_verify(uint32_t *out)
     return algo_parser.get_func_pc(FUNC_NAME_VERIFY, out);
 }
 
+esp_err_t fw_asset_manager::get_pc_erase_sector_async(uint32_t *out)
+{
+    return algo_parser.get_func_pc(FUNC_NAME_ERASE_SECTOR_ASYNC, out, true);
+}
+
+esp_err_t fw_asset_manager::get_pc_erase_status(uint32_t *out)
+{
+    return algo_parser.get_func_pc(FUNC_NAME_ERASE_STATUS, out, true);
+}
+
 esp_err_t fw_asset_manager::get_data_section_offset(uint32_t *out)
 {
     return algo_parser.get_data_section_offset(out);
 }
 
+esp_err_t fw_asset_manager::get_algo_sizes(uint32_t *code_out, uint32_t *data_out, uint32_t *bss_out) const
+{
+    if (code_out == nullptr || data_out == nullptr || bss_out == nullptr) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    size_t code_len = 0, data_len = 0, bss_len = 0;
+    auto ret = algo_parser.get_algo_sizes(&code_len, &data_len, &bss_len);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    *code_out = code_len;
+    *data_out = data_len;
+    *bss_out = bss_len;
+    return ESP_OK;
+}
+
 esp_err_t fw_asset_manager::get_flash_start_addr(uint32_t *out) const
 {
     if (out != nullptr) {
@@ -169,11 +224,106 @@ esp_err_t fw_asset_manager::get_sector_size(uint32_t *out) const
     return ESP_OK;
 }
 
+esp_err_t fw_asset_manager::get_min_sector_size(uint32_t *out) const
+{
+    if (out == nullptr) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    uint32_t min_size = UINT32_MAX;
+    for (const auto &sector : dev_sectors) {
+        if (sector.size != 0 && sector.size != UINT32_MAX) {
+            min_size = std::min(min_size, sector.size);
+        }
+    }
+
+    if (min_size == UINT32_MAX) {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    *out = min_size;
+    return ESP_OK;
+}
+
+esp_err_t fw_asset_manager::get_ram_start_addr(uint32_t *out) const
+{
+    if (out == nullptr) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (test_descr.ram_end_addr <= test_descr.ram_start_addr) {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    *out = test_descr.ram_start_addr;
+    return ESP_OK;
+}
+
+const char *fw_asset_manager::get_dev_name() const
+{
+    return dev_descr.dev_name;
+}
+
 std::vector<flash_algo::test_item> &fw_asset_manager::get_test_items()
 {
     return test_items;
 }
 
+esp_err_t fw_asset_manager::get_sector_at(uint32_t offset, uint32_t *start_out, uint32_t *size_out) const
+{
+    if (start_out == nullptr || size_out == nullptr) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (offset >= dev_descr.dev_size) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    // Each entry runs from its own offset up to the next entry's, the last one up to the device end
+    for (size_t idx = 0; idx < dev_sectors.size(); idx += 1) {
+        uint32_t region_start = dev_sectors[idx].addr;
+        uint32_t region_end = idx + 1 < dev_sectors.size() ? dev_sectors[idx + 1].addr : dev_descr.dev_size;
+        if (offset < region_start || offset >= region_end || dev_sectors[idx].size == 0) {
+            continue;
+        }
+
+        *size_out = dev_sectors[idx].size;
+        *start_out = region_start + ((offset - region_start) / dev_sectors[idx].size) * dev_sectors[idx].size;
+        return ESP_OK;
+    }
+
+    return ESP_ERR_NOT_FOUND;
+}
+
+esp_err_t fw_asset_manager::get_dual_bank(flash_algo::dual_bank_description *out) const
+{
+    if (out == nullptr) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (!has_dual_bank) {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    *out = dual_bank;
+    return ESP_OK;
+}
+
+const std::vector<flash_algo::reg_op> &fw_asset_manager::get_pre_init_script() const
+{
+    return pre_init_script;
+}
+
+const std::vector<flash_algo::reg_op> &fw_asset_manager::get_post_uninit_script() const
+{
+    return post_uninit_script;
+}
+
+const std::vector<flash_algo::flash_sector> &fw_asset_manager::get_sectors() const
+{
+    return dev_sectors;
+}
+
 bool fw_asset_manager::check_fw_bin_hash(uint8_t *sha_expected, size_t len)
 {
     if (len < 32 || sha_expected == nullptr) {
@@ -181,6 +331,12 @@ bool fw_asset_manager::check_fw_bin_hash(uint8_t *sha_expected, size_t len)
         return ESP_ERR_INVALID_ARG;
     }
 
+    // The store knows the active hash already, no need to read the whole file
+    auto *store = asset_store::instance();
+    if (store->get_active_path(asset_store_def::KIND_FW) != nullptr) {
+        return store->is_active(asset_store_def::KIND_FW, sha_expected);
+    }
+
     uint8_t sha_actual[32] = {};
     auto ret = get_sha256_from_file(FIRMWARE_PATH, sha_actual);
     if (ret != ESP_OK) {
@@ -197,6 +353,12 @@ bool fw_asset_manager::check_algo_bin_hash(uint8_t *sha_expected, size_t len)
         return ESP_ERR_INVALID_ARG;
     }
 
+    // The store knows the active hash already, no need to read the whole file
+    auto *store = asset_store::instance();
+    if (store->get_active_path(asset_store_def::KIND_ALGO) != nullptr) {
+        return store->is_active(asset_store_def::KIND_ALGO, sha_expected);
+    }
+
     uint8_t sha_actual[32] = {};
     auto ret = get_sha256_from_file(ALGO_ELF_PATH, sha_actual);
     if (ret != ESP_OK) {
@@ -206,6 +368,24 @@ bool fw_asset_manager::check_algo_bin_hash(uint8_t *sha_expected, size_t len)
     return memcmp(sha_actual, sha_expected, std::min(sizeof(sha_actual), len)) == 0;
 }
 
+const char *fw_asset_manager::get_algo_path()
+{
+    const char *path = asset_store::instance()->get_active_path(asset_store_def::KIND_ALGO);
+    return path != nullptr ? path : ALGO_ELF_PATH;
+}
+
+const char *fw_asset_manager::get_fw_path()
+{
+    const char *path = asset_store::instance()->get_active_path(asset_store_def::KIND_FW);
+    return path != nullptr ? path : FIRMWARE_PATH;
+}
+
+const char *fw_asset_manager::get_test_image_path()
+{
+    const char *path = asset_store::instance()->get_active_path(asset_store_def::KIND_TEST);
+    return path != nullptr ? path : TEST_IMAGE_PATH;
+}
+
 esp_err_t fw_asset_manager::get_sha256_from_file(const char *path, uint8_t *out)
 {
     if (path == nullptr) {
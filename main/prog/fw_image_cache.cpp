@@ -0,0 +1,154 @@
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <sys/stat.h>
+#include <esp_log.h>
+#include <esp_crc.h>
+#include <esp_timer.h>
+#include <esp_heap_caps.h>
+#include <mbedtls/sha256.h>
+
+#include "fw_image_cache.hpp"
+#include "fw_asset_manager.hpp"
+
+esp_err_t fw_image_cache::load(const char *path, uint32_t page_size, uint32_t erased_val)
+{
+    if (path == nullptr || page_size == 0 || strlen(path) >= sizeof(cached_path)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    struct stat file_stat = {};
+    if (stat(path, &file_stat) != 0) {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    size_t len = file_stat.st_size;
+    bool same_params = image != nullptr && strcmp(path, cached_path) == 0 && page_size == cached_page_size && erased_val == cached_erased_val;
+    if (same_params && !stale && len == image_len && file_stat.st_mtime == cached_mtime) {
+        return ESP_OK;
+    }
+
+    // Touched, but maybe rewritten with the same bytes, e.g. a re-sync from the server
+    uint8_t sha[img_cache_def::sha_len] = {};
+    if (same_params && len == image_len && fw_asset_manager::get_sha256_from_file(path, sha) == ESP_OK
+        && memcmp(sha, image_sha, sizeof(sha)) == 0) {
+        ESP_LOGI(TAG, "%s touched, same SHA256; keeping cached image", path);
+        cached_mtime = file_stat.st_mtime;
+        stale = false;
+        return ESP_OK;
+    }
+
+    auto ret = reload(path, len, page_size, erased_val);
+    if (ret == ESP_OK) {
+        cached_mtime = file_stat.st_mtime;
+        stale = false;
+    }
+
+    return ret;
+}
+
+void fw_image_cache::invalidate()
+{
+    stale = true;
+}
+
+const uint8_t *fw_image_cache::data() const
+{
+    return image;
+}
+
+size_t fw_image_cache::size() const
+{
+    return image_len;
+}
+
+const uint8_t *fw_image_cache::get_sha256() const
+{
+    return image != nullptr ? image_sha : nullptr;
+}
+
+const img_cache_def::page_meta *fw_image_cache::get_page(size_t idx) const
+{
+    return idx < page_cnt ? &pages[idx] : nullptr;
+}
+
+bool fw_image_cache::is_blank(uint32_t offset, uint32_t len) const
+{
+    if (image == nullptr || len == 0 || offset % cached_page_size != 0) {
+        return false;
+    }
+
+    size_t end_idx = std::min(page_cnt, ((size_t)offset + len + cached_page_size - 1) / cached_page_size);
+    for (size_t idx = offset / cached_page_size; idx < end_idx; idx += 1) {
+        if (!pages[idx].blank) {
+            return false;
+        }
+    }
+
+    return offset / cached_page_size < end_idx;
+}
+
+esp_err_t fw_image_cache::reload(const char *path, size_t len, uint32_t page_size, uint32_t erased_val)
+{
+    release();
+    if (len == 0) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    int64_t start_ts = esp_timer_get_time();
+    size_t cnt = (len + page_size - 1) / page_size;
+    image = static_cast<uint8_t *>(heap_caps_malloc(len, MALLOC_CAP_SPIRAM));
+    pages = static_cast<img_cache_def::page_meta *>(heap_caps_calloc(cnt, sizeof(img_cache_def::page_meta), MALLOC_CAP_SPIRAM));
+    if (image == nullptr || pages == nullptr) {
+        ESP_LOGW(TAG, "No room for a %u byte image in PSRAM", len);
+        release();
+        return ESP_ERR_NO_MEM;
+    }
+
+    FILE *file = fopen(path, "rb");
+    if (file == nullptr) {
+        release();
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    size_t read_len = fread(image, 1, len, file);
+    fclose(file);
+    if (read_len != len) {
+        ESP_LOGE(TAG, "Short read on %s: %u of %u", path, read_len, len);
+        release();
+        return ESP_FAIL;
+    }
+
+    if (mbedtls_sha256(image, len, image_sha, 0) != 0) {
+        release();
+        return ESP_FAIL;
+    }
+
+    size_t blank_cnt = 0;
+    for (size_t idx = 0; idx < cnt; idx += 1) {
+        const uint8_t *page = image + idx * page_size;
+        size_t page_len = std::min((size_t)page_size, len - idx * page_size);
+        pages[idx].crc = esp_crc32_le(0, page, page_len);
+        pages[idx].blank = std::all_of(page, page + page_len, [erased_val](uint8_t val) { return val == (uint8_t)erased_val; });
+        blank_cnt += pages[idx].blank ? 1 : 0;
+    }
+
+    image_len = len;
+    page_cnt = cnt;
+    cached_page_size = page_size;
+    cached_erased_val = erased_val;
+    strncpy(cached_path, path, sizeof(cached_path) - 1);
+    ESP_LOGI(TAG, "Cached %s: %u bytes, %u pages (%u blank) in %lld us", path, len, cnt, blank_cnt, esp_timer_get_time() - start_ts);
+    return ESP_OK;
+}
+
+void fw_image_cache::release()
+{
+    free(image);
+    free(pages);
+    image = nullptr;
+    pages = nullptr;
+    image_len = 0;
+    page_cnt = 0;
+    memset(cached_path, 0, sizeof(cached_path));
+}
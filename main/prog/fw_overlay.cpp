@@ -0,0 +1,257 @@
+#include <cstring>
+#include <cctype>
+#include <algorithm>
+#include <esp_log.h>
+#include <nvs_flash.h>
+
+#include "fw_overlay.hpp"
+
+esp_err_t fw_overlay::init()
+{
+    esp_err_t ret = ESP_OK;
+    nvs_handle = nvs::open_nvs_handle(NVS_NS, NVS_READWRITE, &ret);
+    if (ret != ESP_OK || nvs_handle == nullptr) {
+        ESP_LOGE(TAG, "Failed to open NVS: 0x%x", ret);
+        return ret;
+    }
+
+    ret = nvs_handle->get_item(NVS_KEY_UNIT_SEQ, unit_seq);
+    if (ret == ESP_ERR_NVS_NOT_FOUND) {
+        unit_seq = 0;
+        ret = ESP_OK;
+    }
+
+    ESP_LOGI(TAG, "Overlay ready, unit seq=%lu", unit_seq);
+    return ret;
+}
+
+esp_err_t fw_overlay::add_patch(const overlay_def::patch_item &item)
+{
+    xSemaphoreTakeRecursive(edit_lock, portMAX_DELAY);
+    esp_err_t ret = ESP_OK;
+    if (patches.size() >= overlay_def::max_patch_cnt) {
+        ESP_LOGE(TAG, "Too many patches, max %u", overlay_def::max_patch_cnt);
+        ret = ESP_ERR_NO_MEM;
+    }
+
+    for (auto &patch : patches) {
+        if (ret == ESP_OK && item.addr < patch.addr + patch.len && patch.addr < item.addr + item.len) {
+            ESP_LOGE(TAG, "Patch @ 0x%08lx len %u overlaps with 0x%08lx len %u", item.addr, item.len, patch.addr, patch.len);
+            ret = ESP_ERR_INVALID_ARG;
+        }
+    }
+
+    if (ret == ESP_OK) {
+        patches.emplace_back(item);
+    }
+
+    xSemaphoreGiveRecursive(edit_lock);
+    return ret;
+}
+
+esp_err_t fw_overlay::add_fixed(uint32_t addr, const uint8_t *buf, size_t len)
+{
+    if (buf == nullptr || len < 1 || len > overlay_def::max_patch_len) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    overlay_def::patch_item item = {};
+    item.addr = addr;
+    item.type = overlay_def::GEN_FIXED;
+    item.len = len;
+    memcpy(item.value, buf, len);
+
+    return add_patch(item);
+}
+
+esp_err_t fw_overlay::add_counter(uint32_t addr, uint8_t width, uint32_t base, uint32_t step)
+{
+    if (width != 1 && width != 2 && width != 4) {
+        ESP_LOGE(TAG, "Counter width must be 1, 2 or 4 bytes, got %u", width);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    overlay_def::patch_item item = {};
+    item.addr = addr;
+    item.type = overlay_def::GEN_COUNTER;
+    item.len = width;
+    item.base = base;
+    item.step = step;
+
+    return add_patch(item);
+}
+
+esp_err_t fw_overlay::add_template(uint32_t addr, const char *fmt, uint8_t len)
+{
+    if (fmt == nullptr || len < 1 || len > overlay_def::max_patch_len || strlen(fmt) >= overlay_def::max_patch_len) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (!is_template_valid(fmt)) {
+        ESP_LOGE(TAG, "Invalid template: %s", fmt);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    overlay_def::patch_item item = {};
+    item.addr = addr;
+    item.type = overlay_def::GEN_TEMPLATE;
+    item.len = len;
+    strncpy(item.fmt, fmt, sizeof(item.fmt) - 1);
+
+    return add_patch(item);
+}
+
+void fw_overlay::clear()
+{
+    xSemaphoreTakeRecursive(edit_lock, portMAX_DELAY);
+    patches.clear();
+    xSemaphoreGiveRecursive(edit_lock);
+}
+
+void fw_overlay::begin_edit()
+{
+    xSemaphoreTakeRecursive(edit_lock, portMAX_DELAY);
+}
+
+void fw_overlay::end_edit()
+{
+    xSemaphoreGiveRecursive(edit_lock);
+}
+
+size_t fw_overlay::size() const
+{
+    xSemaphoreTakeRecursive(edit_lock, portMAX_DELAY);
+    size_t cnt = patches.size();
+    xSemaphoreGiveRecursive(edit_lock);
+    return cnt;
+}
+
+esp_err_t fw_overlay::prepare_unit()
+{
+    xSemaphoreTakeRecursive(edit_lock, portMAX_DELAY);
+    unit_patches = patches;
+    xSemaphoreGiveRecursive(edit_lock);
+
+    for (auto &patch : unit_patches) {
+        switch (patch.type) {
+            case overlay_def::GEN_FIXED: {
+                break;
+            }
+
+            case overlay_def::GEN_COUNTER: {
+                uint32_t val = patch.base + unit_seq * patch.step;
+                memcpy(patch.value, &val, patch.len); // Xtensa is little-endian, so does Cortex-M
+                break;
+            }
+
+            case overlay_def::GEN_TEMPLATE: {
+                char str[overlay_def::max_patch_len + 1] = {};
+                snprintf(str, sizeof(str), patch.fmt, unit_seq);
+                memset(patch.value, 0, sizeof(patch.value));
+                memcpy(patch.value, str, std::min((size_t)patch.len, strlen(str)));
+                break;
+            }
+        }
+    }
+
+    prepared = true;
+    return ESP_OK;
+}
+
+esp_err_t fw_overlay::commit_unit()
+{
+    if (!prepared || unit_patches.empty()) {
+        return ESP_OK;
+    }
+
+    unit_seq += 1;
+    prepared = false;
+    if (nvs_handle == nullptr) {
+        ESP_LOGW(TAG, "NVS not ready, unit seq %lu will be lost after reboot", unit_seq);
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    auto ret = nvs_handle->set_item(NVS_KEY_UNIT_SEQ, unit_seq);
+    ret = ret ?: nvs_handle->commit();
+    return ret;
+}
+
+size_t fw_overlay::apply(uint32_t addr, uint8_t *buf, size_t len) const
+{
+    if (buf == nullptr || !prepared) {
+        return 0;
+    }
+
+    size_t patched = 0;
+    for (auto &patch : unit_patches) {
+        uint32_t start = std::max(addr, patch.addr);
+        uint32_t end = std::min((uint32_t)(addr + len), (uint32_t)(patch.addr + patch.len));
+        if (start >= end) {
+            continue;
+        }
+
+        memcpy(buf + (start - addr), patch.value + (start - patch.addr), end - start);
+        patched += end - start;
+    }
+
+    return patched;
+}
+
+bool fw_overlay::overlaps(uint32_t addr, size_t len) const
+{
+    for (auto &patch : unit_patches) {
+        if (addr < patch.addr + patch.len && patch.addr < addr + len) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool fw_overlay::empty() const
+{
+    return unit_patches.empty();
+}
+
+uint32_t fw_overlay::get_unit_seq() const
+{
+    return unit_seq;
+}
+
+const std::vector<overlay_def::patch_item> &fw_overlay::get_patches() const
+{
+    return unit_patches;
+}
+
+bool fw_overlay::is_template_valid(const char *fmt)
+{
+    // Only one integer conversion is allowed, e.g. "SN-%08lu" or "%lX", since the template comes from the network
+    size_t conv_cnt = 0;
+    for (const char *ptr = fmt; *ptr != '\0'; ptr += 1) {
+        if (*ptr != '%') {
+            continue;
+        }
+
+        ptr += 1;
+        if (*ptr == '%') {
+            continue;
+        }
+
+        while (isdigit((unsigned char)*ptr)) {
+            ptr += 1;
+        }
+
+        if (*ptr != 'l') {
+            return false;
+        }
+
+        ptr += 1;
+        if (*ptr != 'u' && *ptr != 'x' && *ptr != 'X') {
+            return false;
+        }
+
+        conv_cnt += 1;
+    }
+
+    return conv_cnt == 1;
+}
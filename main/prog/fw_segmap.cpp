@@ -0,0 +1,566 @@
+#include <cctype>
+#include <cstring>
+#include <algorithm>
+#include <memory>
+#include <unistd.h>
+#include <esp_log.h>
+#include <esp_crc.h>
+#include <esp_timer.h>
+
+#include "fw_segmap.hpp"
+#include "fw_asset_manager.hpp"
+#include "file_utils.hpp"
+
+bool fw_segmap::is_segmap(const uint8_t *src, size_t len)
+{
+    if (src == nullptr || len < sizeof(fw_segmap_def::header)) {
+        return false;
+    }
+
+    fw_segmap_def::header hdr = {};
+    memcpy(&hdr, src, sizeof(hdr));
+    return hdr.magic == fw_segmap_def::MAGIC && hdr.version == fw_segmap_def::VERSION;
+}
+
+fw_segmap_def::source_format fw_segmap::detect(const uint8_t *head, size_t len)
+{
+    if (head == nullptr || len == 0) {
+        return fw_segmap_def::SRC_BIN;
+    }
+
+    uint32_t magic = 0;
+    memcpy(&magic, head, std::min(len, sizeof(magic)));
+    if (len >= sizeof(magic) && magic == fw_segmap_def::ELF_MAGIC) {
+        return fw_segmap_def::SRC_ELF;
+    }
+
+    if (len >= sizeof(magic) && magic == fw_segmap_def::UF2_MAGIC_START0) {
+        return fw_segmap_def::SRC_UF2;
+    }
+
+    // A raw Cortex-M image starts with the initial SP, which never looks like ':' plus hex digits
+    size_t idx = 0;
+    while (idx < len && (head[idx] == '\r' || head[idx] == '\n' || head[idx] == ' ')) {
+        idx += 1;
+    }
+
+    return idx + 1 < len && head[idx] == ':' && isxdigit(head[idx + 1]) ? fw_segmap_def::SRC_HEX : fw_segmap_def::SRC_BIN;
+}
+
+esp_err_t fw_segmap::ingest(const char *src_path, const char *dst_path, const fw_segmap_def::ingest_opts &opts)
+{
+    if (src_path == nullptr || dst_path == nullptr || opts.align == 0 || opts.align % 4 != 0 || opts.flash_end <= opts.flash_start) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    FILE *src = fopen(src_path, "rb");
+    if (src == nullptr) {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    uint8_t head[sizeof(fw_segmap_def::elf32_ehdr)] = {};
+    size_t head_len = fread(head, 1, sizeof(head), src);
+    auto source = detect(head, head_len);
+    if (source == fw_segmap_def::SRC_BIN) {
+        fclose(src);
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+
+    uint8_t src_sha[fw_segmap_def::sha_len] = {};
+    auto ret = fw_asset_manager::get_sha256_from_file(src_path, src_sha);
+    if (ret != ESP_OK || is_current(dst_path, src_sha, opts)) {
+        fclose(src);
+        return ret;
+    }
+
+    FILE *tmp = fopen(SCRATCH_PATH, "w+b");
+    if (tmp == nullptr) {
+        fclose(src);
+        return ESP_FAIL;
+    }
+
+    int64_t start_ts = esp_timer_get_time();
+    std::vector<fw_segmap_def::chunk> chunks {};
+    fseek(src, 0, SEEK_SET);
+    switch (source) {
+        case fw_segmap_def::SRC_HEX: {
+            ret = parse_hex(src, tmp, chunks, opts);
+            break;
+        }
+
+        case fw_segmap_def::SRC_ELF: {
+            ret = parse_elf(src, tmp, chunks, opts);
+            break;
+        }
+
+        case fw_segmap_def::SRC_UF2: {
+            ret = parse_uf2(src, tmp, chunks, opts);
+            break;
+        }
+
+        default: {
+            ret = ESP_ERR_NOT_SUPPORTED;
+            break;
+        }
+    }
+
+    ret = ret ?: write_map(tmp, chunks, dst_path, source, src_sha, opts);
+    fclose(src);
+    fclose(tmp);
+    remove(SCRATCH_PATH);
+
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to ingest %s (format %u): 0x%x", src_path, source, ret);
+        return ret;
+    }
+
+    ESP_LOGI(TAG, "Ingested %s (format %u) in %lld us", src_path, source, esp_timer_get_time() - start_ts);
+    return ESP_OK;
+}
+
+esp_err_t fw_segmap::open(const uint8_t *src, size_t len)
+{
+    if (src == nullptr || len < sizeof(header)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    memcpy(&header, src, sizeof(header));
+    auto ret = check_header(len);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    segments.resize(header.seg_cnt);
+    memcpy(segments.data(), src + sizeof(header), header.seg_cnt * sizeof(fw_segmap_def::segment));
+    return check_table(len);
+}
+
+esp_err_t fw_segmap::open(FILE *file)
+{
+    if (file == nullptr) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    fseek(file, 0, SEEK_END);
+    size_t len = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    if (fread(&header, 1, sizeof(header), file) != sizeof(header)) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    auto ret = check_header(len);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    segments.resize(header.seg_cnt);
+    size_t table_len = header.seg_cnt * sizeof(fw_segmap_def::segment);
+    if (fread(segments.data(), 1, table_len, file) != table_len) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    return check_table(len);
+}
+
+size_t fw_segmap::size() const
+{
+    return segments.size();
+}
+
+const fw_segmap_def::segment &fw_segmap::get(size_t idx) const
+{
+    return segments.at(idx);
+}
+
+uint32_t fw_segmap::data_len() const
+{
+    return header.data_len;
+}
+
+esp_err_t fw_segmap::check_header(size_t file_len) const
+{
+    if (header.magic != fw_segmap_def::MAGIC || header.version != fw_segmap_def::VERSION) {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    if (header.seg_cnt == 0 || header.seg_cnt > fw_segmap_def::max_segments
+        || sizeof(header) + header.seg_cnt * sizeof(fw_segmap_def::segment) > file_len) {
+        ESP_LOGE(TAG, "Bad segment count %lu", header.seg_cnt);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t fw_segmap::check_table(size_t file_len) const
+{
+    uint32_t crc = esp_crc32_le(0, (const uint8_t *)&header, offsetof(fw_segmap_def::header, crc));
+    crc = esp_crc32_le(crc, (const uint8_t *)segments.data(), segments.size() * sizeof(fw_segmap_def::segment));
+    if (crc != header.crc) {
+        ESP_LOGE(TAG, "Header CRC mismatch");
+        return ESP_ERR_INVALID_CRC;
+    }
+
+    uint64_t total = 0;
+    for (size_t idx = 0; idx < segments.size(); idx += 1) {
+        const auto &seg = segments[idx];
+        bool sorted = idx == 0 || seg.addr >= segments[idx - 1].addr + segments[idx - 1].len;
+        if (seg.len == 0 || seg.len % 4 != 0 || (uint64_t)seg.offset + seg.len > file_len || !sorted) {
+            ESP_LOGE(TAG, "Bad segment %u: 0x%08lx, %lu bytes", idx, seg.addr, seg.len);
+            return ESP_ERR_INVALID_SIZE;
+        }
+
+        total += seg.len;
+    }
+
+    return total == header.data_len ? ESP_OK : ESP_ERR_INVALID_SIZE;
+}
+
+bool fw_segmap::is_current(const char *dst_path, const uint8_t *src_sha, const fw_segmap_def::ingest_opts &opts)
+{
+    FILE *file = fopen(dst_path, "rb");
+    if (file == nullptr) {
+        return false;
+    }
+
+    fw_segmap map {};
+    bool current = map.open(file) == ESP_OK && memcmp(map.header.src_sha256, src_sha, fw_segmap_def::sha_len) == 0
+                   && map.header.align == opts.align && map.header.fill == opts.fill
+                   && map.segments.front().addr >= opts.flash_start && map.segments.back().addr + map.segments.back().len <= opts.flash_end;
+    fclose(file);
+    return current;
+}
+
+esp_err_t fw_segmap::parse_hex(FILE *src, FILE *tmp, std::vector<fw_segmap_def::chunk> &chunks, const fw_segmap_def::ingest_opts &opts)
+{
+    auto hex_val = [](char ch) -> int {
+        if (ch >= '0' && ch <= '9') return ch - '0';
+        if (ch >= 'a' && ch <= 'f') return ch - 'a' + 10;
+        if (ch >= 'A' && ch <= 'F') return ch - 'A' + 10;
+        return -1;
+    };
+
+    char line[fw_segmap_def::max_hex_line] = {};
+    uint8_t rec[fw_segmap_def::max_hex_line / 2] = {};
+    uint32_t base = 0, line_no = 0;
+    bool eof = false;
+    while (!eof && fgets(line, sizeof(line), src) != nullptr) {
+        line_no += 1;
+        size_t len = strcspn(line, "\r\n");
+        if (line[len] == '\0' && !feof(src)) {
+            ESP_LOGE(TAG, "HEX line %lu too long", line_no);
+            return ESP_ERR_INVALID_SIZE;
+        }
+
+        if (len == 0) {
+            continue;
+        }
+
+        // :LLAAAATT, data, checksum; all bytes including the checksum sum to 0
+        size_t byte_cnt = (len - 1) / 2;
+        if (line[0] != ':' || (len - 1) % 2 != 0 || byte_cnt < 5) {
+            ESP_LOGE(TAG, "HEX line %lu malformed", line_no);
+            return ESP_ERR_INVALID_ARG;
+        }
+
+        uint8_t sum = 0;
+        for (size_t idx = 0; idx < byte_cnt; idx += 1) {
+            int hi = hex_val(line[1 + idx * 2]), lo = hex_val(line[2 + idx * 2]);
+            if (hi < 0 || lo < 0) {
+                ESP_LOGE(TAG, "HEX line %lu has a bad digit", line_no);
+                return ESP_ERR_INVALID_ARG;
+            }
+
+            rec[idx] = (uint8_t)((hi << 4) | lo);
+            sum += rec[idx];
+        }
+
+        if (sum != 0 || rec[0] + 5U != byte_cnt) {
+            ESP_LOGE(TAG, "HEX line %lu fails its checksum", line_no);
+            return ESP_ERR_INVALID_CRC;
+        }
+
+        uint32_t offset = ((uint32_t)rec[1] << 8) | rec[2];
+        const uint8_t *data = rec + 4;
+        uint8_t data_len = rec[0];
+        switch (rec[3]) {
+            case 0x00: { // Data
+                auto ret = add_chunk(tmp, chunks, base + offset, data, data_len, opts);
+                if (ret != ESP_OK) return ret;
+                break;
+            }
+
+            case 0x01: { // End of file
+                eof = true;
+                break;
+            }
+
+            case 0x02: // Extended segment address
+            case 0x04: { // Extended linear address
+                if (data_len != 2) {
+                    return ESP_ERR_INVALID_ARG;
+                }
+
+                base = (((uint32_t)data[0] << 8) | data[1]) << (rec[3] == 0x02 ? 4 : 16);
+                break;
+            }
+
+            case 0x03: // Start segment address
+            case 0x05: { // Start linear address, neither is flash content
+                break;
+            }
+
+            default: {
+                ESP_LOGE(TAG, "HEX line %lu has unknown record type %u", line_no, rec[3]);
+                return ESP_ERR_NOT_SUPPORTED;
+            }
+        }
+    }
+
+    // A download cut short still parses line by line, only the missing EOF record gives it away
+    if (!eof) {
+        ESP_LOGE(TAG, "HEX has no EOF record");
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t fw_segmap::parse_elf(FILE *src, FILE *tmp, std::vector<fw_segmap_def::chunk> &chunks, const fw_segmap_def::ingest_opts &opts)
+{
+    fw_segmap_def::elf32_ehdr ehdr = {};
+    if (fread(&ehdr, 1, sizeof(ehdr), src) != sizeof(ehdr)) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    if (ehdr.e_ident[4] != fw_segmap_def::ELF_CLASS_32 || ehdr.e_ident[5] != fw_segmap_def::ELF_DATA_LE) {
+        ESP_LOGE(TAG, "Only 32-bit little-endian ELF is supported");
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+
+    if (ehdr.e_phnum == 0 || ehdr.e_phentsize != sizeof(fw_segmap_def::elf32_phdr)) {
+        ESP_LOGE(TAG, "ELF has no usable program headers");
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    // Program headers first, copying segment data in between would lose the position
+    std::vector<fw_segmap_def::elf32_phdr> loads {};
+    for (uint32_t idx = 0; idx < ehdr.e_phnum; idx += 1) {
+        fw_segmap_def::elf32_phdr phdr = {};
+        if (fseek(src, ehdr.e_phoff + idx * sizeof(phdr), SEEK_SET) != 0 || fread(&phdr, 1, sizeof(phdr), src) != sizeof(phdr)) {
+            return ESP_ERR_INVALID_SIZE;
+        }
+
+        // .bss and the like have nothing in the file, and nothing to program
+        if (phdr.p_type == fw_segmap_def::PT_LOAD && phdr.p_filesz > 0) {
+            loads.push_back(phdr);
+        }
+    }
+
+    std::vector<uint8_t> buf(fw_segmap_def::copy_buf_len);
+    for (const auto &phdr : loads) {
+        if (fseek(src, phdr.p_offset, SEEK_SET) != 0) {
+            return ESP_ERR_INVALID_SIZE;
+        }
+
+        uint32_t done = 0;
+        while (done < phdr.p_filesz) {
+            size_t read_len = std::min((size_t)(phdr.p_filesz - done), buf.size());
+            if (fread(buf.data(), 1, read_len, src) != read_len) {
+                ESP_LOGE(TAG, "ELF segment at 0x%08lx truncated", phdr.p_paddr);
+                return ESP_ERR_INVALID_SIZE;
+            }
+
+            auto ret = add_chunk(tmp, chunks, phdr.p_paddr + done, buf.data(), read_len, opts);
+            if (ret != ESP_OK) return ret;
+            done += read_len;
+        }
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t fw_segmap::parse_uf2(FILE *src, FILE *tmp, std::vector<fw_segmap_def::chunk> &chunks, const fw_segmap_def::ingest_opts &opts)
+{
+    static_assert(sizeof(fw_segmap_def::uf2_block) == 512, "UF2 blocks are 512 bytes");
+    auto block = std::make_unique<fw_segmap_def::uf2_block>();
+    uint32_t block_cnt = 0;
+    while (true) {
+        size_t read_len = fread(block.get(), 1, sizeof(fw_segmap_def::uf2_block), src);
+        if (read_len == 0) {
+            break;
+        }
+
+        if (read_len != sizeof(fw_segmap_def::uf2_block) || block->magic_start0 != fw_segmap_def::UF2_MAGIC_START0
+            || block->magic_start1 != fw_segmap_def::UF2_MAGIC_START1 || block->magic_end != fw_segmap_def::UF2_MAGIC_END
+            || block->payload_size > fw_segmap_def::uf2_payload_max) {
+            ESP_LOGE(TAG, "UF2 block %lu malformed", block_cnt);
+            return ESP_ERR_INVALID_ARG;
+        }
+
+        block_cnt += 1;
+        if ((block->flags & fw_segmap_def::UF2_FLAG_NOT_MAIN_FLASH) != 0) {
+            continue;
+        }
+
+        auto ret = add_chunk(tmp, chunks, block->target_addr, block->data, block->payload_size, opts);
+        if (ret != ESP_OK) return ret;
+    }
+
+    return block_cnt > 0 ? ESP_OK : ESP_ERR_INVALID_SIZE;
+}
+
+esp_err_t fw_segmap::add_chunk(FILE *tmp, std::vector<fw_segmap_def::chunk> &chunks, uint32_t addr, const uint8_t *data, size_t len,
+                               const fw_segmap_def::ingest_opts &opts)
+{
+    if (len == 0) {
+        return ESP_OK;
+    }
+
+    // Option bytes, RAM-loaded code and such end up in HEX/ELF files too; only the algo's flash window gets programmed
+    uint64_t end = (uint64_t)addr + len;
+    if (addr >= opts.flash_end || end <= opts.flash_start) {
+        ESP_LOGW(TAG, "Dropping %u bytes at 0x%08lx, outside flash", len, addr);
+        return ESP_OK;
+    }
+
+    if (addr < opts.flash_start || end > opts.flash_end) {
+        ESP_LOGE(TAG, "Data at 0x%08lx, %u bytes straddles the flash boundary", addr, len);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    uint32_t tmp_offset = ftell(tmp);
+    if (fwrite(data, 1, len, tmp) != len) {
+        return ESP_FAIL;
+    }
+
+    auto *last = chunks.empty() ? nullptr : &chunks.back();
+    if (last != nullptr && last->addr + last->len == addr && last->tmp_offset + last->len == tmp_offset) {
+        last->len += len;
+        return ESP_OK;
+    }
+
+    if (chunks.size() >= fw_segmap_def::max_chunks) {
+        ESP_LOGE(TAG, "Too fragmented, more than %u ranges", fw_segmap_def::max_chunks);
+        return ESP_ERR_NO_MEM;
+    }
+
+    chunks.push_back({addr, (uint32_t)len, tmp_offset});
+    return ESP_OK;
+}
+
+esp_err_t fw_segmap::write_map(FILE *tmp, std::vector<fw_segmap_def::chunk> &chunks, const char *dst_path, fw_segmap_def::source_format source,
+                               const uint8_t *src_sha, const fw_segmap_def::ingest_opts &opts)
+{
+    if (chunks.empty()) {
+        ESP_LOGE(TAG, "Nothing to program in the flash window");
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    std::sort(chunks.begin(), chunks.end(), [](const fw_segmap_def::chunk &a, const fw_segmap_def::chunk &b) { return a.addr < b.addr; });
+
+    // Pages are aligned to the flash start; chunks landing in the same or the next page share a segment
+    auto align_down = [&](uint32_t addr) { return opts.flash_start + (addr - opts.flash_start) / opts.align * opts.align; };
+    auto align_up = [&](uint64_t addr) { return opts.flash_start + (addr - opts.flash_start + opts.align - 1) / opts.align * opts.align; };
+    std::vector<fw_segmap_def::segment> segs {};
+    std::vector<size_t> seg_first {};
+    for (size_t idx = 0; idx < chunks.size(); idx += 1) {
+        const auto &chunk = chunks[idx];
+        if (idx > 0 && chunk.addr < chunks[idx - 1].addr + chunks[idx - 1].len) {
+            ESP_LOGE(TAG, "Overlapping data at 0x%08lx", chunk.addr);
+            return ESP_ERR_INVALID_ARG;
+        }
+
+        uint32_t lo = align_down(chunk.addr);
+        uint64_t hi = std::min(align_up((uint64_t)chunk.addr + chunk.len), (uint64_t)opts.flash_end);
+        if (!segs.empty() && lo <= segs.back().addr + segs.back().len) {
+            segs.back().len = hi - segs.back().addr;
+            continue;
+        }
+
+        if (segs.size() >= fw_segmap_def::max_segments) {
+            ESP_LOGE(TAG, "More than %u segments", fw_segmap_def::max_segments);
+            return ESP_ERR_INVALID_SIZE;
+        }
+
+        segs.push_back({lo, (uint32_t)(hi - lo), 0, 0});
+        seg_first.push_back(idx);
+    }
+
+    fw_segmap_def::header hdr = {};
+    hdr.magic = fw_segmap_def::MAGIC;
+    hdr.version = fw_segmap_def::VERSION;
+    hdr.source = source;
+    hdr.fill = opts.fill;
+    hdr.seg_cnt = segs.size();
+    hdr.align = opts.align;
+    memcpy(hdr.src_sha256, src_sha, sizeof(hdr.src_sha256));
+
+    FILE *out = fopen(OUT_TMP_PATH, "wb");
+    if (out == nullptr) {
+        return ESP_FAIL;
+    }
+
+    // Data first, header and table go in last once the offsets and CRCs are known
+    std::vector<uint8_t> buf(fw_segmap_def::copy_buf_len);
+    uint32_t offset = sizeof(hdr) + segs.size() * sizeof(fw_segmap_def::segment);
+    bool ok = fseek(out, offset, SEEK_SET) == 0;
+    auto emit = [&](fw_segmap_def::segment &seg, const uint8_t *data, size_t len) {
+        seg.crc = esp_crc32_le(seg.crc, data, len);
+        ok = ok && fwrite(data, 1, len, out) == len;
+    };
+
+    auto emit_fill = [&](fw_segmap_def::segment &seg, size_t len) {
+        memset(buf.data(), opts.fill, std::min(len, buf.size()));
+        while (ok && len > 0) {
+            size_t piece = std::min(len, buf.size());
+            emit(seg, buf.data(), piece);
+            len -= piece;
+        }
+    };
+
+    for (size_t seg_idx = 0; seg_idx < segs.size() && ok; seg_idx += 1) {
+        auto &seg = segs[seg_idx];
+        seg.offset = offset;
+        uint32_t pos = seg.addr;
+        size_t end_idx = seg_idx + 1 < segs.size() ? seg_first[seg_idx + 1] : chunks.size();
+        for (size_t idx = seg_first[seg_idx]; idx < end_idx && ok; idx += 1) {
+            const auto &chunk = chunks[idx];
+            emit_fill(seg, chunk.addr - pos);
+            ok = ok && fseek(tmp, chunk.tmp_offset, SEEK_SET) == 0;
+            for (uint32_t done = 0; ok && done < chunk.len;) {
+                size_t piece = std::min((size_t)(chunk.len - done), buf.size());
+                ok = fread(buf.data(), 1, piece, tmp) == piece;
+                if (ok) {
+                    emit(seg, buf.data(), piece);
+                }
+
+                done += piece;
+            }
+
+            pos = chunk.addr + chunk.len;
+        }
+
+        emit_fill(seg, seg.addr + seg.len - pos);
+        offset += seg.len;
+        hdr.data_len += seg.len;
+    }
+
+    hdr.crc = esp_crc32_le(0, (const uint8_t *)&hdr, offsetof(fw_segmap_def::header, crc));
+    hdr.crc = esp_crc32_le(hdr.crc, (const uint8_t *)segs.data(), segs.size() * sizeof(fw_segmap_def::segment));
+    ok = ok && fseek(out, 0, SEEK_SET) == 0 && fwrite(&hdr, 1, sizeof(hdr), out) == sizeof(hdr);
+    ok = ok && fwrite(segs.data(), 1, segs.size() * sizeof(fw_segmap_def::segment), out) == segs.size() * sizeof(fw_segmap_def::segment);
+    ok = ok && fflush(out) == 0 && fsync(fileno(out)) == 0;
+    fclose(out);
+
+    // A power cut between remove and rename only costs a re-ingest, is_current() won't find the map
+    if (!ok || file_utils::replace_file(OUT_TMP_PATH, dst_path) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to write %s", dst_path);
+        remove(OUT_TMP_PATH);
+        return ESP_FAIL;
+    }
+
+    uint64_t span = (uint64_t)segs.back().addr + segs.back().len - segs.front().addr;
+    ESP_LOGI(TAG, "%u segments, %lu bytes to program over a %llu byte span", segs.size(), hdr.data_len, span);
+    return ESP_OK;
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <esp_err.h>
+#include <nvs_handle.hpp>
+
+namespace algo_profile_def
+{
+    static const constexpr uint32_t version = 3;
+
+    struct __attribute__((packed)) record
+    {
+        uint32_t version;
+        uint32_t stack_used; // High-water mark from the last calibration run
+        uint32_t stack_size; // What the RAM layout should reserve, margin included
+        uint32_t prog_chunk_size; // Max bytes per ProgramPage call, 0 for the device page size; since v2
+        uint32_t connect_flags; // swd_def::connect_flag bits, OR-ed with the product default; since v3
+    };
+}
+
+/**
+ * Measured per-algorithm parameters in NVS, keyed by the algorithm ELF's SHA256
+ */
+class algo_profile
+{
+public:
+    static algo_profile *instance()
+    {
+        static algo_profile _instance;
+        return &_instance;
+    }
+
+    algo_profile(algo_profile const &) = delete;
+    void operator=(algo_profile const &) = delete;
+
+public:
+    esp_err_t init();
+    esp_err_t load(const uint8_t *algo_hash, algo_profile_def::record *out);
+    esp_err_t store(const uint8_t *algo_hash, const algo_profile_def::record &record);
+    esp_err_t erase(const uint8_t *algo_hash);
+
+private:
+    algo_profile() = default;
+    static void get_nvs_key(const uint8_t *algo_hash, char *key_out, size_t key_len);
+
+private:
+    std::unique_ptr<nvs::NVSHandle> nvs_handle = {};
+
+    static const constexpr char TAG[] = "algo_profile";
+    static const constexpr char NVS_NS[] = "algo_prof";
+};
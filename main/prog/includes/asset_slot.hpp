@@ -0,0 +1,125 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <esp_err.h>
+#include <esp_partition.h>
+#include <mbedtls/sha256.h>
+
+namespace asset_slot_def
+{
+    static const constexpr uint32_t HEADER_MAGIC = 0x544f4c53; // "SLOT"
+    static const constexpr uint8_t HEADER_VERSION = 1;
+    static const constexpr size_t slot_cnt = 2;
+    static const constexpr size_t sha_len = 32;
+    static const constexpr uint32_t data_offset = 0x1000; // Header has the first sector to itself
+    static const constexpr uint32_t erase_step = 0x10000; // Erased ahead of the writer a block at a time
+    static const constexpr esp_partition_subtype_t PARTITION_SUBTYPE = (esp_partition_subtype_t)0x40;
+
+    enum asset_format : uint8_t
+    {
+        FORMAT_RAW = 0, // Plain binary, flash offset 0 at payload offset 0
+        FORMAT_LZ4 = 1, // lz4_image container, decompressed while programming
+        FORMAT_SEGMAP = 2, // fw_segmap, ingested on the host
+    };
+
+    struct __attribute__((packed)) header
+    {
+        uint32_t magic;
+        uint8_t version;
+        asset_format format;
+        uint16_t _reserved;
+        uint32_t seq; // Bumped on every commit, the valid slot with the highest one is active
+        uint32_t len; // Payload bytes, starting at data_offset
+        uint8_t sha256[sha_len]; // Of the payload
+        uint32_t crc; // Over everything above
+    };
+}
+
+/**
+ * Firmware in raw "fw_slot0"/"fw_slot1" partitions instead of a file on the data partition.
+ *
+ * Downloads stream into the inactive slot and the header is written last, so a slot is either complete
+ * or invalid. The active slot is read through esp_partition_mmap(), i.e. straight from the flash cache.
+ */
+class asset_slot
+{
+public:
+    static asset_slot *instance()
+    {
+        static asset_slot _instance;
+        return &_instance;
+    }
+
+    asset_slot(asset_slot const &) = delete;
+    void operator=(asset_slot const &) = delete;
+
+public:
+    /**
+     * Find both slots and pick the active one; payload SHA256 is checked once here
+     * @return ESP_ERR_NOT_FOUND if the partition table has no slots
+     */
+    esp_err_t init();
+    [[nodiscard]] bool available() const;
+
+    /**
+     * Pin the active slot for reading; begin() and retire() wait for release(), which must follow every ESP_OK
+     * @param data_out Memory-mapped payload, valid until release()
+     * @return ESP_ERR_NOT_FOUND if no slot holds a valid image, nothing to release then
+     */
+    esp_err_t acquire(const uint8_t **data_out, size_t *len_out, asset_slot_def::header *header_out = nullptr);
+    void release();
+    [[nodiscard]] bool is_active(const uint8_t *sha256) const;
+
+    /**
+     * Start writing the inactive slot, which is invalid from here on until commit()
+     */
+    esp_err_t begin(asset_slot_def::asset_format format);
+    esp_err_t write(const uint8_t *buf, size_t len);
+
+    /**
+     * Write the header and make the slot active. The header gets the format the payload turns out to be,
+     * whatever begin() was told.
+     * @param expected_sha256 Checked against what was written, nullptr to skip
+     * @return ESP_ERR_NOT_SUPPORTED for HEX/ELF/UF2, which have to be ingested into a segment map first
+     */
+    esp_err_t commit(const uint8_t *expected_sha256);
+    void abort();
+
+    /**
+     * Firmware now comes from somewhere else, e.g. a CDC upload; erase both headers so no slot wins over it,
+     * now or after a reboot
+     */
+    esp_err_t retire();
+
+private:
+    asset_slot() = default;
+    esp_err_t load_header(size_t idx);
+    esp_err_t detect_format(asset_slot_def::asset_format *format_out);
+    esp_err_t map_slot(size_t idx);
+    void unmap_slot(size_t idx);
+    static uint32_t header_crc(const asset_slot_def::header &header);
+
+private:
+    const esp_partition_t *parts[asset_slot_def::slot_cnt] = {};
+    asset_slot_def::header headers[asset_slot_def::slot_cnt] = {};
+    bool valid[asset_slot_def::slot_cnt] = {};
+    const uint8_t *mapped[asset_slot_def::slot_cnt] = {};
+    esp_partition_mmap_handle_t map_handles[asset_slot_def::slot_cnt] = {};
+    size_t active = SIZE_MAX;
+    bool inited = false;
+    SemaphoreHandle_t reader_lock = xSemaphoreCreateMutex(); // Held by the reader between acquire() and release()
+
+    // Writer state, only one download at a time
+    bool writing = false;
+    size_t write_idx = 0;
+    uint32_t write_pos = 0;
+    uint32_t erased_end = 0;
+    asset_slot_def::asset_format write_format = asset_slot_def::FORMAT_RAW;
+    mbedtls_sha256_context sha_ctx = {};
+
+    static const constexpr char TAG[] = "asset_slot";
+    static const constexpr char *SLOT_LABELS[asset_slot_def::slot_cnt] = {"fw_slot0", "fw_slot1"};
+};
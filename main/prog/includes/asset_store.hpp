@@ -0,0 +1,136 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <esp_err.h>
+
+namespace asset_store_def
+{
+    static const constexpr uint32_t INDEX_MAGIC = 0x31534143; // "CAS1"
+    static const constexpr uint8_t INDEX_VERSION = 1;
+    static const constexpr size_t sha_len = 32;
+    static const constexpr size_t max_entries = 64;
+    static const constexpr size_t path_len = 80; // "/data/cas/" + 64 hex digits
+    static const constexpr size_t fs_headroom = 65536; // Left free for directory growth, cluster rounding and the index
+
+    enum asset_kind : uint8_t
+    {
+        KIND_ALGO = 0,
+        KIND_FW = 1,
+        KIND_TEST = 2, // RAM test image
+        KIND_MAX,
+    };
+
+    /*
+     * Index file layout: header, then entry_cnt x entry. Rewritten as a whole on every change, it's a few KB at most.
+     */
+    struct __attribute__((packed)) header
+    {
+        uint32_t magic;
+        uint8_t version;
+        uint8_t active_mask; // Bit per asset_kind that has active[kind] set
+        uint16_t entry_cnt;
+        uint32_t clock; // Bumped on every use, entry.last_used takes the value
+        uint8_t active[KIND_MAX][sha_len];
+        uint32_t crc; // Over everything above, then the entries
+    };
+
+    struct __attribute__((packed)) entry
+    {
+        uint8_t sha256[sha_len]; // Of the blob, also its file name
+        asset_kind kind;
+        uint8_t _reserved[3];
+        uint32_t len;
+        uint32_t last_used;
+    };
+}
+
+/**
+ * Content-addressed store for algos, firmware and test images under /data/cas, one file per SHA256.
+ * Blob names are 64 hex digits, so it needs FatFS long file names; without them it stays unavailable.
+ *
+ * Every asset ever downloaded stays until space runs out, so changing over to a product seen before is only
+ * an index update. The active asset of each kind is never evicted; the least recently used of the rest go first.
+ */
+class asset_store
+{
+public:
+    static asset_store *instance()
+    {
+        static asset_store _instance;
+        return &_instance;
+    }
+
+    asset_store(asset_store const &) = delete;
+    void operator=(asset_store const &) = delete;
+
+public:
+    /**
+     * Load the index, drop entries whose blob is gone and delete blobs the index doesn't know
+     */
+    esp_err_t init();
+    [[nodiscard]] bool available() const;
+    [[nodiscard]] bool contains(const uint8_t *sha256) const;
+    [[nodiscard]] bool is_active(asset_store_def::asset_kind kind, const uint8_t *sha256) const;
+
+    /**
+     * Evict least recently used blobs until len bytes fit on the partition
+     */
+    esp_err_t reserve(size_t len);
+
+    /**
+     * Downloads go here, then commit() or discard_incoming()
+     */
+    [[nodiscard]] const char *get_incoming_path() const;
+
+    /**
+     * Check the incoming file against sha256 and move it into the store
+     * @return ESP_ERR_INVALID_CRC if the content doesn't match the hash
+     */
+    esp_err_t commit(const uint8_t *sha256, asset_store_def::asset_kind kind);
+    void discard_incoming();
+
+    /**
+     * Make a stored blob the one used for its kind
+     * @return ESP_ERR_NOT_FOUND if it's not in the store
+     */
+    esp_err_t activate(asset_store_def::asset_kind kind, const uint8_t *sha256);
+
+    /**
+     * Move a file that arrived outside the store, e.g. over CDC, into it and make it the active one of its kind
+     */
+    esp_err_t import(const char *path, asset_store_def::asset_kind kind);
+
+    /**
+     * @return Path of the active blob, or nullptr if this kind has none
+     */
+    [[nodiscard]] const char *get_active_path(asset_store_def::asset_kind kind) const;
+    esp_err_t get_active_sha(asset_store_def::asset_kind kind, uint8_t *out) const;
+    [[nodiscard]] size_t size() const;
+
+private:
+    asset_store() = default;
+    esp_err_t load_index();
+    esp_err_t save_index();
+    bool sweep();
+    esp_err_t evict_one();
+    int find(const uint8_t *sha256) const;
+    void touch(size_t idx);
+    void update_active_path(asset_store_def::asset_kind kind);
+    static void make_blob_path(const uint8_t *sha256, char *out);
+    static uint32_t index_crc(const asset_store_def::header &hdr, const std::vector<asset_store_def::entry> &_entries);
+
+private:
+    bool inited = false;
+    asset_store_def::header header = {};
+    std::vector<asset_store_def::entry> entries = {};
+    char active_paths[asset_store_def::KIND_MAX][asset_store_def::path_len] = {};
+
+    static const constexpr char TAG[] = "asset_store";
+    static const constexpr char BASE_PATH[] = "/data"; // FAT mount point, see comm_msc
+    static const constexpr char STORE_PATH[] = "/data/cas";
+    static const constexpr char INDEX_PATH[] = "/data/cas/index.bin";
+    static const constexpr char INDEX_TMP_PATH[] = "/data/cas/index.tmp";
+    static const constexpr char INCOMING_PATH[] = "/data/cas/incoming";
+};
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstdint>
+#include <esp_err.h>
+
+namespace dap_def
+{
+    // Transfer request bits, as in the CMSIS-DAP DAP_Transfer request byte
+    static const constexpr uint8_t REQ_APnDP = (1U << 0);
+    static const constexpr uint8_t REQ_RnW = (1U << 1);
+    static const constexpr uint8_t REQ_A2 = (1U << 2);
+    static const constexpr uint8_t REQ_A3 = (1U << 3);
+    static const constexpr uint8_t REQ_MATCH_VALUE = (1U << 4);
+    static const constexpr uint8_t REQ_MATCH_MASK = (1U << 5);
+    static const constexpr uint8_t REQ_TIMESTAMP = (1U << 7);
+
+    // Transfer response bits
+    static const constexpr uint8_t ACK_OK = (1U << 0);
+    static const constexpr uint8_t ACK_WAIT = (1U << 1);
+    static const constexpr uint8_t ACK_FAULT = (1U << 2);
+    static const constexpr uint8_t ACK_ERROR = (1U << 3);
+    static const constexpr uint8_t ACK_MISMATCH = (1U << 4);
+
+    // SWJ_Pins bits
+    static const constexpr uint8_t PIN_SWCLK = (1U << 0);
+    static const constexpr uint8_t PIN_SWDIO = (1U << 1);
+    static const constexpr uint8_t PIN_nRESET = (1U << 7);
+
+    static const constexpr uint8_t DP_ABORT = 0x00;
+    static const constexpr uint8_t DP_RDBUFF = 0x0c;
+}
+
+/**
+ * Bit level SWD access below swd_host, e.g. for swd_multidrop's TARGETSEL. swd_dap_wire drives the real pins.
+ */
+class dap_wire_if
+{
+public:
+    virtual esp_err_t connect() = 0;
+    virtual esp_err_t disconnect() = 0;
+
+    /**
+     * One SWD transfer, no WAIT retry; data may be nullptr for reads whose value is discarded
+     * @return ACK bits (dap_def::ACK_*)
+     */
+    virtual uint8_t transfer(uint8_t req, uint32_t *data) = 0;
+    virtual void swj_sequence(uint32_t bit_cnt, const uint8_t *data) = 0;
+    virtual void swd_sequence(uint8_t info, const uint8_t *data_out, uint8_t *data_in) = 0;
+    virtual uint8_t swj_pins(uint8_t out, uint8_t select, uint32_t wait_us) = 0;
+
+    virtual esp_err_t set_clock(uint32_t clock_hz) = 0;
+    virtual void configure(uint8_t turnaround, bool data_phase, uint8_t idle_cycles) = 0;
+    virtual bool reset_target() = 0; // False if there's no device specific reset sequence
+    virtual void delay_us(uint32_t us) = 0;
+};
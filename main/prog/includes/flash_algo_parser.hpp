@@ -66,6 +66,61 @@ namespace flash_algo
     };
 
     static const constexpr uint32_t SELF_TEST_MAGIC = 0x536f756c; // "Soul"
+
+    // Register scripts: PreInitScript runs before Init, PostUninitScript after UnInit
+    enum reg_op_type : uint8_t
+    {
+        REG_OP_WRITE = 0, // *addr = value
+        REG_OP_RMW = 1, // *addr = (*addr & ~mask) | (value & mask)
+        REG_OP_READ = 2, // Read and discard, for registers with read side effects
+        REG_OP_POLL = 3, // Until (*addr & mask) == value, or timeout_ms
+        REG_OP_DELAY = 4, // value microseconds
+    };
+
+    struct __attribute__((packed)) reg_script_header
+    {
+        uint32_t magic;
+        uint16_t version;
+        uint16_t op_cnt;
+    };
+
+    struct __attribute__((packed)) reg_op
+    {
+        reg_op_type type;
+        uint8_t _reserved;
+        uint16_t timeout_ms;
+        uint32_t addr;
+        uint32_t value;
+        uint32_t mask;
+    };
+
+    static const constexpr uint32_t REG_SCRIPT_MAGIC = 0x53637270; // "Scrp"
+    static const constexpr uint16_t REG_SCRIPT_VERSION = 1;
+    static const constexpr size_t reg_script_max_ops = 64;
+    static const constexpr uint32_t reg_script_max_poll_ms = 1000;
+    static const constexpr uint32_t reg_script_max_delay_us = 100000;
+    static const constexpr char PRE_INIT_SCRIPT_SECTION[] = "PreInitScript";
+    static const constexpr char POST_UNINIT_SCRIPT_SECTION[] = "PostUninitScript";
+
+    // DualBank: bank layout for algos that also export EraseSectorAsync(adr) and EraseStatus(adr)
+    struct __attribute__((packed)) bank_description
+    {
+        uint32_t offset; // From the device start, sector aligned
+        uint32_t size;
+        uint32_t status_reg; // Busy flag register polled directly, 0 to call EraseStatus instead
+        uint32_t busy_mask;
+    };
+
+    static const constexpr size_t bank_cnt = 2;
+
+    struct __attribute__((packed)) dual_bank_description
+    {
+        uint32_t magic;
+        bank_description banks[bank_cnt]; // In address order, non-overlapping
+    };
+
+    static const constexpr uint32_t DUAL_BANK_MAGIC = 0x324b4e42; // "BNK2"
+    static const constexpr char DUAL_BANK_SECTION[] = "DualBank";
 }
 
 class flash_algo_parser
@@ -76,14 +131,28 @@ public:
     esp_err_t get_test_description(flash_algo::test_description *descr, std::vector<flash_algo::test_item> &test_items);
     esp_err_t get_dev_description(flash_algo::dev_description *descr, std::vector<flash_algo::flash_sector> &sectors);
     esp_err_t get_flash_algo(uint8_t *buf_out, size_t buf_len, size_t *actual_len) const;
-    esp_err_t get_func_pc(const char *func_name, uint32_t *pc_out);
+    esp_err_t get_func_pc(const char *func_name, uint32_t *pc_out, bool optional = false);
     esp_err_t get_section_data(void *data_out, const char *section_name,  size_t min_size, size_t *actual_size, uint32_t offset = 0) const;
     esp_err_t get_section_length(const char *section_name, size_t *len_out, ELFIO::Elf_Word type = ELFIO::SHT_PROGBITS) const;
     esp_err_t get_section_addr(const char *section_name, uint32_t *addr_out, ELFIO::Elf_Word type = ELFIO::SHT_PROGBITS) const;
     esp_err_t get_data_section_offset(uint32_t *offset);
+    esp_err_t get_algo_sizes(size_t *code_len, size_t *data_len, size_t *bss_len) const;
+
+    /**
+     * Read and validate a register script section
+     * @return ESP_OK, ESP_ERR_NOT_FOUND if the algo has no such section, ESP_ERR_INVALID_ARG if it's malformed
+     */
+    esp_err_t get_reg_script(const char *section_name, std::vector<flash_algo::reg_op> &ops) const;
+
+    /**
+     * Read and validate the DualBank section against the device size
+     * @return ESP_OK, ESP_ERR_NOT_FOUND if the algo has none, ESP_ERR_INVALID_ARG if it's malformed
+     */
+    esp_err_t get_dual_bank_description(flash_algo::dual_bank_description *descr, uint32_t dev_size) const;
 
 private:
     esp_err_t run_elf_check();
+    const ELFIO::section *find_optional_section(const char *section_name) const;
 
 private:
     ELFIO::elfio elf_parser;
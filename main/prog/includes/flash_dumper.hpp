@@ -0,0 +1,95 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstdio>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/queue.h>
+#include <esp_err.h>
+#include "swd_prog.hpp"
+#include "fw_asset_manager.hpp"
+
+namespace dump_def
+{
+    static const constexpr uint32_t magic = 0x50444953; // "SIDP"
+    static const constexpr uint16_t version = 1;
+    static const constexpr size_t max_region_cnt = 2; // Flash + (optional) RAM
+    static const constexpr size_t chunk_size = 16384;
+    static const constexpr size_t chunk_cnt = 2; // Double buffered: one being read over SWD while the other is written out
+    static const constexpr char path_prefix[] = "/data/"; // Paths come from the host, they stay on the data partition
+    static const constexpr uint32_t owner_wait_ms = 5000; // For the flasher to finish its unit, see swd_prog::lock()
+
+    struct __attribute__((packed)) region_info
+    {
+        uint32_t addr;
+        uint32_t len;
+        uint32_t crc; // CRC32 LE, same as esp_crc32_le(0, ...)
+    };
+
+    /**
+     * Dump file layout: header, then every region's raw bytes back to back in the same order
+     */
+    struct __attribute__((packed)) header
+    {
+        uint32_t magic;
+        uint16_t version;
+        uint16_t header_len;
+        uint32_t region_cnt;
+        char dev_name[128];
+        region_info regions[max_region_cnt];
+    };
+
+    struct chunk
+    {
+        uint8_t *buf;
+        size_t len; // 0 with a null buf means end of dump
+    };
+}
+
+class flash_dumper
+{
+public:
+    static flash_dumper *instance()
+    {
+        static flash_dumper _instance;
+        return &_instance;
+    }
+
+    flash_dumper(flash_dumper const &) = delete;
+    void operator=(flash_dumper const &) = delete;
+
+public:
+    /**
+     * Read back target memory into a dump file
+     * @param path Output file path under /data/, will be overwritten
+     * @param start_addr Start address, or UINT32_MAX for the flash start from the algorithm
+     * @param len Length in bytes, or 0 for the whole flash from the algorithm
+     * @param with_ram Also dump the RAM window from SelfTestInfo (if the algorithm has one)
+     * @note Target is left halted afterwards
+     * @return ESP_OK on success, ESP_ERR_TIMEOUT if another task kept SWD busy
+     */
+    esp_err_t dump(const char *path, uint32_t start_addr = UINT32_MAX, size_t len = 0, bool with_ram = false);
+
+private:
+    flash_dumper() = default;
+    esp_err_t dump_region(dump_def::region_info *region);
+    esp_err_t start_writer();
+    esp_err_t stop_writer();
+    static void writer_task(void *_ctx);
+
+private:
+    swd_prog *swd = swd_prog::instance();
+    fw_asset_manager *asset = fw_asset_manager::instance();
+    FILE *file = nullptr;
+    QueueHandle_t free_queue = nullptr;
+    QueueHandle_t filled_queue = nullptr;
+    TaskHandle_t reader_task = nullptr;
+    uint8_t *chunk_bufs[dump_def::chunk_cnt] = {};
+    volatile bool busy = false;
+    bool writer_running = false;
+    volatile esp_err_t write_ret = ESP_OK;
+    int64_t stall_us = 0; // Time spent by the reader waiting for a free buffer, i.e. filesystem being the bottleneck
+
+    static const constexpr char TAG[] = "flash_dump";
+};
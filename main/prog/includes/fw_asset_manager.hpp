@@ -10,6 +10,7 @@
 #define CFG_MGR_PKT_MAGIC 0x4a485349
 #define CFG_MGR_FLASH_ALGO_MAX_SIZE  32768
 #define CFG_MGR_FW_MAX_SIZE 1048576
+#define CFG_MGR_TEST_IMAGE_MAX_SIZE 262144
 
 class fw_asset_manager
 {
@@ -32,7 +33,10 @@ public:
     esp_err_t get_pc_erase_sector(uint32_t *out);
     esp_err_t get_pc_erase_all(uint32_t *out);
     esp_err_t get_pc_verify(uint32_t *out);
+    esp_err_t get_pc_erase_sector_async(uint32_t *out);
+    esp_err_t get_pc_erase_status(uint32_t *out);
     esp_err_t get_data_section_offset(uint32_t *out);
+    esp_err_t get_algo_sizes(uint32_t *code_out, uint32_t *data_out, uint32_t *bss_out) const;
     esp_err_t get_flash_start_addr(uint32_t *out) const;
     esp_err_t get_flash_end_addr(uint32_t *out) const;
     esp_err_t get_page_size(uint32_t *out) const;
@@ -40,8 +44,26 @@ public:
     esp_err_t get_program_page_timeout(uint32_t *out) const;
     esp_err_t get_erase_sector_timeout(uint32_t *out) const;
     esp_err_t get_sector_size(uint32_t *out) const;
+    esp_err_t get_min_sector_size(uint32_t *out) const;
+    esp_err_t get_ram_start_addr(uint32_t *out) const;
+
+    /**
+     * Find the sector holding a flash offset in the DeviceData sector map
+     * @param offset From the device start
+     * @param start_out Sector start, also as an offset
+     */
+    esp_err_t get_sector_at(uint32_t offset, uint32_t *start_out, uint32_t *size_out) const;
+
+    /**
+     * @return ESP_ERR_NOT_FOUND unless the algo has a DualBank section and both async erase functions
+     */
+    esp_err_t get_dual_bank(flash_algo::dual_bank_description *out) const;
+    const char *get_dev_name() const;
 
     std::vector<flash_algo::test_item> &get_test_items();
+    const std::vector<flash_algo::flash_sector> &get_sectors() const;
+    const std::vector<flash_algo::reg_op> &get_pre_init_script() const;
+    const std::vector<flash_algo::reg_op> &get_post_uninit_script() const;
 
 public:
 
@@ -69,10 +91,19 @@ public:
      */
     static esp_err_t get_sha256_from_file(const char *path, uint8_t *out);
 
+    /**
+     * Where the active asset lives: its blob in the asset store, or the fixed path below if the store has none
+     */
+    static const char *get_algo_path();
+    static const char *get_fw_path();
+    static const char *get_test_image_path();
+
 
     static const constexpr char BASE_PATH[] = "/data";
     static const constexpr char ALGO_ELF_PATH[] = "/data/algo.elf";
     static const constexpr char FIRMWARE_PATH[] = "/data/fw.bin";
+    static const constexpr char SEGMAP_PATH[] = "/data/fw.smp"; // FIRMWARE_PATH ingested, when that's HEX/ELF/UF2
+    static const constexpr char TEST_IMAGE_PATH[] = "/data/test.bin"; // Optional, run from RAM before programming
 
 private:
     static const constexpr char FUNC_NAME_INIT[] = "Init";
@@ -81,6 +112,8 @@ private:
     static const constexpr char FUNC_NAME_ERASE_SECTOR[] = "EraseSector";
     static const constexpr char FUNC_NAME_PROGRAM_PAGE[] = "ProgramPage";
     static const constexpr char FUNC_NAME_VERIFY[] = "Verify";
+    static const constexpr char FUNC_NAME_ERASE_SECTOR_ASYNC[] = "EraseSectorAsync"; // Start the erase, don't wait
+    static const constexpr char FUNC_NAME_ERASE_STATUS[] = "EraseStatus"; // 0 done, 1 busy, else failed
 
 private:
     flash_algo::dev_description dev_descr = {};
@@ -88,6 +121,10 @@ private:
     flash_algo_parser algo_parser {};
     std::vector<flash_algo::flash_sector> dev_sectors = {};
     std::vector<flash_algo::test_item> test_items = {};
+    std::vector<flash_algo::reg_op> pre_init_script = {};
+    std::vector<flash_algo::reg_op> post_uninit_script = {};
+    flash_algo::dual_bank_description dual_bank = {};
+    bool has_dual_bank = false;
     std::unique_ptr<nvs::NVSHandle> nvs_handle = {};
 
     static const constexpr char *TAG = "asset_mgr";
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <ctime>
+#include <esp_err.h>
+
+namespace img_cache_def
+{
+    static const constexpr size_t max_path_len = 64;
+    static const constexpr size_t sha_len = 32;
+
+    struct page_meta
+    {
+        uint32_t crc; // esp_crc32_le() of the page as in the file, before any overlay
+        bool blank; // Every byte is the algo's erased value
+    };
+}
+
+/**
+ * Firmware image held in PSRAM between units, with per-page metadata worked out once on load.
+ *
+ * load() is cheap on a hit: one stat() of the file. If size or mtime moved, or invalidate() was called,
+ * the file is re-hashed and only reloaded if its SHA256 differs from the cached image's.
+ */
+class fw_image_cache
+{
+public:
+    static fw_image_cache *instance()
+    {
+        static fw_image_cache _instance;
+        return &_instance;
+    }
+
+    fw_image_cache(fw_image_cache const &) = delete;
+    void operator=(fw_image_cache const &) = delete;
+
+public:
+    /**
+     * Make sure the cache holds the current contents of path
+     * @param page_size Granularity of the page metadata
+     * @param erased_val Byte value a blank page consists of
+     * @return ESP_ERR_NO_MEM if the image doesn't fit in PSRAM, caller should fall back to the file
+     */
+    esp_err_t load(const char *path, uint32_t page_size, uint32_t erased_val);
+
+    /**
+     * Force a hash check on the next load(), for writers that may not bump mtime (e.g. a download of the same length)
+     */
+    void invalidate();
+
+    [[nodiscard]] const uint8_t *data() const;
+    [[nodiscard]] size_t size() const;
+    [[nodiscard]] const uint8_t *get_sha256() const;
+    [[nodiscard]] const img_cache_def::page_meta *get_page(size_t idx) const;
+
+    /**
+     * @param offset From the image start, page aligned
+     * @return true if every page touching [offset, offset + len) is blank
+     */
+    [[nodiscard]] bool is_blank(uint32_t offset, uint32_t len) const;
+
+private:
+    fw_image_cache() = default;
+    esp_err_t reload(const char *path, size_t len, uint32_t page_size, uint32_t erased_val);
+    void release();
+
+private:
+    uint8_t *image = nullptr;
+    size_t image_len = 0;
+    img_cache_def::page_meta *pages = nullptr;
+    size_t page_cnt = 0;
+    uint32_t cached_page_size = 0;
+    uint32_t cached_erased_val = 0;
+    time_t cached_mtime = 0;
+    volatile bool stale = false;
+    char cached_path[img_cache_def::max_path_len] = {};
+    uint8_t image_sha[img_cache_def::sha_len] = {};
+
+    static const constexpr char TAG[] = "img_cache";
+};
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <memory>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <esp_err.h>
+#include <nvs_handle.hpp>
+
+namespace overlay_def
+{
+    enum gen_type : uint8_t
+    {
+        GEN_FIXED = 0, // Bytes supplied over CDC/MQTT, used as-is until replaced
+        GEN_COUNTER = 1, // Little-endian integer: base + unit_seq * step
+        GEN_TEMPLATE = 2, // ASCII string rendered from a template with unit_seq, e.g. "SN%08lu"
+    };
+
+    static const constexpr size_t max_patch_len = 64;
+    static const constexpr size_t max_patch_cnt = 16;
+
+    struct patch_item
+    {
+        uint32_t addr;
+        gen_type type;
+        uint8_t len;
+        uint32_t base;
+        uint32_t step;
+        char fmt[max_patch_len];
+        uint8_t value[max_patch_len]; // Value generated for the current unit
+    };
+}
+
+/**
+ * Per-unit data overlay - a list of (address, bytes) patches applied to the page buffer right before
+ * it gets uploaded to the target. The shared firmware image on /data is never modified nor copied.
+ * Patches are edited from the CDC/MQTT tasks; prepare_unit() snapshots them, and everything the flasher
+ * and the page pipeline read afterwards comes from that snapshot, so edits apply from the next unit on.
+ */
+class fw_overlay
+{
+public:
+    static fw_overlay *instance()
+    {
+        static fw_overlay _instance;
+        return &_instance;
+    }
+
+    fw_overlay(fw_overlay const &) = delete;
+    void operator=(fw_overlay const &) = delete;
+
+public:
+    esp_err_t init();
+    esp_err_t add_fixed(uint32_t addr, const uint8_t *buf, size_t len);
+    esp_err_t add_counter(uint32_t addr, uint8_t width, uint32_t base = 0, uint32_t step = 1);
+    esp_err_t add_template(uint32_t addr, const char *fmt, uint8_t len);
+    void clear();
+
+    /**
+     * Group edits so that no prepare_unit() snapshots half of them, e.g. a clear and the new patches; nestable
+     */
+    void begin_edit();
+    void end_edit();
+
+    /**
+     * Patches as edited so far, not necessarily what the current unit uses
+     */
+    [[nodiscard]] size_t size() const;
+
+    /**
+     * Snapshot the patches and generate their values for the next unit, must be called before programming
+     * @return ESP_OK if all patches are generated
+     */
+    esp_err_t prepare_unit();
+
+    /**
+     * Mark current unit as programmed, so that the unit sequence number moves on
+     * @return ESP_OK on success, or NVS errors
+     */
+    esp_err_t commit_unit();
+
+    /**
+     * Patch a page buffer that is about to be written to target address
+     * @param addr Target address of buf[0]
+     * @param buf Page buffer
+     * @param len Page buffer length
+     * @return Number of bytes patched
+     */
+    size_t apply(uint32_t addr, uint8_t *buf, size_t len) const;
+    [[nodiscard]] bool overlaps(uint32_t addr, size_t len) const;
+    [[nodiscard]] bool empty() const;
+    [[nodiscard]] uint32_t get_unit_seq() const;
+
+    /**
+     * Patches of the current unit, as of the last prepare_unit()
+     */
+    [[nodiscard]] const std::vector<overlay_def::patch_item> &get_patches() const;
+
+private:
+    fw_overlay() = default;
+    static bool is_template_valid(const char *fmt);
+    esp_err_t add_patch(const overlay_def::patch_item &item);
+
+private:
+    std::vector<overlay_def::patch_item> patches = {}; // Edited list, under edit_lock
+    std::vector<overlay_def::patch_item> unit_patches = {}; // Snapshot for the current unit, flasher task only
+    SemaphoreHandle_t edit_lock = xSemaphoreCreateRecursiveMutex();
+    std::unique_ptr<nvs::NVSHandle> nvs_handle = {};
+    uint32_t unit_seq = 0;
+    bool prepared = false;
+
+    static const constexpr char TAG[] = "fw_overlay";
+    static const constexpr char NVS_NS[] = "fw_overlay";
+    static const constexpr char NVS_KEY_UNIT_SEQ[] = "unit_seq";
+};
@@ -0,0 +1,181 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <esp_err.h>
+
+namespace fw_segmap_def
+{
+    static const constexpr uint32_t MAGIC = 0x50414d53; // "SMAP"
+    static const constexpr uint8_t VERSION = 1;
+    static const constexpr size_t sha_len = 32;
+    static const constexpr size_t max_segments = 256;
+    static const constexpr size_t max_chunks = 4096; // Before merging; HEX records in address order coalesce as they come
+    static const constexpr size_t max_hex_line = 600; // 255 data bytes is 521 characters, plus line ending
+    static const constexpr size_t copy_buf_len = 4096;
+
+    enum source_format : uint8_t
+    {
+        SRC_BIN = 0, // Raw binary, not ingested
+        SRC_HEX = 1,
+        SRC_ELF = 2,
+        SRC_UF2 = 3,
+    };
+
+    /*
+     * File layout: header, seg_cnt x segment sorted by address, then the packed segment data.
+     * Segments start and end on an `align` boundary; only the slack inside those boundaries is filled.
+     */
+    struct __attribute__((packed)) header
+    {
+        uint32_t magic;
+        uint8_t version;
+        source_format source;
+        uint8_t fill; // Erased value used for the slack
+        uint8_t _reserved;
+        uint32_t seg_cnt;
+        uint32_t data_len; // Sum of segment lengths
+        uint32_t align;
+        uint8_t src_sha256[sha_len]; // Of the file this was ingested from, to tell whether it's current
+        uint32_t crc; // Over everything above, then the segment table
+    };
+
+    struct __attribute__((packed)) segment
+    {
+        uint32_t addr; // Absolute target address
+        uint32_t len;
+        uint32_t offset; // Of the data, from the start of the file
+        uint32_t crc; // esp_crc32_le() of the data
+    };
+
+    struct ingest_opts
+    {
+        uint32_t align; // Program page size
+        uint8_t fill; // Erased byte value
+        uint32_t flash_start; // Absolute; anything outside [flash_start, flash_end) is dropped
+        uint32_t flash_end;
+    };
+
+    // Populated range as the parsers find it, data in the scratch file
+    struct chunk
+    {
+        uint32_t addr;
+        uint32_t len;
+        uint32_t tmp_offset;
+    };
+
+    // ELF32 little-endian, only what's needed to find the loadable segments
+    static const constexpr uint32_t ELF_MAGIC = 0x464c457f; // "\x7fELF"
+    static const constexpr uint8_t ELF_CLASS_32 = 1;
+    static const constexpr uint8_t ELF_DATA_LE = 1;
+    static const constexpr uint32_t PT_LOAD = 1;
+
+    struct __attribute__((packed)) elf32_ehdr
+    {
+        uint8_t e_ident[16];
+        uint16_t e_type;
+        uint16_t e_machine;
+        uint32_t e_version;
+        uint32_t e_entry;
+        uint32_t e_phoff;
+        uint32_t e_shoff;
+        uint32_t e_flags;
+        uint16_t e_ehsize;
+        uint16_t e_phentsize;
+        uint16_t e_phnum;
+        uint16_t e_shentsize;
+        uint16_t e_shnum;
+        uint16_t e_shstrndx;
+    };
+
+    struct __attribute__((packed)) elf32_phdr
+    {
+        uint32_t p_type;
+        uint32_t p_offset;
+        uint32_t p_vaddr;
+        uint32_t p_paddr; // Load address, i.e. where .data's initialisers sit in flash
+        uint32_t p_filesz;
+        uint32_t p_memsz;
+        uint32_t p_flags;
+        uint32_t p_align;
+    };
+
+    // UF2, 512-byte blocks each carrying up to 476 bytes for one address
+    static const constexpr uint32_t UF2_MAGIC_START0 = 0x0a324655; // "UF2\n"
+    static const constexpr uint32_t UF2_MAGIC_START1 = 0x9e5d5157;
+    static const constexpr uint32_t UF2_MAGIC_END = 0x0ab16f30;
+    static const constexpr uint32_t UF2_FLAG_NOT_MAIN_FLASH = 0x00000001;
+    static const constexpr size_t uf2_payload_max = 476;
+
+    struct __attribute__((packed)) uf2_block
+    {
+        uint32_t magic_start0;
+        uint32_t magic_start1;
+        uint32_t flags;
+        uint32_t target_addr;
+        uint32_t payload_size;
+        uint32_t block_no;
+        uint32_t num_blocks;
+        uint32_t family_id; // Or file size, depending on flags
+        uint8_t data[uf2_payload_max];
+        uint32_t magic_end;
+    };
+}
+
+/**
+ * Sparse firmware: Intel HEX, ELF and UF2 from the build are parsed once into a segment map plus packed data,
+ * so gaps between populated ranges are never padded, sent or programmed.
+ */
+class fw_segmap
+{
+public:
+    static bool is_segmap(const uint8_t *src, size_t len);
+
+    /**
+     * Sniff the source format from its first bytes
+     */
+    static fw_segmap_def::source_format detect(const uint8_t *head, size_t len);
+
+    /**
+     * Parse a HEX/ELF/UF2 file into a segment map; does nothing if dst_path already holds one made from the same
+     * source with the same options
+     * @return ESP_OK if dst_path is current, ESP_ERR_NOT_SUPPORTED for a raw binary (program it as is)
+     */
+    static esp_err_t ingest(const char *src_path, const char *dst_path, const fw_segmap_def::ingest_opts &opts);
+
+    /**
+     * Segment table from a map in memory (PSRAM cache or a mapped slot)
+     */
+    esp_err_t open(const uint8_t *src, size_t len);
+
+    /**
+     * Segment table from an open file; leaves the file position anywhere
+     */
+    esp_err_t open(FILE *file);
+
+    [[nodiscard]] size_t size() const;
+    [[nodiscard]] const fw_segmap_def::segment &get(size_t idx) const;
+    [[nodiscard]] uint32_t data_len() const;
+
+private:
+    esp_err_t check_header(size_t file_len) const;
+    esp_err_t check_table(size_t file_len) const;
+    static bool is_current(const char *dst_path, const uint8_t *src_sha, const fw_segmap_def::ingest_opts &opts);
+    static esp_err_t parse_hex(FILE *src, FILE *tmp, std::vector<fw_segmap_def::chunk> &chunks, const fw_segmap_def::ingest_opts &opts);
+    static esp_err_t parse_elf(FILE *src, FILE *tmp, std::vector<fw_segmap_def::chunk> &chunks, const fw_segmap_def::ingest_opts &opts);
+    static esp_err_t parse_uf2(FILE *src, FILE *tmp, std::vector<fw_segmap_def::chunk> &chunks, const fw_segmap_def::ingest_opts &opts);
+    static esp_err_t add_chunk(FILE *tmp, std::vector<fw_segmap_def::chunk> &chunks, uint32_t addr, const uint8_t *data, size_t len,
+                               const fw_segmap_def::ingest_opts &opts);
+    static esp_err_t write_map(FILE *tmp, std::vector<fw_segmap_def::chunk> &chunks, const char *dst_path, fw_segmap_def::source_format source,
+                               const uint8_t *src_sha, const fw_segmap_def::ingest_opts &opts);
+
+private:
+    fw_segmap_def::header header = {};
+    std::vector<fw_segmap_def::segment> segments {};
+
+    static const constexpr char TAG[] = "fw_segmap";
+    static const constexpr char SCRATCH_PATH[] = "/data/fwsmp.tmp"; // 8.3, rev1-3 builds have no long file names
+    static const constexpr char OUT_TMP_PATH[] = "/data/fwsmp.new";
+};
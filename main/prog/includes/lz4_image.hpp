@@ -0,0 +1,92 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <esp_err.h>
+#include <esp_bit_defs.h>
+
+namespace lz4_image_def
+{
+    static const constexpr uint32_t MAGIC = 0x49345a4c; // "LZ4I"
+    static const constexpr uint8_t VERSION = 1;
+    static const constexpr uint32_t max_block_size = 0x10000; // LZ4's match window, blocks never reference each other
+    static const constexpr uint32_t BLOCK_STORED = BIT(31); // In block_entry::len: kept raw, it didn't shrink
+
+    /*
+     * File layout: header, block_cnt x block_entry, then the blocks. Every block is a standalone LZ4 block
+     * (no frame) of block_size raw bytes, the last one may be shorter. tools/lz4i_pack.py writes it.
+     */
+    struct __attribute__((packed)) header
+    {
+        uint32_t magic;
+        uint8_t version;
+        uint8_t _reserved[3];
+        uint32_t block_size;
+        uint32_t raw_len;
+        uint32_t block_cnt;
+        uint32_t crc; // Over everything above
+    };
+
+    struct __attribute__((packed)) block_entry
+    {
+        uint32_t offset; // From the start of the file
+        uint32_t len; // Compressed length, BLOCK_STORED OR-ed in for raw blocks
+        uint32_t raw_crc; // esp_crc32_le() of the decompressed block
+    };
+
+    struct stats
+    {
+        uint32_t blocks;
+        uint64_t raw_bytes;
+        uint64_t decode_us; // Decompression and block CRC check
+    };
+}
+
+/**
+ * Random-access reader for LZ4-compressed firmware images held in memory (PSRAM cache or a mapped slot).
+ *
+ * The block index gives any raw offset in one lookup; whole aligned blocks decompress straight into the
+ * caller's buffer, partial reads go through one cached scratch block.
+ */
+class lz4_image
+{
+public:
+    lz4_image() = default;
+    ~lz4_image();
+    lz4_image(lz4_image const &) = delete;
+    void operator=(lz4_image const &) = delete;
+
+public:
+    static bool is_lz4(const uint8_t *src, size_t len);
+
+    /**
+     * Validates the header only, for a raw length before the whole image is at hand
+     */
+    static esp_err_t get_raw_len(const uint8_t *src, size_t len, size_t *raw_len_out);
+
+    /**
+     * @param src Whole compressed image, must stay valid while this reader is used
+     */
+    esp_err_t open(const uint8_t *src, size_t len);
+    esp_err_t read(uint32_t offset, uint8_t *out, size_t len);
+    esp_err_t read_block(uint32_t idx, uint8_t *out, size_t out_len);
+
+    [[nodiscard]] size_t raw_size() const;
+    [[nodiscard]] uint32_t get_block_size() const;
+    [[nodiscard]] uint32_t get_block_cnt() const;
+    [[nodiscard]] esp_err_t get_block(uint32_t idx, lz4_image_def::block_entry *out) const;
+    [[nodiscard]] const lz4_image_def::stats &get_stats() const;
+
+private:
+    static int32_t decode(const uint8_t *src, size_t src_len, uint8_t *dst, size_t dst_cap);
+
+private:
+    const uint8_t *image = nullptr;
+    size_t image_len = 0;
+    lz4_image_def::header header = {};
+    uint8_t *scratch = nullptr;
+    uint32_t scratch_idx = UINT32_MAX;
+    lz4_image_def::stats stats = {};
+
+    static const constexpr char TAG[] = "lz4_image";
+};
@@ -8,6 +8,9 @@
 #include <esp_err.h>
 #include "swd_prog.hpp"
 #include "display_manager.hpp"
+#include "unit_db.hpp"
+
+class mqtt_client;
 
 namespace flasher
 {
@@ -20,6 +23,7 @@ namespace flasher
         VERIFY = 4,
         SELF_TEST = 5,
         DONE = 6,
+        RAM_TEST = 7,
     };
 }
 
@@ -38,8 +42,24 @@ public:
 private:
     offline_flasher() = default;
     uint32_t written_len = 0;
+    size_t drop_idx = 0; // Current multi-drop target, all of them get programmed in one session
     fw_asset_manager *asset = fw_asset_manager::instance();
     swd_prog *swd = swd_prog::instance();
+    fw_overlay *overlay = fw_overlay::instance();
+    unit_db *units = unit_db::instance();
+    uint32_t uid_addr = 0;
+    uint32_t uid_len = 0; // 0 if the product has no UID configured, then every unit gets programmed
+    bool unit_known = false; // UID read on detect
+    unit_db_def::record unit = {}; // Current unit, stored after verify and self-test
+    uint8_t fw_sha[unit_db_def::sha_len] = {};
+    uint8_t algo_sha[unit_db_def::sha_len] = {};
+    bool sha_valid = false; // Both hashes match the assets in use, otherwise no unit counts as up to date
+    volatile bool assets_changed = false; // Set from the bootstrap task, picked up before the next unit
+    const char *fw_path = fw_asset_manager::FIRMWARE_PATH; // SEGMAP_PATH once a HEX/ELF/UF2 has been ingested
+    mqtt_client *reporter = nullptr; // Set once online, per-unit results go to the host through it
+    const uint8_t *slot_img = nullptr; // Pinned from erase to the end of programming, so both see the same image
+    size_t slot_len = 0;
+    bool slot_held = false;
 
     display_manager *disp = display_manager::instance();
     ui_commander *ui_cmder = ui_commander::instance();
@@ -50,6 +70,16 @@ private:
 public:
     esp_err_t init();
 
+    /**
+     * Report each unit's results through this client from now on; nullptr stops reporting
+     */
+    void set_reporter(mqtt_client *_reporter);
+
+    /**
+     * Firmware or algo changed on storage; the image is re-prepared and its hashes redone before the next unit
+     */
+    void on_assets_changed();
+
 private:
     void on_detect();
     void on_error();
@@ -57,6 +87,22 @@ private:
     void on_program();
     void on_verify();
     void on_self_test();
+    void on_ram_test();
     void on_done();
+    void prepare_image();
+
+    /**
+     * asset_slot::acquire() once per unit
+     * @return false if there's no slot image, fw_path is used then
+     */
+    bool hold_slot_image();
+    void drop_slot_image();
+    esp_err_t refresh_hashes();
+    bool next_drop_target();
+    void read_unit_id();
+    bool unit_up_to_date();
+    void store_unit(unit_db_def::run_result result);
+    void report_program();
+    void report_self_test(uint16_t test_id, uint32_t func_ret, uint8_t *ret_buf = nullptr, size_t ret_len = 0);
 };
 
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstdio>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include <esp_err.h>
+#include "fw_overlay.hpp"
+#include "fw_image_cache.hpp"
+#include "lz4_image.hpp"
+
+namespace pipeline_def
+{
+    static const constexpr size_t buf_cnt = 4; // Pages prepared ahead of the SWD side, at most
+    static const constexpr uint32_t producer_stack = 4096;
+
+    // Where the pages come from; exactly one of image, lz4 or file
+    struct source
+    {
+        const uint8_t *image;
+        lz4_image *lz4;
+        FILE *file;
+        size_t len;
+        uint32_t addr; // Absolute address of the first page
+        uint32_t chunk_size; // Bytes per ProgramPage call
+        uint32_t erased_val;
+    };
+
+    struct page_desc
+    {
+        uint32_t page_idx;
+        uint32_t addr;
+        const uint8_t *data; // Into the image when nothing had to be copied, otherwise the pipeline buffer
+        uint32_t len;
+        uint32_t crc; // Running esp_crc32_le() from the image start up to and including this page
+        uint8_t buf_idx; // Pipeline buffer held until release(), even when data points elsewhere
+        bool blank; // All erased value and no overlay on it, nothing to program
+        esp_err_t ret; // Producer failure, the page is unusable
+    };
+
+    struct stats
+    {
+        uint32_t pages;
+        uint32_t max_depth; // Most prepared pages waiting at once
+        uint64_t prep_us; // Producer busy: read, decompress, overlay, CRC, blank check
+        uint64_t producer_stall_us; // Producer waiting for a free buffer, i.e. SWD is the bottleneck
+        uint64_t consumer_stall_us; // SWD side waiting for a prepared page, i.e. data preparation is
+        bool threaded; // False if the producer task couldn't start and pages were prepared inline
+    };
+}
+
+/**
+ * Page preparation for program_file() on the other core: the producer reads/decompresses, applies the overlay,
+ * CRCs and blank-checks pages ahead of time, the SWD side only uploads and programs.
+ *
+ * Same shape as flash_dumper's writer: a free and a filled queue circulate buf_cnt buffer slots, so the
+ * producer can never run more than buf_cnt pages ahead.
+ */
+class page_pipeline
+{
+public:
+    page_pipeline() = default;
+    ~page_pipeline();
+    page_pipeline(page_pipeline const &) = delete;
+    void operator=(page_pipeline const &) = delete;
+
+public:
+    /**
+     * Allocate buffers and start the producer; falls back to preparing pages inline in next() if the task can't start
+     */
+    esp_err_t start(const pipeline_def::source &src);
+
+    /**
+     * Next page in order; blocks until the producer has it ready
+     */
+    esp_err_t next(pipeline_def::page_desc *out);
+
+    /**
+     * Hand the page's buffer back once its data is in target RAM
+     */
+    void release(const pipeline_def::page_desc &desc);
+
+    /**
+     * Stop the producer (also mid-image, after an error) and free everything
+     */
+    void stop();
+
+    [[nodiscard]] size_t depth() const;
+    [[nodiscard]] const pipeline_def::stats &get_stats() const;
+    void log_stats() const;
+
+private:
+    void prep(uint32_t page_idx, uint8_t buf_idx, pipeline_def::page_desc *out);
+    static void producer_task(void *_ctx);
+
+private:
+    pipeline_def::source src = {};
+    pipeline_def::stats stats = {};
+    uint32_t page_cnt = 0;
+    uint32_t next_idx = 0; // Consumer side
+    uint32_t running_crc = 0; // Producer side
+    uint8_t *bufs[pipeline_def::buf_cnt] = {};
+    QueueHandle_t free_queue = nullptr;
+    QueueHandle_t filled_queue = nullptr;
+    SemaphoreHandle_t producer_done = nullptr; // Given by the producer on exit, a task notification could come from anyone
+    volatile bool stopping = false;
+    bool producer_running = false;
+    fw_overlay *overlay = fw_overlay::instance();
+    fw_image_cache *img_cache = fw_image_cache::instance();
+
+    static const constexpr char TAG[] = "page_pipe";
+};
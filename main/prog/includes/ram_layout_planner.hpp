@@ -0,0 +1,105 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+#include <esp_err.h>
+
+namespace ram_layout
+{
+    static const constexpr size_t max_buf_cnt = 8;
+    static const constexpr uint32_t stack_align = 8; // AAPCS
+    static const constexpr uint32_t buf_align = 4; // ProgramPage sources are read as words
+
+    struct input
+    {
+        uint32_t ram_start;
+        uint32_t ram_size;
+        uint32_t header_size; // Breakpoint/CRC stub in front of the algorithm
+        uint32_t code_size; // PrgCode
+        uint32_t data_offset; // PrgData link address, relative to PrgCode
+        uint32_t data_size; // PrgData PROGBITS
+        uint32_t bss_size; // PrgData NOBITS
+        uint32_t stack_size;
+        uint32_t page_size; // Size of one programming buffer
+        uint32_t buf_cnt_limit; // 0 for as many as fit (up to max_buf_cnt)
+    };
+
+    struct layout
+    {
+        uint32_t code_start; // Header goes here, algorithm right after
+        uint32_t image_end;
+        uint32_t static_base; // R9
+        uint32_t stack_bottom; // Canary sits here
+        uint32_t stack_top; // Initial SP
+        uint32_t buf_size;
+        uint32_t buf_cnt;
+        uint32_t buf_addr[max_buf_cnt];
+        uint32_t free_bytes; // Left unused at the top of RAM
+    };
+}
+
+/**
+ * Target RAM layout: [header][code][data][bss] [stack] [buf 0]...[buf n] [unused]
+ * Stack sits right above the image so that an overflow runs into the canary rather than a page buffer.
+ * No ESP-IDF dependency other than esp_err_t, so it can be built on the host as-is.
+ */
+class ram_layout_planner
+{
+public:
+    static constexpr uint32_t align_up(uint32_t val, uint32_t align)
+    {
+        return (val + align - 1) & ~(align - 1);
+    }
+
+    // Same, without wrapping when a region ends right at the top of the 32-bit address space
+    static constexpr uint64_t align_up(uint64_t val, uint32_t align)
+    {
+        return (val + align - 1) & ~(uint64_t)(align - 1);
+    }
+
+    static esp_err_t plan(const ram_layout::input &in, ram_layout::layout *out)
+    {
+        if (out == nullptr || in.ram_size == 0 || in.page_size == 0) {
+            return ESP_ERR_INVALID_ARG;
+        }
+
+        *out = {};
+        uint64_t ram_end = (uint64_t)in.ram_start + in.ram_size;
+        uint64_t algo_start = (uint64_t)in.ram_start + in.header_size;
+
+        // Data may be linked with a gap after code, so take whichever reaches further
+        uint64_t image_len = std::max((uint64_t)in.code_size + in.data_size + in.bss_size,
+                                      (uint64_t)in.data_offset + in.data_size + in.bss_size);
+        uint64_t image_end = algo_start + image_len;
+
+        uint64_t stack_bottom = align_up(image_end, ram_layout::stack_align);
+        uint64_t stack_top = stack_bottom + align_up((uint64_t)in.stack_size, ram_layout::stack_align);
+        if (image_end > ram_end || stack_top > ram_end) {
+            return ESP_ERR_NO_MEM;
+        }
+
+        uint32_t buf_size = align_up(in.page_size, ram_layout::buf_align);
+        uint64_t buf_start = align_up(stack_top, ram_layout::buf_align);
+        uint64_t buf_cnt = buf_start >= ram_end ? 0 : (ram_end - buf_start) / buf_size;
+        uint64_t cnt_limit = in.buf_cnt_limit == 0 ? ram_layout::max_buf_cnt : std::min((size_t)in.buf_cnt_limit, ram_layout::max_buf_cnt);
+        buf_cnt = std::min(buf_cnt, cnt_limit);
+        if (buf_cnt < 1) {
+            return ESP_ERR_NO_MEM;
+        }
+
+        out->code_start = in.ram_start;
+        out->image_end = (uint32_t)image_end;
+        out->static_base = (uint32_t)(algo_start + in.data_offset);
+        out->stack_bottom = (uint32_t)stack_bottom;
+        out->stack_top = (uint32_t)stack_top;
+        out->buf_size = buf_size;
+        out->buf_cnt = (uint32_t)buf_cnt;
+        for (uint32_t idx = 0; idx < out->buf_cnt; idx += 1) {
+            out->buf_addr[idx] = (uint32_t)(buf_start + (uint64_t)idx * buf_size);
+        }
+
+        out->free_bytes = (uint32_t)(ram_end - (buf_start + buf_cnt * buf_size));
+        return ESP_OK;
+    }
+};
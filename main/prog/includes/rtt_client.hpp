@@ -0,0 +1,129 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <freertos/FreeRTOS.h>
+#include <freertos/ringbuf.h>
+#include <esp_err.h>
+#include <nvs_handle.hpp>
+
+namespace rtt_def
+{
+    static const constexpr char cb_id[] = "SEGGER RTT";
+    static const constexpr size_t max_up_buf_cnt = 4; // Only the first few up-buffers are drained, channel 0 is the terminal
+    static const constexpr size_t ring_size = 16384;
+    static const constexpr size_t capture_size = 4096; // Per-test copy attached to the self-test report
+    static const constexpr size_t xfer_size = 1024;
+    static const constexpr uint32_t min_poll_ms = 1;
+    static const constexpr uint32_t max_poll_ms = 100;
+    static const constexpr uint32_t default_poll_ms = 10;
+
+    enum cb_state : uint8_t
+    {
+        DETACHED = 0,
+        ARMED = 1, // Address known from cache, waiting for target code to init the control block
+        ATTACHED = 2,
+    };
+
+    struct __attribute__((packed)) cb_header
+    {
+        char id[16];
+        int32_t max_up_buf;
+        int32_t max_down_buf;
+    };
+
+    struct __attribute__((packed)) buf_desc
+    {
+        uint32_t name_ptr;
+        uint32_t buf_ptr;
+        uint32_t size;
+        uint32_t wr_off;
+        uint32_t rd_off;
+        uint32_t flags;
+    };
+
+    struct stats
+    {
+        uint32_t polls;
+        uint32_t empty_polls;
+        uint32_t bytes_read;
+        uint32_t bytes_dropped; // Ring was full, i.e. no one is draining the CDC stream
+    };
+}
+
+/**
+ * SEGGER RTT up-buffer reader, accesses the target with raw swd_host calls (not the memory cache),
+ * since the target keeps running while being polled.
+ */
+class rtt_client
+{
+public:
+    static rtt_client *instance()
+    {
+        static rtt_client _instance;
+        return &_instance;
+    }
+
+    rtt_client(rtt_client const &) = delete;
+    void operator=(rtt_client const &) = delete;
+
+public:
+    esp_err_t init();
+
+    /**
+     * Locate the control block, using the cached address for this firmware first
+     * @param scan_start Start of the RAM window to scan
+     * @param scan_len RAM window length
+     * @param fw_hash SHA256 of the code owning the control block
+     * @param allow_scan Scan the RAM window if the cached address is missing or stale; target must be halted
+     * @return ESP_OK if attached, ESP_ERR_NOT_FOUND if armed or nothing found
+     */
+    esp_err_t attach(uint32_t scan_start, uint32_t scan_len, const uint8_t *fw_hash, bool allow_scan);
+    void detach();
+
+    /**
+     * Drain all up-buffers into the ring now, then pick the next poll interval based on the data rate
+     */
+    esp_err_t poll();
+    esp_err_t poll_if_due();
+
+    size_t read(uint8_t *buf, size_t len, TickType_t wait_ticks);
+
+    /**
+     * Add bytes to the ring and the capture as if they came from an up-buffer, e.g. semihosting output
+     */
+    void append(const uint8_t *buf, size_t len);
+    void reset_capture();
+    const uint8_t *get_capture(size_t *len_out) const;
+
+    [[nodiscard]] rtt_def::cb_state get_state() const;
+    [[nodiscard]] uint32_t get_poll_interval_ms() const;
+    [[nodiscard]] const rtt_def::stats &get_stats() const;
+
+private:
+    rtt_client() = default;
+    bool probe(uint32_t addr, uint32_t *up_cnt_out);
+    esp_err_t scan(uint32_t start, uint32_t len, uint32_t *addr_out);
+    esp_err_t drain_buf(uint32_t desc_addr, const rtt_def::buf_desc &desc, size_t *drained_out);
+    void update_interval(size_t drained, uint32_t min_buf_size);
+    void get_nvs_key(const uint8_t *fw_hash, char *key_out, size_t key_len);
+
+private:
+    rtt_def::cb_state state = rtt_def::DETACHED;
+    uint32_t cb_addr = 0;
+    uint32_t up_buf_cnt = 0;
+    uint32_t poll_ms = rtt_def::default_poll_ms;
+    int64_t last_poll_ts = 0;
+    RingbufHandle_t ring = nullptr;
+    StaticRingbuffer_t ring_ctx = {};
+    uint8_t *ring_buf = nullptr;
+    uint8_t *capture_buf = nullptr;
+    size_t capture_len = 0;
+    uint8_t xfer_buf[rtt_def::xfer_size] = {};
+    rtt_def::stats rtt_stats = {};
+    std::unique_ptr<nvs::NVSHandle> nvs_handle = {};
+
+    static const constexpr char TAG[] = "rtt_client";
+    static const constexpr char NVS_NS[] = "rtt_cache";
+};
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <esp_err.h>
+
+namespace semihost_def
+{
+    static const constexpr uint16_t bkpt_insn = 0xBEAB; // BKPT 0xAB in Thumb
+    static const constexpr uint32_t adp_stopped_app_exit = 0x20026; // ADP_Stopped_ApplicationExit
+    static const constexpr size_t out_buf_size = 512;
+    static const constexpr size_t in_buf_size = 256;
+    static const constexpr size_t max_write0_len = 4096; // Stop reading a string that never ends
+    static const constexpr size_t xfer_size = 256;
+
+    enum op : uint32_t
+    {
+        SYS_WRITE0 = 0x04,
+        SYS_WRITE = 0x05,
+        SYS_READ = 0x06,
+        SYS_CLOCK = 0x10,
+        SYS_EXIT = 0x18,
+    };
+
+    enum result : uint8_t
+    {
+        RESUME = 0, // Write R0, step over the BKPT and let the target carry on
+        EXIT = 1, // Target asked to stop, the syscall is over
+        FAILED = 2,
+    };
+
+    struct __attribute__((packed)) rw_block
+    {
+        uint32_t handle;
+        uint32_t buf_ptr;
+        uint32_t len;
+    };
+}
+
+/**
+ * ARM semihosting service, called by swd_prog when the target halts on BKPT 0xAB.
+ * Target memory is accessed with raw swd_host calls, as the core is halted mid-syscall.
+ */
+class semihost
+{
+public:
+    semihost() = default;
+
+public:
+    void begin();
+    semihost_def::result handle(uint32_t op, uint32_t param, uint32_t *ret_out);
+
+    /**
+     * Print out (and forward to the RTT ring) whatever the target has written so far
+     */
+    void flush();
+
+    /**
+     * Bytes handed out to SYS_READ, consumed across calls until set again
+     */
+    esp_err_t set_input(const uint8_t *buf, size_t len);
+    [[nodiscard]] uint32_t get_exit_reason() const;
+
+private:
+    semihost_def::result do_write0(uint32_t str_ptr);
+    semihost_def::result do_write(uint32_t param, uint32_t *ret_out);
+    semihost_def::result do_read(uint32_t param, uint32_t *ret_out);
+    void append(const uint8_t *buf, size_t len);
+
+private:
+    uint8_t out_buf[semihost_def::out_buf_size] = {};
+    size_t out_len = 0;
+    uint8_t in_buf[semihost_def::in_buf_size] = {};
+    size_t in_len = 0;
+    size_t in_pos = 0;
+    uint8_t xfer_buf[semihost_def::xfer_size] = {};
+    int64_t start_ts = 0;
+    uint32_t exit_reason = 0;
+
+    static const constexpr char TAG[] = "semihost";
+};
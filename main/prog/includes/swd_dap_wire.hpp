@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstdint>
+#include <esp_err.h>
+#include "dap_wire_if.hpp"
+
+/**
+ * dap_wire_if on the daplink-esp SW_DP bit-banging layer, the same pins swd_host drives.
+ * The raw DP/AP state is left to the host tool, so swd_prog must re-init after a session.
+ */
+class swd_dap_wire : public dap_wire_if
+{
+public:
+    swd_dap_wire() = default;
+
+public:
+    esp_err_t connect() override;
+    esp_err_t disconnect() override;
+
+    uint8_t transfer(uint8_t req, uint32_t *data) override;
+    void swj_sequence(uint32_t bit_cnt, const uint8_t *data) override;
+    void swd_sequence(uint8_t info, const uint8_t *data_out, uint8_t *data_in) override;
+    uint8_t swj_pins(uint8_t out, uint8_t select, uint32_t wait_us) override;
+
+    esp_err_t set_clock(uint32_t clock_hz) override;
+    void configure(uint8_t turnaround, bool data_phase, uint8_t idle_cycles) override;
+    bool reset_target() override;
+    void delay_us(uint32_t us) override;
+
+private:
+    static uint8_t read_pins();
+
+private:
+    static const constexpr char TAG[] = "dap_wire";
+};
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstdint>
+#include <esp_err.h>
+#include "gdb_target.hpp"
+#include "swd_prog.hpp"
+#include "fw_asset_manager.hpp"
+
+namespace swd_gdb_def
+{
+    static const constexpr size_t max_fpb_cnt = 16;
+    static const constexpr uint32_t fpb_rev_v1 = 0; // Cortex-M3/M4: code region only, per-halfword REPLACE field
+    static const constexpr uint32_t reset_settle_ms = 50;
+    static const constexpr uint32_t owner_wait_ms = 5000; // A flasher unit normally finishes well within this
+}
+
+/**
+ * gdb_target on swd_prog: memory goes through its write-back cache, registers are read in one sweep
+ * per stop, breakpoints use the FPB comparators.
+ */
+class swd_gdb_target : public gdb_target
+{
+public:
+    swd_gdb_target() = default;
+
+public:
+    esp_err_t attach() override;
+    esp_err_t detach() override;
+    void release() override;
+    esp_err_t halt() override;
+    esp_err_t resume() override;
+    esp_err_t step() override;
+    esp_err_t reset(bool halt_after) override;
+    esp_err_t poll_stop(gdb_def::stop_reason *reason) override;
+
+    esp_err_t read_core_regs(uint32_t *regs_out, size_t cnt) override;
+    esp_err_t write_core_reg(uint32_t idx, uint32_t val) override;
+    esp_err_t read_memory(uint32_t addr, uint8_t *buf, size_t len) override;
+    esp_err_t write_memory(uint32_t addr, const uint8_t *buf, size_t len) override;
+
+    esp_err_t add_breakpoint(uint32_t addr) override;
+    esp_err_t remove_breakpoint(uint32_t addr) override;
+
+    esp_err_t get_memory_map(std::vector<gdb_def::mem_region> &regions) override;
+    esp_err_t erase_chip() override;
+    esp_err_t program_file(const char *path) override;
+
+private:
+    esp_err_t prepare_resume();
+    esp_err_t fpb_init();
+    esp_err_t fpb_write(uint32_t slot);
+    int32_t fpb_find(uint32_t key) const;
+
+private:
+    swd_prog *swd = swd_prog::instance();
+    fw_asset_manager *asset = fw_asset_manager::instance();
+    uint32_t regs[gdb_def::core_reg_cnt] = {};
+    bool owner = false; // Holding swd_prog::lock() for the current client
+    bool regs_valid = false;
+    bool stepping = false;
+    uint32_t fpb_rev = 0;
+    uint32_t fpb_cnt = 0;
+    uint32_t fpb_key[swd_gdb_def::max_fpb_cnt] = {}; // Word address on v1, breakpoint address otherwise; UINT32_MAX if free
+    uint8_t fpb_halves[swd_gdb_def::max_fpb_cnt] = {}; // v1 only: bit 0 lower halfword, bit 1 upper
+
+    static const constexpr char TAG[] = "swd_gdb";
+};
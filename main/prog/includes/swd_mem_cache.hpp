@@ -0,0 +1,85 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <esp_err.h>
+
+namespace mem_cache_def
+{
+    static const constexpr size_t line_size = 32; // Must be 32, as the valid/dirty masks are 32-bit
+    static const constexpr size_t line_cnt = 64;
+    static const constexpr size_t bypass_len = 256; // Bulk transfers longer than this go straight to swd_host
+
+    struct region
+    {
+        uint32_t start;
+        uint32_t last; // Inclusive, so that a region can reach 0xffffffff
+    };
+
+    struct line
+    {
+        uint32_t tag; // Line base address
+        uint32_t valid_mask; // One bit per byte
+        uint32_t dirty_mask; // One bit per byte, dirty bytes are always valid
+        uint8_t data[line_size];
+    };
+
+    struct stats
+    {
+        uint32_t read_hits;
+        uint32_t read_misses;
+        uint32_t read_uncached;
+        uint32_t writes_coalesced;
+        uint32_t write_flushes;
+        uint32_t invalidations;
+        uint32_t xfer_avoided; // SWD memory transactions (in 32-bit words) not issued thanks to the cache
+    };
+}
+
+/**
+ * Write-back cache for target memory access while the target is halted.
+ *
+ * Only coherent while the core is halted: anything that lets the target run (syscall exec, reset, resume)
+ * must call flush() before and invalidate() after. Debug/system registers (PPB) and peripheral windows are
+ * non-cacheable by default as they may change without the core running.
+ */
+class swd_mem_cache
+{
+public:
+    swd_mem_cache();
+
+public:
+    uint8_t read_word(uint32_t addr, uint32_t *val);
+    uint8_t write_word(uint32_t addr, uint32_t val);
+    uint8_t read_memory(uint32_t addr, uint8_t *buf, uint32_t len);
+    uint8_t write_memory(uint32_t addr, const uint8_t *buf, uint32_t len);
+    uint8_t flush();
+    void invalidate();
+
+    esp_err_t add_uncached_region(uint32_t start, uint32_t last);
+    void reset_uncached_regions();
+    void set_enabled(bool en);
+
+    [[nodiscard]] const mem_cache_def::stats &get_stats() const;
+    void reset_stats();
+    void log_stats() const;
+
+private:
+    [[nodiscard]] bool is_cacheable(uint32_t addr, uint32_t len) const;
+    mem_cache_def::line &get_line(uint32_t addr);
+    uint8_t fill_line(mem_cache_def::line &line, uint32_t tag);
+    uint8_t evict_line(mem_cache_def::line &line);
+    uint8_t flush_range(uint32_t addr, uint32_t len);
+    void invalidate_range(uint32_t addr, uint32_t len);
+
+private:
+    bool enabled = true;
+    uint32_t pending_writes = 0;
+    mem_cache_def::line lines[mem_cache_def::line_cnt] = {};
+    std::vector<mem_cache_def::region> uncached_regions = {};
+    mem_cache_def::stats cache_stats = {};
+
+    static const constexpr char TAG[] = "swd_cache";
+    static const constexpr uint32_t INVALID_TAG = UINT32_MAX;
+};
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <esp_err.h>
+#include <esp_bit_defs.h>
+#include "swd_dap_wire.hpp"
+
+namespace multidrop_def
+{
+    static const constexpr size_t max_targets = 8;
+    static const constexpr size_t no_target = SIZE_MAX;
+
+    // SWD v2 (ADIv5.2) DP registers and bits not covered by swd_def
+    static const constexpr uint8_t DP_ADDR_DPIDR = 0x00;
+    static const constexpr uint8_t DP_ADDR_SELECT = 0x08;
+    static const constexpr uint8_t DP_ADDR_TARGETSEL = 0x0c; // Write only, right after a line reset
+    static const constexpr uint32_t CTRL_STAT_CSYSPWRUPREQ = BIT(30);
+    static const constexpr uint32_t CTRL_STAT_CDBGPWRUPREQ = BIT(28);
+    static const constexpr uint32_t power_up_timeout_us = 100000;
+
+    // Throwaway values to knock swd_host's SELECT/CSW caches off whatever the previous target left there
+    static const constexpr uint32_t SELECT_RESYNC = 0xff0000f0; // APSEL 0xff, bank 0xf; selects nothing real
+    static const constexpr uint32_t AP_ADDR_CSW = 0x00;
+    static const constexpr uint32_t CSW_DEFAULT = 0x23000052; // swd_host's CSW_VALUE | CSW_SIZE32
+    static const constexpr uint32_t CSW_RESYNC = 0x23000050; // Same, 8-bit size
+
+    struct target
+    {
+        uint32_t targetsel; // TARGETID[27:0] plus TINSTANCE in [31:28], e.g. 0x01002927 / 0x11002927 for RP2040 core 0/1
+        uint32_t dpidr; // Read back on the last select, 0 if never seen
+        bool powered; // Debug/system power-up acked since the bus was last woken
+    };
+
+    struct stats
+    {
+        uint32_t wakeups; // Dormant-to-SWD sequences sent
+        uint32_t switches; // Line reset + TARGETSEL, i.e. actual target changes
+        uint32_t switches_skipped; // select() on the target already on the wire
+        uint32_t power_ups;
+    };
+}
+
+/**
+ * SWD v2 multi-drop target selection on the swd_host bus.
+ *
+ * The bus is woken from dormant once, then each switch costs one line reset plus TARGETSEL and a DPIDR read.
+ * Per-target power-up state is kept across switches, so going back to a target doesn't redo its DP init.
+ */
+class swd_multidrop
+{
+public:
+    swd_multidrop() = default;
+
+public:
+    /**
+     * @param targetsel TARGETSEL values, bus order is programming order
+     * @param cnt 0 for a plain single-drop bus
+     */
+    esp_err_t set_targets(const uint32_t *targetsel, size_t cnt);
+    [[nodiscard]] size_t get_target_cnt() const;
+    [[nodiscard]] bool enabled() const;
+    [[nodiscard]] size_t get_selected() const;
+    [[nodiscard]] const multidrop_def::target *get_target(size_t idx) const;
+
+    /**
+     * Put a target on the wire; wakes the bus first if needed and does nothing if it's already selected
+     */
+    esp_err_t select(size_t idx);
+
+    /**
+     * Power up the selected target's debug domain, unless it's known (and allowed) to still be up
+     */
+    esp_err_t power_up(bool allow_fast, bool *fast_used);
+
+    /**
+     * Wire state unknown (e.g. raw sequences through swd_dap_wire), so the next select() wakes the bus and every target re-inits
+     */
+    void invalidate();
+
+    [[nodiscard]] const multidrop_def::stats &get_stats() const;
+
+private:
+    void wake_bus();
+    void write_targetsel(uint32_t val);
+    uint8_t resync_host_cache();
+
+private:
+    multidrop_def::target targets[multidrop_def::max_targets] = {};
+    size_t target_cnt = 0;
+    size_t selected = multidrop_def::no_target;
+    bool bus_awake = false;
+    multidrop_def::stats stats = {};
+    swd_dap_wire wire {};
+
+    static const constexpr char TAG[] = "swd_mdrop";
+};
@@ -1,9 +1,23 @@
 #pragma once
 
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
 #include <esp_err.h>
+#include <esp_bit_defs.h>
 #include <swd_host.h>
 #include <led_ctrl.hpp>
 #include "fw_asset_manager.hpp"
+#include "fw_overlay.hpp"
+#include "fw_image_cache.hpp"
+#include "lz4_image.hpp"
+#include "fw_segmap.hpp"
+#include "page_pipeline.hpp"
+#include "swd_mem_cache.hpp"
+#include "swd_multidrop.hpp"
+#include "rtt_client.hpp"
+#include "semihost.hpp"
+#include "ram_layout_planner.hpp"
+#include "algo_profile.hpp"
 
 namespace swd_def
 {
@@ -23,6 +37,143 @@ namespace swd_def
         PROGRAM = 2,
         VERIFY = 3,
     };
+
+    // Cortex-M debug registers, named apart from DAPLink's debug_cm.h macros
+    static const constexpr uint32_t REG_DHCSR = 0xE000EDF0;
+    static const constexpr uint32_t REG_DFSR = 0xE000ED30;
+    static const constexpr uint32_t DHCSR_DBGKEY = 0xA05F0000;
+    static const constexpr uint32_t DHCSR_C_DEBUGEN = BIT(0);
+    static const constexpr uint32_t DHCSR_S_HALT = BIT(17);
+    static const constexpr uint32_t DFSR_CLEAR_ALL = 0x1F;
+    static const constexpr uint32_t DHCSR_C_HALT = BIT(1);
+    static const constexpr uint32_t DHCSR_C_STEP = BIT(2);
+    static const constexpr uint32_t DHCSR_C_MASKINTS = BIT(3);
+    static const constexpr uint32_t DFSR_HALTED = BIT(0);
+    static const constexpr uint32_t DFSR_BKPT = BIT(1);
+    static const constexpr uint32_t REG_DEMCR = 0xE000EDFC;
+    static const constexpr uint32_t DEMCR_VC_CORERESET = BIT(0);
+    static const constexpr uint32_t REG_AIRCR = 0xE000ED0C;
+    static const constexpr uint32_t AIRCR_SYSRESETREQ = 0x05FA0004; // VECTKEY included
+    static const constexpr uint32_t REG_FP_CTRL = 0xE0002000;
+    static const constexpr uint32_t REG_FP_COMP0 = 0xE0002008;
+    static const constexpr uint32_t FP_CTRL_KEY = BIT(1);
+    static const constexpr uint32_t FP_CTRL_ENABLE = BIT(0);
+    static const constexpr uint32_t DEMCR_TRCENA = BIT(24);
+    static const constexpr uint32_t REG_DWT_CTRL = 0xE0001000;
+    static const constexpr uint32_t REG_DWT_CYCCNT = 0xE0001004;
+    static const constexpr uint32_t DWT_CTRL_CYCCNTENA = BIT(0);
+    static const constexpr uint32_t DWT_CTRL_NOCYCCNT = BIT(25); // Set on parts without a cycle counter, e.g. Cortex-M0
+
+    // DP CTRL/STAT, for telling whether the debug domain is still powered up from the last session
+    static const constexpr uint8_t DP_ADDR_ABORT = 0x00;
+    static const constexpr uint8_t DP_ADDR_CTRL_STAT = 0x04;
+    static const constexpr uint32_t ABORT_CLEAR_ALL = 0x1E; // ORUNERRCLR, WDERRCLR, STKERRCLR, STKCMPCLR
+    static const constexpr uint32_t CTRL_STAT_CSYSPWRUPACK = BIT(31);
+    static const constexpr uint32_t CTRL_STAT_CDBGPWRUPACK = BIT(29);
+    static const constexpr uint32_t CTRL_STAT_STICKY_MASK = 0xB2; // WDATAERR, STICKYERR, STICKYCMP, STICKYORUN
+
+    enum connect_flag : uint32_t
+    {
+        CONNECT_UNDER_RESET = BIT(0), // Hold NRST through DP power-up and halt, catch the reset vector on release
+        CONNECT_FAST_RECONNECT = BIT(1), // Skip swd_init_debug() if the DP is still powered up
+    };
+
+    enum algo_fn : uint8_t
+    {
+        FN_INIT = 0,
+        FN_UNINIT = 1,
+        FN_ERASE_CHIP = 2,
+        FN_ERASE_SECTOR = 3,
+        FN_PROGRAM_PAGE = 4,
+        FN_VERIFY = 5,
+        FN_OTHER = 6, // Self-tests and anything else
+        FN_CNT = 7,
+    };
+
+    struct algo_fn_stats
+    {
+        uint32_t calls;
+        uint64_t cycles; // On-target CYCCNT, halted time (semihosting, RTT) excluded
+        uint64_t max_cycles;
+        uint64_t run_us; // Resume until the halt was seen, includes polling latency
+        uint64_t host_us; // Register setup before and R0 readback after, i.e. pure SWD overhead
+    };
+
+    struct connect_metrics
+    {
+        uint32_t flags; // connect_flag bits in effect
+        bool fast_path; // DP power-up was skipped
+        uint32_t power_up_us;
+        uint32_t halt_us;
+        uint32_t total_us;
+    };
+
+    enum core_reg : uint32_t
+    {
+        CORE_REG_R0 = 0,
+        CORE_REG_R9 = 9,
+        CORE_REG_SP = 13,
+        CORE_REG_LR = 14,
+        CORE_REG_PC = 15,
+        CORE_REG_XPSR = 16,
+    };
+
+    static const constexpr uint32_t XPSR_THUMB = BIT(24);
+    static const constexpr uint32_t self_test_timeout_ms = 30000;
+    static const constexpr size_t max_readout_len = 65536;
+    static const constexpr uint32_t syscall_timeout_ms = 60000; // Generous, EraseChip on large parts is slow
+    static const constexpr int64_t syscall_spin_us = 2000;
+    static const constexpr uint32_t default_ram_size = 0x4000; // When neither the caller nor SelfTestInfo knows better
+    static const constexpr uint32_t stack_paint_pattern = 0xCDCDCDCD;
+    static const constexpr uint32_t stack_margin_pct = 25;
+    static const constexpr uint32_t stack_min_margin = 256;
+    static const constexpr uint32_t reset_release_ms = 10; // Lets NRST rise through a weak pull-up before polling for the halt
+
+    // Dual-bank erase/program overlap, one per flash_algo::bank_description
+    struct bank_sched
+    {
+        uint32_t start; // Absolute bank range
+        uint32_t end;
+        uint32_t erase_next; // Image sectors below this are erased
+        uint32_t erase_end; // End of the last image sector in this bank, == erase_next when there's nothing to do
+        uint32_t status_reg; // 0 to poll EraseStatus
+        uint32_t busy_mask;
+        uint32_t busy_addr; // Sector under async erase
+        uint32_t busy_len;
+        int64_t busy_since;
+        bool busy;
+    };
+
+    struct bank_sched_stats
+    {
+        uint32_t sectors;
+        uint64_t erase_us; // Per-sector erase time as seen by polling, summed over both banks
+        uint64_t wait_us; // ProgramPage held back for an erase, i.e. what the overlap didn't hide
+    };
+
+    // One contiguous range the last program_file()/program_mem() wrote; a segment map gives one per segment
+    struct prog_range
+    {
+        uint32_t addr; // Absolute
+        uint32_t len;
+        uint32_t crc; // esp_crc32_le() as sent, overlay included
+    };
+
+    static const constexpr uint32_t ERASE_STATUS_DONE = 0;
+    static const constexpr uint32_t ERASE_STATUS_BUSY = 1;
+
+    // RAM test images start with a Cortex-M vector table; slot 7 (reserved by the architecture) points to the mailbox
+    static const constexpr uint32_t REG_VTOR = 0xE000ED08;
+    static const constexpr size_t ram_image_mailbox_slot = 7;
+    static const constexpr size_t ram_image_max_len = 0x40000;
+    static const constexpr uint32_t RAM_MAILBOX_DONE = 0x454e4f44; // "DONE", written last by the test image
+
+    struct ram_mailbox
+    {
+        uint32_t state; // Zeroed before the image starts
+        uint32_t result; // 0 for pass
+        uint32_t len; // Bytes of result data right after this header
+    };
 }
 
 
@@ -46,27 +197,288 @@ private:
     uint32_t stack_offset = 0; // Offset of stack top
     uint32_t stack_canary = 0; // Random 32-bit word generated on every init
     uint32_t func_offset = 0;
+    uint32_t syscall_ptr_expect = 0; // What a FLASHALGO_RETURN_POINTER call should return on success
+    uint8_t algo_hash[32] = {};
+    bool algo_hash_valid = false;
+    bool stack_calibrating = false; // Plan with the full requested stack, ignoring the stored profile
+    bool rtt_scanned = false;
+    bool rtt_active = false; // Only self-test calls service RTT, flash ops don't pay for it
     uint32_t ram_addr = 0;
+    uint32_t ram_size = 0; // As given to init(), 0 for auto
     uint32_t stack_size = 0;
+    ram_layout::layout layout = {};
+    uint32_t prog_chunk_size = 0; // Bytes per ProgramPage call, whole pages
+    uint32_t default_connect_flags = 0; // Product level, from config.json
+    uint32_t connect_flags = 0; // Product level plus the algo profile's, resolved on init()
+    bool dp_powered = false; // swd_init_debug() succeeded and nothing else has driven the wire since
+    swd_multidrop multidrop {}; // Empty target list means a plain single-drop bus
+    size_t drop_idx = 0; // Multi-drop target the next connect goes to
+    swd_def::bank_sched banks[flash_algo::bank_cnt] = {};
+    swd_def::bank_sched_stats bank_stats = {};
+    bool bank_sched_on = false; // program_file() erases ahead of itself
+    bool keep_algo_inited = false; // program_image() leaves UnInit to its caller, program_segments() runs one session
+    uint32_t last_prog_crc = 0; // Over the pages program_file() sent, overlay applied
+    std::vector<swd_def::prog_range> prog_ranges {};
+    uint32_t pc_erase_async = 0;
+    uint32_t pc_erase_status = 0;
+    swd_def::connect_metrics metrics = {};
+    bool cyccnt_ok = false; // DWT cycle counter present and running
+    uint32_t fn_entry[swd_def::FN_CNT] = {}; // Absolute entry points, UINT32_MAX if the algo lacks one
+    swd_def::algo_fn_stats fn_stats[swd_def::FN_CNT] = {};
+    swd_def::algo_fn curr_fn = swd_def::FN_OTHER;
+    int64_t call_start_ts = 0;
+    int64_t run_start_ts = 0;
+    uint64_t cyccnt_acc = 0; // CYCCNT wraps in seconds at a few hundred MHz, long calls accumulate across wraps
+    uint32_t cyccnt_last = 0;
     size_t algo_bin_len = 0;
     fw_asset_manager *fw_mgr = nullptr;
+    fw_overlay *overlay = fw_overlay::instance();
+    fw_image_cache *img_cache = fw_image_cache::instance();
     led_ctrl &led = led_ctrl::instance();
+    swd_mem_cache mem_cache {};
+    page_pipeline pipeline {};
+    rtt_client *rtt = rtt_client::instance();
+    algo_profile *profile = algo_profile::instance();
+    semihost semihosting {};
+    SemaphoreHandle_t owner_lock = xSemaphoreCreateRecursiveMutex(); // See lock()
 
     static const uint32_t header_blob[];
+    static const uint32_t crc32_blob[];
 
 private:
     swd_prog() = default;
+    esp_err_t plan_ram_layout();
+    esp_err_t connect_target();
+    esp_err_t dp_power_up(bool allow_fast, bool *fast_used);
+    esp_err_t halt_under_reset();
+    void profile_setup();
+    void profile_sample();
+    void profile_record(int64_t halt_ts);
+    const uint8_t *get_algo_hash();
+    esp_err_t run_stack_calibration(uint32_t sector_addr, uint32_t *stack_used_out);
+    esp_err_t paint_stack();
+    esp_err_t measure_stack(uint32_t *stack_used_out);
     esp_err_t load_flash_algorithm();
     esp_err_t run_algo_init(swd_def::init_mode mode);
     esp_err_t run_algo_uninit(swd_def::init_mode mode);
+    esp_err_t run_reg_script(const std::vector<flash_algo::reg_op> &ops, const char *name);
+
+    /**
+     * Core of program_file()/program_mem(); pages come from exactly one of image, lz4 or file
+     * @param len Raw image length
+     */
+    esp_err_t program_image(const uint8_t *image, lz4_image *lz4, FILE *file, size_t len, uint32_t *len_written, uint32_t start_addr);
+
+    /**
+     * @param image_len Stored length of image, which may be compressed
+     * @param len Raw length, what the erase plan covers
+     */
+    esp_err_t erase_program(const char *path, const uint8_t *image, size_t image_len, size_t len, uint32_t *len_written, uint32_t start_addr);
+
+    /**
+     * Segment by segment through program_image() in one algo session, from image if it's in memory, otherwise from file
+     */
+    esp_err_t program_segments(const fw_segmap &map, const uint8_t *image, FILE *file, uint32_t *len_written);
+    esp_err_t segment_crc(const fw_segmap_def::segment &seg, const uint8_t *image, FILE *file, uint32_t *crc_out);
+    esp_err_t erase_ranges(const std::vector<swd_def::prog_range> &ranges);
+    esp_err_t bank_sched_setup(uint32_t addr, uint32_t len);
+    esp_err_t bank_sched_kick(swd_def::bank_sched &bank, uint32_t flash_start_addr);
+    esp_err_t bank_sched_poll(swd_def::bank_sched &bank);
+    esp_err_t bank_sched_wait(uint32_t addr, uint32_t len);
+    uint32_t bank_sched_pending(uint32_t addr, uint32_t len, uint32_t flash_start_addr);
+    esp_err_t bank_sched_drain();
+    uint8_t exec_syscall(uint32_t entry, uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4, flash_algo_return_t return_type, uint32_t *ret_val,
+                         uint32_t timeout_ms = swd_def::syscall_timeout_ms);
+
+    /**
+     * exec_syscall() in two halves; the wait half services semihosting (BKPT 0xAB) and RTT while the target runs
+     */
+    uint8_t syscall_start(uint32_t entry, uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4);
+    uint8_t syscall_wait(flash_algo_return_t return_type, uint32_t *ret_val, uint32_t timeout_ms);
+    void rtt_arm();
+    esp_err_t find_result_region(uint32_t *start_out, uint32_t *len_out) const;
+    esp_err_t reserve_result_buf(size_t readout_buf_len, uint32_t *addr_out, uint32_t *size_out);
+    esp_err_t read_result_buf(uint32_t addr, uint32_t size, uint8_t *readout_buf, size_t *readout_len);
+    void rtt_finish();
 
 public:
-    esp_err_t init(fw_asset_manager *algo, uint32_t ram_addr = 0x20000000, uint32_t _stack_size = 0x2000);
+    /**
+     * Exclusive use of the SWD wire and of this object. Every task that drives the target (flasher, GDB server,
+     * dumper) holds it for its whole session; recursive, so an owner may nest scopes.
+     * @return ESP_ERR_TIMEOUT if another task kept it longer than timeout
+     */
+    esp_err_t lock(TickType_t timeout = portMAX_DELAY);
+    void unlock();
+
+    /**
+     * Connect, halt and lay out target RAM for the flash algorithm
+     * @param algo Flash algorithm assets
+     * @param ram_addr Target RAM start, where the algorithm is loaded
+     * @param _stack_size Algorithm stack size
+     * @param _ram_size Target RAM size; 0 to take the SelfTestInfo window (if it covers ram_addr) or default_ram_size
+     * @return ESP_OK on success, ESP_ERR_NO_MEM if not even one page buffer fits
+     */
+    esp_err_t init(fw_asset_manager *algo, uint32_t ram_addr = 0x20000000, uint32_t _stack_size = 0x2000, uint32_t _ram_size = 0);
     esp_err_t erase_chip();
+
+    /**
+     * @param start_addr Absolute, on a sector boundary of the DeviceData sector map
+     * @param end_addr Absolute, exclusive, on a sector boundary
+     */
     esp_err_t erase_sector(uint32_t start_addr, uint32_t end_addr);
     esp_err_t program_page(const uint8_t *buf, size_t len, uint32_t start_addr = UINT32_MAX);
     esp_err_t program_file(const char *path, uint32_t *len_written = nullptr, uint32_t start_addr = UINT32_MAX);
+
+    /**
+     * program_file() from an image already in memory, e.g. a memory-mapped asset slot; nothing is copied
+     * except the pages a per-unit overlay lands on. LZ4 images (lz4_image) and segment maps (fw_segmap) are
+     * recognised by their header; a segment map programs only its segments, start_addr is ignored.
+     */
+    esp_err_t program_mem(const uint8_t *image, size_t len, uint32_t *len_written = nullptr, uint32_t start_addr = UINT32_MAX);
     esp_err_t verify(uint32_t expected_crc, uint32_t start_addr = UINT32_MAX, size_t len = 0);
-    esp_err_t self_test(uint16_t test_id, uint8_t *readout_buf, size_t readout_buf_len = 0, uint32_t *func_return_val = nullptr);
+
+    /**
+     * CRC32 of a flash range computed by the target itself, so only the result crosses the wire.
+     * Loads the algo if needed but doesn't run Init; the range must be readable memory-mapped flash.
+     * @param start_addr Absolute address
+     */
+    esp_err_t checksum_flash(uint32_t start_addr, uint32_t len, uint32_t *crc_out);
+
+    /**
+     * CRC32 (esp_crc32_le) of what the last program_file() actually wrote, per-unit overlay included
+     */
+    [[nodiscard]] uint32_t get_last_program_crc() const;
+    [[nodiscard]] const std::vector<swd_def::prog_range> &get_last_program_ranges() const;
+
+    /**
+     * Page preparation of the last program_file()/program_mem() call (its last segment, for a segment map):
+     * which side waited on which
+     */
+    [[nodiscard]] const pipeline_def::stats &get_pipeline_stats() const;
+
+    /**
+     * verify() every range the last program_file()/program_mem() wrote, gaps between segments aren't read
+     */
+    esp_err_t verify_last_program();
+
+    /**
+     * Erase and program in one pass on dual-bank parts: the bank not being programmed erases its image sectors
+     * in the background (EraseSectorAsync), the one being programmed erases just ahead of ProgramPage.
+     * Only the sectors the image covers get erased. Init runs in PROGRAM mode, the async erase must cope with that.
+     * @return ESP_ERR_NOT_SUPPORTED if the algo has no DualBank section or async erase functions
+     */
+    esp_err_t erase_program_file(const char *path, uint32_t *len_written = nullptr, uint32_t start_addr = UINT32_MAX);
+    esp_err_t erase_program_mem(const uint8_t *image, size_t len, uint32_t *len_written = nullptr, uint32_t start_addr = UINT32_MAX);
+
+    /**
+     * Erase only the sectors an image will be programmed into: each segment of a segment map, otherwise the
+     * image length from the flash start
+     */
+    esp_err_t erase_image_file(const char *path);
+    esp_err_t erase_image_mem(const uint8_t *image, size_t len);
+
+    /**
+     * The erase before program_file()/program_mem(): erase_image_*() for a segment map, the whole flash otherwise
+     * (EraseChip, sector by sector if that fails). Nothing for dual-bank algos, erase_program_*() does it.
+     * @param path Image file, ignored if image is given
+     */
+    esp_err_t erase_before_program(const char *path, const uint8_t *image = nullptr, size_t len = 0);
+    bool has_dual_bank() const;
+
+    /**
+     * Paint the stack, run Init/EraseSector/ProgramPage/UnInit once and store the high-water mark (plus margin)
+     * for this algorithm, so later init() calls reserve only that much stack. Erases and blank-programs one sector.
+     * @param sector_addr Sector to use, or UINT32_MAX for the first one
+     * @return ESP_OK on success, target is re-initialised with the new layout
+     */
+    esp_err_t calibrate_stack(uint32_t sector_addr = UINT32_MAX);
+    bool has_stack_profile();
+
+    /**
+     * Store the max bytes per ProgramPage call for the current algorithm; takes effect on the next init()
+     * @param size Multiple of the page size (rounded down if not), 0 to go back to one page per call
+     */
+    esp_err_t set_prog_chunk_size(uint32_t size);
+
+    /**
+     * Store connect_flag bits for the current algorithm, on top of the product default; takes effect on the next init()
+     */
+    esp_err_t set_connect_flags(uint32_t flags);
+    void set_default_connect_flags(uint32_t flags);
+    const swd_def::connect_metrics &get_connect_metrics() const;
+    const swd_def::algo_fn_stats &get_algo_fn_stats(swd_def::algo_fn fn) const;
+    void reset_algo_fn_stats();
+    void log_algo_fn_stats() const;
+
+    /**
+     * Something else drove the DP (e.g. raw sequences through swd_dap_wire), so the next connect does a full swd_init_debug()
+     */
+    void mark_dp_stale();
+
+    /**
+     * Address SWD v2 multi-drop targets by TARGETSEL; 0 targets for a plain single-drop bus
+     */
+    esp_err_t set_drop_targets(const uint32_t *targetsel, size_t cnt);
+    size_t get_drop_target_cnt() const;
+
+    /**
+     * Pick the multi-drop target for the next init()/connect(); the previous target's DP state is kept
+     */
+    esp_err_t select_drop_target(size_t idx);
+    size_t get_drop_target_idx() const;
+
+    /**
+     * Run a self-test function in the flash algorithm
+     * @param test_id Test ID from SelfTestInfo
+     * @param readout_buf Result buffer for extended tests, or nullptr for simple ones
+     * @param readout_buf_len Result buffer length; the target gets a buffer of this plus a leading length word in free space of the SelfTestInfo RAM window
+     * @param func_return_val Function return value (R0)
+     * @param readout_len Actual result length, as written by the test into the length word
+     * @return ESP_OK on success
+     */
+    esp_err_t self_test(uint16_t test_id, uint8_t *readout_buf, size_t readout_buf_len = 0, uint32_t *func_return_val = nullptr, size_t *readout_len = nullptr);
+
+    /**
+     * Largest result an extended self-test can hand back: what's left of the SelfTestInfo window next to the
+     * algorithm, stack and page buffers, less the length word
+     */
+    esp_err_t get_result_buf_capacity(size_t *len_out) const;
+
+    /**
+     * Load a test image into target RAM and run it from its own vector table (VTOR, SP and PC), flash untouched.
+     * The image reports through the mailbox its vector slot 7 points to. Clobbers the flash algorithm in RAM,
+     * so the next flash operation loads it again; peripherals are left as the test set them up.
+     * @param path Raw binary, linked to run at load_addr
+     * @param load_addr Where to put it, UINT32_MAX for the init() RAM start
+     * @param result_out Mailbox result word, 0 for pass
+     * @param readout_buf Optional buffer for the mailbox result data
+     * @return ESP_OK if the image ran to completion (check result_out for pass/fail), ESP_ERR_TIMEOUT if it never finished
+     */
+    esp_err_t run_ram_image(const char *path, uint32_t load_addr, uint32_t *result_out, uint8_t *readout_buf = nullptr,
+                            size_t readout_buf_len = 0, size_t *readout_len = nullptr, uint32_t timeout_ms = swd_def::self_test_timeout_ms);
+    esp_err_t connect();
+    esp_err_t halt();
+    esp_err_t read_memory(uint32_t addr, uint8_t *buf, size_t len);
+    semihost &get_semihost();
+    swd_mem_cache &get_mem_cache();
+    const ram_layout::layout &get_ram_layout() const;
     static void trigger_nrst();
 };
+
+/**
+ * swd_prog::lock() for a scope; check status() when a timeout was given
+ */
+class swd_owner_scope
+{
+public:
+    explicit swd_owner_scope(TickType_t timeout = portMAX_DELAY) : ret(swd_prog::instance()->lock(timeout)) {};
+    ~swd_owner_scope() { if (ret == ESP_OK) swd_prog::instance()->unlock(); };
+
+    swd_owner_scope(swd_owner_scope const &) = delete;
+    void operator=(swd_owner_scope const &) = delete;
+
+    [[nodiscard]] esp_err_t status() const { return ret; };
+
+private:
+    esp_err_t ret;
+};
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <sdkconfig.h>
+#include <esp_err.h>
+
+namespace swd_wire_def
+{
+    enum op : uint8_t
+    {
+        OP_IDLE = 0, // Nothing tagged, e.g. RTT polling between operations
+        OP_CONNECT = 1,
+        OP_LOAD_ALGO = 2,
+        OP_ERASE = 3,
+        OP_PROGRAM = 4,
+        OP_VERIFY = 5,
+        OP_SELF_TEST = 6,
+        OP_MEMORY = 7, // Readouts, dumps
+        OP_DEBUG = 8, // GDB server
+        OP_SCRIPT = 9, // Pre-init/post-uninit register scripts
+        OP_CNT = 10,
+    };
+
+    // SWD_Transfer() request and response bits, as in DAP.h
+    static const constexpr uint32_t REQ_APnDP = (1U << 0);
+    static const constexpr uint32_t REQ_RnW = (1U << 1);
+    static const constexpr uint8_t ACK_OK = 0x01;
+    static const constexpr uint8_t ACK_WAIT = 0x02;
+    static const constexpr uint8_t ACK_FAULT = 0x04;
+    static const constexpr uint8_t ACK_NONE = 0x07;
+    static const constexpr uint8_t ACK_PARITY_ERR = 0x08;
+
+    struct counters
+    {
+        uint32_t dp_reads;
+        uint32_t dp_writes;
+        uint32_t ap_reads;
+        uint32_t ap_writes;
+        uint32_t acks_ok;
+        uint32_t acks_wait;
+        uint32_t acks_fault;
+        uint32_t acks_none;
+        uint32_t parity_errs;
+        uint32_t retries; // Same request re-issued straight after a WAIT
+        uint64_t bytes; // Data phases that went through, 4 bytes each
+    };
+
+    struct __attribute__((packed)) trace_entry
+    {
+        uint32_t ts_us; // Low 32 bits of esp_timer
+        uint32_t data;
+        uint8_t req;
+        uint8_t ack;
+        uint8_t op;
+        uint8_t reserved;
+    };
+
+#ifdef CONFIG_SI_SWD_TRACE_DEPTH
+    static const constexpr size_t trace_depth = CONFIG_SI_SWD_TRACE_DEPTH;
+#else
+    static const constexpr size_t trace_depth = 0;
+#endif
+}
+
+/**
+ * Counters fed by the --wrap'd SWD_Transfer(), built only with CONFIG_SI_SWD_WIRE_STATS.
+ * Without it, everything here is a no-op so call sites needn't be #ifdef'd.
+ * Updates aren't locked: everything that drives SWD holds swd_prog::lock(), which serializes them too.
+ */
+class swd_wire_stats
+{
+public:
+    static swd_wire_stats *instance()
+    {
+        static swd_wire_stats _instance;
+        return &_instance;
+    }
+
+    swd_wire_stats(swd_wire_stats const &) = delete;
+    void operator=(swd_wire_stats const &) = delete;
+
+public:
+    void record(uint32_t req, uint8_t ack, uint32_t data);
+    swd_wire_def::op set_op(swd_wire_def::op op);
+    esp_err_t get_counters(swd_wire_def::op op, swd_wire_def::counters *out) const;
+
+    /**
+     * Copy out the trace, oldest first
+     * @return Number of entries copied
+     */
+    size_t get_trace(swd_wire_def::trace_entry *out, size_t max_cnt) const;
+    void reset();
+    void log_stats() const;
+
+private:
+    swd_wire_stats() = default;
+
+private:
+    volatile swd_wire_def::op curr_op = swd_wire_def::OP_IDLE;
+    swd_wire_def::counters stats[swd_wire_def::OP_CNT] = {};
+    uint32_t last_req = UINT32_MAX;
+    uint8_t last_ack = 0;
+#ifdef CONFIG_SI_SWD_WIRE_STATS
+    swd_wire_def::trace_entry trace[swd_wire_def::trace_depth > 0 ? swd_wire_def::trace_depth : 1] = {};
+#endif
+    size_t trace_head = 0;
+    size_t trace_cnt = 0;
+
+    static const constexpr char TAG[] = "swd_wire";
+};
+
+/**
+ * Tags SWD traffic with an operation for as long as it's in scope; nests, restoring the outer tag
+ */
+class swd_wire_op_scope
+{
+public:
+    explicit swd_wire_op_scope(swd_wire_def::op op) : prev_op(swd_wire_stats::instance()->set_op(op)) {};
+    ~swd_wire_op_scope() { swd_wire_stats::instance()->set_op(prev_op); };
+
+    swd_wire_op_scope(swd_wire_op_scope const &) = delete;
+    void operator=(swd_wire_op_scope const &) = delete;
+
+private:
+    swd_wire_def::op prev_op;
+};
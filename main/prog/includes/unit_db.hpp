@@ -0,0 +1,86 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <esp_err.h>
+
+namespace unit_db_def
+{
+    static const constexpr uint32_t RECORD_MAGIC = 0x55444231; // "UDB1"
+    static const constexpr size_t max_uid_len = 16;
+    static const constexpr size_t sha_len = 32;
+    static const constexpr size_t compact_min_records = 256; // Don't bother rewriting small files
+
+    enum run_result : uint8_t
+    {
+        RESULT_UNKNOWN = 0,
+        RESULT_VERIFIED = 1, // Programmed and verified, self-test not run yet
+        RESULT_PASSED = 2,
+        RESULT_FAILED = 3, // Programmed fine, self-test failed
+    };
+
+    struct __attribute__((packed)) record
+    {
+        uint32_t magic;
+        uint8_t uid_len;
+        run_result result;
+        uint16_t _reserved;
+        uint8_t uid[max_uid_len];
+        uint8_t fw_sha[sha_len];
+        uint8_t algo_sha[sha_len];
+        uint32_t flash_addr;
+        uint32_t flash_len;
+        uint32_t flash_crc; // CRC32 of what actually went into flash, per-unit overlay included
+        uint32_t seq; // Append counter, survives compaction
+        uint32_t crc; // Over everything above
+    };
+}
+
+/**
+ * Per-unit programming history in an append-only file, keyed by the target's unique ID.
+ *
+ * Every update is a new record at the end of the file, the latest one per UID wins. A torn record at the
+ * tail (power loss mid-append) is cut off on load. All live records sit in RAM behind a hash index.
+ */
+class unit_db
+{
+public:
+    static unit_db *instance()
+    {
+        static unit_db _instance;
+        return &_instance;
+    }
+
+    unit_db(unit_db const &) = delete;
+    void operator=(unit_db const &) = delete;
+
+public:
+    esp_err_t init();
+    esp_err_t lookup(const uint8_t *uid, size_t uid_len, unit_db_def::record *out) const;
+
+    /**
+     * Append a record; magic, seq and crc are filled in here
+     */
+    esp_err_t store(unit_db_def::record &record);
+    [[nodiscard]] size_t size() const;
+
+private:
+    unit_db() = default;
+    esp_err_t compact();
+    static std::string make_key(const uint8_t *uid, size_t uid_len);
+    static uint32_t record_crc(const unit_db_def::record &record);
+
+private:
+    bool inited = false;
+    uint32_t next_seq = 0;
+    size_t file_records = 0; // Including superseded ones
+    std::vector<unit_db_def::record> records = {};
+    std::unordered_map<std::string, size_t> index = {}; // UID -> records[]
+
+    static const constexpr char TAG[] = "unit_db";
+    static const constexpr char DB_PATH[] = "/data/units.db";
+    static const constexpr char DB_TMP_PATH[] = "/data/units.tmp"; // 8.3, some builds have no long file names
+};
@@ -0,0 +1,262 @@
+#include <cstring>
+#include <algorithm>
+#include <esp_log.h>
+#include <esp_crc.h>
+#include <esp_timer.h>
+#include <esp_heap_caps.h>
+
+#include "lz4_image.hpp"
+
+lz4_image::~lz4_image()
+{
+    free(scratch);
+}
+
+bool lz4_image::is_lz4(const uint8_t *src, size_t len)
+{
+    size_t raw_len = 0;
+    return get_raw_len(src, len, &raw_len) == ESP_OK;
+}
+
+esp_err_t lz4_image::get_raw_len(const uint8_t *src, size_t len, size_t *raw_len_out)
+{
+    if (src == nullptr || raw_len_out == nullptr || len < sizeof(lz4_image_def::header)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    lz4_image_def::header hdr = {};
+    memcpy(&hdr, src, sizeof(hdr));
+    if (hdr.magic != lz4_image_def::MAGIC) {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    if (hdr.crc != esp_crc32_le(0, (const uint8_t *)&hdr, offsetof(lz4_image_def::header, crc)) || hdr.version != lz4_image_def::VERSION) {
+        return ESP_ERR_INVALID_CRC;
+    }
+
+    *raw_len_out = hdr.raw_len;
+    return ESP_OK;
+}
+
+esp_err_t lz4_image::open(const uint8_t *src, size_t len)
+{
+    size_t raw_len = 0;
+    auto hdr_ret = get_raw_len(src, len, &raw_len);
+    if (hdr_ret != ESP_OK) {
+        return hdr_ret;
+    }
+
+    memcpy(&header, src, sizeof(header));
+    size_t index_end = sizeof(header) + (size_t)header.block_cnt * sizeof(lz4_image_def::block_entry);
+    if (header.block_size == 0 || header.block_size > lz4_image_def::max_block_size || index_end > len
+        || header.block_cnt != (header.raw_len + header.block_size - 1) / header.block_size) {
+        ESP_LOGE(TAG, "Bad geometry: block size %lu, %lu blocks for %lu bytes", header.block_size, header.block_cnt, header.raw_len);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    image = src;
+    image_len = len;
+    for (uint32_t idx = 0; idx < header.block_cnt; idx += 1) {
+        lz4_image_def::block_entry entry = {};
+        auto ret = get_block(idx, &entry);
+        uint32_t comp_len = entry.len & ~lz4_image_def::BLOCK_STORED;
+        if (ret != ESP_OK || entry.offset < index_end || entry.offset + (size_t)comp_len > len) {
+            ESP_LOGE(TAG, "Block %lu out of bounds", idx);
+            image = nullptr;
+            return ESP_ERR_INVALID_SIZE;
+        }
+    }
+
+    // Partial reads land here; internal RAM when there's room, it's hit once per byte
+    free(scratch);
+    scratch = static_cast<uint8_t *>(heap_caps_malloc(header.block_size, MALLOC_CAP_INTERNAL));
+    if (scratch == nullptr) {
+        scratch = static_cast<uint8_t *>(heap_caps_malloc(header.block_size, MALLOC_CAP_SPIRAM));
+    }
+
+    if (scratch == nullptr) {
+        image = nullptr;
+        return ESP_ERR_NO_MEM;
+    }
+
+    scratch_idx = UINT32_MAX;
+    stats = {};
+    ESP_LOGI(TAG, "%lu bytes in %lu blocks of %lu, %u compressed", header.raw_len, header.block_cnt, header.block_size, len);
+    return ESP_OK;
+}
+
+esp_err_t lz4_image::read(uint32_t offset, uint8_t *out, size_t len)
+{
+    if (image == nullptr || out == nullptr) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    if ((size_t)offset + len > header.raw_len) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    while (len > 0) {
+        uint32_t idx = offset / header.block_size;
+        uint32_t in_block = offset % header.block_size;
+        uint32_t block_len = std::min(header.block_size, header.raw_len - idx * header.block_size);
+        size_t copy_len = std::min(len, (size_t)(block_len - in_block));
+
+        if (in_block == 0 && copy_len == block_len) {
+            auto ret = read_block(idx, out, copy_len);
+            if (ret != ESP_OK) return ret;
+        } else {
+            if (scratch_idx != idx) {
+                scratch_idx = UINT32_MAX;
+                auto ret = read_block(idx, scratch, header.block_size);
+                if (ret != ESP_OK) return ret;
+                scratch_idx = idx;
+            }
+
+            memcpy(out, scratch + in_block, copy_len);
+        }
+
+        out += copy_len;
+        offset += copy_len;
+        len -= copy_len;
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t lz4_image::read_block(uint32_t idx, uint8_t *out, size_t out_len)
+{
+    lz4_image_def::block_entry entry = {};
+    auto ret = get_block(idx, &entry);
+    if (ret != ESP_OK || out == nullptr) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    uint32_t block_len = std::min(header.block_size, header.raw_len - idx * header.block_size);
+    if (out_len < block_len) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    int64_t start_ts = esp_timer_get_time();
+    const uint8_t *src = image + entry.offset;
+    uint32_t comp_len = entry.len & ~lz4_image_def::BLOCK_STORED;
+    int32_t decoded = (int32_t)block_len;
+    if ((entry.len & lz4_image_def::BLOCK_STORED) != 0) {
+        if (comp_len != block_len) {
+            return ESP_ERR_INVALID_SIZE;
+        }
+
+        memcpy(out, src, block_len);
+    } else {
+        decoded = decode(src, comp_len, out, block_len);
+    }
+
+    if (decoded != (int32_t)block_len || esp_crc32_le(0, out, block_len) != entry.raw_crc) {
+        ESP_LOGE(TAG, "Block %lu corrupted, decoded %ld of %lu", idx, decoded, block_len);
+        return ESP_ERR_INVALID_CRC;
+    }
+
+    stats.blocks += 1;
+    stats.raw_bytes += block_len;
+    stats.decode_us += esp_timer_get_time() - start_ts;
+    return ESP_OK;
+}
+
+size_t lz4_image::raw_size() const
+{
+    return image != nullptr ? header.raw_len : 0;
+}
+
+uint32_t lz4_image::get_block_size() const
+{
+    return header.block_size;
+}
+
+uint32_t lz4_image::get_block_cnt() const
+{
+    return image != nullptr ? header.block_cnt : 0;
+}
+
+esp_err_t lz4_image::get_block(uint32_t idx, lz4_image_def::block_entry *out) const
+{
+    if (image == nullptr || out == nullptr || idx >= header.block_cnt) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    memcpy(out, image + sizeof(header) + idx * sizeof(lz4_image_def::block_entry), sizeof(lz4_image_def::block_entry));
+    return ESP_OK;
+}
+
+const lz4_image_def::stats &lz4_image::get_stats() const
+{
+    return stats;
+}
+
+int32_t lz4_image::decode(const uint8_t *src, size_t src_len, uint8_t *dst, size_t dst_cap)
+{
+    // Plain LZ4 block format: token, literal run, 16-bit LE offset, match run; the last sequence has no match
+    const uint8_t *ip = src, *ip_end = src + src_len;
+    uint8_t *op = dst, *op_end = dst + dst_cap;
+
+    auto read_len = [&](size_t len) -> size_t {
+        uint8_t val = 255;
+        while (len != SIZE_MAX && val == 255) {
+            if (ip >= ip_end) return SIZE_MAX;
+            val = *ip++;
+            len += val;
+        }
+
+        return len;
+    };
+
+    while (ip < ip_end) {
+        uint8_t token = *ip++;
+        size_t lit_len = token >> 4;
+        if (lit_len == 15 && (lit_len = read_len(lit_len)) == SIZE_MAX) {
+            return -1;
+        }
+
+        if (lit_len > (size_t)(ip_end - ip) || lit_len > (size_t)(op_end - op)) {
+            return -1;
+        }
+
+        memcpy(op, ip, lit_len);
+        op += lit_len;
+        ip += lit_len;
+        if (ip == ip_end) {
+            break;
+        }
+
+        if (ip_end - ip < 2) {
+            return -1;
+        }
+
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - dst)) {
+            return -1;
+        }
+
+        size_t match_len = token & 0x0f;
+        if (match_len == 15 && (match_len = read_len(match_len)) == SIZE_MAX) {
+            return -1;
+        }
+
+        match_len += 4;
+        if (match_len > (size_t)(op_end - op)) {
+            return -1;
+        }
+
+        const uint8_t *match = op - offset;
+        if (offset >= match_len) {
+            memcpy(op, match, match_len);
+            op += match_len;
+        } else {
+            // Overlapping match repeats the last `offset` bytes, has to go byte by byte
+            for (size_t idx = 0; idx < match_len; idx += 1) {
+                *op++ = *match++;
+            }
+        }
+    }
+
+    return (int32_t)(op - dst);
+}
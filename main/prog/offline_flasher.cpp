@@ -5,8 +5,15 @@
 #include <led_ctrl.hpp>
 #include <esp_crc.h>
 #include <esp_timer.h>
+#include <esp_heap_caps.h>
+#include <algorithm>
 
 #include "offline_flasher.hpp"
+#include "swd_wire_stats.hpp"
+#include "config_reader.hpp"
+#include "asset_slot.hpp"
+#include "asset_store.hpp"
+#include "mqtt_client.hpp"
 
 esp_err_t offline_flasher::init()
 {
@@ -15,7 +22,40 @@ esp_err_t offline_flasher::init()
 
     if (ret != ESP_OK) return ret;
 
+    if (overlay->init() != ESP_OK) {
+        ESP_LOGW(TAG, "Overlay init failed, unit sequence won't survive reboot");
+    }
+
+    asset_slot::instance()->init();
+    asset_store::instance()->init();
+    prepare_image();
+    auto sha_ret = refresh_hashes();
+
+    if (config_reader::instance()->get_uid_opts(&uid_addr, &uid_len) == ESP_OK && uid_len > 0 && uid_len <= unit_db_def::max_uid_len) {
+        auto db_ret = units->init();
+        db_ret = db_ret ?: sha_ret;
+        if (db_ret != ESP_OK) {
+            ESP_LOGW(TAG, "Unit database unavailable: 0x%x, programming every unit", db_ret);
+            uid_len = 0;
+        } else {
+            ESP_LOGI(TAG, "Unit ID at 0x%08lx, %lu bytes; %u units known", uid_addr, uid_len, units->size());
+        }
+    } else {
+        uid_len = 0;
+    }
+
+    bool swd_owned = false;
     while (true) {
+        // One unit is one SWD session from detect to DONE/ERROR, the GDB server and dumps get in after it
+        bool busy = state != flasher::DONE && state != flasher::ERROR;
+        if (busy && !swd_owned) {
+            swd->lock();
+            swd_owned = true;
+        } else if (!busy && swd_owned) {
+            swd->unlock();
+            swd_owned = false;
+        }
+
         switch (state) {
             case flasher::DETECT: {
                 on_detect();
@@ -51,12 +91,27 @@ esp_err_t offline_flasher::init()
                 on_self_test();
                 break;
             }
+
+            case flasher::RAM_TEST: {
+                on_ram_test();
+                break;
+            }
         }
     }
 
     return ret;
 }
 
+void offline_flasher::set_reporter(mqtt_client *_reporter)
+{
+    reporter = _reporter;
+}
+
+void offline_flasher::on_assets_changed()
+{
+    assets_changed = true;
+}
+
 void offline_flasher::on_error()
 {
 
@@ -65,29 +120,21 @@ void offline_flasher::on_error()
 void offline_flasher::on_erase()
 {
     ESP_LOGI(TAG, "Erasing");
+    if (swd->has_dual_bank()) {
+        ESP_LOGI(TAG, "Dual-bank algo, erasing along with programming");
+        state = flasher::PROGRAM;
+        return;
+    }
+
     ui_cmder->display_chip_erase();
-    uint32_t start_addr = 0, end_addr = 0;
-    auto ret = asset->get_flash_start_addr(&start_addr);
-    ret = ret ?: asset->get_flash_end_addr(&end_addr);
+    auto ret = hold_slot_image() ? swd->erase_before_program(nullptr, slot_img, slot_len) : swd->erase_before_program(fw_path);
     if (ret != ESP_OK) {
+        drop_slot_image();
         ui_state::error_screen error = {};
-        strcpy(error.comment, "No flash address");
+        snprintf(error.comment, sizeof(error.comment), "Erase failed\nCode: 0x%x", ret);
         ui_cmder->display_error(&error);
-
         state = flasher::ERROR;
-        ESP_LOGE(TAG, "Failed to read flash addresses");
-    } else {
-        ret = swd->erase_chip();
-        if (ret != ESP_OK) {
-            ret = swd->erase_sector(start_addr, end_addr);
-        }
-
-        if (ret != ESP_OK) {
-            ui_state::error_screen error = {};
-            snprintf(error.comment, sizeof(error.comment), "Erase failed\nCode: 0x%x", ret);
-            ui_cmder->display_error(&error);
-            state = flasher::ERROR;
-        }
+        return;
     }
 
     state = flasher::PROGRAM;
@@ -99,7 +146,22 @@ void offline_flasher::on_program()
 
     ui_state::flash_screen flash = {};
     ui_cmder->display_flash(&flash);
-    auto ret = swd->program_file(fw_asset_manager::FIRMWARE_PATH, &written_len);
+    auto ret = overlay->prepare_unit();
+
+    // Memory-mapped from the active asset slot if there is one, the filesystem is only the fallback
+    if (hold_slot_image()) {
+        if (swd->has_dual_bank()) {
+            ret = ret ?: swd->erase_program_mem(slot_img, slot_len, &written_len);
+        } else {
+            ret = ret ?: swd->program_mem(slot_img, slot_len, &written_len);
+        }
+    } else if (swd->has_dual_bank()) {
+        ret = ret ?: swd->erase_program_file(fw_path, &written_len);
+    } else {
+        ret = ret ?: swd->program_file(fw_path, &written_len);
+    }
+
+    drop_slot_image();
     if (ret != ESP_OK) {
         ui_state::error_screen error = {};
         snprintf(error.comment, sizeof(error.comment), "Prog failed\nCode: 0x%x", ret);
@@ -117,14 +179,85 @@ void offline_flasher::on_program()
 void offline_flasher::on_detect()
 {
     ESP_LOGI(TAG, "Detecting");
+    if (assets_changed) {
+        assets_changed = false;
+        ESP_LOGI(TAG, "Assets changed, preparing the new image");
+        prepare_image();
+        auto sha_ret = refresh_hashes();
+        if (sha_ret != ESP_OK) {
+            ESP_LOGW(TAG, "Can't hash the new assets: 0x%x, programming every unit", sha_ret);
+        }
+    }
+
+    if (swd->get_drop_target_cnt() > 0) {
+        ESP_LOGI(TAG, "Multi-drop target %u of %u", drop_idx + 1, swd->get_drop_target_cnt());
+        swd->select_drop_target(drop_idx);
+    }
+
+    swd->reset_algo_fn_stats(); // Per unit
+    swd_wire_stats::instance()->reset();
+    int64_t ts = esp_timer_get_time();
+    uint32_t attempts = 1;
     auto ret = swd->init(asset);
     while (ret != ESP_OK) {
         ui_cmder->display_init();
         ESP_LOGE(TAG, "Detect failed, retrying");
+
+        // No unit yet, so nothing to protect; let a waiting GDB client or dump have the wire
+        swd->unlock();
+        vTaskDelay(pdMS_TO_TICKS(10));
+        swd->lock();
         ret = swd->init(asset);
+        attempts += 1;
+    }
+
+    const swd_def::connect_metrics &metrics = swd->get_connect_metrics();
+    ESP_LOGI(TAG, "Detected after %lu attempt(s), %lld us; last connect flags 0x%lx%s, DP %lu us, halt %lu us",
+             attempts, esp_timer_get_time() - ts, metrics.flags, metrics.fast_path ? " (fast)" : "", metrics.power_up_us, metrics.halt_us);
+
+#ifdef CONFIG_SI_STACK_CALIBRATE
+    if (!swd->has_stack_profile() && swd->calibrate_stack() != ESP_OK) {
+        ESP_LOGW(TAG, "Stack calibration failed, keeping the default stack size");
+        swd->init(asset);
+    }
+#endif
+
+    read_unit_id();
+    state = flasher::RAM_TEST; // Then erase, unless the unit already holds this image
+}
+
+void offline_flasher::on_ram_test()
+{
+    ui_state::test_screen test = {};
+    strcpy(test.subtitle, "RAM test");
+    ui_cmder->display_test(&test);
+
+    uint32_t result = UINT32_MAX;
+    auto ret = swd->run_ram_image(fw_asset_manager::get_test_image_path(), UINT32_MAX, &result);
+    if (ret == ESP_ERR_NOT_FOUND) {
+        state = unit_up_to_date() ? flasher::SELF_TEST : flasher::ERASE; // No test image for this product
+        return;
+    }
+
+    if (ret != ESP_OK || result != 0) {
+        ESP_LOGE(TAG, "RAM test failed, host returned 0x%x, test returned 0x%lx", ret, result);
+        ui_state::error_screen error = {};
+        snprintf(error.comment, sizeof(error.comment), "RAM test failed\nCode: 0x%lx", ret != ESP_OK ? (uint32_t)ret : result);
+        ui_cmder->display_error(&error);
+        state = flasher::ERROR;
+        return;
+    }
+
+    // Back to reset state, the test image may have left clocks and peripherals set up its own way
+    swd_prog::trigger_nrst();
+    ret = swd->init(asset);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Re-init after RAM test failed: 0x%x", ret);
+        state = flasher::ERROR;
+        return;
     }
 
-    state = flasher::ERASE; // To erase
+    state = unit_up_to_date() ? flasher::SELF_TEST : flasher::ERASE;
 }
 
 void offline_flasher::on_done()
@@ -134,19 +267,12 @@ void offline_flasher::on_done()
 
 void offline_flasher::on_verify()
 {
-    uint32_t crc = 0;
-    // TODO: move to normal memcmp()
-//    if (fw_asset_manager::instance()->get_fw_crc(&crc) != ESP_OK) {
-//        state = flasher::ERROR;
-//        return;
-//    }
-
     ui_state::test_screen test = {};
     test.done_test = 0;
     test.total_test = 0;
     strcpy(test.subtitle, "Verify prog");
     ui_cmder->display_test(&test);
-    auto ret = swd->verify(crc, UINT32_MAX, written_len);
+    auto ret = swd->verify_last_program(); // Image plus this unit's overlay, as sent
     if (ret != ESP_OK) {
         ESP_LOGE(TAG, "Failed to verify!");
         ui_state::error_screen error = {};
@@ -155,6 +281,25 @@ void offline_flasher::on_verify()
         state = flasher::ERROR;
     } else {
         ESP_LOGI(TAG, "Firmware verified");
+        swd->get_mem_cache().log_stats();
+        swd->log_algo_fn_stats();
+        swd_wire_stats::instance()->log_stats();
+        report_program(); // Before commit_unit(), the patches still hold this unit's values
+        overlay->commit_unit();
+
+        // A record holds one range; for a sparse image that's the whole span, gaps as they are on this unit
+        const auto &ranges = swd->get_last_program_ranges();
+        unit.flash_addr = ranges.front().addr;
+        unit.flash_len = ranges.back().addr + ranges.back().len - ranges.front().addr;
+        uint32_t crc = ranges.front().crc;
+        if (ranges.size() > 1 && swd->checksum_flash(unit.flash_addr, unit.flash_len, &crc) != ESP_OK) {
+            ESP_LOGW(TAG, "Span checksum failed, unit will be reprogrammed next time");
+            unit.flash_len = 0;
+        }
+
+        unit.flash_crc = crc;
+
+        store_unit(unit_db_def::RESULT_VERIFIED);
         state = flasher::SELF_TEST;
     }
 }
@@ -175,24 +320,253 @@ void offline_flasher::on_self_test()
             uint32_t func_ret = UINT32_MAX;
             auto ret = swd->self_test(items[idx].id, nullptr, 0, &func_ret);
             ESP_LOGW(TAG, "Self test OK, host returned 0x%x, function returned 0x%lx", ret, func_ret);
+            if (ret != ESP_ERR_NOT_SUPPORTED) {
+                report_self_test(items[idx].id, func_ret);
+            }
+
             if (ret == ESP_ERR_NOT_SUPPORTED) {
                 ESP_LOGW(TAG, "No self test config found, skipping");
-                state = flasher::DONE;
+                if (!next_drop_target()) {
+                    state = flasher::DONE;
+                }
                 return;
             } else if (ret != ESP_OK) {
                 ESP_LOGW(TAG, "Self test failed, host returned 0x%x, function returned 0x%lx", ret, func_ret);
+                store_unit(unit_db_def::RESULT_FAILED);
                 state = flasher::ERROR;
                 return;
             }
         } else if (items[idx].type == flash_algo::INTERNAL_EXTEND_TEST) {
-            ESP_LOGW(TAG, "Unsupported InternalExtendTest type!");
+            size_t buf_len = 0;
+            if (swd->get_result_buf_capacity(&buf_len) != ESP_OK || buf_len == 0) {
+                ESP_LOGW(TAG, "No free RAM for the InternalExtendTest result, skipping");
+                continue;
+            }
+
+            buf_len = std::min(buf_len, swd_def::max_readout_len);
+            auto *result_buf = static_cast<uint8_t *>(heap_caps_malloc(buf_len, MALLOC_CAP_SPIRAM));
+            if (result_buf == nullptr) {
+                ESP_LOGE(TAG, "Failed to allocate result buffer");
+                state = flasher::ERROR;
+                return;
+            }
+
+            uint32_t func_ret = UINT32_MAX;
+            size_t result_len = 0;
+            auto ret = swd->self_test(items[idx].id, result_buf, buf_len, &func_ret, &result_len);
+            report_self_test(items[idx].id, func_ret, result_buf, result_len); // Serialized into the report, freed after
+            if (ret != ESP_OK) {
+                ESP_LOGW(TAG, "Extended test failed, host returned 0x%x, function returned 0x%lx", ret, func_ret);
+                store_unit(unit_db_def::RESULT_FAILED);
+                free(result_buf);
+                state = flasher::ERROR;
+                return;
+            }
+
+            ESP_LOGI(TAG, "Extended test %u returned 0x%lx with %u bytes of result", items[idx].id, func_ret, result_len);
+            ESP_LOG_BUFFER_HEX_LEVEL(TAG, result_buf, std::min(result_len, (size_t)64), ESP_LOG_DEBUG);
+            free(result_buf);
         } else if (items[idx].type == flash_algo::EXTERNAL_TEST) {
             ESP_LOGW(TAG, "Unsupported ExternalTest type!");
         }
 
     }
 
+    store_unit(unit_db_def::RESULT_PASSED);
+
+    // NRST is shared across a multi-drop bus, so the reset waits for the last target
+    if (next_drop_target()) {
+        return;
+    }
+
     swd_prog::trigger_nrst();
 
     state = flasher::DONE;
 }
+
+void offline_flasher::prepare_image()
+{
+    // HEX/ELF/UF2 from the build are parsed once into a segment map, a raw binary is programmed as it is
+    fw_segmap_def::ingest_opts opts = {};
+    uint32_t erased_val = 0;
+    auto ret = asset->get_page_size(&opts.align);
+    ret = ret ?: asset->get_erased_byte_val(&erased_val);
+    ret = ret ?: asset->get_flash_start_addr(&opts.flash_start);
+    ret = ret ?: asset->get_flash_end_addr(&opts.flash_end);
+    opts.fill = (uint8_t)erased_val;
+    ret = ret ?: fw_segmap::ingest(fw_asset_manager::get_fw_path(), fw_asset_manager::SEGMAP_PATH, opts);
+    if (ret == ESP_OK) {
+        ESP_LOGI(TAG, "Programming from segment map %s", fw_asset_manager::SEGMAP_PATH);
+        fw_path = fw_asset_manager::SEGMAP_PATH;
+    } else if (ret == ESP_ERR_NOT_SUPPORTED || ret == ESP_ERR_NOT_FOUND) {
+        fw_path = fw_asset_manager::get_fw_path();
+    } else {
+        ESP_LOGE(TAG, "Firmware ingest failed: 0x%x", ret);
+        fw_path = nullptr; // Never program HEX text or an ELF as if it were a binary
+    }
+}
+
+esp_err_t offline_flasher::refresh_hashes()
+{
+    // Slot header, then the store index, hashing the file only when neither knows it
+    auto *store = asset_store::instance();
+    const uint8_t *img = nullptr;
+    size_t img_len = 0;
+    asset_slot_def::header slot_header = {};
+    esp_err_t ret = ESP_OK;
+    sha_valid = false;
+    if (asset_slot::instance()->acquire(&img, &img_len, &slot_header) == ESP_OK) {
+        asset_slot::instance()->release();
+        memcpy(fw_sha, slot_header.sha256, sizeof(fw_sha));
+    } else if (store->get_active_sha(asset_store_def::KIND_FW, fw_sha) != ESP_OK) {
+        ret = fw_asset_manager::get_sha256_from_file(fw_asset_manager::get_fw_path(), fw_sha);
+    }
+
+    if (store->get_active_sha(asset_store_def::KIND_ALGO, algo_sha) != ESP_OK) {
+        ret = ret ?: fw_asset_manager::get_sha256_from_file(fw_asset_manager::get_algo_path(), algo_sha);
+    }
+
+    sha_valid = ret == ESP_OK;
+    return ret;
+}
+
+bool offline_flasher::hold_slot_image()
+{
+    if (!slot_held) {
+        slot_held = asset_slot::instance()->acquire(&slot_img, &slot_len) == ESP_OK;
+    }
+
+    return slot_held;
+}
+
+void offline_flasher::drop_slot_image()
+{
+    if (slot_held) {
+        asset_slot::instance()->release();
+        slot_held = false;
+        slot_img = nullptr;
+        slot_len = 0;
+    }
+}
+
+bool offline_flasher::next_drop_target()
+{
+    if (drop_idx + 1 >= swd->get_drop_target_cnt()) {
+        drop_idx = 0;
+        return false;
+    }
+
+    drop_idx += 1;
+    state = flasher::DETECT;
+    return true;
+}
+
+void offline_flasher::read_unit_id()
+{
+    unit = {};
+    unit_known = false;
+    if (uid_len == 0) {
+        return;
+    }
+
+    if (swd->read_memory(uid_addr, unit.uid, uid_len) != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to read unit ID, unit won't be tracked");
+        return;
+    }
+
+    unit.uid_len = uid_len;
+    memcpy(unit.fw_sha, fw_sha, sizeof(fw_sha));
+    memcpy(unit.algo_sha, algo_sha, sizeof(algo_sha));
+    unit_known = true;
+    ESP_LOG_BUFFER_HEX_LEVEL(TAG, unit.uid, uid_len, ESP_LOG_INFO);
+}
+
+bool offline_flasher::unit_up_to_date()
+{
+    unit_db_def::record record = {};
+    if (!unit_known || !sha_valid || units->lookup(unit.uid, unit.uid_len, &record) != ESP_OK) {
+        return false;
+    }
+
+    if (record.result == unit_db_def::RESULT_UNKNOWN || memcmp(record.fw_sha, fw_sha, sizeof(fw_sha)) != 0
+        || memcmp(record.algo_sha, algo_sha, sizeof(algo_sha)) != 0) {
+        ESP_LOGI(TAG, "Known unit, last programmed with a different image or algo");
+        return false;
+    }
+
+    // The record says what should be there; the checksum says whether it still is
+    uint32_t crc = 0;
+    auto ret = swd->checksum_flash(record.flash_addr, record.flash_len, &crc);
+    if (ret != ESP_OK || crc != record.flash_crc) {
+        ESP_LOGI(TAG, "Known unit, flash doesn't match its record (0x%x, CRC 0x%08lx vs 0x%08lx)", ret, crc, record.flash_crc);
+        return false;
+    }
+
+    ESP_LOGI(TAG, "Unit already holds this image (last result %u), skipping erase and program", record.result);
+    unit = record;
+    return true;
+}
+
+void offline_flasher::store_unit(unit_db_def::run_result result)
+{
+    if (!unit_known) {
+        return;
+    }
+
+    unit.result = result;
+    if (units->store(unit) != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to store unit record");
+    }
+}
+
+void offline_flasher::report_program()
+{
+    const auto &ranges = swd->get_last_program_ranges();
+    if (reporter == nullptr || ranges.empty()) {
+        return;
+    }
+
+    rpc::report::prog_event event = {};
+    event.addr = ranges.front().addr;
+    event.len = ranges.back().addr + ranges.back().len - ranges.front().addr;
+    memcpy(event.flash_algo_hash, algo_sha, sizeof(event.flash_algo_hash));
+    memcpy(event.firmware_hash, fw_sha, sizeof(event.firmware_hash));
+    if (unit_known) {
+        event.target_sn_len = unit.uid_len;
+        memcpy(event.target_sn, unit.uid, unit.uid_len);
+    }
+
+    if (!overlay->empty()) {
+        event.overlay_seq = overlay->get_unit_seq();
+        event.overlay = &overlay->get_patches();
+    }
+
+    auto ret = reporter->report_program(&event);
+    if (ret != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to report programming: 0x%x", ret);
+    }
+}
+
+void offline_flasher::report_self_test(uint16_t test_id, uint32_t func_ret, uint8_t *ret_buf, size_t ret_len)
+{
+    if (reporter == nullptr) {
+        return;
+    }
+
+    rpc::report::self_test_event event = {};
+    event.test_id = test_id;
+    event.return_num = func_ret;
+    event.ret_buf = ret_buf;
+    event.ret_len = ret_len;
+    event.rtt_buf = rtt_client::instance()->get_capture(&event.rtt_len); // Whatever the target logged during the test
+    memcpy(event.flash_algo_hash, algo_sha, sizeof(event.flash_algo_hash));
+    if (unit_known) {
+        event.target_sn_len = unit.uid_len;
+        memcpy(event.target_sn, unit.uid, unit.uid_len);
+    }
+
+    auto ret = reporter->report_self_test(&event, ret_buf, ret_len);
+    if (ret != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to report test %u: 0x%x", test_id, ret);
+    }
+}
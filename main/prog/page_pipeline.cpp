@@ -0,0 +1,226 @@
+#include <cstring>
+#include <algorithm>
+#include <esp_log.h>
+#include <esp_crc.h>
+#include <esp_timer.h>
+#include <esp_heap_caps.h>
+
+#include "page_pipeline.hpp"
+
+page_pipeline::~page_pipeline()
+{
+    stop();
+}
+
+esp_err_t page_pipeline::start(const pipeline_def::source &_src)
+{
+    stop();
+    if (_src.chunk_size == 0 || (_src.image == nullptr && _src.lz4 == nullptr && _src.file == nullptr)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    src = _src;
+    stats = {};
+    page_cnt = (src.len + src.chunk_size - 1) / src.chunk_size;
+    next_idx = 0;
+    running_crc = 0;
+    stopping = false;
+
+    free_queue = xQueueCreate(pipeline_def::buf_cnt, sizeof(uint8_t));
+    filled_queue = xQueueCreate(pipeline_def::buf_cnt, sizeof(pipeline_def::page_desc));
+    producer_done = xSemaphoreCreateBinary();
+    if (free_queue == nullptr || filled_queue == nullptr || producer_done == nullptr) {
+        ESP_LOGE(TAG, "Failed to create queues");
+        stop();
+        return ESP_ERR_NO_MEM;
+    }
+
+    for (uint8_t idx = 0; idx < pipeline_def::buf_cnt; idx += 1) {
+        // Internal RAM is preferred as both SWD and CRC go over every byte, PSRAM is the fallback
+        bufs[idx] = static_cast<uint8_t *>(heap_caps_malloc(src.chunk_size, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT));
+        if (bufs[idx] == nullptr) {
+            bufs[idx] = static_cast<uint8_t *>(heap_caps_malloc(src.chunk_size, MALLOC_CAP_SPIRAM));
+        }
+
+        if (bufs[idx] == nullptr) {
+            ESP_LOGE(TAG, "Failed to allocate page buffer");
+            stop();
+            return ESP_ERR_NO_MEM;
+        }
+
+        xQueueSend(free_queue, &idx, portMAX_DELAY);
+    }
+
+    // Producer goes to the other core, so the data side overlaps with the SWD bit-banging
+    BaseType_t core_id = xPortGetCoreID() == 0 ? 1 : 0;
+    if (xTaskCreatePinnedToCore(producer_task, "page_prep", pipeline_def::producer_stack, this, tskIDLE_PRIORITY + 4, nullptr, core_id) != pdPASS) {
+        ESP_LOGW(TAG, "Failed to start producer, preparing pages inline");
+        return ESP_OK;
+    }
+
+    producer_running = true;
+    stats.threaded = true;
+    return ESP_OK;
+}
+
+esp_err_t page_pipeline::next(pipeline_def::page_desc *out)
+{
+    if (out == nullptr || free_queue == nullptr || next_idx >= page_cnt) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    if (!producer_running) {
+        uint8_t buf_idx = 0;
+        xQueueReceive(free_queue, &buf_idx, portMAX_DELAY);
+        prep(next_idx, buf_idx, out);
+    } else {
+        stats.max_depth = std::max(stats.max_depth, (uint32_t)uxQueueMessagesWaiting(filled_queue));
+        int64_t wait_ts = esp_timer_get_time();
+        xQueueReceive(filled_queue, out, portMAX_DELAY);
+        stats.consumer_stall_us += esp_timer_get_time() - wait_ts;
+    }
+
+    next_idx += 1;
+    stats.pages += 1;
+    return out->ret;
+}
+
+void page_pipeline::release(const pipeline_def::page_desc &desc)
+{
+    if (free_queue != nullptr) {
+        xQueueSend(free_queue, &desc.buf_idx, portMAX_DELAY);
+    }
+}
+
+void page_pipeline::stop()
+{
+    if (producer_running) {
+        // Keep handing back buffers until the producer notices; it may be blocked waiting for one
+        stopping = true;
+        while (xSemaphoreTake(producer_done, pdMS_TO_TICKS(5)) != pdTRUE) {
+            pipeline_def::page_desc desc = {};
+            while (xQueueReceive(filled_queue, &desc, 0) == pdTRUE) {
+                xQueueSend(free_queue, &desc.buf_idx, portMAX_DELAY);
+            }
+        }
+
+        producer_running = false;
+    }
+
+    for (auto &buf : bufs) {
+        if (buf != nullptr) {
+            heap_caps_free(buf);
+            buf = nullptr;
+        }
+    }
+
+    if (free_queue != nullptr) {
+        vQueueDelete(free_queue);
+        free_queue = nullptr;
+    }
+
+    if (filled_queue != nullptr) {
+        vQueueDelete(filled_queue);
+        filled_queue = nullptr;
+    }
+
+    if (producer_done != nullptr) {
+        vSemaphoreDelete(producer_done);
+        producer_done = nullptr;
+    }
+}
+
+size_t page_pipeline::depth() const
+{
+    return filled_queue != nullptr ? uxQueueMessagesWaiting(filled_queue) : 0;
+}
+
+const pipeline_def::stats &page_pipeline::get_stats() const
+{
+    return stats;
+}
+
+void page_pipeline::log_stats() const
+{
+    ESP_LOGI(TAG, "%lu pages%s, prep %llu us; producer waited %llu us (SWD-bound), SWD waited %llu us (prep-bound); max depth %lu of %u",
+             stats.pages, stats.threaded ? "" : " inline", stats.prep_us, stats.producer_stall_us, stats.consumer_stall_us,
+             stats.max_depth, pipeline_def::buf_cnt);
+}
+
+void page_pipeline::prep(uint32_t page_idx, uint8_t buf_idx, pipeline_def::page_desc *out)
+{
+    int64_t start_ts = esp_timer_get_time();
+    uint32_t offset = page_idx * src.chunk_size;
+    uint8_t *buf = bufs[buf_idx];
+    *out = {};
+    out->page_idx = page_idx;
+    out->addr = src.addr + offset;
+    out->len = std::min((size_t)src.chunk_size, src.len - offset);
+    out->buf_idx = buf_idx;
+    out->data = buf;
+    out->ret = ESP_OK;
+
+    if (src.image != nullptr) {
+        out->data = src.image + offset;
+    } else if (src.lz4 != nullptr) {
+        out->ret = src.lz4->read(offset, buf, out->len);
+    } else {
+        // A short read leaves the page with a tail ProgramPage can't take, and the file has changed under us anyway
+        size_t read_len = fread(buf, 1, out->len, src.file);
+        if (read_len != out->len) {
+            ESP_LOGE(TAG, "Trying to read %lu bytes but got only %u bytes", out->len, read_len);
+            out->ret = ESP_ERR_INVALID_SIZE;
+        }
+    }
+
+    // Per-unit data (SN, MAC, keys etc.) goes into the page buffer only, the image stays untouched
+    bool patched = false;
+    if (out->ret == ESP_OK && overlay->overlaps(out->addr, out->len)) {
+        if (out->data != buf) {
+            memcpy(buf, out->data, out->len);
+            out->data = buf;
+        }
+
+        overlay->apply(out->addr, buf, out->len);
+        patched = true;
+    }
+
+    running_crc = esp_crc32_le(running_crc, out->data, out->len);
+    out->crc = running_crc;
+
+    // Nothing to program on a page that's all erased value, as long as no overlay landed on it
+    if (out->ret != ESP_OK || patched) {
+        out->blank = false;
+    } else if (src.image != nullptr && src.image == img_cache->data()) {
+        out->blank = img_cache->is_blank(offset, out->len);
+    } else {
+        out->blank = std::all_of(out->data, out->data + out->len, [this](uint8_t val) { return val == (uint8_t)src.erased_val; });
+    }
+
+    stats.prep_us += esp_timer_get_time() - start_ts;
+}
+
+void page_pipeline::producer_task(void *_ctx)
+{
+    auto *ctx = static_cast<page_pipeline *>(_ctx);
+    for (uint32_t idx = 0; idx < ctx->page_cnt && !ctx->stopping; idx += 1) {
+        uint8_t buf_idx = 0;
+        int64_t wait_ts = esp_timer_get_time();
+        xQueueReceive(ctx->free_queue, &buf_idx, portMAX_DELAY);
+        ctx->stats.producer_stall_us += esp_timer_get_time() - wait_ts;
+        if (ctx->stopping) {
+            xQueueSend(ctx->free_queue, &buf_idx, portMAX_DELAY);
+            break;
+        }
+
+        pipeline_def::page_desc desc = {};
+        ctx->prep(idx, buf_idx, &desc);
+        xQueueSend(ctx->filled_queue, &desc, portMAX_DELAY);
+        if (desc.ret != ESP_OK) {
+            break;
+        }
+    }
+
+    xSemaphoreGive(ctx->producer_done);
+    vTaskDelete(nullptr);
+}
@@ -0,0 +1,332 @@
+#include <cstring>
+#include <algorithm>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_heap_caps.h>
+#include <nvs_flash.h>
+#include <swd_host.h>
+
+#include "rtt_client.hpp"
+
+esp_err_t rtt_client::init()
+{
+    if (ring != nullptr) {
+        return ESP_OK;
+    }
+
+    ring_buf = (uint8_t *)heap_caps_calloc(rtt_def::ring_size, 1, MALLOC_CAP_SPIRAM);
+    capture_buf = (uint8_t *)heap_caps_calloc(rtt_def::capture_size, 1, MALLOC_CAP_SPIRAM);
+    if (ring_buf == nullptr || capture_buf == nullptr) {
+        ESP_LOGE(TAG, "Failed to allocate RTT buffers");
+        free(ring_buf);
+        free(capture_buf);
+        ring_buf = nullptr;
+        capture_buf = nullptr;
+        return ESP_ERR_NO_MEM;
+    }
+
+    ring = xRingbufferCreateStatic(rtt_def::ring_size, RINGBUF_TYPE_BYTEBUF, ring_buf, &ring_ctx);
+    if (ring == nullptr) {
+        ESP_LOGE(TAG, "Failed to set up RTT ringbuffer");
+        return ESP_ERR_NO_MEM;
+    }
+
+    esp_err_t ret = ESP_OK;
+    nvs_handle = nvs::open_nvs_handle(NVS_NS, NVS_READWRITE, &ret);
+    if (ret != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to open NVS, control block address won't be cached: 0x%x", ret);
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t rtt_client::attach(uint32_t scan_start, uint32_t scan_len, const uint8_t *fw_hash, bool allow_scan)
+{
+    detach();
+    poll_ms = rtt_def::default_poll_ms;
+    last_poll_ts = esp_timer_get_time();
+
+    char key[16] = {};
+    uint32_t cached_addr = 0;
+    bool has_cache = false;
+    if (fw_hash != nullptr && nvs_handle != nullptr) {
+        get_nvs_key(fw_hash, key, sizeof(key));
+        has_cache = nvs_handle->get_item(key, cached_addr) == ESP_OK;
+    }
+
+    if (has_cache) {
+        cb_addr = cached_addr;
+        if (probe(cb_addr, &up_buf_cnt)) {
+            state = rtt_def::ATTACHED;
+            ESP_LOGI(TAG, "Attached to cached control block @ 0x%08lx", cb_addr);
+            return ESP_OK;
+        }
+
+        if (!allow_scan) {
+            state = rtt_def::ARMED; // Target code probably hasn't called SEGGER_RTT_Init() yet
+            return ESP_ERR_NOT_FOUND;
+        }
+    }
+
+    if (!allow_scan) {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    auto ret = scan(scan_start, scan_len, &cb_addr);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    state = rtt_def::ATTACHED;
+    ESP_LOGI(TAG, "Found control block @ 0x%08lx, %lu up-buffers", cb_addr, up_buf_cnt);
+
+    if (fw_hash != nullptr && nvs_handle != nullptr && cb_addr != cached_addr) {
+        ret = nvs_handle->set_item(key, cb_addr);
+        ret = ret ?: nvs_handle->commit();
+        if (ret != ESP_OK) {
+            ESP_LOGW(TAG, "Failed to cache control block address: 0x%x", ret);
+        }
+    }
+
+    return ESP_OK;
+}
+
+void rtt_client::detach()
+{
+    state = rtt_def::DETACHED;
+    cb_addr = 0;
+    up_buf_cnt = 0;
+}
+
+esp_err_t rtt_client::poll()
+{
+    if (state == rtt_def::ARMED) {
+        last_poll_ts = esp_timer_get_time();
+        if (!probe(cb_addr, &up_buf_cnt)) {
+            return ESP_OK;
+        }
+
+        state = rtt_def::ATTACHED;
+        ESP_LOGI(TAG, "Control block @ 0x%08lx is up", cb_addr);
+    }
+
+    if (state != rtt_def::ATTACHED) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    // Header and all descriptors in one go, rather than a few words per buffer
+    uint8_t table[sizeof(rtt_def::cb_header) + rtt_def::max_up_buf_cnt * sizeof(rtt_def::buf_desc)] = {};
+    uint32_t table_len = sizeof(rtt_def::cb_header) + up_buf_cnt * sizeof(rtt_def::buf_desc);
+    if (swd_read_memory(cb_addr, table, table_len) < 1) {
+        ESP_LOGE(TAG, "Failed to read control block");
+        return ESP_ERR_INVALID_RESPONSE;
+    }
+
+    auto *header = (rtt_def::cb_header *)table;
+    if (memcmp(header->id, rtt_def::cb_id, sizeof(rtt_def::cb_id)) != 0) {
+        ESP_LOGW(TAG, "Control block @ 0x%08lx is gone", cb_addr);
+        state = rtt_def::ARMED;
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    size_t total_drained = 0;
+    uint32_t min_buf_size = UINT32_MAX;
+    for (uint32_t idx = 0; idx < up_buf_cnt; idx += 1) {
+        rtt_def::buf_desc desc = {};
+        memcpy(&desc, table + sizeof(rtt_def::cb_header) + idx * sizeof(rtt_def::buf_desc), sizeof(desc));
+        if (desc.size == 0 || desc.buf_ptr == 0) {
+            continue;
+        }
+
+        size_t drained = 0;
+        auto ret = drain_buf(cb_addr + sizeof(rtt_def::cb_header) + idx * sizeof(rtt_def::buf_desc), desc, &drained);
+        if (ret != ESP_OK) {
+            return ret;
+        }
+
+        total_drained += drained;
+        min_buf_size = std::min(min_buf_size, desc.size);
+    }
+
+    rtt_stats.polls += 1;
+    if (total_drained == 0) {
+        rtt_stats.empty_polls += 1;
+    }
+
+    update_interval(total_drained, min_buf_size);
+    return ESP_OK;
+}
+
+esp_err_t rtt_client::poll_if_due()
+{
+    if (state == rtt_def::DETACHED) {
+        return ESP_OK;
+    }
+
+    if (esp_timer_get_time() - last_poll_ts < (int64_t)poll_ms * 1000) {
+        return ESP_OK;
+    }
+
+    return poll();
+}
+
+size_t rtt_client::read(uint8_t *buf, size_t len, TickType_t wait_ticks)
+{
+    if (ring == nullptr || buf == nullptr || len < 1) {
+        return 0;
+    }
+
+    size_t actual_len = 0;
+    auto *item = (uint8_t *)xRingbufferReceiveUpTo(ring, &actual_len, wait_ticks, len);
+    if (item == nullptr) {
+        return 0;
+    }
+
+    memcpy(buf, item, actual_len);
+    vRingbufferReturnItem(ring, item);
+    return actual_len;
+}
+
+void rtt_client::reset_capture()
+{
+    capture_len = 0;
+}
+
+const uint8_t *rtt_client::get_capture(size_t *len_out) const
+{
+    if (len_out != nullptr) {
+        *len_out = capture_len;
+    }
+
+    return capture_buf;
+}
+
+rtt_def::cb_state rtt_client::get_state() const
+{
+    return state;
+}
+
+uint32_t rtt_client::get_poll_interval_ms() const
+{
+    return poll_ms;
+}
+
+const rtt_def::stats &rtt_client::get_stats() const
+{
+    return rtt_stats;
+}
+
+bool rtt_client::probe(uint32_t addr, uint32_t *up_cnt_out)
+{
+    rtt_def::cb_header header = {};
+    if (swd_read_memory(addr, (uint8_t *)&header, sizeof(header)) < 1) {
+        return false;
+    }
+
+    if (memcmp(header.id, rtt_def::cb_id, sizeof(rtt_def::cb_id)) != 0 || header.max_up_buf < 1 || header.max_up_buf > 32) {
+        return false;
+    }
+
+    if (up_cnt_out != nullptr) {
+        *up_cnt_out = std::min((uint32_t)header.max_up_buf, (uint32_t)rtt_def::max_up_buf_cnt);
+    }
+
+    return true;
+}
+
+esp_err_t rtt_client::scan(uint32_t start, uint32_t len, uint32_t *addr_out)
+{
+    // Chunks overlap by the ID length so that an ID straddling two reads is still found
+    const uint32_t stride = rtt_def::xfer_size - sizeof(rtt_def::cb_header::id);
+    for (uint32_t offset = 0; offset < len; offset += stride) {
+        uint32_t chunk_len = std::min((uint32_t)rtt_def::xfer_size, len - offset);
+        if (swd_read_memory(start + offset, xfer_buf, chunk_len) < 1) {
+            ESP_LOGE(TAG, "Scan failed @ 0x%08lx", start + offset);
+            return ESP_ERR_INVALID_RESPONSE;
+        }
+
+        for (uint32_t pos = 0; pos + sizeof(rtt_def::cb_id) <= chunk_len; pos += 4) {
+            if (memcmp(xfer_buf + pos, rtt_def::cb_id, sizeof(rtt_def::cb_id)) == 0 && probe(start + offset + pos, &up_buf_cnt)) {
+                *addr_out = start + offset + pos;
+                return ESP_OK;
+            }
+        }
+
+        if (chunk_len < rtt_def::xfer_size) {
+            break;
+        }
+    }
+
+    ESP_LOGW(TAG, "No control block in 0x%08lx - 0x%08lx", start, start + len);
+    return ESP_ERR_NOT_FOUND;
+}
+
+esp_err_t rtt_client::drain_buf(uint32_t desc_addr, const rtt_def::buf_desc &desc, size_t *drained_out)
+{
+    *drained_out = 0;
+    if (desc.wr_off >= desc.size || desc.rd_off >= desc.size || desc.wr_off == desc.rd_off) {
+        return ESP_OK;
+    }
+
+    uint32_t rd_off = desc.rd_off;
+    while (rd_off != desc.wr_off) {
+        uint32_t end = desc.wr_off > rd_off ? desc.wr_off : desc.size;
+        uint32_t chunk_len = std::min(end - rd_off, (uint32_t)rtt_def::xfer_size);
+        if (swd_read_memory(desc.buf_ptr + rd_off, xfer_buf, chunk_len) < 1) {
+            ESP_LOGE(TAG, "Failed to read up-buffer @ 0x%08lx", desc.buf_ptr + rd_off);
+            return ESP_ERR_INVALID_RESPONSE;
+        }
+
+        append(xfer_buf, chunk_len);
+        *drained_out += chunk_len;
+        rd_off += chunk_len;
+        if (rd_off >= desc.size) {
+            rd_off = 0;
+        }
+    }
+
+    // Single RdOff write-back per buffer, the target only needs to see it once everything is copied out
+    if (swd_write_word(desc_addr + offsetof(rtt_def::buf_desc, rd_off), rd_off) < 1) {
+        ESP_LOGE(TAG, "Failed to update RdOff");
+        return ESP_ERR_INVALID_RESPONSE;
+    }
+
+    return ESP_OK;
+}
+
+void rtt_client::append(const uint8_t *buf, size_t len)
+{
+    rtt_stats.bytes_read += len;
+    if (ring != nullptr && xRingbufferSend(ring, buf, len, 0) != pdTRUE) {
+        rtt_stats.bytes_dropped += len;
+    }
+
+    if (capture_buf != nullptr && capture_len < rtt_def::capture_size) {
+        size_t copy_len = std::min(len, rtt_def::capture_size - capture_len);
+        memcpy(capture_buf + capture_len, buf, copy_len);
+        capture_len += copy_len;
+    }
+}
+
+void rtt_client::update_interval(size_t drained, uint32_t min_buf_size)
+{
+    int64_t now = esp_timer_get_time();
+    int64_t elapsed_us = std::max(now - last_poll_ts, (int64_t)1);
+    last_poll_ts = now;
+
+    if (drained == 0 || min_buf_size == UINT32_MAX) {
+        poll_ms = std::min(poll_ms * 2, rtt_def::max_poll_ms);
+        return;
+    }
+
+    // Aim to come back when the smallest up-buffer is about half full at the current rate
+    uint64_t rate_bps = ((uint64_t)drained * 1000000ULL) / (uint64_t)elapsed_us;
+    uint64_t half_full_ms = rate_bps == 0 ? rtt_def::max_poll_ms : ((uint64_t)(min_buf_size / 2) * 1000ULL) / rate_bps;
+    poll_ms = (uint32_t)std::clamp(half_full_ms, (uint64_t)rtt_def::min_poll_ms, (uint64_t)rtt_def::max_poll_ms);
+}
+
+void rtt_client::get_nvs_key(const uint8_t *fw_hash, char *key_out, size_t key_len)
+{
+    // NVS keys are 15 chars max, 6 bytes of SHA256 is plenty to tell firmware builds apart
+    snprintf(key_out, key_len, "a%02x%02x%02x%02x%02x%02x", fw_hash[0], fw_hash[1], fw_hash[2], fw_hash[3], fw_hash[4], fw_hash[5]);
+}
@@ -0,0 +1,173 @@
+#include <cstring>
+#include <algorithm>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <swd_host.h>
+
+#include "semihost.hpp"
+#include "rtt_client.hpp"
+
+void semihost::begin()
+{
+    start_ts = esp_timer_get_time();
+    exit_reason = 0;
+}
+
+semihost_def::result semihost::handle(uint32_t op, uint32_t param, uint32_t *ret_out)
+{
+    switch (op) {
+        case semihost_def::SYS_WRITE0: {
+            return do_write0(param);
+        }
+
+        case semihost_def::SYS_WRITE: {
+            return do_write(param, ret_out);
+        }
+
+        case semihost_def::SYS_READ: {
+            return do_read(param, ret_out);
+        }
+
+        case semihost_def::SYS_CLOCK: {
+            *ret_out = (uint32_t)((esp_timer_get_time() - start_ts) / 10000); // Centiseconds since the call started
+            return semihost_def::RESUME;
+        }
+
+        case semihost_def::SYS_EXIT: {
+            exit_reason = param; // On 32-bit targets the reason code is in R1 itself, not a parameter block
+            flush();
+            return semihost_def::EXIT;
+        }
+
+        default: {
+            ESP_LOGW(TAG, "Unsupported op 0x%02lx", op);
+            *ret_out = UINT32_MAX;
+            return semihost_def::RESUME;
+        }
+    }
+}
+
+void semihost::flush()
+{
+    if (out_len < 1) {
+        return;
+    }
+
+    rtt_client::instance()->append(out_buf, out_len);
+
+    // One log line per target line, a trailing partial line is logged as-is
+    size_t line_start = 0;
+    for (size_t idx = 0; idx <= out_len; idx += 1) {
+        if (idx == out_len || out_buf[idx] == '\n') {
+            if (idx > line_start) {
+                ESP_LOGI(TAG, "%.*s", (int)(idx - line_start), out_buf + line_start);
+            }
+
+            line_start = idx + 1;
+        }
+    }
+
+    out_len = 0;
+}
+
+esp_err_t semihost::set_input(const uint8_t *buf, size_t len)
+{
+    if (len > sizeof(in_buf) || (buf == nullptr && len > 0)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (len > 0) {
+        memcpy(in_buf, buf, len);
+    }
+
+    in_len = len;
+    in_pos = 0;
+    return ESP_OK;
+}
+
+uint32_t semihost::get_exit_reason() const
+{
+    return exit_reason;
+}
+
+semihost_def::result semihost::do_write0(uint32_t str_ptr)
+{
+    // Bulk reads until the NUL shows up, rather than a byte per SWD transaction
+    size_t total = 0;
+    while (total < semihost_def::max_write0_len) {
+        // Stop at the next aligned boundary, so the read never runs past the end of a RAM/flash region
+        uint32_t chunk_len = sizeof(xfer_buf) - ((str_ptr + total) % sizeof(xfer_buf));
+        if (swd_read_memory(str_ptr + total, xfer_buf, chunk_len) < 1) {
+            ESP_LOGE(TAG, "SYS_WRITE0 failed to read @ 0x%08lx", str_ptr + total);
+            return semihost_def::FAILED;
+        }
+
+        auto *nul = (uint8_t *)memchr(xfer_buf, '\0', chunk_len);
+        size_t len = nul == nullptr ? chunk_len : (size_t)(nul - xfer_buf);
+        append(xfer_buf, len);
+        total += len;
+        if (nul != nullptr) {
+            break;
+        }
+    }
+
+    return semihost_def::RESUME;
+}
+
+semihost_def::result semihost::do_write(uint32_t param, uint32_t *ret_out)
+{
+    semihost_def::rw_block block = {};
+    if (swd_read_memory(param, (uint8_t *)&block, sizeof(block)) < 1) {
+        ESP_LOGE(TAG, "SYS_WRITE failed to read parameters");
+        return semihost_def::FAILED;
+    }
+
+    uint32_t offset = 0;
+    while (offset < block.len) {
+        uint32_t chunk_len = std::min((uint32_t)sizeof(xfer_buf), block.len - offset);
+        if (swd_read_memory(block.buf_ptr + offset, xfer_buf, chunk_len) < 1) {
+            ESP_LOGE(TAG, "SYS_WRITE failed to read @ 0x%08lx", block.buf_ptr + offset);
+            return semihost_def::FAILED;
+        }
+
+        append(xfer_buf, chunk_len);
+        offset += chunk_len;
+    }
+
+    *ret_out = 0; // Number of bytes NOT written
+    return semihost_def::RESUME;
+}
+
+semihost_def::result semihost::do_read(uint32_t param, uint32_t *ret_out)
+{
+    semihost_def::rw_block block = {};
+    if (swd_read_memory(param, (uint8_t *)&block, sizeof(block)) < 1) {
+        ESP_LOGE(TAG, "SYS_READ failed to read parameters");
+        return semihost_def::FAILED;
+    }
+
+    uint32_t copy_len = std::min(block.len, (uint32_t)(in_len - in_pos));
+    if (copy_len > 0 && swd_write_memory(block.buf_ptr, in_buf + in_pos, copy_len) < 1) {
+        ESP_LOGE(TAG, "SYS_READ failed to write @ 0x%08lx", block.buf_ptr);
+        return semihost_def::FAILED;
+    }
+
+    in_pos += copy_len;
+    *ret_out = block.len - copy_len; // Number of bytes NOT read, so equals to len at EOF
+    return semihost_def::RESUME;
+}
+
+void semihost::append(const uint8_t *buf, size_t len)
+{
+    while (len > 0) {
+        if (out_len == sizeof(out_buf)) {
+            flush();
+        }
+
+        size_t copy_len = std::min(len, sizeof(out_buf) - out_len);
+        memcpy(out_buf + out_len, buf, copy_len);
+        out_len += copy_len;
+        buf += copy_len;
+        len -= copy_len;
+    }
+}
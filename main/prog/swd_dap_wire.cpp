@@ -0,0 +1,122 @@
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_rom_sys.h>
+#include <DAP_config.h>
+#include <DAP.h>
+
+#include "swd_dap_wire.hpp"
+#include "swd_prog.hpp"
+
+esp_err_t swd_dap_wire::connect()
+{
+    // The host tool owns DP/AP state from here on, swd_host's view of it is no longer trustworthy
+    swd_prog::instance()->mark_dp_stale();
+    DAP_Data.debug_port = DAP_PORT_SWD;
+    PORT_SWD_SETUP();
+    return ESP_OK;
+}
+
+esp_err_t swd_dap_wire::disconnect()
+{
+    DAP_Data.debug_port = DAP_PORT_DISABLED;
+    PORT_OFF();
+    return ESP_OK;
+}
+
+uint8_t swd_dap_wire::transfer(uint8_t req, uint32_t *data)
+{
+    return SWD_Transfer(req, data);
+}
+
+void swd_dap_wire::swj_sequence(uint32_t bit_cnt, const uint8_t *data)
+{
+    SWJ_Sequence(bit_cnt, data);
+}
+
+void swd_dap_wire::swd_sequence(uint8_t info, const uint8_t *data_out, uint8_t *data_in)
+{
+    // SWD_Sequence() only clocks, turning SWDIO around for input is up to the caller (DAP.c does the same)
+    if (info & SWD_SEQUENCE_DIN) {
+        PIN_SWDIO_OUT_DISABLE();
+        SWD_Sequence(info, data_out, data_in);
+        PIN_SWDIO_OUT_ENABLE();
+    } else {
+        SWD_Sequence(info, data_out, data_in);
+    }
+}
+
+uint8_t swd_dap_wire::swj_pins(uint8_t out, uint8_t select, uint32_t wait_us)
+{
+    if (select & dap_def::PIN_SWCLK) {
+        if (out & dap_def::PIN_SWCLK) PIN_SWCLK_TCK_SET(); else PIN_SWCLK_TCK_CLR();
+    }
+
+    if (select & dap_def::PIN_SWDIO) {
+        if (out & dap_def::PIN_SWDIO) PIN_SWDIO_TMS_SET(); else PIN_SWDIO_TMS_CLR();
+    }
+
+    if (select & dap_def::PIN_nRESET) {
+        PIN_nRESET_OUT((out & dap_def::PIN_nRESET) ? 1 : 0);
+    }
+
+    // Wait for the selected pins to settle at the requested level, e.g. nRESET released by an external pull-up
+    if (wait_us > 0) {
+        int64_t start_ts = esp_timer_get_time();
+        while (((read_pins() ^ out) & select) != 0 && esp_timer_get_time() - start_ts < (int64_t)wait_us) {
+            esp_rom_delay_us(1);
+        }
+    }
+
+    return read_pins();
+}
+
+esp_err_t swd_dap_wire::set_clock(uint32_t clock_hz)
+{
+    if (clock_hz == 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    // Same delay calculation as DAP.c, the bit-banging loop is shared with it
+    if (clock_hz >= MAX_SWJ_CLOCK(DELAY_FAST_CYCLES)) {
+        DAP_Data.fast_clock = 1U;
+        DAP_Data.clock_delay = 1U;
+    } else {
+        DAP_Data.fast_clock = 0U;
+        uint32_t delay = ((CPU_CLOCK / 2U) + (clock_hz - 1U)) / clock_hz;
+        if (delay > IO_PORT_WRITE_CYCLES) {
+            delay -= IO_PORT_WRITE_CYCLES;
+            delay = (delay + (DELAY_SLOW_CYCLES - 1U)) / DELAY_SLOW_CYCLES;
+        } else {
+            delay = 1U;
+        }
+
+        DAP_Data.clock_delay = delay;
+    }
+
+    ESP_LOGD(TAG, "SWJ clock %lu Hz, delay %lu", clock_hz, (uint32_t)DAP_Data.clock_delay);
+    return ESP_OK;
+}
+
+void swd_dap_wire::configure(uint8_t turnaround, bool data_phase, uint8_t idle_cycles)
+{
+    DAP_Data.swd_conf.turnaround = turnaround;
+    DAP_Data.swd_conf.data_phase = data_phase ? 1U : 0U;
+    DAP_Data.transfer.idle_cycles = idle_cycles;
+}
+
+bool swd_dap_wire::reset_target()
+{
+    return RESET_TARGET() != 0;
+}
+
+void swd_dap_wire::delay_us(uint32_t us)
+{
+    esp_rom_delay_us(us);
+}
+
+uint8_t swd_dap_wire::read_pins()
+{
+    return (PIN_SWCLK_TCK_IN() ? dap_def::PIN_SWCLK : 0) |
+           (PIN_SWDIO_TMS_IN() ? dap_def::PIN_SWDIO : 0) |
+           (PIN_nRESET_IN() ? dap_def::PIN_nRESET : 0);
+}
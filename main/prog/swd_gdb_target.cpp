@@ -0,0 +1,412 @@
+#include <cstring>
+#include <algorithm>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <esp_log.h>
+#include <swd_host.h>
+
+#include "swd_gdb_target.hpp"
+#include "swd_wire_stats.hpp"
+
+esp_err_t swd_gdb_target::attach()
+{
+    if (!owner) {
+        if (swd->lock(pdMS_TO_TICKS(swd_gdb_def::owner_wait_ms)) != ESP_OK) {
+            ESP_LOGE(TAG, "SWD still busy, e.g. the flasher is mid-unit");
+            return ESP_ERR_TIMEOUT;
+        }
+
+        owner = true;
+    }
+
+    swd_wire_op_scope wire_op(swd_wire_def::OP_DEBUG);
+    regs_valid = false;
+    stepping = false;
+
+    auto ret = swd->connect();
+    ret = ret ?: fpb_init();
+    return ret;
+}
+
+esp_err_t swd_gdb_target::detach()
+{
+    swd_wire_op_scope wire_op(swd_wire_def::OP_DEBUG);
+    for (uint32_t slot = 0; slot < fpb_cnt; slot += 1) {
+        fpb_key[slot] = UINT32_MAX;
+        fpb_halves[slot] = 0;
+        fpb_write(slot);
+    }
+
+    swd_write_word(swd_def::REG_FP_CTRL, swd_def::FP_CTRL_KEY); // KEY set, ENABLE cleared
+    return resume();
+}
+
+void swd_gdb_target::release()
+{
+    if (owner) {
+        owner = false;
+        swd->unlock();
+    }
+}
+
+esp_err_t swd_gdb_target::halt()
+{
+    swd_wire_op_scope wire_op(swd_wire_def::OP_DEBUG);
+    regs_valid = false;
+    stepping = false;
+    return swd->halt();
+}
+
+esp_err_t swd_gdb_target::resume()
+{
+    swd_wire_op_scope wire_op(swd_wire_def::OP_DEBUG);
+    auto ret = prepare_resume();
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    if (swd_write_word(swd_def::REG_DHCSR, swd_def::DHCSR_DBGKEY | swd_def::DHCSR_C_DEBUGEN) < 1) {
+        ESP_LOGE(TAG, "Failed to resume");
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t swd_gdb_target::step()
+{
+    swd_wire_op_scope wire_op(swd_wire_def::OP_DEBUG);
+    auto ret = prepare_resume();
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    // Interrupts masked, otherwise a pending SysTick makes every step land in its handler
+    stepping = true;
+    if (swd_write_word(swd_def::REG_DHCSR, swd_def::DHCSR_DBGKEY | swd_def::DHCSR_C_DEBUGEN | swd_def::DHCSR_C_MASKINTS | swd_def::DHCSR_C_STEP) < 1) {
+        ESP_LOGE(TAG, "Failed to step");
+        stepping = false;
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t swd_gdb_target::reset(bool halt_after)
+{
+    swd_wire_op_scope wire_op(swd_wire_def::OP_DEBUG);
+    uint32_t demcr = 0;
+    if (swd->get_mem_cache().flush() < 1 || swd_read_word(swd_def::REG_DEMCR, &demcr) < 1) {
+        ESP_LOGE(TAG, "Failed to prepare reset");
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    // Vector catch halts the core on the very first instruction, before any user code runs
+    if (halt_after) {
+        swd_write_word(swd_def::REG_DEMCR, demcr | swd_def::DEMCR_VC_CORERESET);
+    }
+
+    swd_write_word(swd_def::REG_AIRCR, swd_def::AIRCR_SYSRESETREQ); // No ack expected, the core is gone mid-transfer
+    swd->get_mem_cache().invalidate();
+    regs_valid = false;
+    stepping = false;
+    vTaskDelay(pdMS_TO_TICKS(swd_gdb_def::reset_settle_ms));
+
+    if (!halt_after) {
+        return ESP_OK;
+    }
+
+    auto ret = swd->halt();
+    swd_write_word(swd_def::REG_DEMCR, demcr & ~swd_def::DEMCR_VC_CORERESET);
+    swd_write_word(swd_def::REG_DFSR, swd_def::DFSR_CLEAR_ALL);
+    return ret;
+}
+
+esp_err_t swd_gdb_target::poll_stop(gdb_def::stop_reason *reason)
+{
+    swd_wire_op_scope wire_op(swd_wire_def::OP_DEBUG);
+    uint32_t dhcsr = 0;
+    if (swd_read_word(swd_def::REG_DHCSR, &dhcsr) < 1) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    if ((dhcsr & swd_def::DHCSR_S_HALT) == 0) {
+        *reason = gdb_def::STOP_RUNNING;
+        return ESP_OK;
+    }
+
+    uint32_t dfsr = 0;
+    if (swd_read_word(swd_def::REG_DFSR, &dfsr) < 1) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    if ((dfsr & swd_def::DFSR_BKPT) != 0) {
+        *reason = gdb_def::STOP_BREAKPOINT;
+    } else {
+        *reason = stepping ? gdb_def::STOP_STEP : gdb_def::STOP_HALTED;
+    }
+
+    stepping = false;
+    regs_valid = false;
+    swd_write_word(swd_def::REG_DFSR, swd_def::DFSR_CLEAR_ALL);
+    return ESP_OK;
+}
+
+esp_err_t swd_gdb_target::read_core_regs(uint32_t *regs_out, size_t cnt)
+{
+    swd_wire_op_scope wire_op(swd_wire_def::OP_DEBUG);
+    if (regs_out == nullptr) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    // One sweep per stop; 'g', then 'p' for the same registers, are served from here
+    if (!regs_valid) {
+        for (uint32_t idx = 0; idx < gdb_def::core_reg_cnt; idx += 1) {
+            if (swd_read_core_register(idx, &regs[idx]) < 1) {
+                ESP_LOGE(TAG, "Failed to read core register %lu", idx);
+                return ESP_ERR_INVALID_STATE;
+            }
+        }
+
+        regs_valid = true;
+    }
+
+    memcpy(regs_out, regs, std::min(cnt, gdb_def::core_reg_cnt) * sizeof(uint32_t));
+    return ESP_OK;
+}
+
+esp_err_t swd_gdb_target::write_core_reg(uint32_t idx, uint32_t val)
+{
+    swd_wire_op_scope wire_op(swd_wire_def::OP_DEBUG);
+    if (idx >= gdb_def::core_reg_cnt) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (swd_write_core_register(idx, val) < 1) {
+        ESP_LOGE(TAG, "Failed to write core register %lu", idx);
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    regs[idx] = val;
+    return ESP_OK;
+}
+
+esp_err_t swd_gdb_target::read_memory(uint32_t addr, uint8_t *buf, size_t len)
+{
+    swd_wire_op_scope wire_op(swd_wire_def::OP_DEBUG);
+    return swd->read_memory(addr, buf, len);
+}
+
+esp_err_t swd_gdb_target::write_memory(uint32_t addr, const uint8_t *buf, size_t len)
+{
+    swd_wire_op_scope wire_op(swd_wire_def::OP_DEBUG);
+    if (swd->get_mem_cache().write_memory(addr, buf, len) < 1) {
+        ESP_LOGE(TAG, "Failed to write memory @ 0x%08lx, len %u", addr, len);
+        return ESP_ERR_INVALID_RESPONSE;
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t swd_gdb_target::add_breakpoint(uint32_t addr)
+{
+    swd_wire_op_scope wire_op(swd_wire_def::OP_DEBUG);
+    if (fpb_cnt < 1) {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+
+    uint32_t key = addr & ~1UL;
+    uint8_t half = 0;
+    if (fpb_rev == swd_gdb_def::fpb_rev_v1) {
+        if (addr >= 0x20000000) {
+            ESP_LOGW(TAG, "FPB v1 can't break outside the code region: 0x%08lx", addr);
+            return ESP_ERR_NOT_SUPPORTED;
+        }
+
+        key = addr & ~3UL;
+        half = (addr & 2) ? 2 : 1;
+    }
+
+    int32_t slot = fpb_find(key);
+    if (slot < 0) {
+        slot = fpb_find(UINT32_MAX);
+        if (slot < 0) {
+            ESP_LOGW(TAG, "Out of FPB comparators (%lu)", fpb_cnt);
+            return ESP_ERR_NO_MEM;
+        }
+    }
+
+    fpb_key[slot] = key;
+    fpb_halves[slot] |= half;
+    return fpb_write(slot);
+}
+
+esp_err_t swd_gdb_target::remove_breakpoint(uint32_t addr)
+{
+    swd_wire_op_scope wire_op(swd_wire_def::OP_DEBUG);
+    uint32_t key = fpb_rev == swd_gdb_def::fpb_rev_v1 ? (addr & ~3UL) : (addr & ~1UL);
+    int32_t slot = fpb_find(key);
+    if (slot < 0) {
+        return ESP_OK; // GDB removes what it thinks is inserted, not worth an error
+    }
+
+    if (fpb_rev == swd_gdb_def::fpb_rev_v1) {
+        fpb_halves[slot] &= ~((addr & 2) ? 2 : 1);
+    } else {
+        fpb_halves[slot] = 0;
+    }
+
+    if (fpb_halves[slot] == 0) {
+        fpb_key[slot] = UINT32_MAX;
+    }
+
+    return fpb_write(slot);
+}
+
+esp_err_t swd_gdb_target::get_memory_map(std::vector<gdb_def::mem_region> &regions)
+{
+    regions.clear();
+
+    uint32_t flash_start = 0, flash_end = 0;
+    auto ret = asset->get_flash_start_addr(&flash_start);
+    ret = ret ?: asset->get_flash_end_addr(&flash_end);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    // Each sector item starts a run of same-sized sectors, up to the next item or the end of flash
+    const auto &sectors = asset->get_sectors();
+    std::vector<gdb_def::mem_region> flash = {};
+    for (size_t idx = 0; idx < sectors.size(); idx += 1) {
+        uint32_t start = flash_start + sectors[idx].addr;
+        uint32_t end = idx + 1 < sectors.size() ? flash_start + sectors[idx + 1].addr : flash_end;
+        if (end > start && sectors[idx].size > 0) {
+            flash.push_back({ gdb_def::MEM_FLASH, start, end - start, sectors[idx].size });
+        }
+    }
+
+    if (flash.empty() && flash_end > flash_start) {
+        uint32_t sector_size = 0;
+        asset->get_sector_size(&sector_size);
+        flash.push_back({ gdb_def::MEM_FLASH, flash_start, flash_end - flash_start, sector_size });
+    }
+
+    // Everything around the flash is plain memory, or GDB refuses to touch peripherals and RAM
+    uint64_t cursor = 0;
+    for (const auto &region : flash) {
+        if (region.addr > cursor) {
+            regions.push_back({ gdb_def::MEM_RAM, (uint32_t)cursor, (uint32_t)(region.addr - cursor), 0 });
+        }
+
+        regions.push_back(region);
+        cursor = (uint64_t)region.addr + region.len;
+    }
+
+    if (cursor < 0x100000000ULL) {
+        regions.push_back({ gdb_def::MEM_RAM, (uint32_t)cursor, (uint32_t)(0x100000000ULL - cursor), 0 });
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t swd_gdb_target::erase_chip()
+{
+    regs_valid = false;
+    auto ret = swd->init(asset);
+    ret = ret ?: swd->erase_chip();
+    return ret;
+}
+
+esp_err_t swd_gdb_target::program_file(const char *path)
+{
+    regs_valid = false;
+    if (path == nullptr) {
+        path = fw_asset_manager::get_fw_path();
+    }
+
+    // Same erase as the offline flasher, ProgramPage on unerased sectors would leave the old contents ANDed in
+    auto ret = swd->init(asset);
+    if (swd->has_dual_bank()) {
+        ret = ret ?: swd->erase_program_file(path);
+    } else {
+        ret = ret ?: swd->erase_before_program(path);
+        ret = ret ?: swd->program_file(path);
+    }
+
+    return ret;
+}
+
+esp_err_t swd_gdb_target::prepare_resume()
+{
+    if (swd->get_mem_cache().flush() < 1) {
+        ESP_LOGE(TAG, "Failed to flush memory cache");
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    swd->get_mem_cache().invalidate(); // Target may change anything while running
+    regs_valid = false;
+
+    if (swd_write_word(swd_def::REG_DFSR, swd_def::DFSR_CLEAR_ALL) < 1) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t swd_gdb_target::fpb_init()
+{
+    uint32_t ctrl = 0;
+    if (swd_read_word(swd_def::REG_FP_CTRL, &ctrl) < 1) {
+        ESP_LOGE(TAG, "Failed to read FP_CTRL");
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    fpb_rev = (ctrl >> 28) & 0xf;
+    fpb_cnt = std::min((((ctrl >> 8) & 0x70) | ((ctrl >> 4) & 0xf)), (uint32_t)swd_gdb_def::max_fpb_cnt);
+    ESP_LOGI(TAG, "FPB rev %lu, %lu code comparators", fpb_rev, fpb_cnt);
+
+    for (uint32_t slot = 0; slot < fpb_cnt; slot += 1) {
+        fpb_key[slot] = UINT32_MAX;
+        fpb_halves[slot] = 0;
+        if (fpb_write(slot) != ESP_OK) {
+            return ESP_ERR_INVALID_STATE;
+        }
+    }
+
+    if (swd_write_word(swd_def::REG_FP_CTRL, swd_def::FP_CTRL_KEY | swd_def::FP_CTRL_ENABLE) < 1) {
+        ESP_LOGE(TAG, "Failed to enable FPB");
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t swd_gdb_target::fpb_write(uint32_t slot)
+{
+    uint32_t comp = 0;
+    if (fpb_key[slot] != UINT32_MAX) {
+        if (fpb_rev == swd_gdb_def::fpb_rev_v1) {
+            comp = (fpb_key[slot] & 0x1FFFFFFC) | ((uint32_t)fpb_halves[slot] << 30) | 1;
+        } else {
+            comp = fpb_key[slot] | 1;
+        }
+    }
+
+    if (swd_write_word(swd_def::REG_FP_COMP0 + slot * sizeof(uint32_t), comp) < 1) {
+        ESP_LOGE(TAG, "Failed to write FP_COMP%lu", slot);
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    return ESP_OK;
+}
+
+int32_t swd_gdb_target::fpb_find(uint32_t key) const
+{
+    for (uint32_t slot = 0; slot < fpb_cnt; slot += 1) {
+        if (fpb_key[slot] == key) {
+            return (int32_t)slot;
+        }
+    }
+
+    return -1;
+}
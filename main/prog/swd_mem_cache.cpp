@@ -0,0 +1,365 @@
+#include <cstring>
+#include <algorithm>
+#include <esp_log.h>
+#include <swd_host.h>
+
+#include "swd_mem_cache.hpp"
+
+static inline uint32_t byte_mask(uint32_t offset, uint32_t len)
+{
+    if (len >= 32) {
+        return UINT32_MAX;
+    }
+
+    return ((1UL << len) - 1) << offset;
+}
+
+swd_mem_cache::swd_mem_cache()
+{
+    reset_uncached_regions();
+    invalidate();
+    cache_stats = {};
+}
+
+uint8_t swd_mem_cache::read_word(uint32_t addr, uint32_t *val)
+{
+    if (val == nullptr) {
+        return 0;
+    }
+
+    return read_memory(addr, (uint8_t *)val, sizeof(uint32_t));
+}
+
+uint8_t swd_mem_cache::write_word(uint32_t addr, uint32_t val)
+{
+    return write_memory(addr, (const uint8_t *)&val, sizeof(uint32_t));
+}
+
+uint8_t swd_mem_cache::read_memory(uint32_t addr, uint8_t *buf, uint32_t len)
+{
+    if (buf == nullptr || len < 1) {
+        return 0;
+    }
+
+    if (!is_cacheable(addr, len) || len > mem_cache_def::bypass_len) {
+        if (flush_range(addr, len) < 1) {
+            return 0;
+        }
+
+        cache_stats.read_uncached += 1;
+        return swd_read_memory(addr, buf, len);
+    }
+
+    uint32_t pos = 0;
+    while (pos < len) {
+        uint32_t curr_addr = addr + pos;
+        uint32_t tag = curr_addr & ~(mem_cache_def::line_size - 1);
+        uint32_t offset = curr_addr - tag;
+        uint32_t chunk_len = std::min((uint32_t)(mem_cache_def::line_size - offset), len - pos);
+        uint32_t mask = byte_mask(offset, chunk_len);
+
+        auto &line = get_line(curr_addr);
+        if (line.tag != tag) {
+            if (evict_line(line) < 1) {
+                return 0;
+            }
+
+            line.tag = tag;
+            line.valid_mask = 0;
+            line.dirty_mask = 0;
+        }
+
+        if ((line.valid_mask & mask) != mask) {
+            cache_stats.read_misses += 1;
+            if (fill_line(line, tag) < 1) {
+                return 0;
+            }
+        } else {
+            cache_stats.read_hits += 1;
+            cache_stats.xfer_avoided += (chunk_len + 3) / 4;
+        }
+
+        memcpy(buf + pos, line.data + offset, chunk_len);
+        pos += chunk_len;
+    }
+
+    return 1;
+}
+
+uint8_t swd_mem_cache::write_memory(uint32_t addr, const uint8_t *buf, uint32_t len)
+{
+    if (buf == nullptr || len < 1) {
+        return 0;
+    }
+
+    if (!is_cacheable(addr, len) || len > mem_cache_def::bypass_len) {
+        if (flush_range(addr, len) < 1) {
+            return 0;
+        }
+
+        invalidate_range(addr, len);
+        return swd_write_memory(addr, const_cast<uint8_t *>(buf), len);
+    }
+
+    uint32_t pos = 0;
+    while (pos < len) {
+        uint32_t curr_addr = addr + pos;
+        uint32_t tag = curr_addr & ~(mem_cache_def::line_size - 1);
+        uint32_t offset = curr_addr - tag;
+        uint32_t chunk_len = std::min((uint32_t)(mem_cache_def::line_size - offset), len - pos);
+
+        auto &line = get_line(curr_addr);
+        if (line.tag != tag) {
+            if (evict_line(line) < 1) {
+                return 0;
+            }
+
+            line.tag = tag;
+            line.valid_mask = 0;
+            line.dirty_mask = 0;
+        }
+
+        // Write-allocate without fetching, the line only gets filled when someone reads the missing bytes
+        memcpy(line.data + offset, buf + pos, chunk_len);
+        line.valid_mask |= byte_mask(offset, chunk_len);
+        line.dirty_mask |= byte_mask(offset, chunk_len);
+        pos += chunk_len;
+    }
+
+    cache_stats.writes_coalesced += 1;
+    pending_writes += 1;
+    return 1;
+}
+
+uint8_t swd_mem_cache::flush()
+{
+    mem_cache_def::line *dirty_lines[mem_cache_def::line_cnt] = {};
+    size_t dirty_cnt = 0;
+    for (auto &line : lines) {
+        if (line.tag != INVALID_TAG && line.dirty_mask != 0) {
+            dirty_lines[dirty_cnt] = &line;
+            dirty_cnt += 1;
+        }
+    }
+
+    if (dirty_cnt == 0) {
+        return 1;
+    }
+
+    std::sort(dirty_lines, dirty_lines + dirty_cnt, [](const mem_cache_def::line *a, const mem_cache_def::line *b) {
+        return a->tag < b->tag;
+    });
+
+    // Coalesce dirty bytes into runs, a run may span across lines as long as it stays contiguous
+    uint8_t run_buf[mem_cache_def::line_size * 4] = {};
+    uint32_t run_addr = 0, run_len = 0, run_cnt = 0;
+    for (size_t idx = 0; idx < dirty_cnt; idx += 1) {
+        auto *line = dirty_lines[idx];
+        for (uint32_t offset = 0; offset < mem_cache_def::line_size; offset += 1) {
+            bool dirty = (line->dirty_mask & (1UL << offset)) != 0;
+            uint32_t byte_addr = line->tag + offset;
+            bool contiguous = run_len > 0 && (run_addr + run_len == byte_addr) && run_len < sizeof(run_buf);
+
+            if (run_len > 0 && (!dirty || !contiguous)) {
+                if (swd_write_memory(run_addr, run_buf, run_len) < 1) {
+                    ESP_LOGE(TAG, "Flush failed @ 0x%08lx, len %lu", run_addr, run_len);
+                    return 0;
+                }
+
+                run_cnt += 1;
+                run_len = 0;
+            }
+
+            if (dirty) {
+                if (run_len == 0) {
+                    run_addr = byte_addr;
+                }
+
+                run_buf[run_len] = line->data[offset];
+                run_len += 1;
+            }
+        }
+
+        line->dirty_mask = 0;
+    }
+
+    if (run_len > 0) {
+        if (swd_write_memory(run_addr, run_buf, run_len) < 1) {
+            ESP_LOGE(TAG, "Flush failed @ 0x%08lx, len %lu", run_addr, run_len);
+            return 0;
+        }
+
+        run_cnt += 1;
+    }
+
+    cache_stats.write_flushes += run_cnt;
+    if (pending_writes > run_cnt) {
+        cache_stats.xfer_avoided += pending_writes - run_cnt;
+    }
+
+    pending_writes = 0;
+    return 1;
+}
+
+void swd_mem_cache::invalidate()
+{
+    for (auto &line : lines) {
+        if (line.dirty_mask != 0) {
+            ESP_LOGW(TAG, "Dropping dirty line 0x%08lx, mask 0x%08lx", line.tag, line.dirty_mask);
+        }
+
+        line.tag = INVALID_TAG;
+        line.valid_mask = 0;
+        line.dirty_mask = 0;
+    }
+
+    pending_writes = 0;
+    cache_stats.invalidations += 1;
+}
+
+esp_err_t swd_mem_cache::add_uncached_region(uint32_t start, uint32_t last)
+{
+    if (last < start) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (flush() < 1) {
+        return ESP_FAIL;
+    }
+
+    invalidate_range(start, last - start + 1);
+    uncached_regions.push_back({ .start = start, .last = last });
+    return ESP_OK;
+}
+
+void swd_mem_cache::reset_uncached_regions()
+{
+    uncached_regions.clear();
+    uncached_regions.push_back({ .start = 0x40000000, .last = 0x5fffffff }); // Peripherals
+    uncached_regions.push_back({ .start = 0xa0000000, .last = 0xdfffffff }); // External devices
+    uncached_regions.push_back({ .start = 0xe0000000, .last = 0xffffffff }); // PPB (DHCSR, DWT etc.) and vendor system area
+}
+
+void swd_mem_cache::set_enabled(bool en)
+{
+    if (!en) {
+        flush();
+        invalidate();
+    }
+
+    enabled = en;
+}
+
+const mem_cache_def::stats &swd_mem_cache::get_stats() const
+{
+    return cache_stats;
+}
+
+void swd_mem_cache::reset_stats()
+{
+    cache_stats = {};
+}
+
+void swd_mem_cache::log_stats() const
+{
+    uint32_t total_reads = cache_stats.read_hits + cache_stats.read_misses;
+    uint32_t hit_rate = total_reads == 0 ? 0 : (cache_stats.read_hits * 100) / total_reads;
+    ESP_LOGI(TAG, "Reads: %lu hit, %lu miss (%lu%%), %lu uncached; writes: %lu coalesced into %lu flushes; invalidated %lu times",
+             cache_stats.read_hits, cache_stats.read_misses, hit_rate, cache_stats.read_uncached,
+             cache_stats.writes_coalesced, cache_stats.write_flushes, cache_stats.invalidations);
+    ESP_LOGI(TAG, "SWD transactions avoided: %lu", cache_stats.xfer_avoided);
+}
+
+bool swd_mem_cache::is_cacheable(uint32_t addr, uint32_t len) const
+{
+    if (!enabled) {
+        return false;
+    }
+
+    uint32_t last = addr + len - 1;
+    for (auto &region : uncached_regions) {
+        if (addr <= region.last && region.start <= last) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+mem_cache_def::line &swd_mem_cache::get_line(uint32_t addr)
+{
+    return lines[(addr / mem_cache_def::line_size) % mem_cache_def::line_cnt];
+}
+
+uint8_t swd_mem_cache::fill_line(mem_cache_def::line &line, uint32_t tag)
+{
+    uint8_t buf[mem_cache_def::line_size] = {};
+    if (swd_read_memory(tag, buf, sizeof(buf)) < 1) {
+        return 0;
+    }
+
+    // Keep whatever is dirty, it's newer than the target's copy
+    for (uint32_t offset = 0; offset < mem_cache_def::line_size; offset += 1) {
+        if ((line.dirty_mask & (1UL << offset)) == 0) {
+            line.data[offset] = buf[offset];
+        }
+    }
+
+    line.tag = tag;
+    line.valid_mask = UINT32_MAX;
+    return 1;
+}
+
+uint8_t swd_mem_cache::evict_line(mem_cache_def::line &line)
+{
+    if (line.tag == INVALID_TAG || line.dirty_mask == 0) {
+        return 1;
+    }
+
+    uint32_t offset = 0;
+    while (offset < mem_cache_def::line_size) {
+        if ((line.dirty_mask & (1UL << offset)) == 0) {
+            offset += 1;
+            continue;
+        }
+
+        uint32_t run_start = offset;
+        while (offset < mem_cache_def::line_size && (line.dirty_mask & (1UL << offset)) != 0) {
+            offset += 1;
+        }
+
+        if (swd_write_memory(line.tag + run_start, line.data + run_start, offset - run_start) < 1) {
+            ESP_LOGE(TAG, "Evict failed @ 0x%08lx", line.tag + run_start);
+            return 0;
+        }
+
+        cache_stats.write_flushes += 1;
+    }
+
+    line.dirty_mask = 0;
+    return 1;
+}
+
+uint8_t swd_mem_cache::flush_range(uint32_t addr, uint32_t len)
+{
+    uint32_t first_tag = addr & ~(mem_cache_def::line_size - 1);
+    for (auto &line : lines) {
+        if (line.tag != INVALID_TAG && line.dirty_mask != 0 && line.tag >= first_tag && line.tag < addr + len) {
+            return flush(); // Flush everything so that the writes still get coalesced
+        }
+    }
+
+    return 1;
+}
+
+void swd_mem_cache::invalidate_range(uint32_t addr, uint32_t len)
+{
+    uint32_t first_tag = addr & ~(mem_cache_def::line_size - 1);
+    for (auto &line : lines) {
+        if (line.tag != INVALID_TAG && line.tag >= first_tag && line.tag < addr + len) {
+            line.tag = INVALID_TAG;
+            line.valid_mask = 0;
+            line.dirty_mask = 0;
+        }
+    }
+}
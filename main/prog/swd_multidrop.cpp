@@ -0,0 +1,222 @@
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_rom_sys.h>
+#include <swd_host.h>
+
+#include "swd_multidrop.hpp"
+#include "swd_prog.hpp"
+
+// LSB first, as sent by SWJ_Sequence; same sequences as ADIv5.2 B5.3
+static const uint8_t swd_to_dormant[] = {
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, // Line reset, >= 50 cycles high
+        0xbc, 0xe3, // SWD-to-dormant, 0xE3BC
+};
+
+static const uint8_t dormant_to_swd[] = {
+        0xff, // >= 8 cycles high
+        0x92, 0xf3, 0x09, 0x62, 0x95, 0x2d, 0x85, 0x86, // Selection alert, 128 bits
+        0xe9, 0xaf, 0xdd, 0xe3, 0xa2, 0x0e, 0xbc, 0x19,
+        0xa0, 0xf1, // 4 cycles low, SWD activation code 0x1A, then high
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, // Line reset...
+        0x00, // ...and idle, so TARGETSEL can follow right away
+};
+
+static const uint8_t line_reset[] = {
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x00,
+};
+
+esp_err_t swd_multidrop::set_targets(const uint32_t *targetsel, size_t cnt)
+{
+    if (cnt > multidrop_def::max_targets || (cnt > 0 && targetsel == nullptr)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    for (size_t idx = 0; idx < cnt; idx += 1) {
+        targets[idx] = {};
+        targets[idx].targetsel = targetsel[idx];
+    }
+
+    target_cnt = cnt;
+    invalidate();
+    return ESP_OK;
+}
+
+size_t swd_multidrop::get_target_cnt() const
+{
+    return target_cnt;
+}
+
+bool swd_multidrop::enabled() const
+{
+    return target_cnt > 0;
+}
+
+size_t swd_multidrop::get_selected() const
+{
+    return selected;
+}
+
+const multidrop_def::target *swd_multidrop::get_target(size_t idx) const
+{
+    return idx < target_cnt ? &targets[idx] : nullptr;
+}
+
+esp_err_t swd_multidrop::select(size_t idx)
+{
+    if (idx >= target_cnt) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (bus_awake && selected == idx) {
+        stats.switches_skipped += 1;
+        return ESP_OK;
+    }
+
+    // The wakeup ends in a line reset already, only a switch on an awake bus needs its own
+    if (!bus_awake) {
+        wake_bus();
+    } else {
+        wire.swj_sequence(sizeof(line_reset) * 8, line_reset);
+    }
+
+    auto &target = targets[idx];
+    write_targetsel(target.targetsel);
+
+    uint32_t dpidr = 0;
+    if (swd_read_dp(multidrop_def::DP_ADDR_DPIDR, &dpidr) < 1) {
+        // Nobody answered: wrong TARGETSEL, unpowered part, or the bus went dormant behind our back
+        ESP_LOGE(TAG, "Target %u (TARGETSEL 0x%08lx) not responding", idx, target.targetsel);
+        selected = multidrop_def::no_target;
+        bus_awake = false;
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    // swd_host's cached SELECT belongs to the previous target; make sure the next AP access rewrites it
+    if (swd_write_dp(multidrop_def::DP_ADDR_SELECT, multidrop_def::SELECT_RESYNC) < 1) {
+        ESP_LOGE(TAG, "Target %u: SELECT write failed", idx);
+        selected = multidrop_def::no_target;
+        return ESP_FAIL;
+    }
+
+    if (target.dpidr != 0 && target.dpidr != dpidr) {
+        ESP_LOGW(TAG, "Target %u DPIDR changed 0x%08lx -> 0x%08lx, different part?", idx, target.dpidr, dpidr);
+        target.powered = false;
+    }
+
+    target.dpidr = dpidr;
+    selected = idx;
+    stats.switches += 1;
+    ESP_LOGD(TAG, "Selected target %u, TARGETSEL 0x%08lx, DPIDR 0x%08lx", idx, target.targetsel, dpidr);
+    return ESP_OK;
+}
+
+esp_err_t swd_multidrop::power_up(bool allow_fast, bool *fast_used)
+{
+    if (fast_used == nullptr) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    *fast_used = false;
+    if (selected == multidrop_def::no_target) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    auto &target = targets[selected];
+    const uint32_t pwr_acks = swd_def::CTRL_STAT_CSYSPWRUPACK | swd_def::CTRL_STAT_CDBGPWRUPACK;
+    uint32_t ctrl_stat = 0;
+    if (allow_fast && target.powered) {
+        if (swd_read_dp(swd_def::DP_ADDR_CTRL_STAT, &ctrl_stat) >= 1 && (ctrl_stat & pwr_acks) == pwr_acks
+            && (ctrl_stat & swd_def::CTRL_STAT_STICKY_MASK) == 0) {
+            *fast_used = true;
+        } else {
+            ESP_LOGI(TAG, "Target %u DP not powered up (CTRL/STAT 0x%08lx), full init", selected, ctrl_stat);
+        }
+    }
+
+    if (!*fast_used) {
+        // What swd_init_debug() does after its own JTAG-to-SWD and line reset, which would deselect the target here
+        target.powered = false;
+        if (swd_write_dp(swd_def::DP_ADDR_ABORT, swd_def::ABORT_CLEAR_ALL) < 1
+            || swd_write_dp(swd_def::DP_ADDR_CTRL_STAT, multidrop_def::CTRL_STAT_CSYSPWRUPREQ | multidrop_def::CTRL_STAT_CDBGPWRUPREQ) < 1) {
+            ESP_LOGE(TAG, "Target %u: power-up request failed", selected);
+            return ESP_FAIL;
+        }
+
+        int64_t start_ts = esp_timer_get_time();
+        do {
+            if (swd_read_dp(swd_def::DP_ADDR_CTRL_STAT, &ctrl_stat) < 1) {
+                ESP_LOGE(TAG, "Target %u: CTRL/STAT read failed", selected);
+                return ESP_FAIL;
+            }
+
+            if ((ctrl_stat & pwr_acks) == pwr_acks) {
+                break;
+            }
+
+            esp_rom_delay_us(10);
+        } while (esp_timer_get_time() - start_ts < multidrop_def::power_up_timeout_us);
+
+        if ((ctrl_stat & pwr_acks) != pwr_acks) {
+            ESP_LOGE(TAG, "Target %u: power-up not acked, CTRL/STAT 0x%08lx", selected, ctrl_stat);
+            return ESP_ERR_TIMEOUT;
+        }
+
+        stats.power_ups += 1;
+    }
+
+    if (resync_host_cache() < 1) {
+        ESP_LOGE(TAG, "Target %u: CSW write failed", selected);
+        return ESP_FAIL;
+    }
+
+    target.powered = true;
+    return ESP_OK;
+}
+
+void swd_multidrop::invalidate()
+{
+    bus_awake = false;
+    selected = multidrop_def::no_target;
+    for (size_t idx = 0; idx < target_cnt; idx += 1) {
+        targets[idx].powered = false;
+    }
+}
+
+const multidrop_def::stats &swd_multidrop::get_stats() const
+{
+    return stats;
+}
+
+void swd_multidrop::wake_bus()
+{
+    // Park anything still in SWD state first, so every DP sees the same selection alert
+    swd_init();
+    wire.swj_sequence(sizeof(swd_to_dormant) * 8, swd_to_dormant);
+    wire.swj_sequence(sizeof(dormant_to_swd) * 8, dormant_to_swd);
+    bus_awake = true;
+    selected = multidrop_def::no_target;
+    stats.wakeups += 1;
+}
+
+void swd_multidrop::write_targetsel(uint32_t val)
+{
+    // No target drives the ACK of a TARGETSEL write, so swd_host's SWD_Transfer() can't do it
+    const uint8_t req = 0x99; // Start, DP, write, A[3:2] = 0b11, parity 0, stop, park
+    uint8_t data[5] = {(uint8_t)(val & 0xff), (uint8_t)((val >> 8) & 0xff), (uint8_t)((val >> 16) & 0xff), (uint8_t)(val >> 24), 0};
+    data[4] = __builtin_parity(val) & 1;
+
+    uint8_t ack = 0;
+    wire.swj_sequence(8, &req);
+    wire.swd_sequence(0x80 | 5, nullptr, &ack); // Turnaround, ACK, turnaround; line released
+    wire.swj_sequence(33, data);
+
+    const uint8_t idle = 0;
+    wire.swj_sequence(8, &idle);
+}
+
+uint8_t swd_multidrop::resync_host_cache()
+{
+    // CSW is per target too; whatever swd_host has cached, the second write always reaches the wire
+    return swd_write_ap(multidrop_def::AP_ADDR_CSW, multidrop_def::CSW_RESYNC) >= 1
+           && swd_write_ap(multidrop_def::AP_ADDR_CSW, multidrop_def::CSW_DEFAULT) >= 1;
+}
@@ -7,7 +7,12 @@
 #include <esp_crc.h>
 #include <algorithm>
 #include <esp_random.h>
+#include <esp_rom_sys.h>
+#include <sys/stat.h>
+#include <esp_heap_caps.h>
 #include "swd_prog.hpp"
+#include "swd_wire_stats.hpp"
+#include "asset_store.hpp"
 
 #define TAG "swd_prog"
 
@@ -22,8 +27,23 @@ const uint32_t swd_prog::header_blob[] = {
         0x04770D1F,
 };
 
+// crc = crc32(r0 = addr, r1 = len, r2 = seed), reflected 0xEDB88320, same result as esp_crc32_le(); Thumb-1 only, runs on M0
+const uint32_t swd_prog::crc32_blob[] = {
+        0x4B0843D2, // mvns r2, r2; ldr r3, =poly
+        0xD00A2900, // loop: cmp r1, #0; beq done
+        0x30017804, // ldrb r4, [r0]; adds r0, #1
+        0x25084062, // eors r2, r4; movs r5, #8
+        0xD3000852, // bit: lsrs r2, #1; bcc 1f
+        0x3D01405A, // eors r2, r3; 1: subs r5, #1
+        0x3901D1FA, // bne bit; subs r1, #1
+        0x43D0E7F2, // b loop; done: mvns r0, r2
+        0x46C04770, // bx lr; nop
+        0xEDB88320,
+};
+
 esp_err_t swd_prog::load_flash_algorithm()
 {
+    swd_wire_op_scope wire_op(swd_wire_def::OP_LOAD_ALGO);
     auto ret = swd_halt_target();
     if (ret < 1) {
         ESP_LOGE(TAG, "Failed when halting");
@@ -38,20 +58,15 @@ esp_err_t swd_prog::load_flash_algorithm()
         return ESP_ERR_INVALID_STATE;
     }
 
-    // Mem structure: 512 bytes stack + flash algorithm binary + buffer
-    ret = swd_write_memory(code_start, (uint8_t *)header_blob, sizeof(header_blob));
+    // Mem structure: see ram_layout_planner
+    ret = mem_cache.write_memory(code_start, (const uint8_t *)header_blob, sizeof(header_blob));
     if (ret < 1) {
         ESP_LOGE(TAG, "Failed when writing flash algorithm header");
         state = swd_def::UNKNOWN;
         return ESP_FAIL;
     }
 
-    uint32_t est_algo_len = 0;
-    if (fw_mgr->get_ram_size_byte(&est_algo_len) != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to read algo bin len");
-        return ESP_ERR_INVALID_STATE;
-    }
-
+    uint32_t est_algo_len = layout.image_end - (code_start + sizeof(header_blob));
     if (heap_caps_get_largest_free_block(MALLOC_CAP_INTERNAL) < est_algo_len) {
         ESP_LOGE(TAG, "Flash algo is too huge");
         return ESP_ERR_NO_MEM;
@@ -63,14 +78,14 @@ esp_err_t swd_prog::load_flash_algorithm()
         return ESP_ERR_NO_MEM;
     }
 
-    ESP_LOGI(TAG, "Allocated est algo (RAM size) = %lu", est_algo_len);
+    ESP_LOGI(TAG, "Allocated est algo (image size) = %lu", est_algo_len);
     if (fw_mgr->get_algo_bin(algo_bin, est_algo_len, &algo_bin_len) != ESP_OK) {
         ESP_LOGE(TAG, "Failed to read algo bin");
         free(algo_bin);
         return ESP_ERR_INVALID_STATE;
     }
 
-    ret = swd_write_memory(code_start + sizeof(header_blob), algo_bin, algo_bin_len);
+    ret = mem_cache.write_memory(code_start + sizeof(header_blob), algo_bin, algo_bin_len);
     if (ret < 1) {
         ESP_LOGE(TAG, "Failed when writing main flash algorithm");
         state = swd_def::UNKNOWN;
@@ -120,10 +135,15 @@ esp_err_t swd_prog::run_algo_init(swd_def::init_mode mode)
             return ESP_ERR_INVALID_STATE;
         }
 
+        // Clock boost etc. goes in before Init, so Init already sees the faster core
+        if (run_reg_script(fw_mgr->get_pre_init_script(), "pre-init") != ESP_OK) {
+            state = swd_def::UNKNOWN;
+            return ESP_FAIL;
+        }
+
         ESP_LOGI(TAG, "Flash start addr = 0x%lx, pc_init = 0x%lx", flash_start_addr, func_offset + pc_init);
 
-        ret = swd_flash_syscall_exec(
-                &syscall,
+        ret = exec_syscall(
                 func_offset + pc_init, // Init PC (usually) = 1, +0x20 for header (but somehow actually 0?)
                 flash_start_addr, // r0 = flash base addr
                 0, // r1 = ignored
@@ -134,7 +154,7 @@ esp_err_t swd_prog::run_algo_init(swd_def::init_mode mode)
 
         if (ret < 1) {
             ESP_LOGW(TAG, "Failed when init algorithm, returned %d, retrying...", ret);
-            init(fw_mgr, ram_addr, stack_size); // Re-init SWD as well (so that target will reset)
+            init(fw_mgr, ram_addr, stack_size, ram_size); // Re-init SWD as well (so that target will reset)
             retry_cnt -= 1;
         } else {
             state = swd_def::FLASH_ALG_INITED;
@@ -168,8 +188,7 @@ esp_err_t swd_prog::run_algo_uninit(swd_def::init_mode mode)
         return ESP_ERR_INVALID_STATE;
     }
 
-    ret = swd_flash_syscall_exec(
-            &syscall,
+    ret = exec_syscall(
             func_offset + pc_uninit, // UnInit PC = 61
             mode,
             0, 0, 0, // r2, r3 = ignored
@@ -185,7 +204,7 @@ esp_err_t swd_prog::run_algo_uninit(swd_def::init_mode mode)
 
     // Check stack canary
     uint32_t curr_stack_canary = 0;
-    ret = swd_read_word(stack_bottom, &curr_stack_canary);
+    ret = mem_cache.read_word(stack_bottom, &curr_stack_canary);
     if (ret < 1) {
         ESP_LOGE(TAG, "Failed when reading stack canary");
         state = swd_def::UNKNOWN;
@@ -198,12 +217,217 @@ esp_err_t swd_prog::run_algo_uninit(swd_def::init_mode mode)
         return ESP_FAIL;
     }
 
+    if (run_reg_script(fw_mgr->get_post_uninit_script(), "post-uninit") != ESP_OK) {
+        state = swd_def::UNKNOWN;
+        return ESP_FAIL;
+    }
+
     state = swd_def::FLASH_ALG_UNINITED;
     return ESP_OK;
 }
 
-esp_err_t swd_prog::init(fw_asset_manager *_algo, uint32_t _ram_addr, uint32_t _stack_size)
+esp_err_t swd_prog::run_reg_script(const std::vector<flash_algo::reg_op> &ops, const char *name)
+{
+    if (ops.empty()) {
+        return ESP_OK;
+    }
+
+    swd_wire_op_scope wire_op(swd_wire_def::OP_SCRIPT);
+
+    // Scripts talk to peripherals and may retime the bus, so go around the cache and drop whatever it held
+    if (mem_cache.flush() < 1) {
+        ESP_LOGE(TAG, "%s script: cache flush failed", name);
+        return ESP_FAIL;
+    }
+
+    mem_cache.invalidate();
+
+    // Already validated by fw_asset_manager on load; swd_host has no transfer queue, so ops run back to back
+    // and runs of writes to consecutive words are merged into one auto-increment block write
+    int64_t start_ts = esp_timer_get_time();
+    uint32_t run_buf[flash_algo::reg_script_max_ops] = {};
+    uint8_t swd_ret = 1;
+    size_t idx = 0;
+    while (idx < ops.size() && swd_ret >= 1) {
+        const auto &op = ops[idx];
+        switch (op.type) {
+            case flash_algo::REG_OP_WRITE: {
+                size_t run_len = 0;
+                while (idx + run_len < ops.size() && ops[idx + run_len].type == flash_algo::REG_OP_WRITE
+                       && ops[idx + run_len].addr == op.addr + run_len * sizeof(uint32_t)) {
+                    run_buf[run_len] = ops[idx + run_len].value;
+                    run_len += 1;
+                }
+
+                if (run_len > 1) {
+                    swd_ret = swd_write_memory(op.addr, (uint8_t *)run_buf, run_len * sizeof(uint32_t));
+                } else {
+                    swd_ret = swd_write_word(op.addr, op.value);
+                }
+
+                idx += run_len;
+                continue;
+            }
+
+            case flash_algo::REG_OP_RMW: {
+                uint32_t val = 0;
+                swd_ret = swd_read_word(op.addr, &val);
+                if (swd_ret >= 1) {
+                    swd_ret = swd_write_word(op.addr, (val & ~op.mask) | (op.value & op.mask));
+                }
+                break;
+            }
+
+            case flash_algo::REG_OP_READ: {
+                uint32_t val = 0;
+                swd_ret = swd_read_word(op.addr, &val);
+                break;
+            }
+
+            case flash_algo::REG_OP_POLL: {
+                uint32_t val = 0;
+                int64_t poll_start = esp_timer_get_time();
+                int64_t poll_end = poll_start + (int64_t)op.timeout_ms * 1000;
+                while (true) {
+                    swd_ret = swd_read_word(op.addr, &val);
+                    if (swd_ret < 1 || (val & op.mask) == op.value) {
+                        break;
+                    }
+
+                    int64_t now = esp_timer_get_time();
+                    if (now > poll_end) {
+                        ESP_LOGE(TAG, "%s script: op %u poll timeout @ 0x%08lx, got 0x%08lx, want 0x%08lx/0x%08lx",
+                                 name, idx, op.addr, val, op.value, op.mask);
+                        return ESP_ERR_TIMEOUT;
+                    }
+
+                    if (now - poll_start > 2000) {
+                        vTaskDelay(1); // PLL locks take a while, don't starve the other tasks
+                    }
+                }
+                break;
+            }
+
+            case flash_algo::REG_OP_DELAY: {
+                if (op.value >= 1000) {
+                    vTaskDelay(pdMS_TO_TICKS(op.value / 1000));
+                }
+
+                esp_rom_delay_us(op.value % 1000);
+                break;
+            }
+
+            default: {
+                swd_ret = 0;
+                break;
+            }
+        }
+
+        if (swd_ret < 1) {
+            break;
+        }
+
+        idx += 1;
+    }
+
+    if (swd_ret < 1) {
+        ESP_LOGE(TAG, "%s script: op %u failed @ 0x%08lx", name, idx, idx < ops.size() ? ops[idx].addr : 0);
+        return ESP_FAIL;
+    }
+
+    ESP_LOGI(TAG, "%s script: %u ops in %lld us", name, ops.size(), esp_timer_get_time() - start_ts);
+    return ESP_OK;
+}
+
+esp_err_t swd_prog::plan_ram_layout()
+{
+    uint32_t code_len = 0, data_len = 0, bss_len = 0, data_offset = 0, page_size = 0;
+    auto ret = fw_mgr->get_algo_sizes(&code_len, &data_len, &bss_len);
+    ret = ret ?: fw_mgr->get_data_section_offset(&data_offset);
+    ret = ret ?: fw_mgr->get_page_size(&page_size);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Missing algo info for RAM layout: 0x%x", ret);
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    uint32_t actual_ram_size = ram_size;
+    uint32_t window_start = 0, window_len = 0;
+    if (actual_ram_size == 0) {
+        if (fw_mgr->get_ram_start_addr(&window_start) == ESP_OK && fw_mgr->get_ram_size_byte(&window_len) == ESP_OK
+            && ram_addr >= window_start && ram_addr - window_start < window_len) {
+            actual_ram_size = window_len - (ram_addr - window_start);
+        } else {
+            actual_ram_size = swd_def::default_ram_size;
+        }
+    }
+
+    uint32_t actual_stack_size = stack_size;
+    algo_profile_def::record record = {};
+    const uint8_t *hash = get_algo_hash();
+    bool has_profile = hash != nullptr && profile->load(hash, &record) == ESP_OK;
+    if (!stack_calibrating && has_profile && record.stack_size > 0 && record.stack_size < stack_size) {
+        ESP_LOGI(TAG, "Stack: %lu bytes from calibration (high-water %lu) instead of %lu", record.stack_size, record.stack_used, stack_size);
+        actual_stack_size = record.stack_size;
+    }
+
+    // Whole pages per ProgramPage call, never spanning more than the smallest sector
+    uint32_t chunk_size = page_size;
+    uint32_t min_sector_size = 0;
+    if (!stack_calibrating && has_profile && record.prog_chunk_size > page_size) {
+        chunk_size = record.prog_chunk_size / page_size * page_size;
+    }
+
+    if (fw_mgr->get_min_sector_size(&min_sector_size) == ESP_OK && min_sector_size >= page_size) {
+        chunk_size = std::min(chunk_size, min_sector_size / page_size * page_size);
+    }
+
+    ram_layout::input input = {};
+    input.ram_start = ram_addr;
+    input.ram_size = actual_ram_size;
+    input.header_size = sizeof(header_blob);
+    input.code_size = code_len;
+    input.data_offset = data_offset;
+    input.data_size = data_len;
+    input.bss_size = bss_len;
+    input.stack_size = actual_stack_size;
+    input.page_size = chunk_size;
+
+    // Halve the chunk until it fits, keeping a second buffer for pipelining over a bigger chunk
+    ret = ram_layout_planner::plan(input, &layout);
+    while (chunk_size > page_size && (ret != ESP_OK || layout.buf_cnt < 2)) {
+        chunk_size = std::max(page_size, (chunk_size / 2) / page_size * page_size);
+        input.page_size = chunk_size;
+        ret = ram_layout_planner::plan(input, &layout);
+    }
+
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Algo (code %lu, data %lu, bss %lu) + stack %lu + one %lu-byte page won't fit in %lu bytes RAM @ 0x%08lx",
+                 code_len, data_len, bss_len, actual_stack_size, page_size, actual_ram_size, ram_addr);
+        return ret;
+    }
+
+    ESP_LOGI(TAG, "RAM layout: %lu bytes @ 0x%08lx; image 0x%08lx-0x%08lx, stack 0x%08lx-0x%08lx",
+             actual_ram_size, ram_addr, layout.code_start, layout.image_end, layout.stack_bottom, layout.stack_top);
+    ESP_LOGI(TAG, "RAM layout: %lu x %lu-byte buffers from 0x%08lx, %lu bytes spare; %lu bytes per ProgramPage",
+             layout.buf_cnt, layout.buf_size, layout.buf_addr[0], layout.free_bytes, chunk_size);
+    prog_chunk_size = chunk_size;
+    return ESP_OK;
+}
+
+const uint8_t *swd_prog::get_algo_hash()
+{
+    if (!algo_hash_valid) {
+        // A stored algo is named by its hash, only the legacy file needs reading
+        algo_hash_valid = asset_store::instance()->get_active_sha(asset_store_def::KIND_ALGO, algo_hash) == ESP_OK
+                          || fw_asset_manager::get_sha256_from_file(fw_asset_manager::ALGO_ELF_PATH, algo_hash) == ESP_OK;
+    }
+
+    return algo_hash_valid ? algo_hash : nullptr;
+}
+
+esp_err_t swd_prog::init(fw_asset_manager *_algo, uint32_t _ram_addr, uint32_t _stack_size, uint32_t _ram_size)
 {
+    swd_wire_op_scope wire_op(swd_wire_def::OP_CONNECT);
     if (_algo == nullptr) {
         ESP_LOGE(TAG, "Flash algorithm container pointer is null");
         return ESP_ERR_INVALID_ARG;
@@ -215,63 +439,60 @@ esp_err_t swd_prog::init(fw_asset_manager *_algo, uint32_t _ram_addr, uint32_t _
     }
 
     fw_mgr = _algo;
+    algo_hash_valid = false; // Algo ELF may have been replaced since the last init
     ram_addr = _ram_addr;
+    ram_size = _ram_size;
     stack_size = _stack_size;
+    profile->init();
 
-    ESP_LOGI(TAG, "Init target");
-    auto ret = swd_init_debug();
-    if (ret < 1) {
-        ESP_LOGE(TAG, "Failed when init");
+    // Before touching the target, so an algo that can't fit fails without side effects
+    if (plan_ram_layout() != ESP_OK) {
         state = swd_def::UNKNOWN;
-        return ESP_FAIL;
+        return ESP_ERR_NO_MEM;
     }
 
-    ESP_LOGI(TAG, "Halt target");
-    ret = swd_halt_target();
-    if (ret < 1) {
-        ESP_LOGE(TAG, "Failed when halting");
-        state = swd_def::UNKNOWN;
-        return ESP_ERR_INVALID_STATE;
+    ESP_LOGI(TAG, "Init target");
+    mem_cache.invalidate(); // Target may have been reset or swapped
+    rtt->detach();
+    rtt_scanned = false;
+    if (rtt->init() != ESP_OK) {
+        ESP_LOGW(TAG, "RTT capture not available");
     }
 
-    ret = swd_wait_until_halted();
-    if (ret < 1) {
-        ESP_LOGE(TAG, "Timeout when halting");
-        state = swd_def::UNKNOWN;
-        return ESP_ERR_INVALID_STATE;
+    connect_flags = default_connect_flags;
+    algo_profile_def::record record = {};
+    const uint8_t *hash = get_algo_hash();
+    if (hash != nullptr && profile->load(hash, &record) == ESP_OK) {
+        connect_flags |= record.connect_flags;
     }
 
-    // We are using probe-rs style flash algorithm
-    uint32_t offset = 0;
-    offset += sizeof(header_blob);
-    code_start = ram_addr;
+    auto connect_ret = connect_target();
+    if (connect_ret != ESP_OK) {
+        return connect_ret;
+    }
 
-    offset += algo_bin_len; // Add the actual algorithm binary length
-    stack_offset = ram_addr + offset + stack_size + sizeof(header_blob);
-    stack_bottom = stack_offset - stack_size; // It's 2024, no one uses 8051; so the stack must've been growing backwards/downwards, right...?
+    // We are using probe-rs style flash algorithm
+    code_start = layout.code_start;
+    stack_offset = layout.stack_top;
+    stack_bottom = layout.stack_bottom; // It's 2024, no one uses 8051; so the stack must've been growing backwards/downwards, right...?
     stack_canary = esp_random();
 
     ESP_LOGI(TAG, "Stack: top=0x%08lx, bottom=0x%08lx, canary=0x%08lx", stack_offset, stack_bottom, stack_canary);
-    ret = swd_write_word(stack_bottom, stack_canary);
+    auto ret = mem_cache.write_word(stack_bottom, stack_canary);
     if (ret < 1) {
         ESP_LOGE(TAG, "Timeout when writing stack canary!");
         state = swd_def::UNKNOWN;
         return ESP_ERR_INVALID_STATE;
     }
 
-    uint32_t data_section_offset = 0;
-    if (fw_mgr->get_data_section_offset(&data_section_offset) != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to read data section offset");
-        return ESP_ERR_INVALID_STATE;
-    }
-
     syscall.breakpoint = code_start + 1; // This is ARM
-    syscall.static_base = data_section_offset + sizeof(header_blob); // Length = 512, header = 32 bytes
+    syscall.static_base = layout.static_base;
     syscall.stack_pointer = stack_offset;
 
     func_offset = ram_addr + sizeof(header_blob);
+    profile_setup();
 
-    ESP_LOGI(TAG, "Addr: code_start: 0x%08lx; data_section: 0x%08lx", code_start, data_section_offset);
+    ESP_LOGI(TAG, "Addr: code_start: 0x%08lx; static_base: 0x%08lx", code_start, syscall.static_base);
     ESP_LOGI(TAG, "Addr: stack top: 0x%08lx; bkpt: 0x%08lx; func_offset: 0x%08lx", stack_offset, syscall.breakpoint, func_offset);
 
     state = swd_def::INITIALISED;
@@ -280,6 +501,7 @@ esp_err_t swd_prog::init(fw_asset_manager *_algo, uint32_t _ram_addr, uint32_t _
 
 esp_err_t swd_prog::erase_chip()
 {
+    swd_wire_op_scope wire_op(swd_wire_def::OP_ERASE);
     uint32_t pc_erase_all = 0;
     auto nvs_ret = fw_mgr->get_pc_erase_all(&pc_erase_all);
     if (nvs_ret != ESP_OK || pc_erase_all == 0 || pc_erase_all == UINT32_MAX) {
@@ -311,8 +533,7 @@ esp_err_t swd_prog::erase_chip()
 
     led.set_color(0, 0, 60, 1);
 
-    swd_ret = swd_flash_syscall_exec(
-            &syscall,
+    swd_ret = exec_syscall(
             func_offset + pc_erase_all,
             0, // No arguments
             0, 0, 0, // r1, r2 = ignored
@@ -337,8 +558,147 @@ esp_err_t swd_prog::erase_chip()
     return ret;
 }
 
-esp_err_t swd_prog::self_test(uint16_t test_id, uint8_t *readout_buf, size_t readout_buf_len, uint32_t *func_return_val)
+esp_err_t swd_prog::run_ram_image(const char *path, uint32_t load_addr, uint32_t *result_out, uint8_t *readout_buf,
+                                  size_t readout_buf_len, size_t *readout_len, uint32_t timeout_ms)
+{
+    swd_wire_op_scope wire_op(swd_wire_def::OP_SELF_TEST);
+    if (path == nullptr || result_out == nullptr || (readout_buf == nullptr && readout_buf_len > 0)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    load_addr = load_addr == UINT32_MAX ? ram_addr : load_addr;
+    uint32_t vector_len = (swd_def::ram_image_mailbox_slot + 1) * sizeof(uint32_t);
+    FILE *file = fopen(path, "rb");
+    if (file == nullptr) {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    fseek(file, 0, SEEK_END);
+    size_t len = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    if (len < vector_len || len > swd_def::ram_image_max_len || len % sizeof(uint32_t) != 0) {
+        ESP_LOGE(TAG, "RAM image: bad length %u", len);
+        fclose(file);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    auto *image = static_cast<uint8_t *>(heap_caps_malloc(len, MALLOC_CAP_SPIRAM));
+    if (image == nullptr) {
+        fclose(file);
+        return ESP_ERR_NO_MEM;
+    }
+
+    size_t read_len = fread(image, 1, len, file);
+    fclose(file);
+
+    uint32_t vectors[swd_def::ram_image_mailbox_slot + 1] = {};
+    memcpy(vectors, image, sizeof(vectors));
+    uint32_t sp = vectors[0], pc = vectors[1], mailbox = vectors[swd_def::ram_image_mailbox_slot];
+
+    // Catch images linked elsewhere before they run off into the weeds
+    uint32_t image_end = load_addr + len;
+    if (read_len != len || (pc & 1U) == 0 || (pc & ~1UL) < load_addr || (pc & ~1UL) >= image_end
+        || mailbox < load_addr || mailbox % sizeof(uint32_t) != 0 || sp % 8 != 0 || sp <= load_addr) {
+        ESP_LOGE(TAG, "RAM image @ 0x%08lx: bad vectors; SP 0x%08lx, PC 0x%08lx, mailbox 0x%08lx", load_addr, sp, pc, mailbox);
+        free(image);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (halt() != ESP_OK) {
+        free(image);
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    // From here on the algo in RAM is gone
+    state = swd_def::UNKNOWN;
+    if (mem_cache.flush() < 1) {
+        free(image);
+        return ESP_FAIL;
+    }
+
+    mem_cache.invalidate();
+    int64_t start_ts = esp_timer_get_time();
+    const swd_def::ram_mailbox mailbox_init = {};
+    uint8_t swd_ret = swd_write_memory(load_addr, image, len);
+    free(image);
+    swd_ret = swd_ret < 1 ? swd_ret : swd_write_memory(mailbox, (uint8_t *)&mailbox_init, sizeof(mailbox_init));
+    swd_ret = swd_ret < 1 ? swd_ret : swd_write_word(swd_def::REG_VTOR, load_addr);
+
+    const uint32_t regs[][2] = {
+            { swd_def::CORE_REG_SP, sp },
+            { swd_def::CORE_REG_LR, UINT32_MAX }, // Returning from reset is a lockup, same as on real hardware
+            { swd_def::CORE_REG_PC, pc & ~1UL },
+            { swd_def::CORE_REG_XPSR, swd_def::XPSR_THUMB },
+    };
+
+    for (auto &reg : regs) {
+        swd_ret = swd_ret < 1 ? swd_ret : swd_write_core_register(reg[0], reg[1]);
+    }
+
+    swd_ret = swd_ret < 1 ? swd_ret : swd_write_word(swd_def::REG_DFSR, swd_def::DFSR_CLEAR_ALL);
+    swd_ret = swd_ret < 1 ? swd_ret : swd_write_word(swd_def::REG_DHCSR, swd_def::DHCSR_DBGKEY | swd_def::DHCSR_C_DEBUGEN);
+    if (swd_ret < 1) {
+        ESP_LOGE(TAG, "RAM image: failed to load or start");
+        return ESP_FAIL;
+    }
+
+    int64_t run_ts = esp_timer_get_time();
+    int64_t deadline = run_ts + (int64_t)timeout_ms * 1000;
+    uint32_t mailbox_state = 0, dhcsr = 0;
+    while (true) {
+        // Target is running, raw reads only
+        if (swd_read_word(mailbox, &mailbox_state) < 1 || swd_read_word(swd_def::REG_DHCSR, &dhcsr) < 1) {
+            ESP_LOGE(TAG, "RAM image: mailbox read failed");
+            return ESP_FAIL;
+        }
+
+        if (mailbox_state == swd_def::RAM_MAILBOX_DONE) {
+            break;
+        }
+
+        int64_t now = esp_timer_get_time();
+        if ((dhcsr & swd_def::DHCSR_S_HALT) != 0 || now > deadline) {
+            uint32_t halt_pc = 0;
+            halt();
+            swd_read_core_register(swd_def::CORE_REG_PC, &halt_pc);
+            ESP_LOGE(TAG, "RAM image: %s, PC 0x%08lx, mailbox 0x%08lx", (dhcsr & swd_def::DHCSR_S_HALT) != 0 ? "halted" : "timed out",
+                     halt_pc, mailbox_state);
+            return ESP_ERR_TIMEOUT;
+        }
+
+        if (now - run_ts > swd_def::syscall_spin_us) {
+            vTaskDelay(1);
+        }
+    }
+
+    int64_t done_ts = esp_timer_get_time();
+    if (halt() != ESP_OK) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    swd_def::ram_mailbox result = {};
+    if (swd_read_memory(mailbox, (uint8_t *)&result, sizeof(result)) < 1) {
+        return ESP_FAIL;
+    }
+
+    *result_out = result.result;
+    size_t data_len = std::min((size_t)result.len, std::min(readout_buf_len, swd_def::max_readout_len));
+    if (data_len > 0 && swd_read_memory(mailbox + sizeof(result), readout_buf, data_len) < 1) {
+        return ESP_FAIL;
+    }
+
+    if (readout_len != nullptr) {
+        *readout_len = data_len;
+    }
+
+    ESP_LOGI(TAG, "RAM image: %u bytes loaded in %lld us, ran %lld us; result 0x%08lx, %lu bytes of data",
+             len, run_ts - start_ts, done_ts - run_ts, result.result, result.len);
+    return ESP_OK;
+}
+
+esp_err_t swd_prog::self_test(uint16_t test_id, uint8_t *readout_buf, size_t readout_buf_len, uint32_t *func_return_val, size_t *readout_len)
 {
+    swd_wire_op_scope wire_op(swd_wire_def::OP_SELF_TEST);
     uint32_t pc_verify = 0;
     auto nvs_ret = fw_mgr->get_pc_verify(&pc_verify);
 
@@ -367,15 +727,28 @@ esp_err_t swd_prog::self_test(uint16_t test_id, uint8_t *readout_buf, size_t rea
         return ESP_ERR_INVALID_STATE;
     }
 
-    swd_ret = swd_flash_syscall_exec(
-            &syscall,
+    if (readout_len != nullptr) {
+        *readout_len = 0;
+    }
+
+    uint32_t result_addr = 0, result_size = 0;
+    if (readout_buf != nullptr && readout_buf_len > 0) {
+        auto ret = reserve_result_buf(readout_buf_len, &result_addr, &result_size);
+        if (ret != ESP_OK) return ret;
+    }
+
+    rtt->reset_capture();
+    rtt_arm();
+
+    swd_ret = exec_syscall(
             func_offset + pc_verify,
             test_id + 0xfffff000, // r0 is addr, for SI's algo executing 0xfffff000+ to trigger self test
-            readout_buf_len, // r1 indicates self test result RAM buffer size (or 0 if not used)
-            0, // r2 indicates self test result RAM buffer pointer (or 0, aka. null, if not used) - TODO: need to implement readout buffer copy
+            result_size, // r1 indicates self test result RAM buffer size, incl. the length word (or 0 if not used)
+            result_addr, // r2 indicates self test result RAM buffer pointer (or 0, aka. null, if not used)
             0, // r3 unused
             FLASHALGO_RETURN_VALUE,
-            func_return_val
+            func_return_val,
+            swd_def::self_test_timeout_ms
     );
 
     if (swd_ret < 1) {
@@ -383,14 +756,111 @@ esp_err_t swd_prog::self_test(uint16_t test_id, uint8_t *readout_buf, size_t rea
         return ESP_FAIL;
     }
 
+    if (result_size > 0) {
+        return read_result_buf(result_addr, result_size, readout_buf, readout_len);
+    }
+
     return 0;
 }
 
+esp_err_t swd_prog::find_result_region(uint32_t *start_out, uint32_t *len_out) const
+{
+    uint32_t window_start = 0, window_len = 0;
+    if (fw_mgr->get_ram_start_addr(&window_start) != ESP_OK || fw_mgr->get_ram_size_byte(&window_len) != ESP_OK) {
+        ESP_LOGE(TAG, "No SelfTestInfo RAM window for the result buffer");
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+
+    // Algorithm, stack and page buffers stay put; whichever side of them is left in the window is the region
+    uint64_t window_end = (uint64_t)window_start + window_len;
+    uint64_t used_start = layout.code_start;
+    uint64_t used_end = layout.buf_cnt > 0 ? (uint64_t)layout.buf_addr[layout.buf_cnt - 1] + layout.buf_size : layout.stack_top;
+    uint64_t start = window_start, end = window_end;
+    if (used_start < window_end && used_end > window_start) {
+        uint64_t above_start = ram_layout_planner::align_up(std::min(used_end, window_end), sizeof(uint32_t));
+        uint64_t above_len = window_end > above_start ? window_end - above_start : 0;
+        uint64_t below_len = used_start > window_start ? used_start - window_start : 0;
+        start = above_len >= below_len ? above_start : window_start;
+        end = above_len >= below_len ? window_end : used_start;
+    }
+
+    *start_out = (uint32_t)start;
+    *len_out = end > start ? (uint32_t)(end - start) : 0;
+    return ESP_OK;
+}
+
+esp_err_t swd_prog::get_result_buf_capacity(size_t *len_out) const
+{
+    uint32_t region_start = 0, region_len = 0;
+    auto ret = find_result_region(&region_start, &region_len);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    region_len &= ~3UL;
+    *len_out = region_len > sizeof(uint32_t) ? region_len - sizeof(uint32_t) : 0;
+    return ESP_OK;
+}
+
+esp_err_t swd_prog::reserve_result_buf(size_t readout_buf_len, uint32_t *addr_out, uint32_t *size_out)
+{
+    uint32_t region_start = 0, region_len = 0;
+    auto ret = find_result_region(&region_start, &region_len);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    // Buffer sits at the top of the free region: [length word][payload...], word aligned
+    uint32_t size = std::min((uint32_t)(readout_buf_len + sizeof(uint32_t)), region_len) & ~3UL;
+    uint32_t addr = (region_start + region_len - size) & ~3UL;
+    if (size <= sizeof(uint32_t) || addr < region_start) {
+        ESP_LOGE(TAG, "No room left in the RAM window for the result buffer, %lu bytes free", region_len);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    // A test that never writes the length word then reads back as an empty result, not stale RAM
+    if (mem_cache.write_word(addr, 0) < 1) {
+        ESP_LOGE(TAG, "Failed to clear result length");
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    *addr_out = addr;
+    *size_out = size;
+    return ESP_OK;
+}
+
+esp_err_t swd_prog::read_result_buf(uint32_t addr, uint32_t size, uint8_t *readout_buf, size_t *readout_len)
+{
+    uint32_t result_len = 0;
+    if (mem_cache.read_word(addr, &result_len) < 1) {
+        ESP_LOGE(TAG, "Failed to read result length");
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    uint32_t max_len = size - sizeof(uint32_t);
+    if (result_len > max_len) {
+        ESP_LOGW(TAG, "Result length %lu exceeds buffer, truncated to %lu", result_len, max_len);
+        result_len = max_len;
+    }
+
+    // Whole payload in one go, no per-word polling
+    if (result_len > 0 && mem_cache.read_memory(addr + sizeof(uint32_t), readout_buf, result_len) < 1) {
+        ESP_LOGE(TAG, "Failed to read result payload");
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    if (readout_len != nullptr) {
+        *readout_len = result_len;
+    }
+
+    return ESP_OK;
+}
+
 esp_err_t swd_prog::erase_sector(uint32_t start_addr, uint32_t end_addr)
 {
-    uint32_t flash_sector_size = 0, pc_erase_sector = 0, flash_start_addr = 0;
-    auto nvs_ret = fw_mgr->get_sector_size(&flash_sector_size);
-    nvs_ret = nvs_ret ?: fw_mgr->get_pc_erase_sector(&pc_erase_sector);
+    swd_wire_op_scope wire_op(swd_wire_def::OP_ERASE);
+    uint32_t pc_erase_sector = 0, flash_start_addr = 0;
+    auto nvs_ret = fw_mgr->get_pc_erase_sector(&pc_erase_sector);
     nvs_ret = nvs_ret ?: fw_mgr->get_flash_start_addr(&flash_start_addr);
 
     if (nvs_ret != ESP_OK) {
@@ -398,9 +868,24 @@ esp_err_t swd_prog::erase_sector(uint32_t start_addr, uint32_t end_addr)
         return ESP_ERR_INVALID_STATE;
     }
 
-    uint32_t sector_cnt = (end_addr - start_addr) / flash_sector_size;
-    ESP_LOGI(TAG, "End addr 0x%lx, start addr 0x%lx, sector size %lu", end_addr, start_addr, flash_sector_size);
-    if ((end_addr - start_addr) % flash_sector_size != 0 || sector_cnt < 1) {
+    // Sector sizes come from the DeviceData map and may change along the range; both ends must be on a boundary
+    uint32_t sector_cnt = 0;
+    for (uint32_t addr = start_addr; addr < end_addr; sector_cnt += 1) {
+        uint32_t sector_start = 0, sector_size = 0;
+        if (addr < flash_start_addr || fw_mgr->get_sector_at(addr - flash_start_addr, &sector_start, &sector_size) != ESP_OK
+            || flash_start_addr + sector_start != addr) {
+            break;
+        }
+
+        addr += sector_size;
+        if (addr > end_addr) {
+            sector_cnt = 0;
+            break;
+        }
+    }
+
+    ESP_LOGI(TAG, "End addr 0x%lx, start addr 0x%lx, %lu sectors", end_addr, start_addr, sector_cnt);
+    if (sector_cnt < 1) {
         ESP_LOGE(TAG, "Misaligned sector address");
         return ESP_ERR_INVALID_ARG;
     }
@@ -426,11 +911,11 @@ esp_err_t swd_prog::erase_sector(uint32_t start_addr, uint32_t end_addr)
         return ESP_ERR_INVALID_STATE;
     }
 
-    for (uint32_t idx = 0; idx < sector_cnt - 1; idx += 1) {
-        swd_ret = swd_flash_syscall_exec(
-                &syscall,
+    uint32_t addr = start_addr;
+    for (uint32_t idx = 0; idx < sector_cnt; idx += 1) {
+        swd_ret = exec_syscall(
                 func_offset + pc_erase_sector, // ErasePage PC = 173
-                flash_start_addr + (idx * flash_sector_size), // r0 = flash base addr
+                addr, // r0 = sector addr
                 0, 0, 0, // r1, r2 = ignored
                 FLASHALGO_RETURN_BOOL,
                 nullptr
@@ -441,6 +926,10 @@ esp_err_t swd_prog::erase_sector(uint32_t start_addr, uint32_t end_addr)
             return ESP_FAIL;
         }
 
+        uint32_t sector_start = 0, sector_size = 0;
+        fw_mgr->get_sector_at(addr - flash_start_addr, &sector_start, &sector_size);
+        addr += sector_size;
+
         if(idx % 10 == 0) {
             led.set_color(0, 0, 60, 50);
         } else {
@@ -457,6 +946,7 @@ esp_err_t swd_prog::erase_sector(uint32_t start_addr, uint32_t end_addr)
 
 esp_err_t swd_prog::program_page(const uint8_t *buf, size_t len, uint32_t start_addr)
 {
+    swd_wire_op_scope wire_op(swd_wire_def::OP_PROGRAM);
     if (len % 4 != 0) {
         ESP_LOGE(TAG, "Length is not 32-bit word aligned");
         return ESP_ERR_INVALID_ARG;
@@ -492,31 +982,37 @@ esp_err_t swd_prog::program_page(const uint8_t *buf, size_t len, uint32_t start_
     }
 
 
-    ESP_LOGI(TAG, "program_page: page_size: %lu, pc_prg_page=0x%lx, flash_start_addr=0x%lx", page_size, pc_program_page, flash_start_addr);
+    uint32_t chunk_size = prog_chunk_size; // Whole pages, as many as the algo takes per call and the RAM layout fits
+    uint32_t chunk_cnt = (len / chunk_size) + ((len % chunk_size != 0) ? 1 : 0);
+    ESP_LOGI(TAG, "program_page: page_size: %lu, chunk: %lu, pc_prg_page=0x%lx, flash_start_addr=0x%lx", page_size, chunk_size, pc_program_page, flash_start_addr);
 
     uint32_t addr_offset = flash_start_addr + (start_addr == UINT32_MAX ? 0 : start_addr);
     uint32_t remain_len = len;
-    for (uint32_t page_idx = 0; page_idx < (len / page_size); page_idx += 1) {
-        uint32_t write_size = std::min(page_size, remain_len);
+    for (uint32_t page_idx = 0; page_idx < chunk_cnt; page_idx += 1) {
+        uint32_t write_size = std::min(chunk_size, remain_len);
         ESP_LOGD(TAG, "program_page: write size: %lu", write_size);
-        swd_ret = swd_write_memory(syscall.static_base, (uint8_t *)(buf + (page_idx * page_size)), write_size);
+        swd_ret = mem_cache.write_memory(layout.buf_addr[0], (uint8_t *)(buf + (page_idx * chunk_size)), write_size);
         if (swd_ret < 1) {
             ESP_LOGE(TAG, "Failed when writing RAM cache");
             state = swd_def::UNKNOWN;
             return ESP_ERR_INVALID_STATE;
         }
 
-        ESP_LOGD(TAG, "Writing page 0x%lx, size %lu", 0x08000000 + (page_idx * page_size), write_size);
-        swd_ret = swd_flash_syscall_exec(
-                &syscall,
+        ESP_LOGD(TAG, "Writing page 0x%lx, size %lu", addr_offset + (page_idx * chunk_size), write_size);
+        swd_ret = exec_syscall(
                 func_offset + pc_program_page, // ErasePage PC = 305
-                addr_offset + (page_idx * page_size), // r0 = flash base addr
+                addr_offset + (page_idx * chunk_size), // r0 = flash base addr
                 write_size,
-                syscall.static_base, 0, // r1 = len, r2 = buf addr
+                layout.buf_addr[0], 0, // r1 = len, r2 = buf addr
                 FLASHALGO_RETURN_BOOL,
                 nullptr
         );
 
+        if (swd_ret < 1) {
+            ESP_LOGE(TAG, "ProgramPage failed @ 0x%08lx", addr_offset + (page_idx * chunk_size));
+            break; // The rest would land after a hole
+        }
+
         if(page_idx % 2 == 0) {
             led.set_color(50, 50, 0, 20);
         } else {
@@ -546,102 +1042,320 @@ esp_err_t swd_prog::program_file(const char *path, uint32_t *len_written, uint32
         return ESP_ERR_INVALID_ARG;
     }
 
-    FILE *file = fopen(path, "rb");
+    // Streams from PSRAM when the image fits there, the file is only stat()ed to catch changes
+    prog_ranges.clear();
+    FILE *file = nullptr;
+    size_t len = 0;
+    uint32_t cache_page_size = 0, erased_val = 0;
+    auto cache_ret = fw_mgr->get_page_size(&cache_page_size);
+    cache_ret = cache_ret ?: fw_mgr->get_erased_byte_val(&erased_val);
+    cache_ret = cache_ret ?: img_cache->load(path, cache_page_size, erased_val);
+    if (cache_ret == ESP_OK) {
+        return program_mem(img_cache->data(), img_cache->size(), len_written, start_addr);
+    }
+
+    ESP_LOGW(TAG, "Image cache unavailable (0x%x), reading from file", cache_ret);
+    file = fopen(path, "rb");
     if (file == nullptr) {
         ESP_LOGE(TAG, "Failed when reading firmware file");
         return ESP_ERR_NOT_FOUND;
     }
 
-    fseek(file, 0, SEEK_END);
-    size_t len = ftell(file);
-    if (len < 4 || len % 4 != 0) {
-        ESP_LOGE(TAG, "Manifest in a wrong length: %u", len);
+    uint8_t hdr_buf[std::max(sizeof(lz4_image_def::header), sizeof(fw_segmap_def::header))] = {};
+    size_t hdr_len = fread(hdr_buf, 1, sizeof(hdr_buf), file);
+    if (lz4_image::is_lz4(hdr_buf, hdr_len)) {
+        ESP_LOGE(TAG, "Compressed image needs the PSRAM image cache");
         fclose(file);
-        return ESP_ERR_INVALID_SIZE;
+        return ESP_ERR_NOT_SUPPORTED;
     }
 
-    if (len_written != nullptr) {
-        *len_written = len;
+    if (fw_segmap::is_segmap(hdr_buf, hdr_len)) {
+        fw_segmap map {};
+        auto ret = map.open(file);
+        ret = ret ?: program_segments(map, nullptr, file, len_written);
+        fclose(file);
+        return ret;
     }
 
+    fseek(file, 0, SEEK_END);
+    len = ftell(file);
     fseek(file, 0, SEEK_SET);
 
-    if (state != swd_def::FLASH_ALG_INITED) {
-        auto ret = run_algo_init(swd_def::PROGRAM);
-        if (ret != ESP_OK) return ret;
+    auto ret = program_image(nullptr, nullptr, file, len, len_written, start_addr);
+    fclose(file);
+    return ret;
+}
+
+esp_err_t swd_prog::program_mem(const uint8_t *image, size_t len, uint32_t *len_written, uint32_t start_addr)
+{
+    if (image == nullptr) {
+        return ESP_ERR_INVALID_ARG;
     }
 
-    auto swd_ret = swd_halt_target();
-    if (swd_ret < 1) {
-        ESP_LOGE(TAG, "Failed when halting");
-        state = swd_def::UNKNOWN;
-        fclose(file);
-        return ESP_ERR_INVALID_STATE;
+    prog_ranges.clear();
+    if (fw_segmap::is_segmap(image, len)) {
+        fw_segmap map {};
+        auto ret = map.open(image, len);
+        return ret ?: program_segments(map, image, nullptr, len_written);
     }
 
-    uint32_t page_size = 0, pc_program_page = 0, flash_start_addr = 0;
-    auto nvs_ret = fw_mgr->get_page_size(&page_size);
-    nvs_ret = nvs_ret ?: fw_mgr->get_pc_program_page(&pc_program_page);
-    nvs_ret = nvs_ret ?: fw_mgr->get_flash_start_addr(&flash_start_addr);
+    if (!lz4_image::is_lz4(image, len)) {
+        return program_image(image, nullptr, nullptr, len, len_written, start_addr);
+    }
 
-    if (nvs_ret != ESP_OK) {
-        ESP_LOGE(TAG, "Missing config for ProgramPage");
-        return ESP_ERR_NOT_FOUND;
+    // Compressed: every page is decompressed straight into the page buffer on its way to the target
+    lz4_image lz4 {};
+    auto ret = lz4.open(image, len);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Bad compressed image: 0x%x", ret);
+        return ret;
     }
 
-    swd_ret = swd_wait_until_halted();
-    if (swd_ret < 1) {
-        ESP_LOGE(TAG, "Timeout when halting");
-        state = swd_def::UNKNOWN;
-        fclose(file);
-        return ESP_ERR_TIMEOUT;
+    int64_t start_ts = esp_timer_get_time();
+    ret = program_image(nullptr, &lz4, nullptr, lz4.raw_size(), len_written, start_addr);
+    int64_t total_us = esp_timer_get_time() - start_ts;
+
+    const lz4_image_def::stats &stats = lz4.get_stats();
+    ESP_LOGI(TAG, "LZ4: %u -> %u bytes, %llu us decoding (%.1f MB/s) of %lld us programming",
+             len, lz4.raw_size(), stats.decode_us, stats.decode_us > 0 ? (double)stats.raw_bytes / (double)stats.decode_us : 0.0, total_us);
+    return ret;
+}
+
+esp_err_t swd_prog::program_segments(const fw_segmap &map, const uint8_t *image, FILE *file, uint32_t *len_written)
+{
+    uint32_t flash_start_addr = 0;
+    if (fw_mgr->get_flash_start_addr(&flash_start_addr) != ESP_OK) {
+        return ESP_ERR_NOT_FOUND;
     }
 
-    uint32_t addr_offset = flash_start_addr + (start_addr == UINT32_MAX ? 0 : start_addr);
-    uint32_t remain_len = len;
-    auto *buf = new uint8_t[page_size];
-    memset(buf, 0, page_size);
+    // Each segment is a small contiguous image of its own; gaps between them never touch the wire
+    int64_t start_ts = esp_timer_get_time();
+    uint32_t total_len = 0;
+    esp_err_t ret = ESP_OK;
+    keep_algo_inited = true; // One Init for the whole map, UnInit after the last segment
+    for (size_t idx = 0; ret == ESP_OK && idx < map.size(); idx += 1) {
+        const auto &seg = map.get(idx);
+        if (seg.addr < flash_start_addr) {
+            ESP_LOGE(TAG, "Segment at 0x%08lx is below flash start", seg.addr);
+            ret = ESP_ERR_INVALID_ARG;
+            break;
+        }
 
-    ESP_LOGI(TAG, "program_file: page_size: %lu, pc_prg_page=0x%lx, flash_start_addr=0x%lx", page_size, pc_program_page, flash_start_addr);
+        // A segment whose source doesn't match the map never reaches the target
+        uint32_t src_crc = 0;
+        ret = segment_crc(seg, image, file, &src_crc);
+        if (ret == ESP_OK && src_crc != seg.crc) {
+            ESP_LOGE(TAG, "Segment at 0x%08lx: source CRC 0x%08lx, map says 0x%08lx", seg.addr, src_crc, seg.crc);
+            ret = ESP_ERR_INVALID_CRC;
+        }
 
-    for (uint32_t page_idx = 0; page_idx < ((len / page_size) + ((len % page_size != 0) ? 1 : 0)); page_idx += 1) {
-        uint32_t write_size = std::min(page_size, remain_len);
-        size_t read_len = fread(buf, 1, write_size, file);
-        ESP_LOGD(TAG, "program_file: write size: %lu", write_size);
-        if (read_len != write_size) {
-            ESP_LOGW(TAG, "Trying to read %lu bytes but got only %u bytes", write_size, read_len);
-            write_size = read_len;
+        if (ret != ESP_OK) {
+            break;
         }
 
-        swd_ret = swd_write_memory(syscall.static_base + stack_size, (uint8_t *)buf, write_size); // TODO: temp fix
-        if (swd_ret < 1) {
+        ESP_LOGI(TAG, "Segment %u/%u: 0x%08lx, %lu bytes", idx + 1, map.size(), seg.addr, seg.len);
+        ret = program_image(image != nullptr ? image + seg.offset : nullptr, nullptr, file, seg.len, nullptr, seg.addr - flash_start_addr);
+        if (ret == ESP_OK && last_prog_crc != seg.crc && !overlay->overlaps(seg.addr, seg.len)) {
+            ESP_LOGE(TAG, "Segment at 0x%08lx doesn't match its CRC as sent", seg.addr);
+            ret = ESP_ERR_INVALID_CRC;
+        }
+
+        total_len += seg.len;
+    }
+
+    keep_algo_inited = false;
+    if (state == swd_def::FLASH_ALG_INITED) {
+        auto uninit_ret = run_algo_uninit(swd_def::PROGRAM);
+        state = uninit_ret == ESP_OK ? swd_def::FLASH_ALG_UNINITED : state;
+        ret = ret ?: uninit_ret;
+    }
+
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    if (len_written != nullptr) {
+        *len_written = total_len;
+    }
+
+    ESP_LOGI(TAG, "Programmed %u segments, %lu bytes in %lld us", map.size(), total_len, esp_timer_get_time() - start_ts);
+    return ESP_OK;
+}
+
+esp_err_t swd_prog::segment_crc(const fw_segmap_def::segment &seg, const uint8_t *image, FILE *file, uint32_t *crc_out)
+{
+    if (image != nullptr) {
+        *crc_out = esp_crc32_le(0, image + seg.offset, seg.len);
+        return ESP_OK;
+    }
+
+    if (file == nullptr || fseek(file, seg.offset, SEEK_SET) != 0) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    uint8_t buf[512] = {};
+    uint32_t crc = 0;
+    for (uint32_t done = 0; done < seg.len; ) {
+        size_t chunk = std::min((uint32_t)sizeof(buf), seg.len - done);
+        if (fread(buf, 1, chunk, file) != chunk) {
+            return ESP_ERR_INVALID_SIZE;
+        }
+
+        crc = esp_crc32_le(crc, buf, chunk);
+        done += chunk;
+    }
+
+    // Back to the segment start for program_image()
+    *crc_out = crc;
+    return fseek(file, seg.offset, SEEK_SET) == 0 ? ESP_OK : ESP_ERR_INVALID_SIZE;
+}
+
+esp_err_t swd_prog::program_image(const uint8_t *image, lz4_image *lz4, FILE *file, size_t len, uint32_t *len_written, uint32_t start_addr)
+{
+    swd_wire_op_scope wire_op(swd_wire_def::OP_PROGRAM);
+    if (len < 4 || len % 4 != 0) {
+        ESP_LOGE(TAG, "Manifest in a wrong length: %u", len);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    if (len_written != nullptr) {
+        *len_written = len;
+    }
+
+    if (state != swd_def::FLASH_ALG_INITED) {
+        auto ret = run_algo_init(swd_def::PROGRAM);
+        if (ret != ESP_OK) return ret;
+    }
+
+    auto swd_ret = swd_halt_target();
+    if (swd_ret < 1) {
+        ESP_LOGE(TAG, "Failed when halting");
+        state = swd_def::UNKNOWN;
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    uint32_t page_size = 0, pc_program_page = 0, flash_start_addr = 0, erased_val = 0;
+    auto nvs_ret = fw_mgr->get_page_size(&page_size);
+    nvs_ret = nvs_ret ?: fw_mgr->get_erased_byte_val(&erased_val);
+    nvs_ret = nvs_ret ?: fw_mgr->get_pc_program_page(&pc_program_page);
+    nvs_ret = nvs_ret ?: fw_mgr->get_flash_start_addr(&flash_start_addr);
+
+    if (nvs_ret != ESP_OK) {
+        ESP_LOGE(TAG, "Missing config for ProgramPage");
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    swd_ret = swd_wait_until_halted();
+    if (swd_ret < 1) {
+        ESP_LOGE(TAG, "Timeout when halting");
+        state = swd_def::UNKNOWN;
+        return ESP_ERR_TIMEOUT;
+    }
+
+    uint32_t addr_offset = flash_start_addr + (start_addr == UINT32_MAX ? 0 : start_addr);
+    uint32_t chunk_size = prog_chunk_size; // Whole pages, as many as the algo takes per call and the RAM layout fits
+    uint32_t page_cnt = (len / chunk_size) + ((len % chunk_size != 0) ? 1 : 0);
+    last_prog_crc = 0;
+
+    ESP_LOGI(TAG, "program_file: page_size: %lu, chunk: %lu, pc_prg_page=0x%lx, flash_start_addr=0x%lx, buffers: %lu",
+             page_size, chunk_size, pc_program_page, flash_start_addr, layout.buf_cnt);
+
+    // Reading, decompression, overlay, CRC and blank checks run on the other core; this side only does SWD
+    auto ret = pipeline.start({image, lz4, file, len, addr_offset, chunk_size, erased_val});
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    // Take the next prepared page and put it into a target RAM buffer; raw SWD if the target is running
+    uint32_t blank_cnt = 0;
+    auto stage_page = [&](uint32_t page_idx, bool target_running, uint32_t *size_out, bool *skip_out) -> uint8_t {
+        pipeline_def::page_desc desc = {};
+        if (pipeline.next(&desc) != ESP_OK || desc.page_idx != page_idx) {
+            ESP_LOGE(TAG, "Page %lu not prepared: 0x%x", page_idx, desc.ret);
+            return 0;
+        }
+
+        ESP_LOGD(TAG, "program_file: write size: %lu", desc.len);
+        last_prog_crc = desc.crc;
+        *size_out = desc.len;
+        *skip_out = desc.blank;
+
+        uint8_t stage_ret = 1;
+        if (desc.blank) {
+            blank_cnt += 1;
+        } else {
+            uint32_t buf_addr = layout.buf_addr[page_idx % layout.buf_cnt];
+            stage_ret = target_running ? swd_write_memory(buf_addr, const_cast<uint8_t *>(desc.data), desc.len)
+                                       : mem_cache.write_memory(buf_addr, desc.data, desc.len);
+        }
+
+        pipeline.release(desc);
+        return stage_ret;
+    };
+
+    uint32_t write_size = 0;
+    bool skip = false;
+    swd_ret = page_cnt > 0 ? stage_page(0, false, &write_size, &skip) : 1;
+    for (uint32_t page_idx = 0; page_idx < page_cnt && swd_ret >= 1; page_idx += 1) {
+        uint32_t buf_addr = layout.buf_addr[page_idx % layout.buf_cnt];
+        bool has_next = page_idx + 1 < page_cnt;
+
+        // Blank pages still wait, their sector has to be erased all the same
+        if (bank_sched_on && bank_sched_wait(addr_offset + (page_idx * chunk_size), write_size) != ESP_OK) {
+            swd_ret = 0;
+            break;
+        }
+
+        uint32_t next_size = 0;
+        bool next_skip = false;
+        uint8_t stage_ret = 1;
+        if (skip) {
+            ESP_LOGD(TAG, "Skipping blank page 0x%lx, size %lu", addr_offset + (page_idx * chunk_size), write_size);
+            if (has_next) {
+                stage_ret = stage_page(page_idx + 1, false, &next_size, &next_skip);
+            }
+        } else {
+            ESP_LOGD(TAG, "Writing page 0x%lx, size %lu from RAM 0x%lx", addr_offset + (page_idx * chunk_size), write_size, buf_addr);
+            swd_ret = syscall_start(
+                    func_offset + pc_program_page, // ErasePage PC = 305
+                    addr_offset + (page_idx * chunk_size), // r0 = flash base addr
+                    write_size,
+                    buf_addr, 0 // r1 = len, r2 = buf addr
+            );
+
+            if (swd_ret < 1) {
+                break;
+            }
+
+            // With a spare buffer, the next page goes over the wire while this one is being programmed
+            if (has_next && layout.buf_cnt > 1) {
+                stage_ret = stage_page(page_idx + 1, true, &next_size, &next_skip);
+            }
+
+            swd_ret = syscall_wait(FLASHALGO_RETURN_BOOL, nullptr, swd_def::syscall_timeout_ms);
+            if (swd_ret >= 1 && has_next && layout.buf_cnt < 2) {
+                stage_ret = stage_page(page_idx + 1, false, &next_size, &next_skip);
+            }
+        }
+
+        if (stage_ret < 1) {
             ESP_LOGE(TAG, "Failed when writing RAM cache");
-            delete[] buf;
+            pipeline.stop();
             state = swd_def::UNKNOWN;
             return ESP_ERR_INVALID_STATE;
         }
 
-        ESP_LOGD(TAG, "Writing page 0x%lx, size %lu from RAM 0x%lx", addr_offset + (page_idx * page_size), write_size, syscall.static_base + stack_size);
-        swd_ret = swd_flash_syscall_exec(
-                &syscall,
-                func_offset + pc_program_page, // ErasePage PC = 305
-                addr_offset + (page_idx * page_size), // r0 = flash base addr
-                write_size,
-                syscall.static_base + stack_size, 0, // r1 = len, r2 = buf addr
-                FLASHALGO_RETURN_BOOL,
-                nullptr
-        );
-
+        write_size = next_size;
+        skip = next_skip;
         if(page_idx % 2 == 0) {
             led.set_color(50, 50, 0, 20);
         } else {
             led.set_color(0, 0, 0, 20);
         }
-
-        remain_len -= write_size;
     }
 
-    delete[] buf;
+    pipeline.stop();
+    pipeline.log_stats();
 
     if (swd_ret < 1) {
         ESP_LOGE(TAG, "Program function returned an unknown error");
@@ -649,64 +1363,1307 @@ esp_err_t swd_prog::program_file(const char *path, uint32_t *len_written, uint32
         return ESP_ERR_INVALID_STATE;
     }
 
-    fclose(file);
-    auto ret = run_algo_uninit(swd_def::PROGRAM);
+    if (blank_cnt > 0) {
+        ESP_LOGI(TAG, "program_file: %lu of %lu pages blank, not programmed", blank_cnt, page_cnt);
+    }
+
+    if (keep_algo_inited) {
+        prog_ranges.push_back({addr_offset, (uint32_t)len, last_prog_crc});
+        return ESP_OK;
+    }
+
+    ret = run_algo_uninit(swd_def::PROGRAM);
     if (ret != ESP_OK) return ret;
 
+    prog_ranges.push_back({addr_offset, (uint32_t)len, last_prog_crc});
     state = swd_def::FLASH_ALG_UNINITED;
     return ret;
 }
 
-esp_err_t swd_prog::verify(uint32_t expected_crc, uint32_t start_addr, size_t len)
+esp_err_t swd_prog::erase_program_file(const char *path, uint32_t *len_written, uint32_t start_addr)
 {
-    auto swd_ret = swd_halt_target();
-    if (swd_ret < 1) {
-        ESP_LOGE(TAG, "Failed when halting");
-        state = swd_def::UNKNOWN;
-        return ESP_ERR_INVALID_STATE;
+    if (path == nullptr) {
+        ESP_LOGE(TAG, "Path is null!");
+        return ESP_ERR_INVALID_ARG;
     }
 
-    uint32_t flash_start_addr = 0, flash_end_addr = 0;
-    auto nvs_ret = fw_mgr->get_flash_end_addr(&flash_end_addr);
-    nvs_ret = nvs_ret ?: fw_mgr->get_flash_start_addr(&flash_start_addr);
+    // The erase plan needs the raw length, which for a compressed image is in its header
+    FILE *file = fopen(path, "rb");
+    if (file == nullptr) {
+        return ESP_ERR_NOT_FOUND;
+    }
 
-    if (nvs_ret != ESP_OK) {
-        ESP_LOGE(TAG, "Missing config for verify");
-        return ESP_ERR_INVALID_STATE;
+    uint8_t hdr_buf[std::max(sizeof(lz4_image_def::header), sizeof(fw_segmap_def::header))] = {};
+    size_t hdr_len = fread(hdr_buf, 1, sizeof(hdr_buf), file);
+    fseek(file, 0, SEEK_END);
+    size_t len = ftell(file);
+    fclose(file);
+
+    // The overlap works on one contiguous range; sparse images erase their sectors up front instead
+    if (fw_segmap::is_segmap(hdr_buf, hdr_len)) {
+        auto ret = erase_image_file(path);
+        return ret ?: program_file(path, len_written, start_addr);
     }
 
-    uint32_t actual_read_addr = (start_addr == UINT32_MAX) ? flash_start_addr : start_addr;
-    uint32_t actual_len = (len == 0) ? (flash_end_addr - flash_start_addr) : len;
-    uint32_t actual_crc = 0;
-    size_t remain_len = actual_len;
-    uint32_t offset = 0;
+    lz4_image::get_raw_len(hdr_buf, hdr_len, &len);
+    return erase_program(path, nullptr, 0, len, len_written, start_addr);
+}
 
-    while(remain_len > 0) {
-        uint8_t buf[1024] = { 0 };
-        uint32_t read_len = std::min(sizeof(buf), remain_len);
-        swd_ret = swd_read_memory((actual_read_addr + offset), buf, read_len);
-        if (swd_ret < 1) {
-            ESP_LOGE(TAG, "Failed when reading flash");
-            return ESP_ERR_INVALID_STATE;
+esp_err_t swd_prog::erase_program_mem(const uint8_t *image, size_t len, uint32_t *len_written, uint32_t start_addr)
+{
+    if (image == nullptr) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (fw_segmap::is_segmap(image, len)) {
+        auto ret = erase_image_mem(image, len);
+        return ret ?: program_mem(image, len, len_written, start_addr);
+    }
+
+    size_t raw_len = len;
+    lz4_image::get_raw_len(image, len, &raw_len);
+    return erase_program(nullptr, image, len, raw_len, len_written, start_addr);
+}
+
+esp_err_t swd_prog::erase_program(const char *path, const uint8_t *image, size_t image_len, size_t len, uint32_t *len_written, uint32_t start_addr)
+{
+    uint32_t flash_start_addr = 0;
+    if (fw_mgr->get_flash_start_addr(&flash_start_addr) != ESP_OK) {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    uint32_t addr = flash_start_addr + (start_addr == UINT32_MAX ? 0 : start_addr);
+    auto ret = bank_sched_setup(addr, len);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    int64_t start_ts = esp_timer_get_time();
+    bank_sched_on = true;
+    ret = image != nullptr ? program_mem(image, image_len, len_written, start_addr) : program_file(path, len_written, start_addr);
+    bank_sched_on = false;
+    if (ret != ESP_OK) {
+        bank_sched_drain(); // Don't leave a sector erasing under whatever runs next
+    }
+
+    ESP_LOGI(TAG, "Dual-bank: %lu sectors erased in %llu us of erase time, programming waited %llu us; total %lld us",
+             bank_stats.sectors, bank_stats.erase_us, bank_stats.wait_us, esp_timer_get_time() - start_ts);
+    return ret;
+}
+
+esp_err_t swd_prog::erase_image_file(const char *path)
+{
+    if (path == nullptr) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    uint32_t flash_start_addr = 0;
+    if (fw_mgr->get_flash_start_addr(&flash_start_addr) != ESP_OK) {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    FILE *file = fopen(path, "rb");
+    if (file == nullptr) {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    uint8_t hdr_buf[std::max(sizeof(lz4_image_def::header), sizeof(fw_segmap_def::header))] = {};
+    size_t hdr_len = fread(hdr_buf, 1, sizeof(hdr_buf), file);
+    std::vector<swd_def::prog_range> ranges {};
+    esp_err_t ret = ESP_OK;
+    if (fw_segmap::is_segmap(hdr_buf, hdr_len)) {
+        fw_segmap map {};
+        ret = map.open(file);
+        for (size_t idx = 0; ret == ESP_OK && idx < map.size(); idx += 1) {
+            ranges.push_back({map.get(idx).addr, map.get(idx).len, 0});
         }
+    } else {
+        fseek(file, 0, SEEK_END);
+        size_t len = ftell(file);
+        lz4_image::get_raw_len(hdr_buf, hdr_len, &len);
+        ranges.push_back({flash_start_addr, (uint32_t)len, 0});
+    }
 
-        actual_crc = esp_crc32_le(actual_crc, buf, read_len);
-        offset += read_len;
-        remain_len -= read_len;
+    fclose(file);
+    return ret ?: erase_ranges(ranges);
+}
+
+esp_err_t swd_prog::erase_before_program(const char *path, const uint8_t *image, size_t len)
+{
+    if (has_dual_bank()) {
+        return ESP_OK;
     }
 
-    if (expected_crc != actual_crc) {
-        ESP_LOGE(TAG, "CRC mismatched, expected 0x%lx, actual 0x%lx", expected_crc, actual_crc);
-        return ESP_ERR_INVALID_CRC;
+    // Sparse images erase just the sectors their segments cover, the rest of the flash is left alone
+    if (image != nullptr) {
+        if (fw_segmap::is_segmap(image, len)) {
+            return erase_image_mem(image, len);
+        }
+    } else if (path != nullptr) {
+        FILE *file = fopen(path, "rb");
+        if (file == nullptr) {
+            return ESP_ERR_NOT_FOUND;
+        }
+
+        uint8_t hdr_buf[sizeof(fw_segmap_def::header)] = {};
+        size_t hdr_len = fread(hdr_buf, 1, sizeof(hdr_buf), file);
+        fclose(file);
+        if (fw_segmap::is_segmap(hdr_buf, hdr_len)) {
+            return erase_image_file(path);
+        }
     } else {
-        ESP_LOGI(TAG, "CRC matched, expected 0x%lx, actual 0x%lx", expected_crc, actual_crc);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    uint32_t start_addr = 0, end_addr = 0;
+    auto ret = fw_mgr->get_flash_start_addr(&start_addr);
+    ret = ret ?: fw_mgr->get_flash_end_addr(&end_addr);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to read flash addresses");
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    ret = erase_chip();
+    if (ret != ESP_OK) {
+        ret = erase_sector(start_addr, end_addr);
+    }
+
+    return ret;
+}
+
+esp_err_t swd_prog::erase_image_mem(const uint8_t *image, size_t len)
+{
+    uint32_t flash_start_addr = 0;
+    if (image == nullptr || fw_mgr->get_flash_start_addr(&flash_start_addr) != ESP_OK) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    std::vector<swd_def::prog_range> ranges {};
+    if (fw_segmap::is_segmap(image, len)) {
+        fw_segmap map {};
+        auto ret = map.open(image, len);
+        if (ret != ESP_OK) return ret;
+        for (size_t idx = 0; idx < map.size(); idx += 1) {
+            ranges.push_back({map.get(idx).addr, map.get(idx).len, 0});
+        }
+    } else {
+        size_t raw_len = len;
+        lz4_image::get_raw_len(image, len, &raw_len);
+        ranges.push_back({flash_start_addr, (uint32_t)raw_len, 0});
+    }
+
+    return erase_ranges(ranges);
+}
+
+esp_err_t swd_prog::erase_ranges(const std::vector<swd_def::prog_range> &ranges)
+{
+    uint32_t flash_start_addr = 0;
+    if (fw_mgr->get_flash_start_addr(&flash_start_addr) != ESP_OK) {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    // Round out to whole sectors and merge; two segments sharing a sector must not erase it twice
+    std::vector<swd_def::prog_range> sectors {};
+    for (const auto &range : ranges) {
+        uint32_t first_start = 0, first_size = 0, last_start = 0, last_size = 0;
+        if (range.len == 0 || range.addr < flash_start_addr) {
+            return ESP_ERR_INVALID_ARG;
+        }
+
+        auto ret = fw_mgr->get_sector_at(range.addr - flash_start_addr, &first_start, &first_size);
+        ret = ret ?: fw_mgr->get_sector_at(range.addr - flash_start_addr + range.len - 1, &last_start, &last_size);
+        if (ret != ESP_OK) {
+            ESP_LOGE(TAG, "No sector for 0x%08lx, %lu bytes", range.addr, range.len);
+            return ESP_ERR_INVALID_ARG;
+        }
+
+        uint32_t lo = flash_start_addr + first_start, hi = flash_start_addr + last_start + last_size;
+        if (!sectors.empty() && lo <= sectors.back().addr + sectors.back().len) {
+            sectors.back().len = std::max(sectors.back().addr + sectors.back().len, hi) - sectors.back().addr;
+        } else {
+            sectors.push_back({lo, hi - lo, 0});
+        }
+    }
+
+    uint32_t erased_len = 0;
+    for (const auto &range : sectors) {
+        auto ret = erase_sector(range.addr, range.addr + range.len);
+        if (ret != ESP_OK) {
+            return ret;
+        }
+
+        erased_len += range.len;
+    }
+
+    ESP_LOGI(TAG, "Erased %lu bytes in %u ranges", erased_len, sectors.size());
+    return ESP_OK;
+}
+
+bool swd_prog::has_dual_bank() const
+{
+    flash_algo::dual_bank_description descr = {};
+    return fw_mgr != nullptr && fw_mgr->get_dual_bank(&descr) == ESP_OK;
+}
+
+esp_err_t swd_prog::bank_sched_setup(uint32_t addr, uint32_t len)
+{
+    flash_algo::dual_bank_description descr = {};
+    uint32_t flash_start_addr = 0;
+    auto ret = fw_mgr->get_dual_bank(&descr);
+    ret = ret ?: fw_mgr->get_pc_erase_sector_async(&pc_erase_async);
+    ret = ret ?: fw_mgr->get_pc_erase_status(&pc_erase_status);
+    ret = ret ?: fw_mgr->get_flash_start_addr(&flash_start_addr);
+    if (ret != ESP_OK) {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+
+    if (len == 0) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    bank_stats = {};
+    for (size_t idx = 0; idx < flash_algo::bank_cnt; idx += 1) {
+        auto &bank = banks[idx];
+        bank = {};
+        bank.start = flash_start_addr + descr.banks[idx].offset;
+        bank.end = bank.start + descr.banks[idx].size;
+        bank.status_reg = descr.banks[idx].status_reg;
+        bank.busy_mask = descr.banks[idx].busy_mask;
+        bank.erase_next = bank.start;
+        bank.erase_end = bank.start;
+
+        uint32_t lo = std::max(addr, bank.start), hi = std::min(addr + len, bank.end);
+        if (lo >= hi) {
+            continue;
+        }
+
+        // Round out to whole sectors from the DeviceData map, which must not straddle the bank boundary
+        uint32_t first_start = 0, last_start = 0, sector_size = 0;
+        if (fw_mgr->get_sector_at(lo - flash_start_addr, &first_start, &sector_size) != ESP_OK
+            || fw_mgr->get_sector_at(hi - 1 - flash_start_addr, &last_start, &sector_size) != ESP_OK) {
+            ESP_LOGE(TAG, "Dual-bank: no sector map for 0x%08lx-0x%08lx", lo, hi);
+            return ESP_ERR_INVALID_ARG;
+        }
+
+        bank.erase_next = flash_start_addr + first_start;
+        bank.erase_end = flash_start_addr + last_start + sector_size;
+        if (bank.erase_next < bank.start || bank.erase_end > bank.end) {
+            ESP_LOGE(TAG, "Dual-bank: sectors cross bank %u boundary", idx);
+            return ESP_ERR_INVALID_ARG;
+        }
+
+        ESP_LOGI(TAG, "Dual-bank: bank %u erases 0x%08lx-0x%08lx", idx, bank.erase_next, bank.erase_end);
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t swd_prog::bank_sched_kick(swd_def::bank_sched &bank, uint32_t flash_start_addr)
+{
+    uint32_t sector_start = 0, sector_size = 0;
+    if (fw_mgr->get_sector_at(bank.erase_next - flash_start_addr, &sector_start, &sector_size) != ESP_OK) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (exec_syscall(func_offset + pc_erase_async, bank.erase_next, 0, 0, 0, FLASHALGO_RETURN_BOOL, nullptr) < 1) {
+        ESP_LOGE(TAG, "EraseSectorAsync failed @ 0x%08lx", bank.erase_next);
+        return ESP_FAIL;
     }
 
+    bank.busy = true;
+    bank.busy_addr = bank.erase_next;
+    bank.busy_len = sector_size;
+    bank.busy_since = esp_timer_get_time();
     return ESP_OK;
 }
 
+esp_err_t swd_prog::bank_sched_poll(swd_def::bank_sched &bank)
+{
+    // A status register costs one SWD read; EraseStatus costs a whole syscall but can report errors too
+    uint32_t status = swd_def::ERASE_STATUS_BUSY;
+    if (bank.status_reg != 0) {
+        uint32_t val = 0;
+        if (swd_read_word(bank.status_reg, &val) < 1) {
+            return ESP_FAIL;
+        }
+
+        status = (val & bank.busy_mask) != 0 ? swd_def::ERASE_STATUS_BUSY : swd_def::ERASE_STATUS_DONE;
+    } else if (exec_syscall(func_offset + pc_erase_status, bank.busy_addr, 0, 0, 0, FLASHALGO_RETURN_VALUE, &status) < 1) {
+        return ESP_FAIL;
+    }
+
+    if (status == swd_def::ERASE_STATUS_BUSY) {
+        return ESP_OK;
+    }
+
+    bank.busy = false;
+    if (status != swd_def::ERASE_STATUS_DONE) {
+        ESP_LOGE(TAG, "Async erase @ 0x%08lx failed: 0x%lx", bank.busy_addr, status);
+        return ESP_FAIL;
+    }
+
+    bank.erase_next = bank.busy_addr + bank.busy_len;
+    bank_stats.sectors += 1;
+    bank_stats.erase_us += esp_timer_get_time() - bank.busy_since;
+    return ESP_OK;
+}
+
+esp_err_t swd_prog::bank_sched_wait(uint32_t addr, uint32_t len)
+{
+    uint32_t flash_start_addr = 0, erase_timeout_ms = 0;
+    if (fw_mgr->get_flash_start_addr(&flash_start_addr) != ESP_OK) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    if (fw_mgr->get_erase_sector_timeout(&erase_timeout_ms) != ESP_OK || erase_timeout_ms == 0) {
+        erase_timeout_ms = swd_def::syscall_timeout_ms;
+    }
+
+    // Worst case is one sector finishing in the other bank plus every sector still between this chunk and its bank's erase cursor
+    int64_t start_ts = esp_timer_get_time();
+    int64_t deadline = start_ts + (int64_t)erase_timeout_ms * 1000 * (1 + bank_sched_pending(addr, len, flash_start_addr));
+    while (true) {
+        bool ready = true;
+        for (auto &bank : banks) {
+            if (bank.busy && bank_sched_poll(bank) != ESP_OK) {
+                return ESP_FAIL;
+            }
+
+            uint32_t lo = std::max(addr, bank.start), hi = std::min(addr + len, bank.end);
+            bool needed = lo < hi;
+            bool erased = !needed || hi <= bank.erase_next;
+
+            // Erase ahead on a bank that's idle as far as programming goes, or erase just what this chunk needs
+            if (!bank.busy && bank.erase_next < bank.erase_end && (!needed || !erased)) {
+                if (bank_sched_kick(bank, flash_start_addr) != ESP_OK) {
+                    return ESP_FAIL;
+                }
+            }
+
+            if (needed && (bank.busy || !erased)) {
+                ready = false;
+            }
+        }
+
+        int64_t now = esp_timer_get_time();
+        if (ready) {
+            bank_stats.wait_us += now - start_ts;
+            return ESP_OK;
+        }
+
+        if (now > deadline) {
+            ESP_LOGE(TAG, "Dual-bank: timeout waiting for erase before 0x%08lx", addr);
+            return ESP_ERR_TIMEOUT;
+        }
+
+        if (now - start_ts > swd_def::syscall_spin_us) {
+            vTaskDelay(1);
+        }
+    }
+}
+
+uint32_t swd_prog::bank_sched_pending(uint32_t addr, uint32_t len, uint32_t flash_start_addr)
+{
+    uint32_t pending = 0;
+    for (const auto &bank : banks) {
+        uint32_t hi = std::min(std::min(addr + len, bank.end), bank.erase_end);
+        uint32_t cur = bank.busy ? bank.busy_addr : bank.erase_next;
+        if (std::max(addr, bank.start) >= hi) {
+            continue;
+        }
+
+        while (cur < hi) {
+            uint32_t sector_start = 0, sector_size = 0;
+            if (fw_mgr->get_sector_at(cur - flash_start_addr, &sector_start, &sector_size) != ESP_OK || sector_size == 0) {
+                pending += 1;
+                break;
+            }
+
+            cur = flash_start_addr + sector_start + sector_size;
+            pending += 1;
+        }
+    }
+
+    return std::max(pending, (uint32_t)1);
+}
+
+esp_err_t swd_prog::bank_sched_drain()
+{
+    uint32_t erase_timeout_ms = 0;
+    if (fw_mgr->get_erase_sector_timeout(&erase_timeout_ms) != ESP_OK || erase_timeout_ms == 0) {
+        erase_timeout_ms = swd_def::syscall_timeout_ms;
+    }
+
+    int64_t deadline = esp_timer_get_time() + (int64_t)erase_timeout_ms * 1000;
+    for (auto &bank : banks) {
+        while (bank.busy) {
+            if (bank_sched_poll(bank) != ESP_OK) {
+                bank.busy = false;
+                return ESP_FAIL;
+            }
+
+            if (bank.busy && esp_timer_get_time() > deadline) {
+                ESP_LOGE(TAG, "Dual-bank: erase @ 0x%08lx still busy", bank.busy_addr);
+                bank.busy = false;
+                return ESP_ERR_TIMEOUT;
+            }
+
+            vTaskDelay(1);
+        }
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t swd_prog::verify(uint32_t expected_crc, uint32_t start_addr, size_t len)
+{
+    swd_wire_op_scope wire_op(swd_wire_def::OP_VERIFY);
+    auto swd_ret = swd_halt_target();
+    if (swd_ret < 1) {
+        ESP_LOGE(TAG, "Failed when halting");
+        state = swd_def::UNKNOWN;
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    uint32_t flash_start_addr = 0, flash_end_addr = 0;
+    auto nvs_ret = fw_mgr->get_flash_end_addr(&flash_end_addr);
+    nvs_ret = nvs_ret ?: fw_mgr->get_flash_start_addr(&flash_start_addr);
+
+    if (nvs_ret != ESP_OK) {
+        ESP_LOGE(TAG, "Missing config for verify");
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    uint32_t actual_read_addr = (start_addr == UINT32_MAX) ? flash_start_addr : start_addr;
+    uint32_t actual_len = (len == 0) ? (flash_end_addr - flash_start_addr) : len;
+    uint32_t actual_crc = 0;
+    size_t remain_len = actual_len;
+    uint32_t offset = 0;
+
+    while(remain_len > 0) {
+        uint8_t buf[1024] = { 0 };
+        uint32_t read_len = std::min(sizeof(buf), remain_len);
+        swd_ret = mem_cache.read_memory((actual_read_addr + offset), buf, read_len);
+        if (swd_ret < 1) {
+            ESP_LOGE(TAG, "Failed when reading flash");
+            return ESP_ERR_INVALID_STATE;
+        }
+
+        actual_crc = esp_crc32_le(actual_crc, buf, read_len);
+        offset += read_len;
+        remain_len -= read_len;
+    }
+
+    if (expected_crc != actual_crc) {
+        ESP_LOGE(TAG, "CRC mismatched, expected 0x%lx, actual 0x%lx", expected_crc, actual_crc);
+        return ESP_ERR_INVALID_CRC;
+    } else {
+        ESP_LOGI(TAG, "CRC matched, expected 0x%lx, actual 0x%lx", expected_crc, actual_crc);
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t swd_prog::checksum_flash(uint32_t start_addr, uint32_t len, uint32_t *crc_out)
+{
+    swd_wire_op_scope wire_op(swd_wire_def::OP_VERIFY);
+    if (crc_out == nullptr || len == 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    // Only the BKPT return and the stack are needed, the algo itself doesn't have to be initialised
+    if (state == swd_def::UNKNOWN || state == swd_def::INITIALISED) {
+        auto ret = load_flash_algorithm();
+        if (ret != ESP_OK) return ret;
+    }
+
+    // The blob goes where page data would, nothing of the algo gets overwritten
+    uint32_t blob_addr = layout.buf_addr[0];
+    if (mem_cache.write_memory(blob_addr, (const uint8_t *)crc32_blob, sizeof(crc32_blob)) < 1) {
+        ESP_LOGE(TAG, "Failed when writing checksum routine");
+        state = swd_def::UNKNOWN;
+        return ESP_FAIL;
+    }
+
+    int64_t start_ts = esp_timer_get_time();
+    uint32_t crc = 0;
+    if (exec_syscall(blob_addr | 1, start_addr, len, 0, 0, FLASHALGO_RETURN_VALUE, &crc) < 1) {
+        ESP_LOGE(TAG, "Checksum routine failed");
+        state = swd_def::UNKNOWN;
+        return ESP_FAIL;
+    }
+
+    ESP_LOGI(TAG, "On-target CRC of 0x%08lx, len %lu: 0x%08lx, %lld us", start_addr, len, crc, esp_timer_get_time() - start_ts);
+    *crc_out = crc;
+    return ESP_OK;
+}
+
+uint32_t swd_prog::get_last_program_crc() const
+{
+    return last_prog_crc;
+}
+
+const std::vector<swd_def::prog_range> &swd_prog::get_last_program_ranges() const
+{
+    return prog_ranges;
+}
+
+const pipeline_def::stats &swd_prog::get_pipeline_stats() const
+{
+    return pipeline.get_stats();
+}
+
+esp_err_t swd_prog::verify_last_program()
+{
+    if (prog_ranges.empty()) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    for (const auto &range : prog_ranges) {
+        auto ret = verify(range.crc, range.addr, range.len);
+        if (ret != ESP_OK) {
+            return ret;
+        }
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t swd_prog::calibrate_stack(uint32_t sector_addr)
+{
+    if (fw_mgr == nullptr) {
+        ESP_LOGE(TAG, "Not initialised");
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    uint32_t stack_used = 0;
+    stack_calibrating = true;
+    auto ret = run_stack_calibration(sector_addr, &stack_used);
+    stack_calibrating = false;
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    if (stack_used == 0) {
+        ESP_LOGE(TAG, "Stack paint untouched, calibration run didn't reach the stack region?");
+        return ESP_ERR_INVALID_RESPONSE;
+    }
+
+    const uint8_t *hash = get_algo_hash();
+    if (hash == nullptr) {
+        ESP_LOGE(TAG, "No algo hash, can't store stack profile");
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    algo_profile_def::record record = {};
+    profile->load(hash, &record); // Keep whatever else is in there
+    record.version = algo_profile_def::version;
+    record.stack_used = stack_used;
+    uint32_t margin = std::max(stack_used * swd_def::stack_margin_pct / 100, swd_def::stack_min_margin);
+    record.stack_size = std::min(ram_layout_planner::align_up(stack_used + margin, ram_layout::stack_align), stack_size);
+
+    ESP_LOGI(TAG, "Stack calibrated: high-water %lu of %lu bytes, reserving %lu", stack_used, stack_size, record.stack_size);
+    ret = profile->store(hash, record);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    return init(fw_mgr, ram_addr, stack_size, ram_size);
+}
+
+bool swd_prog::has_stack_profile()
+{
+    algo_profile_def::record record = {};
+    const uint8_t *hash = get_algo_hash();
+    return hash != nullptr && profile->load(hash, &record) == ESP_OK && record.stack_size > 0;
+}
+
+esp_err_t swd_prog::set_prog_chunk_size(uint32_t size)
+{
+    profile->init();
+    const uint8_t *hash = get_algo_hash();
+    if (hash == nullptr) {
+        ESP_LOGE(TAG, "No algo hash, can't store chunk size");
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    algo_profile_def::record record = {};
+    profile->load(hash, &record);
+    record.version = algo_profile_def::version;
+    record.prog_chunk_size = size;
+    ESP_LOGI(TAG, "ProgramPage chunk size set to %lu", size);
+    return profile->store(hash, record);
+}
+
+esp_err_t swd_prog::set_connect_flags(uint32_t flags)
+{
+    profile->init();
+    const uint8_t *hash = get_algo_hash();
+    if (hash == nullptr) {
+        ESP_LOGE(TAG, "No algo hash, can't store connect flags");
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    algo_profile_def::record record = {};
+    profile->load(hash, &record);
+    record.version = algo_profile_def::version;
+    record.connect_flags = flags & (swd_def::CONNECT_UNDER_RESET | swd_def::CONNECT_FAST_RECONNECT);
+    ESP_LOGI(TAG, "Connect flags set to 0x%lx", record.connect_flags);
+    return profile->store(hash, record);
+}
+
+esp_err_t swd_prog::run_stack_calibration(uint32_t sector_addr, uint32_t *stack_used_out)
+{
+    uint32_t pc_erase_sector = 0, pc_program_page = 0, flash_start_addr = 0, page_size = 0, erased_val = 0;
+    auto ret = fw_mgr->get_pc_erase_sector(&pc_erase_sector);
+    ret = ret ?: fw_mgr->get_pc_program_page(&pc_program_page);
+    ret = ret ?: fw_mgr->get_flash_start_addr(&flash_start_addr);
+    ret = ret ?: fw_mgr->get_page_size(&page_size);
+    ret = ret ?: fw_mgr->get_erased_byte_val(&erased_val);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Missing config for stack calibration");
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    uint32_t addr = sector_addr == UINT32_MAX ? flash_start_addr : sector_addr;
+
+    // Full requested stack, painted after init() has put the canary at the bottom
+    ret = init(fw_mgr, ram_addr, stack_size, ram_size);
+    ret = ret ?: paint_stack();
+    ret = ret ?: run_algo_init(swd_def::ERASE);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    auto swd_ret = exec_syscall(func_offset + pc_erase_sector, addr, 0, 0, 0, FLASHALGO_RETURN_BOOL, nullptr);
+    if (swd_ret < 1) {
+        ESP_LOGE(TAG, "Calibration EraseSector @ 0x%08lx failed", addr);
+        state = swd_def::UNKNOWN;
+        return ESP_FAIL;
+    }
+
+    ret = run_algo_uninit(swd_def::ERASE);
+    ret = ret ?: run_algo_init(swd_def::PROGRAM);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    // Blank page, so the sector reads back the same as erased
+    auto *buf = new uint8_t[page_size];
+    memset(buf, (uint8_t)erased_val, page_size);
+    swd_ret = mem_cache.write_memory(layout.buf_addr[0], buf, page_size);
+    delete[] buf;
+
+    swd_ret = swd_ret < 1 ? swd_ret : exec_syscall(func_offset + pc_program_page, addr, page_size, layout.buf_addr[0], 0, FLASHALGO_RETURN_BOOL, nullptr);
+    if (swd_ret < 1) {
+        ESP_LOGE(TAG, "Calibration ProgramPage @ 0x%08lx failed", addr);
+        state = swd_def::UNKNOWN;
+        return ESP_FAIL;
+    }
+
+    ret = run_algo_uninit(swd_def::PROGRAM);
+    ret = ret ?: measure_stack(stack_used_out);
+    return ret;
+}
+
+esp_err_t swd_prog::paint_stack()
+{
+    uint32_t pattern[64] = {};
+    std::fill_n(pattern, sizeof(pattern) / sizeof(uint32_t), swd_def::stack_paint_pattern);
+
+    // Canary word at stack_bottom stays as-is
+    uint32_t addr = stack_bottom + sizeof(uint32_t);
+    while (addr < stack_offset) {
+        uint32_t len = std::min((uint32_t)sizeof(pattern), stack_offset - addr);
+        if (mem_cache.write_memory(addr, (uint8_t *)pattern, len) < 1) {
+            ESP_LOGE(TAG, "Failed to paint stack @ 0x%08lx", addr);
+            return ESP_ERR_INVALID_STATE;
+        }
+
+        addr += len;
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t swd_prog::measure_stack(uint32_t *stack_used_out)
+{
+    // Stack grows down, so the first word above the canary that's been touched is the high-water mark
+    uint32_t chunk[256] = {};
+    uint32_t addr = stack_bottom + sizeof(uint32_t);
+    while (addr < stack_offset) {
+        uint32_t len = std::min((uint32_t)sizeof(chunk), stack_offset - addr);
+        if (mem_cache.read_memory(addr, (uint8_t *)chunk, len) < 1) {
+            ESP_LOGE(TAG, "Failed to read stack @ 0x%08lx", addr);
+            return ESP_ERR_INVALID_STATE;
+        }
+
+        for (uint32_t idx = 0; idx < len / sizeof(uint32_t); idx += 1) {
+            if (chunk[idx] != swd_def::stack_paint_pattern) {
+                *stack_used_out = stack_offset - (addr + idx * sizeof(uint32_t));
+                return ESP_OK;
+            }
+        }
+
+        addr += len;
+    }
+
+    *stack_used_out = 0;
+    return ESP_OK;
+}
+
+uint8_t swd_prog::exec_syscall(uint32_t entry, uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4, flash_algo_return_t return_type, uint32_t *ret_val, uint32_t timeout_ms)
+{
+    // Not swd_flash_syscall_exec(), as that can't service semihosting or RTT while the target runs
+    auto ret = syscall_start(entry, arg1, arg2, arg3, arg4);
+    if (ret < 1) {
+        return ret;
+    }
+
+    return syscall_wait(return_type, ret_val, timeout_ms);
+}
+
+uint8_t swd_prog::syscall_start(uint32_t entry, uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4)
+{
+    if (mem_cache.flush() < 1) {
+        ESP_LOGE(TAG, "Failed to flush target memory cache");
+        return 0;
+    }
+
+    call_start_ts = esp_timer_get_time();
+
+    // Same register setup as swd_flash_syscall_exec(): LR points to the BKPT in header_blob
+    const uint32_t regs[][2] = {
+            { swd_def::CORE_REG_R0, arg1 },
+            { swd_def::CORE_REG_R0 + 1, arg2 },
+            { swd_def::CORE_REG_R0 + 2, arg3 },
+            { swd_def::CORE_REG_R0 + 3, arg4 },
+            { swd_def::CORE_REG_R9, syscall.static_base },
+            { swd_def::CORE_REG_SP, syscall.stack_pointer },
+            { swd_def::CORE_REG_LR, syscall.breakpoint },
+            { swd_def::CORE_REG_PC, entry },
+            { swd_def::CORE_REG_XPSR, swd_def::XPSR_THUMB },
+    };
+
+    for (auto &reg : regs) {
+        if (swd_write_core_register(reg[0], reg[1]) < 1) {
+            ESP_LOGE(TAG, "Failed to set core register %lu", reg[0]);
+            return 0;
+        }
+    }
+
+    syscall_ptr_expect = arg1 + arg2;
+    mem_cache.invalidate();
+
+    curr_fn = swd_def::FN_OTHER;
+    for (uint32_t fn = 0; fn < swd_def::FN_OTHER; fn += 1) {
+        if (fn_entry[fn] == entry) {
+            curr_fn = (swd_def::algo_fn)fn;
+            break;
+        }
+    }
+
+    // Zeroed rather than read, saves a round trip per call; DWT isn't touched by the algorithm
+    cyccnt_acc = 0;
+    cyccnt_last = 0;
+    if (cyccnt_ok && swd_write_word(swd_def::REG_DWT_CYCCNT, 0) < 1) {
+        ESP_LOGW(TAG, "Failed to clear CYCCNT, profiling off");
+        cyccnt_ok = false;
+    }
+
+    run_start_ts = esp_timer_get_time();
+    if (swd_write_word(swd_def::REG_DFSR, swd_def::DFSR_CLEAR_ALL) < 1
+        || swd_write_word(swd_def::REG_DHCSR, swd_def::DHCSR_DBGKEY | swd_def::DHCSR_C_DEBUGEN) < 1) {
+        ESP_LOGE(TAG, "Failed to resume target");
+        return 0;
+    }
+
+    return 1;
+}
+
+uint8_t swd_prog::syscall_wait(flash_algo_return_t return_type, uint32_t *ret_val, uint32_t timeout_ms)
+{
+    // Target is running here, so only raw swd_host access - nothing must land in the memory cache
+    int64_t start_ts = esp_timer_get_time();
+    int64_t deadline = start_ts + (int64_t)timeout_ms * 1000;
+    uint32_t r0 = 0;
+    bool exited = false;
+    semihosting.begin();
+
+    while (true) {
+        uint32_t dhcsr = 0;
+        if (swd_read_word(swd_def::REG_DHCSR, &dhcsr) < 1) {
+            ESP_LOGE(TAG, "Failed to read DHCSR");
+            return 0;
+        }
+
+        if ((dhcsr & swd_def::DHCSR_S_HALT) == 0) {
+            int64_t now = esp_timer_get_time();
+            if (now > deadline) {
+                ESP_LOGE(TAG, "Syscall timed out after %lu ms", timeout_ms);
+                semihosting.flush();
+                swd_halt_target();
+                return 0;
+            }
+
+            rtt->poll_if_due();
+
+            // Busy-poll for short calls like ProgramPage, only start yielding once the call is clearly a long one
+            if (now - start_ts > swd_def::syscall_spin_us) {
+                profile_sample(); // Once per tick is enough to catch every CYCCNT wrap
+                vTaskDelay(1);
+            }
+
+            continue;
+        }
+
+        uint32_t pc = 0;
+        if (swd_read_core_register(swd_def::CORE_REG_PC, &pc) < 1) {
+            ESP_LOGE(TAG, "Failed to read PC");
+            return 0;
+        }
+
+        if ((pc & ~1UL) == (syscall.breakpoint & ~1UL)) {
+            break;
+        }
+
+        uint16_t insn = 0;
+        if (swd_read_memory(pc & ~1UL, (uint8_t *)&insn, sizeof(insn)) < 1 || insn != semihost_def::bkpt_insn) {
+            ESP_LOGE(TAG, "Unexpected halt @ 0x%08lx, insn 0x%04x", pc, insn);
+            semihosting.flush();
+            return 0;
+        }
+
+        uint32_t op = 0, param = 0;
+        if (swd_read_core_register(swd_def::CORE_REG_R0, &op) < 1 || swd_read_core_register(swd_def::CORE_REG_R0 + 1, &param) < 1) {
+            ESP_LOGE(TAG, "Failed to read semihosting args");
+            return 0;
+        }
+
+        uint32_t result = op; // Unchanged R0 unless the op returns something
+        auto action = semihosting.handle(op, param, &result);
+        if (action == semihost_def::FAILED) {
+            semihosting.flush();
+            return 0;
+        } else if (action == semihost_def::EXIT) {
+            exited = true;
+            break;
+        }
+
+        // Step over the BKPT and carry on, the target sees the call as a plain function return
+        if (swd_write_core_register(swd_def::CORE_REG_R0, result) < 1
+            || swd_write_core_register(swd_def::CORE_REG_PC, pc + 2) < 1
+            || swd_write_word(swd_def::REG_DFSR, swd_def::DFSR_CLEAR_ALL) < 1
+            || swd_write_word(swd_def::REG_DHCSR, swd_def::DHCSR_DBGKEY | swd_def::DHCSR_C_DEBUGEN) < 1) {
+            ESP_LOGE(TAG, "Failed to resume after semihosting");
+            return 0;
+        }
+    }
+
+    int64_t halt_ts = esp_timer_get_time();
+    profile_sample();
+    semihosting.flush();
+    rtt_finish();
+
+    if (exited) {
+        // SYS_EXIT ends the call early; only ADP_Stopped_ApplicationExit counts as success
+        r0 = semihosting.get_exit_reason() == semihost_def::adp_stopped_app_exit ? 0 : semihosting.get_exit_reason();
+        ESP_LOGI(TAG, "Target exited via semihosting, reason 0x%lx", semihosting.get_exit_reason());
+    } else if (swd_read_core_register(swd_def::CORE_REG_R0, &r0) < 1) {
+        ESP_LOGE(TAG, "Failed to read R0");
+        return 0;
+    }
+
+    profile_record(halt_ts);
+
+    switch (return_type) {
+        case FLASHALGO_RETURN_VALUE: {
+            if (ret_val != nullptr) {
+                *ret_val = r0;
+            }
+
+            return 1;
+        }
+
+        case FLASHALGO_RETURN_POINTER: {
+            return r0 == syscall_ptr_expect ? 1 : 0;
+        }
+
+        default: {
+            return r0 == 0 ? 1 : 0;
+        }
+    }
+}
+
+void swd_prog::profile_setup()
+{
+    uint32_t pcs[swd_def::FN_OTHER] = {};
+    const esp_err_t rets[swd_def::FN_OTHER] = {
+            fw_mgr->get_pc_init(&pcs[swd_def::FN_INIT]),
+            fw_mgr->get_pc_uninit(&pcs[swd_def::FN_UNINIT]),
+            fw_mgr->get_pc_erase_all(&pcs[swd_def::FN_ERASE_CHIP]),
+            fw_mgr->get_pc_erase_sector(&pcs[swd_def::FN_ERASE_SECTOR]),
+            fw_mgr->get_pc_program_page(&pcs[swd_def::FN_PROGRAM_PAGE]),
+            fw_mgr->get_pc_verify(&pcs[swd_def::FN_VERIFY]),
+    };
+
+    for (uint32_t fn = 0; fn < swd_def::FN_OTHER; fn += 1) {
+        fn_entry[fn] = rets[fn] == ESP_OK ? func_offset + pcs[fn] : UINT32_MAX;
+    }
+
+    fn_entry[swd_def::FN_OTHER] = UINT32_MAX;
+
+    // TRCENA powers the DWT; on cores without CYCCNT we still get wall time and host time
+    uint32_t demcr = 0, dwt_ctrl = 0;
+    cyccnt_ok = swd_read_word(swd_def::REG_DEMCR, &demcr) >= 1
+                && swd_write_word(swd_def::REG_DEMCR, demcr | swd_def::DEMCR_TRCENA) >= 1
+                && swd_read_word(swd_def::REG_DWT_CTRL, &dwt_ctrl) >= 1
+                && (dwt_ctrl & swd_def::DWT_CTRL_NOCYCCNT) == 0
+                && swd_write_word(swd_def::REG_DWT_CTRL, dwt_ctrl | swd_def::DWT_CTRL_CYCCNTENA) >= 1;
+
+    if (!cyccnt_ok) {
+        // Cores without a DWT fault the probe; clear the sticky error or every later transfer faults too
+        swd_write_dp(swd_def::DP_ADDR_ABORT, swd_def::ABORT_CLEAR_ALL);
+        ESP_LOGI(TAG, "No DWT cycle counter (DWT_CTRL 0x%08lx), timing algo calls by wall clock only", dwt_ctrl);
+    }
+}
+
+void swd_prog::profile_sample()
+{
+    if (!cyccnt_ok) {
+        return;
+    }
+
+    uint32_t cyccnt = 0;
+    if (swd_read_word(swd_def::REG_DWT_CYCCNT, &cyccnt) < 1) {
+        return;
+    }
+
+    cyccnt_acc += (uint32_t)(cyccnt - cyccnt_last); // Modulo 2^32, right across a wrap
+    cyccnt_last = cyccnt;
+}
+
+void swd_prog::profile_record(int64_t halt_ts)
+{
+    auto &stats = fn_stats[curr_fn];
+    stats.calls += 1;
+    stats.cycles += cyccnt_acc;
+    stats.max_cycles = std::max(stats.max_cycles, cyccnt_acc);
+    stats.run_us += halt_ts - run_start_ts;
+    stats.host_us += (run_start_ts - call_start_ts) + (esp_timer_get_time() - halt_ts);
+}
+
+const swd_def::algo_fn_stats &swd_prog::get_algo_fn_stats(swd_def::algo_fn fn) const
+{
+    return fn_stats[fn < swd_def::FN_CNT ? fn : swd_def::FN_OTHER];
+}
+
+void swd_prog::reset_algo_fn_stats()
+{
+    memset(fn_stats, 0, sizeof(fn_stats));
+}
+
+void swd_prog::log_algo_fn_stats() const
+{
+    static const char *fn_names[swd_def::FN_CNT] = { "Init", "UnInit", "EraseChip", "EraseSector", "ProgramPage", "Verify", "Other" };
+    for (uint32_t fn = 0; fn < swd_def::FN_CNT; fn += 1) {
+        const auto &stats = fn_stats[fn];
+        if (stats.calls == 0) {
+            continue;
+        }
+
+        // Cycles over run time gives the effective core clock; far below the part's clock means we're slow to notice the halt
+        ESP_LOGI(TAG, "%s: %lu calls; %llu cycles (avg %llu, max %llu); target %llu us, SWD overhead %llu us",
+                 fn_names[fn], stats.calls, stats.cycles, stats.cycles / stats.calls, stats.max_cycles, stats.run_us, stats.host_us);
+    }
+}
+
+void swd_prog::rtt_arm()
+{
+    if (rtt->get_state() != rtt_def::DETACHED) {
+        rtt_active = true;
+        return;
+    }
+
+    // Only the cached address is tried here; the control block usually doesn't exist until the test code runs
+    rtt_active = true;
+    rtt->attach(0, 0, get_algo_hash(), false);
+}
+
+void swd_prog::rtt_finish()
+{
+    if (!rtt_active) {
+        return;
+    }
+
+    rtt_active = false;
+    if (rtt->get_state() != rtt_def::ATTACHED && !rtt_scanned) {
+        uint32_t scan_start = 0, scan_len = 0;
+        if (fw_mgr->get_ram_start_addr(&scan_start) != ESP_OK || fw_mgr->get_ram_size_byte(&scan_len) != ESP_OK) {
+            scan_start = ram_addr;
+            scan_len = stack_offset - ram_addr;
+        }
+
+        rtt_scanned = true; // Once per init, a firmware without RTT shouldn't pay for the scan on every test
+        rtt->attach(scan_start, scan_len, get_algo_hash(), true);
+    }
+
+    if (rtt->get_state() == rtt_def::ATTACHED) {
+        rtt->poll();
+    }
+}
+
+esp_err_t swd_prog::connect()
+{
+    swd_wire_op_scope wire_op(swd_wire_def::OP_CONNECT);
+    // Unlike init(), this leaves target RAM untouched (no stack canary), so that it can be read back as-is
+    mem_cache.invalidate();
+    return connect_target();
+}
+
+esp_err_t swd_prog::connect_target()
+{
+    int64_t start_ts = esp_timer_get_time();
+    bool under_reset = (connect_flags & swd_def::CONNECT_UNDER_RESET) != 0;
+    bool allow_fast = (connect_flags & swd_def::CONNECT_FAST_RECONNECT) != 0;
+    metrics = {};
+    metrics.flags = connect_flags;
+
+    // Held before the first SWD bit, so firmware that remaps SWDIO/SWCLK or sleeps early never gets to run
+    if (under_reset) {
+        swd_set_target_reset(1);
+    }
+
+    bool fast_used = false;
+    auto ret = dp_power_up(allow_fast, &fast_used);
+    int64_t halt_ts = esp_timer_get_time();
+    if (ret == ESP_OK) {
+        ret = under_reset ? halt_under_reset() : halt();
+    }
+
+    // CTRL/STAT looked fine but the rest of the debug state didn't survive, redo it the slow way
+    if (ret != ESP_OK && fast_used) {
+        ESP_LOGW(TAG, "Fast reconnect failed, falling back to full init");
+        if (under_reset) {
+            swd_set_target_reset(1);
+        }
+
+        ret = dp_power_up(false, &fast_used);
+        halt_ts = esp_timer_get_time();
+        if (ret == ESP_OK) {
+            ret = under_reset ? halt_under_reset() : halt();
+        }
+    }
+
+    if (under_reset) {
+        swd_set_target_reset(0); // Already released on success, this covers the failure paths
+    }
+
+    int64_t end_ts = esp_timer_get_time();
+    metrics.fast_path = fast_used;
+    metrics.power_up_us = (uint32_t)(halt_ts - start_ts);
+    metrics.halt_us = (uint32_t)(end_ts - halt_ts);
+    metrics.total_us = (uint32_t)(end_ts - start_ts);
+
+    if (ret != ESP_OK) {
+        state = swd_def::UNKNOWN;
+        return ret;
+    }
+
+    ESP_LOGI(TAG, "Connect: %s%s; DP %lu us, halt %lu us, total %lu us", under_reset ? "under reset" : "normal",
+             fast_used ? ", fast" : "", metrics.power_up_us, metrics.halt_us, metrics.total_us);
+    if (multidrop.enabled()) {
+        const auto *target = multidrop.get_target(drop_idx);
+        const auto &drop_stats = multidrop.get_stats();
+        ESP_LOGI(TAG, "Multi-drop target %u/%u, TARGETSEL 0x%08lx, DPIDR 0x%08lx; %lu wakeups, %lu switches, %lu skipped",
+                 drop_idx + 1, multidrop.get_target_cnt(), target->targetsel, target->dpidr,
+                 drop_stats.wakeups, drop_stats.switches, drop_stats.switches_skipped);
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t swd_prog::dp_power_up(bool allow_fast, bool *fast_used)
+{
+    *fast_used = false;
+    if (multidrop.enabled()) {
+        auto ret = multidrop.select(drop_idx);
+        return ret ?: multidrop.power_up(allow_fast, fast_used);
+    }
+
+    if (allow_fast && dp_powered) {
+        uint32_t ctrl_stat = 0;
+        const uint32_t pwr_acks = swd_def::CTRL_STAT_CSYSPWRUPACK | swd_def::CTRL_STAT_CDBGPWRUPACK;
+        if (swd_read_dp(swd_def::DP_ADDR_CTRL_STAT, &ctrl_stat) >= 1 && (ctrl_stat & pwr_acks) == pwr_acks
+            && (ctrl_stat & swd_def::CTRL_STAT_STICKY_MASK) == 0) {
+            *fast_used = true;
+            return ESP_OK;
+        }
+
+        ESP_LOGI(TAG, "DP not powered up (CTRL/STAT 0x%08lx), full init", ctrl_stat);
+    }
+
+    dp_powered = false;
+    if (swd_init_debug() < 1) {
+        ESP_LOGE(TAG, "Failed when init");
+        return ESP_FAIL;
+    }
+
+    dp_powered = true;
+    return ESP_OK;
+}
+
+esp_err_t swd_prog::halt_under_reset()
+{
+    // Request the halt and catch the reset vector while NRST is still low, then let go
+    uint32_t demcr = 0;
+    bool caught = swd_write_word(swd_def::REG_DHCSR, swd_def::DHCSR_DBGKEY | swd_def::DHCSR_C_DEBUGEN | swd_def::DHCSR_C_HALT) >= 1
+                  && swd_read_word(swd_def::REG_DEMCR, &demcr) >= 1
+                  && swd_write_word(swd_def::REG_DEMCR, demcr | swd_def::DEMCR_VC_CORERESET) >= 1;
+
+    swd_set_target_reset(0);
+    if (!caught) {
+        // Some parts gate the SCS while in reset; the core may run briefly, but a late halt beats none
+        ESP_LOGW(TAG, "Debug registers not accessible under reset, halting after release");
+        vTaskDelay(pdMS_TO_TICKS(swd_def::reset_release_ms));
+        return halt();
+    }
+
+    vTaskDelay(pdMS_TO_TICKS(swd_def::reset_release_ms));
+    if (swd_wait_until_halted() < 1) {
+        ESP_LOGE(TAG, "Timeout when halting on reset vector");
+        return ESP_ERR_TIMEOUT;
+    }
+
+    // Leave vector catch as found, or every later reset would stop at the vector too
+    if (swd_write_word(swd_def::REG_DEMCR, demcr & ~swd_def::DEMCR_VC_CORERESET) < 1) {
+        ESP_LOGW(TAG, "Failed to restore DEMCR");
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t swd_prog::halt()
+{
+    auto ret = swd_halt_target();
+    if (ret < 1) {
+        ESP_LOGE(TAG, "Failed when halting");
+        state = swd_def::UNKNOWN;
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    ret = swd_wait_until_halted();
+    if (ret < 1) {
+        ESP_LOGE(TAG, "Timeout when halting");
+        state = swd_def::UNKNOWN;
+        return ESP_ERR_TIMEOUT;
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t swd_prog::read_memory(uint32_t addr, uint8_t *buf, size_t len)
+{
+    swd_wire_op_scope wire_op(swd_wire_def::OP_MEMORY);
+    if (buf == nullptr || len < 1) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (mem_cache.read_memory(addr, buf, len) < 1) {
+        ESP_LOGE(TAG, "Failed when reading memory @ 0x%08lx, len %u", addr, len);
+        return ESP_ERR_INVALID_RESPONSE;
+    }
+
+    return ESP_OK;
+}
+
+semihost &swd_prog::get_semihost()
+{
+    return semihosting;
+}
+
+swd_mem_cache &swd_prog::get_mem_cache()
+{
+    return mem_cache;
+}
+
+const ram_layout::layout &swd_prog::get_ram_layout() const
+{
+    return layout;
+}
+
+const swd_def::connect_metrics &swd_prog::get_connect_metrics() const
+{
+    return metrics;
+}
+
+void swd_prog::set_default_connect_flags(uint32_t flags)
+{
+    default_connect_flags = flags;
+}
+
+esp_err_t swd_prog::lock(TickType_t timeout)
+{
+    if (xSemaphoreTakeRecursive(owner_lock, timeout) != pdTRUE) {
+        ESP_LOGW(TAG, "SWD is busy with another task");
+        return ESP_ERR_TIMEOUT;
+    }
+
+    return ESP_OK;
+}
+
+void swd_prog::unlock()
+{
+    xSemaphoreGiveRecursive(owner_lock);
+}
+
+void swd_prog::mark_dp_stale()
+{
+    dp_powered = false;
+    multidrop.invalidate();
+}
+
+esp_err_t swd_prog::set_drop_targets(const uint32_t *targetsel, size_t cnt)
+{
+    auto ret = multidrop.set_targets(targetsel, cnt);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    drop_idx = 0;
+    dp_powered = false; // Single-drop init state means nothing on a multi-drop bus, and vice versa
+    state = swd_def::UNKNOWN;
+    return ESP_OK;
+}
+
+size_t swd_prog::get_drop_target_cnt() const
+{
+    return multidrop.get_target_cnt();
+}
+
+esp_err_t swd_prog::select_drop_target(size_t idx)
+{
+    if (idx >= multidrop.get_target_cnt()) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (idx != drop_idx) {
+        drop_idx = idx;
+        state = swd_def::UNKNOWN; // Algo, layout and cache all belong to the previous target
+        mem_cache.invalidate();
+    }
+
+    return ESP_OK;
+}
+
+size_t swd_prog::get_drop_target_idx() const
+{
+    return drop_idx;
+}
+
 void swd_prog::trigger_nrst()
 {
     swd_trigger_nrst();
+    instance()->mem_cache.invalidate();
 }
 
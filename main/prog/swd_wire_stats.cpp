@@ -0,0 +1,131 @@
+#include <cstring>
+#include <algorithm>
+#include <esp_log.h>
+#include <esp_timer.h>
+
+#include "swd_wire_stats.hpp"
+
+#ifdef CONFIG_SI_SWD_WIRE_STATS
+extern "C" uint8_t __real_SWD_Transfer(uint32_t request, uint32_t *data);
+
+extern "C" uint8_t __wrap_SWD_Transfer(uint32_t request, uint32_t *data)
+{
+    uint8_t ack = __real_SWD_Transfer(request, data);
+    swd_wire_stats::instance()->record(request, ack, data == nullptr ? 0 : *data);
+    return ack;
+}
+#endif
+
+void swd_wire_stats::record(uint32_t req, uint8_t ack, uint32_t data)
+{
+#ifdef CONFIG_SI_SWD_WIRE_STATS
+    auto &counter = stats[curr_op];
+    bool is_read = (req & swd_wire_def::REQ_RnW) != 0;
+    if (req & swd_wire_def::REQ_APnDP) {
+        is_read ? counter.ap_reads++ : counter.ap_writes++;
+    } else {
+        is_read ? counter.dp_reads++ : counter.dp_writes++;
+    }
+
+    if (last_ack == swd_wire_def::ACK_WAIT && last_req == req) {
+        counter.retries += 1;
+    }
+
+    switch (ack) {
+        case swd_wire_def::ACK_OK: {
+            counter.acks_ok += 1;
+            counter.bytes += sizeof(uint32_t);
+            break;
+        }
+        case swd_wire_def::ACK_WAIT: counter.acks_wait += 1; break;
+        case swd_wire_def::ACK_FAULT: counter.acks_fault += 1; break;
+        case swd_wire_def::ACK_PARITY_ERR: counter.parity_errs += 1; break;
+        default: counter.acks_none += 1; break;
+    }
+
+    last_req = req;
+    last_ack = ack;
+
+    if (swd_wire_def::trace_depth > 0) {
+        auto &entry = trace[trace_head];
+        entry.ts_us = (uint32_t)esp_timer_get_time();
+        entry.data = data;
+        entry.req = (uint8_t)req;
+        entry.ack = ack;
+        entry.op = curr_op;
+        trace_head = (trace_head + 1) % swd_wire_def::trace_depth;
+        trace_cnt = std::min(trace_cnt + 1, swd_wire_def::trace_depth);
+    }
+#endif
+}
+
+swd_wire_def::op swd_wire_stats::set_op(swd_wire_def::op op)
+{
+    auto prev = curr_op;
+    curr_op = op < swd_wire_def::OP_CNT ? op : swd_wire_def::OP_IDLE;
+    return prev;
+}
+
+esp_err_t swd_wire_stats::get_counters(swd_wire_def::op op, swd_wire_def::counters *out) const
+{
+    if (out == nullptr || op >= swd_wire_def::OP_CNT) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+#ifdef CONFIG_SI_SWD_WIRE_STATS
+    *out = stats[op];
+    return ESP_OK;
+#else
+    return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+size_t swd_wire_stats::get_trace(swd_wire_def::trace_entry *out, size_t max_cnt) const
+{
+#ifdef CONFIG_SI_SWD_WIRE_STATS
+    if (out == nullptr || swd_wire_def::trace_depth == 0) {
+        return 0;
+    }
+
+    size_t cnt = std::min(trace_cnt, max_cnt);
+    size_t start = (trace_head + swd_wire_def::trace_depth - trace_cnt) % swd_wire_def::trace_depth;
+    start = (start + (trace_cnt - cnt)) % swd_wire_def::trace_depth; // Newest cnt entries if out is short
+    for (size_t idx = 0; idx < cnt; idx += 1) {
+        out[idx] = trace[(start + idx) % swd_wire_def::trace_depth];
+    }
+
+    return cnt;
+#else
+    return 0;
+#endif
+}
+
+void swd_wire_stats::reset()
+{
+    memset(stats, 0, sizeof(stats));
+    trace_head = 0;
+    trace_cnt = 0;
+    last_req = UINT32_MAX;
+    last_ack = 0;
+}
+
+void swd_wire_stats::log_stats() const
+{
+#ifdef CONFIG_SI_SWD_WIRE_STATS
+    static const char *op_names[swd_wire_def::OP_CNT] = {
+            "Idle", "Connect", "LoadAlgo", "Erase", "Program", "Verify", "SelfTest", "Memory", "Debug", "Script"
+    };
+
+    for (uint32_t op = 0; op < swd_wire_def::OP_CNT; op += 1) {
+        const auto &counter = stats[op];
+        uint32_t total = counter.dp_reads + counter.dp_writes + counter.ap_reads + counter.ap_writes;
+        if (total == 0) {
+            continue;
+        }
+
+        ESP_LOGI(TAG, "%s: %lu xfers (DP %lu R/%lu W, AP %lu R/%lu W), %llu bytes; WAIT %lu, FAULT %lu, no ACK %lu, parity %lu, retries %lu",
+                 op_names[op], total, counter.dp_reads, counter.dp_writes, counter.ap_reads, counter.ap_writes, counter.bytes,
+                 counter.acks_wait, counter.acks_fault, counter.acks_none, counter.parity_errs, counter.retries);
+    }
+#endif
+}
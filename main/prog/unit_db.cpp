@@ -0,0 +1,176 @@
+#include <cstdio>
+#include <cstring>
+#include <cstddef>
+#include <algorithm>
+#include <unistd.h>
+#include <esp_log.h>
+#include <esp_crc.h>
+#include <esp_timer.h>
+
+#include "unit_db.hpp"
+#include "file_utils.hpp"
+
+esp_err_t unit_db::init()
+{
+    records.clear();
+    index.clear();
+    file_records = 0;
+    next_seq = 0;
+
+    file_utils::recover_replace(DB_TMP_PATH, DB_PATH);
+    FILE *file = fopen(DB_PATH, "rb");
+    if (file == nullptr) {
+        ESP_LOGI(TAG, "No database yet, starting empty");
+        inited = true;
+        return ESP_OK;
+    }
+
+    int64_t start_ts = esp_timer_get_time();
+    size_t good_len = 0;
+    unit_db_def::record record = {};
+    while (fread(&record, 1, sizeof(record), file) == sizeof(record)) {
+        if (record.magic != unit_db_def::RECORD_MAGIC || record.crc != record_crc(record) || record.uid_len > unit_db_def::max_uid_len) {
+            break;
+        }
+
+        auto key = make_key(record.uid, record.uid_len);
+        auto it = index.find(key);
+        if (it != index.end()) {
+            records[it->second] = record;
+        } else {
+            index.emplace(key, records.size());
+            records.emplace_back(record);
+        }
+
+        next_seq = std::max(next_seq, record.seq + 1);
+        file_records += 1;
+        good_len += sizeof(record);
+    }
+
+    fseek(file, 0, SEEK_END);
+    size_t file_len = ftell(file);
+    fclose(file);
+
+    // Anything past the last good record is a torn append; cut it so the next one lands on a record boundary
+    if (file_len != good_len) {
+        ESP_LOGW(TAG, "Dropping %u bytes of broken tail", file_len - good_len);
+        if (truncate(DB_PATH, (off_t)good_len) != 0) {
+            ESP_LOGE(TAG, "Failed to truncate database");
+            return ESP_FAIL;
+        }
+    }
+
+    ESP_LOGI(TAG, "Loaded %u units from %u records in %lld us", records.size(), file_records, esp_timer_get_time() - start_ts);
+    inited = true;
+
+    if (file_records >= unit_db_def::compact_min_records && file_records > records.size() * 2) {
+        return compact();
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t unit_db::lookup(const uint8_t *uid, size_t uid_len, unit_db_def::record *out) const
+{
+    if (uid == nullptr || out == nullptr || uid_len == 0 || uid_len > unit_db_def::max_uid_len) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    auto it = index.find(make_key(uid, uid_len));
+    if (it == index.end()) {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    *out = records[it->second];
+    return ESP_OK;
+}
+
+esp_err_t unit_db::store(unit_db_def::record &record)
+{
+    if (!inited) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    if (record.uid_len == 0 || record.uid_len > unit_db_def::max_uid_len) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    record.magic = unit_db_def::RECORD_MAGIC;
+    record.seq = next_seq;
+    record.crc = record_crc(record);
+
+    FILE *file = fopen(DB_PATH, "ab");
+    if (file == nullptr) {
+        ESP_LOGE(TAG, "Can't open database for append");
+        return ESP_FAIL;
+    }
+
+    bool ok = fwrite(&record, 1, sizeof(record), file) == sizeof(record);
+    ok = ok && fflush(file) == 0 && fsync(fileno(file)) == 0;
+    fclose(file);
+    if (!ok) {
+        ESP_LOGE(TAG, "Append failed");
+        return ESP_FAIL;
+    }
+
+    next_seq += 1;
+    file_records += 1;
+    auto key = make_key(record.uid, record.uid_len);
+    auto it = index.find(key);
+    if (it != index.end()) {
+        records[it->second] = record;
+    } else {
+        index.emplace(key, records.size());
+        records.emplace_back(record);
+    }
+
+    return ESP_OK;
+}
+
+size_t unit_db::size() const
+{
+    return records.size();
+}
+
+esp_err_t unit_db::compact()
+{
+    // Latest record per unit into a new file that replaces the old one, see file_utils::replace_file()
+    FILE *file = fopen(DB_TMP_PATH, "wb");
+    if (file == nullptr) {
+        return ESP_FAIL;
+    }
+
+    bool ok = true;
+    for (const auto &record : records) {
+        ok = ok && fwrite(&record, 1, sizeof(record), file) == sizeof(record);
+    }
+
+    ok = ok && fflush(file) == 0 && fsync(fileno(file)) == 0;
+    fclose(file);
+
+    if (!ok) {
+        ESP_LOGE(TAG, "Compaction failed");
+        remove(DB_TMP_PATH);
+        return ESP_FAIL;
+    }
+
+    if (file_utils::replace_file(DB_TMP_PATH, DB_PATH) != ESP_OK) {
+        ESP_LOGE(TAG, "Compaction failed");
+        file_utils::recover_replace(DB_TMP_PATH, DB_PATH); // Whichever copy is left becomes the database
+        return ESP_FAIL;
+    }
+
+    ESP_LOGI(TAG, "Compacted %u records down to %u", file_records, records.size());
+    file_records = records.size();
+    return ESP_OK;
+}
+
+std::string unit_db::make_key(const uint8_t *uid, size_t uid_len)
+{
+    return {reinterpret_cast<const char *>(uid), uid_len};
+}
+
+uint32_t unit_db::record_crc(const unit_db_def::record &record)
+{
+    return esp_crc32_le(0, (const uint8_t *)&record, offsetof(unit_db_def::record, crc));
+}
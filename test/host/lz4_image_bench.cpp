@@ -0,0 +1,133 @@
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <vector>
+#include <esp_timer.h>
+
+#include "lz4_image.hpp"
+
+// Host benchmark for lz4_image: checks an LZ4I image from tools/lz4i_pack.py against its raw source and
+// times whole-block decoding, which is what program_mem() does per page
+
+static std::vector<uint8_t> read_file(const char *path)
+{
+    std::vector<uint8_t> buf {};
+    FILE *file = fopen(path, "rb");
+    if (file == nullptr) {
+        return buf;
+    }
+
+    fseek(file, 0, SEEK_END);
+    buf.resize(ftell(file));
+    fseek(file, 0, SEEK_SET);
+    if (fread(buf.data(), 1, buf.size(), file) != buf.size()) {
+        buf.clear();
+    }
+
+    fclose(file);
+    return buf;
+}
+
+/**
+ * Something shaped like a Cortex-M image: vector table, code drawn from a small set of halfwords,
+ * a few strings, then erased flash
+ */
+static int generate(const char *path, size_t len)
+{
+    std::vector<uint8_t> buf(len, 0xff);
+    uint32_t seed = 0x2545f491;
+    auto next = [&]() {
+        seed = seed * 1664525 + 1013904223;
+        return seed >> 16;
+    };
+
+    uint16_t opcodes[64] = {};
+    for (auto &op : opcodes) {
+        op = (uint16_t)next();
+    }
+
+    size_t code_end = len * 3 / 4;
+    for (size_t pos = 0; pos + 4 <= 0x200 && pos + 4 <= len; pos += 4) {
+        uint32_t vec = pos == 0 ? 0x20010000 : 0x08000201 + (next() & 0x3ffe);
+        memcpy(&buf[pos], &vec, sizeof(vec));
+    }
+
+    for (size_t pos = 0x200; pos + 2 <= code_end; pos += 2) {
+        uint16_t op = (next() & 7) == 0 ? (uint16_t)next() : opcodes[next() & 63];
+        memcpy(&buf[pos], &op, sizeof(op));
+    }
+
+    static const char text[] = "Assertion failed in %s:%d\0Flash init done\0HardFault PC=0x%08lx\0";
+    for (size_t pos = code_end; pos + sizeof(text) <= len * 7 / 8; pos += sizeof(text)) {
+        memcpy(&buf[pos], text, sizeof(text));
+    }
+
+    FILE *file = fopen(path, "wb");
+    if (file == nullptr || fwrite(buf.data(), 1, buf.size(), file) != buf.size()) {
+        fprintf(stderr, "Can't write %s\n", path);
+        return 1;
+    }
+
+    fclose(file);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc == 4 && strcmp(argv[1], "gen") == 0) {
+        return generate(argv[2], strtoul(argv[3], nullptr, 0));
+    }
+
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s <image.lz4i> <raw.bin> [rounds]\n       %s gen <raw.bin> <len>\n", argv[0], argv[0]);
+        return 2;
+    }
+
+    auto image = read_file(argv[1]);
+    auto raw = read_file(argv[2]);
+    int rounds = argc > 3 ? atoi(argv[3]) : 20;
+    lz4_image reader {};
+    if (image.empty() || raw.empty() || reader.open(image.data(), image.size()) != ESP_OK) {
+        fprintf(stderr, "Can't open %s and %s\n", argv[1], argv[2]);
+        return 1;
+    }
+
+    if (reader.raw_size() != raw.size()) {
+        fprintf(stderr, "Raw size %zu, image says %zu\n", raw.size(), reader.raw_size());
+        return 1;
+    }
+
+    // Unaligned reads across block boundaries, like a resume or delta run starting mid-image
+    std::vector<uint8_t> out(raw.size());
+    for (size_t pos = 0; pos < raw.size();) {
+        size_t len = std::min(raw.size() - pos, (size_t)(pos % 3001) + 1);
+        if (reader.read(pos, out.data() + pos, len) != ESP_OK) {
+            fprintf(stderr, "Read at %zu failed\n", pos);
+            return 1;
+        }
+
+        pos += len;
+    }
+
+    if (out != raw) {
+        fprintf(stderr, "Decoded image differs from %s\n", argv[2]);
+        return 1;
+    }
+
+    uint32_t block_size = reader.get_block_size();
+    int64_t start_ts = esp_timer_get_time();
+    for (int round = 0; round < rounds; round += 1) {
+        for (uint32_t idx = 0; idx < reader.get_block_cnt(); idx += 1) {
+            if (reader.read_block(idx, out.data() + (size_t)idx * block_size, out.size() - (size_t)idx * block_size) != ESP_OK) {
+                fprintf(stderr, "Block %u failed\n", idx);
+                return 1;
+            }
+        }
+    }
+
+    int64_t elapsed_us = esp_timer_get_time() - start_ts;
+    double mbps = (double)raw.size() * rounds / (elapsed_us > 0 ? elapsed_us : 1);
+    printf("%zu -> %zu bytes (%.1f%%), %u blocks of %u; decode + CRC %.1f MB/s over %d rounds\n", raw.size(), image.size(),
+           100.0 * image.size() / raw.size(), reader.get_block_cnt(), block_size, mbps, rounds);
+    return 0;
+}
@@ -0,0 +1,87 @@
+#include <cstdio>
+
+#include "ram_layout_planner.hpp"
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            failures += 1; \
+        } \
+    } while (0)
+
+static void check_invariants(const ram_layout::input &in, const ram_layout::layout &out)
+{
+    CHECK(out.stack_bottom % ram_layout::stack_align == 0 && out.stack_bottom >= out.image_end);
+    CHECK(out.stack_top % ram_layout::stack_align == 0 && out.stack_top >= out.stack_bottom + in.stack_size);
+    CHECK(out.buf_size % ram_layout::buf_align == 0 && out.buf_size >= in.page_size);
+    CHECK(out.buf_cnt >= 1 && out.buf_cnt <= ram_layout::max_buf_cnt);
+    for (uint32_t idx = 0; idx < out.buf_cnt; idx += 1) {
+        CHECK(out.buf_addr[idx] % ram_layout::buf_align == 0 && out.buf_addr[idx] >= out.stack_top);
+        CHECK(idx == 0 || out.buf_addr[idx] == out.buf_addr[idx - 1] + out.buf_size);
+    }
+
+    uint64_t bufs_end = (uint64_t)out.buf_addr[out.buf_cnt - 1] + out.buf_size;
+    CHECK(bufs_end + out.free_bytes == (uint64_t)in.ram_start + in.ram_size);
+}
+
+int main()
+{
+    ram_layout::layout out = {};
+
+    // ram_start, ram_size, header, code, data_offset, data, bss, stack, page, buf_cnt_limit
+    ram_layout::input in = {0x20000000, 0x10000, 32, 0x400, 0x400, 0x10, 0x20, 0x800, 0x400, 0};
+    CHECK(ram_layout_planner::plan(in, &out) == ESP_OK);
+    CHECK(out.code_start == 0x20000000 && out.image_end == 0x20000000 + 32 + 0x430);
+    CHECK(out.static_base == 0x20000000 + 32 + 0x400);
+    CHECK(out.stack_top == out.stack_bottom + 0x800);
+    CHECK(out.buf_cnt == ram_layout::max_buf_cnt);
+    check_invariants(in, out);
+
+    // Nothing aligned: image end, stack size and page size all odd
+    in = {0x20000000, 0x4000, 30, 0x3ff, 0x3ff, 3, 1, 0x7fd, 0x3fe, 2};
+    CHECK(ram_layout_planner::plan(in, &out) == ESP_OK);
+    CHECK(out.buf_size == 0x400 && out.buf_cnt == 2);
+    check_invariants(in, out);
+
+    // PrgData linked with a gap after PrgCode, the gap is part of the image
+    in = {0x20000000, 0x10000, 32, 0x100, 0x1000, 0x10, 0x10, 0x400, 0x400, 1};
+    CHECK(ram_layout_planner::plan(in, &out) == ESP_OK);
+    CHECK(out.image_end == 0x20000000 + 32 + 0x1020 && out.static_base == 0x20000000 + 32 + 0x1000);
+    CHECK(out.buf_cnt == 1);
+    check_invariants(in, out);
+
+    // RAM right at the top of the address space, nothing may wrap
+    in = {0xffff0000, 0x10000, 0, 0x800, 0x800, 0, 0, 0x800, 0x100, 0};
+    CHECK(ram_layout_planner::plan(in, &out) == ESP_OK);
+    check_invariants(in, out);
+
+    in = {0xfffff000, 0x1000, 0, 0x1000, 0x1000, 0, 0, 0x100, 0x100, 0};
+    CHECK(ram_layout_planner::plan(in, &out) == ESP_ERR_NO_MEM);
+
+    in = {0xfffff000, 0x1000, 32, 0x800, 0x800, 0, 0, 0x800, 0x100, 0};
+    CHECK(ram_layout_planner::plan(in, &out) == ESP_ERR_NO_MEM);
+
+    // Stack overruns RAM, or leaves no room for a single page buffer
+    in = {0x20000000, 0x1000, 32, 0x400, 0x400, 0, 0, 0x1000, 0x100, 0};
+    CHECK(ram_layout_planner::plan(in, &out) == ESP_ERR_NO_MEM);
+
+    in = {0x20000000, 0x1000, 32, 0x400, 0x400, 0, 0, 0x800, 0x400, 0};
+    CHECK(ram_layout_planner::plan(in, &out) == ESP_ERR_NO_MEM);
+
+    in = {0x20000000, 0, 0, 0, 0, 0, 0, 0, 0x100, 0};
+    CHECK(ram_layout_planner::plan(in, &out) == ESP_ERR_INVALID_ARG);
+
+    in = {0x20000000, 0x1000, 0, 0, 0, 0, 0, 0, 0, 0};
+    CHECK(ram_layout_planner::plan(in, &out) == ESP_ERR_INVALID_ARG);
+    CHECK(ram_layout_planner::plan(in, nullptr) == ESP_ERR_INVALID_ARG);
+
+    if (failures > 0) {
+        fprintf(stderr, "%d check(s) failed\n", failures);
+        return 1;
+    }
+
+    puts("ram_layout_planner: all checks passed");
+    return 0;
+}
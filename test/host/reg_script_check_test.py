@@ -0,0 +1,49 @@
+#!/usr/bin/env python3
+"""Host checks for tools/reg_script_check.py against hand-built scripts"""
+
+import os
+import struct
+import sys
+
+sys.path.insert(0, sys.argv[1] if len(sys.argv) > 1 else os.path.join(os.path.dirname(__file__), "..", "..", "tools"))
+import reg_script_check as rsc  # noqa: E402
+
+
+def script(*ops, op_cnt=None, magic=rsc.MAGIC, version=rsc.VERSION):
+    data = struct.pack(rsc.HEADER_FMT, magic, version, len(ops) if op_cnt is None else op_cnt)
+    for op_type, timeout_ms, addr, value, mask in ops:
+        data += struct.pack(rsc.OP_FMT, op_type, timeout_ms, addr, value, mask)
+    return data
+
+
+def expect(data, ok):
+    errors = rsc.check_script(data)
+    if (not errors) != ok:
+        print("expected %s, got %s" % ("OK" if ok else "errors", errors or "OK"), file=sys.stderr)
+        return 1
+    return 0
+
+
+failures = 0
+good = script((rsc.OP_WRITE, 0, 0x40021000, 1, 0),
+              (rsc.OP_RMW, 0, 0x40021004, 0x10, 0x30),
+              (rsc.OP_READ, 0, 0x40021008, 0, 0),
+              (rsc.OP_POLL, 100, 0x4002100C, 0x2, 0x2),
+              (rsc.OP_DELAY, 0, 0, rsc.MAX_DELAY_US, 0))
+failures += expect(good, True)
+failures += expect(script(), True)
+
+failures += expect(good[:4], False)
+failures += expect(script(magic=0), False)
+failures += expect(script(version=2), False)
+failures += expect(script(op_cnt=rsc.MAX_OPS + 1), False)
+failures += expect(good[:-1], False)
+failures += expect(script((5, 0, 0, 0, 0)), False)
+failures += expect(script((rsc.OP_WRITE, 0, 0x40021002, 1, 0)), False)
+failures += expect(script((rsc.OP_POLL, 0, 0x40021000, 1, 1)), False)
+failures += expect(script((rsc.OP_POLL, rsc.MAX_POLL_MS + 1, 0x40021000, 1, 1)), False)
+failures += expect(script((rsc.OP_POLL, 10, 0x40021000, 3, 1)), False)
+failures += expect(script((rsc.OP_DELAY, 0, 0, rsc.MAX_DELAY_US + 1, 0)), False)
+
+print("reg_script_check: %d failure(s)" % failures)
+sys.exit(1 if failures else 0)
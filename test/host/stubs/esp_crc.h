@@ -0,0 +1,8 @@
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * Same as the ROM's: reflected CRC-32, i.e. esp_crc32_le(0, buf, len) equals zlib's crc32()
+ */
+uint32_t esp_crc32_le(uint32_t crc, const uint8_t *buf, uint32_t len);
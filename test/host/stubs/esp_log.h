@@ -0,0 +1,6 @@
+#pragma once
+
+#define ESP_LOGE(tag, fmt, ...) do {} while (0)
+#define ESP_LOGW(tag, fmt, ...) do {} while (0)
+#define ESP_LOGI(tag, fmt, ...) do {} while (0)
+#define ESP_LOGD(tag, fmt, ...) do {} while (0)
@@ -0,0 +1,31 @@
+#include <chrono>
+#include "esp_crc.h"
+#include "esp_timer.h"
+
+uint32_t esp_crc32_le(uint32_t crc, const uint8_t *buf, uint32_t len)
+{
+    static uint32_t table[256] = {};
+    if (table[1] == 0) {
+        for (uint32_t idx = 0; idx < 256; idx += 1) {
+            uint32_t val = idx;
+            for (int bit = 0; bit < 8; bit += 1) {
+                val = (val >> 1) ^ (0xedb88320 & (0 - (val & 1)));
+            }
+
+            table[idx] = val;
+        }
+    }
+
+    crc = ~crc;
+    for (uint32_t idx = 0; idx < len; idx += 1) {
+        crc = (crc >> 8) ^ table[(crc ^ buf[idx]) & 0xff];
+    }
+
+    return ~crc;
+}
+
+int64_t esp_timer_get_time()
+{
+    using namespace std::chrono;
+    return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+}
@@ -0,0 +1,124 @@
+#!/usr/bin/env python3
+"""
+Pack a raw firmware binary into the LZ4I container programmed by lz4_image (main/prog/includes/lz4_image.hpp):
+header, block index, then one standalone LZ4 block per block_size raw bytes. Blocks that don't shrink are
+stored as they are. Pure Python, no lz4 package needed; a greedy matcher is plenty for firmware-sized images.
+"""
+
+import argparse
+import struct
+import sys
+import zlib
+
+MAGIC = 0x49345A4C  # "LZ4I"
+VERSION = 1
+MAX_BLOCK_SIZE = 0x10000
+BLOCK_STORED = 1 << 31
+
+HEADER_FMT = "<IB3xIII"  # magic, version, block_size, raw_len, block_cnt; crc follows
+ENTRY_FMT = "<III"  # offset, len (BLOCK_STORED or-ed in), raw_crc
+
+MIN_MATCH = 4
+LAST_LITERALS = 5  # LZ4 block format: the last 5 bytes are always literals
+MF_LIMIT = 12  # ...and the last match starts at least 12 bytes before the end
+
+
+def _put_len(out, val):
+    while val >= 255:
+        out.append(255)
+        val -= 255
+    out.append(val)
+
+
+def _emit(out, literals, offset=0, match_len=0):
+    lit_len = len(literals)
+    token = min(lit_len, 15) << 4
+    if match_len:
+        token |= min(match_len - MIN_MATCH, 15)
+    out.append(token)
+    if lit_len >= 15:
+        _put_len(out, lit_len - 15)
+    out += literals
+    if match_len:
+        out += struct.pack("<H", offset)
+        if match_len - MIN_MATCH >= 15:
+            _put_len(out, match_len - MIN_MATCH - 15)
+
+
+def compress_block(src):
+    """One LZ4 block, no frame"""
+    end = len(src)
+    out = bytearray()
+    last_seen = {}
+    anchor = 0
+    pos = 0
+    while pos < end - MF_LIMIT:
+        key = src[pos:pos + MIN_MATCH]
+        cand = last_seen.get(key, -1)
+        last_seen[key] = pos
+        if cand < 0 or pos - cand > 0xFFFF:
+            pos += 1
+            continue
+
+        match_len = MIN_MATCH
+        match_max = end - LAST_LITERALS - pos
+        while match_len < match_max and src[cand + match_len] == src[pos + match_len]:
+            match_len += 1
+
+        _emit(out, src[anchor:pos], pos - cand, match_len)
+        pos += match_len
+        anchor = pos
+
+    _emit(out, src[anchor:])
+    return bytes(out)
+
+
+def pack(raw, block_size):
+    block_cnt = (len(raw) + block_size - 1) // block_size
+    header = struct.pack(HEADER_FMT, MAGIC, VERSION, block_size, len(raw), block_cnt)
+    header += struct.pack("<I", zlib.crc32(header))
+
+    offset = len(header) + block_cnt * struct.calcsize(ENTRY_FMT)
+    index = bytearray()
+    blocks = bytearray()
+    for start in range(0, len(raw), block_size):
+        block = raw[start:start + block_size]
+        comp = compress_block(block)
+        if len(comp) >= len(block):
+            comp = block
+            comp_len = len(block) | BLOCK_STORED
+        else:
+            comp_len = len(comp)
+
+        index += struct.pack(ENTRY_FMT, offset + len(blocks), comp_len, zlib.crc32(block))
+        blocks += comp
+
+    return header + index + blocks
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument("input", help="Raw firmware binary")
+    parser.add_argument("output", help="LZ4I image to write")
+    parser.add_argument("--block-size", type=lambda val: int(val, 0), default=4096,
+                        help="Raw bytes per block, the random access granularity (default 4096, max 65536)")
+    args = parser.parse_args()
+
+    if args.block_size <= 0 or args.block_size > MAX_BLOCK_SIZE:
+        sys.exit("Block size must be 1..%d" % MAX_BLOCK_SIZE)
+
+    with open(args.input, "rb") as file:
+        raw = file.read()
+    if not raw:
+        sys.exit("%s is empty" % args.input)
+
+    image = pack(raw, args.block_size)
+    with open(args.output, "wb") as file:
+        file.write(image)
+
+    print("%s: %d -> %d bytes (%.1f%%), %d blocks of %d" % (args.output, len(raw), len(image), 100.0 * len(image) / len(raw),
+                                                          (len(raw) + args.block_size - 1) // args.block_size, args.block_size))
+
+
+if __name__ == "__main__":
+    main()
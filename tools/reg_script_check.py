@@ -0,0 +1,111 @@
+#!/usr/bin/env python3
+"""
+Check the PreInitScript and PostUninitScript sections of a flash algo ELF before it is uploaded, with the same
+rules flash_algo_parser::get_reg_script (main/prog/flash_algo_parser.cpp) applies on the device, so a bad script
+fails here instead of refusing the whole asset on the probe. Pure Python, ELF32 little endian only.
+"""
+
+import argparse
+import struct
+import sys
+
+MAGIC = 0x53637270  # "Scrp"
+VERSION = 1
+MAX_OPS = 64
+MAX_POLL_MS = 1000
+MAX_DELAY_US = 100000
+SECTIONS = ("PreInitScript", "PostUninitScript")
+
+HEADER_FMT = "<IHH"  # magic, version, op_cnt
+OP_FMT = "<BxHIII"  # type, reserved, timeout_ms, addr, value, mask
+
+OP_WRITE, OP_RMW, OP_READ, OP_POLL, OP_DELAY = range(5)
+OP_NAMES = ("write", "rmw", "read", "poll", "delay")
+
+
+def elf_sections(elf):
+    """Section name -> data, for an ELF32 little endian file"""
+    if elf[:4] != b"\x7fELF" or elf[4] != 1 or elf[5] != 1:
+        raise ValueError("not an ELF32 little endian file")
+
+    sh_off, = struct.unpack_from("<I", elf, 0x20)
+    sh_entsize, sh_num, sh_strndx = struct.unpack_from("<HHH", elf, 0x2E)
+    headers = [struct.unpack_from("<IIIIIIIIII", elf, sh_off + idx * sh_entsize) for idx in range(sh_num)]
+    strtab = headers[sh_strndx]
+
+    sections = {}
+    for name_off, sh_type, _, _, offset, size, *_ in headers:
+        name_start = strtab[4] + name_off
+        name = elf[name_start:elf.index(b"\0", name_start)].decode()
+        sections[name] = b"" if sh_type == 8 else elf[offset:offset + size]  # SHT_NOBITS has no data
+    return sections
+
+
+def check_script(data):
+    """List of problems, empty when the device would accept the script"""
+    if len(data) < struct.calcsize(HEADER_FMT):
+        return ["too short, len=%d" % len(data)]
+
+    magic, version, op_cnt = struct.unpack_from(HEADER_FMT, data)
+    if magic != MAGIC or version != VERSION:
+        return ["bad magic 0x%08x or version %d" % (magic, version)]
+
+    op_len = struct.calcsize(OP_FMT)
+    if op_cnt > MAX_OPS or len(data) < struct.calcsize(HEADER_FMT) + op_cnt * op_len:
+        return ["%d ops don't fit in %d bytes (max %d ops)" % (op_cnt, len(data), MAX_OPS)]
+
+    errors = []
+    for idx in range(op_cnt):
+        op_type, timeout_ms, addr, value, mask = struct.unpack_from(OP_FMT, data, struct.calcsize(HEADER_FMT) + idx * op_len)
+        if op_type > OP_DELAY:
+            errors.append("op %d: unknown type %d" % (idx, op_type))
+            continue
+
+        name = OP_NAMES[op_type]
+        if op_type != OP_DELAY and addr % 4 != 0:
+            errors.append("op %d (%s): addr 0x%08x not word aligned" % (idx, name, addr))
+        if op_type == OP_POLL and not 0 < timeout_ms <= MAX_POLL_MS:
+            errors.append("op %d (%s): timeout %d ms not in 1..%d" % (idx, name, timeout_ms, MAX_POLL_MS))
+        if op_type == OP_POLL and value & ~mask:
+            errors.append("op %d (%s): value 0x%08x has bits outside mask 0x%08x, never matches" % (idx, name, value, mask))
+        if op_type == OP_DELAY and value > MAX_DELAY_US:
+            errors.append("op %d (%s): %d us over the %d us limit" % (idx, name, value, MAX_DELAY_US))
+    return errors
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument("input", help="Flash algo ELF, or a raw script section with --raw")
+    parser.add_argument("--raw", action="store_true", help="Input is one script section, not an ELF")
+    args = parser.parse_args()
+
+    with open(args.input, "rb") as file:
+        blob = file.read()
+
+    if args.raw:
+        scripts = {args.input: blob}
+    else:
+        try:
+            sections = elf_sections(blob)
+        except (ValueError, struct.error) as err:
+            sys.exit("%s: %s" % (args.input, err))
+        scripts = {name: sections[name] for name in SECTIONS if name in sections}
+        if not scripts:
+            print("%s: no register scripts" % args.input)
+            return
+
+    failed = False
+    for name, data in scripts.items():
+        errors = check_script(data)
+        for error in errors:
+            print("%s: %s" % (name, error), file=sys.stderr)
+        if errors:
+            failed = True
+        else:
+            print("%s: %d ops OK" % (name, struct.unpack_from(HEADER_FMT, data)[2]))
+
+    sys.exit(1 if failed else 0)
+
+
+if __name__ == "__main__":
+    main()